@@ -21,6 +21,7 @@
 
 
 #include "AnalyzeFrame.h"
+#include "FrameHeaderLayout.h"
 
 // GET Includes:
 
@@ -34,6 +35,8 @@
 #include <iostream>
 #include <stdexcept>
 #include <math.h>
+#include <string.h>
+#include <stdint.h>
 
 static const int COMPRESSED_FRAME=1;          // GET data are 'compressed'.
 static const int UNCOMPRESSED_FRAME=2;        // GET data are uncompressed.
@@ -86,23 +89,28 @@ void
 CreateHits::processFrame(mfm::Frame& frame)
 {
     m_results.clear();
-    uint32_t nSamples = frame.itemCount();
-
     
     // We need to know the frameType field from the cobo
     // to know how to decode.  We also need the item count.
-    
-    mfm::Field ftypeField = frame.headerField(5,2);
-    uint16_t ftype   = ftypeField.value<uint16_t>();
-
-    
-
-    // Figure out the cobo/ASAD numbers too:
-    
-    mfm::Field coboField = frame.headerField(26, 1);
-    mfm::Field asadField = frame.headerField(27,1);
-    uint8_t cobo    = coboField.value<uint8_t>();
-    uint8_t asad    = asadField.value<uint8_t>();
+    // These and the cobo/ASAD numbers are read directly from the
+    // frame header at offsets resolved once per frame revision.
+    // A layout that lacks a field would read it as 0, so for those
+    // we go back to asking the frame.
+    
+    static thread_local NSCLGET::FrameHeaderLayout::Cache layoutCache;
+    const NSCLGET::FrameHeaderLayout& layout(layoutCache.layout(frame));
+    const mfm::Byte* pFrame = frame.data();
+    
+    uint16_t ftype    = NSCLGET::FrameHeaderLayout::frameType(pFrame);
+    uint32_t nSamples = layout.has(NSCLGET::FrameHeaderLayout::ITEM_COUNT) ?
+        layout.get(NSCLGET::FrameHeaderLayout::ITEM_COUNT, pFrame) :
+        frame.itemCount();
+    uint8_t  cobo     = layout.has(NSCLGET::FrameHeaderLayout::COBO_IDX) ?
+        layout.get(NSCLGET::FrameHeaderLayout::COBO_IDX, pFrame) :
+        frame.headerField(26, 1).value<uint8_t>();
+    uint8_t  asad     = layout.has(NSCLGET::FrameHeaderLayout::ASAD_IDX) ?
+        layout.get(NSCLGET::FrameHeaderLayout::ASAD_IDX, pFrame) :
+        frame.headerField(27, 1).value<uint8_t>();
     
     if (ftype == COMPRESSED_FRAME) {
         processCompressedFrame(frame, nSamples, cobo, asad);
@@ -438,3 +446,35 @@ NSCLGET::analyzeFrame(size_t bodySize, const void* pFrame)
     
     return hitMaker.getResults();
 }
+/**
+ * hitBodySize
+ *    @param nHits - number of hits.
+ *    @return size_t - bytes in the body of a hit ring item holding them.
+ */
+size_t
+NSCLGET::hitBodySize(size_t nHits)
+{
+    return sizeof(uint32_t) + nHits * sizeof(NSCLGET::Hit);
+}
+/**
+ * packHits
+ *    Format the body of a hit ring item.
+ *
+ * @param[in]  hits  - the hits.
+ * @param[out] pBody - where the body goes; must hold hitBodySize(hits.size())
+ *                     bytes.
+ * @return size_t - number of bytes written.
+ */
+size_t
+NSCLGET::packHits(const std::vector<NSCLGET::Hit>& hits, void* pBody)
+{
+    uint8_t* p = static_cast<uint8_t*>(pBody);
+    uint32_t nhits = hits.size();
+    memcpy(p, &nhits, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    
+    if (nhits) {
+        memcpy(p, hits.data(), nhits * sizeof(NSCLGET::Hit));
+    }
+    return hitBodySize(nhits);
+}
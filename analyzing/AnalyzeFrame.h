@@ -55,6 +55,16 @@ typedef struct _hit {
  */
 
 std::vector<Hit> analyzeFrame(size_t  bodySize, const void* pFrame);
+
+/**
+ * Hit ring items are PHYSICS_EVENT items whose body is a uint32_t count of
+ * hits followed by that many Hit structs, verbatim.  The source id of the
+ * item is the frame's source id plus the ASAD index of the hits.
+ * These format the body:
+ */
+
+size_t hitBodySize(size_t nHits);
+size_t packHits(const std::vector<Hit>& hits, void* pBody);
     
 };
 
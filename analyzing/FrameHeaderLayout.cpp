@@ -0,0 +1,274 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  FrameHeaderLayout.cpp
+ *  @brief: Implement the frame header layout cache.  See FrameHeaderLayout.h
+ */
+
+#include "FrameHeaderLayout.h"
+
+// GET Includes:
+
+#include <mfm/Frame.h>
+
+// System includes:
+
+#include <map>
+#include <mutex>
+#include <string>
+
+// Names of the fields in the format description, in Field order:
+
+static const char* fieldNames[NSCLGET::FrameHeaderLayout::FIELD_COUNT] = {
+    "eventTime", "eventIdx", "coboIdx", "asadIdx", "itemCount"
+};
+
+// Primary header: metaType is byte 0 (bit 7 set means little endian),
+// frameType is bytes 5-6, revision byte 7.
+
+static const uint8_t  LITTLE_ENDIAN_BIT(0x80);
+static const size_t   FRAME_TYPE_OFFSET(5);
+static const size_t   REVISION_OFFSET(7);
+
+// The resolved layouts, indexed by key().  Layouts are never deleted so
+// pointers to them stay good.
+
+static std::mutex                                   layoutLock;
+static std::map<uint32_t, NSCLGET::FrameHeaderLayout*> layouts;
+
+/*-----------------------------------------------------------------------------
+ * Cache implementation.
+ */
+
+/**
+ * constructor
+ *    Starts out remembering nothing.  No frame has a zero frame type so
+ *    a zero key never matches.
+ */
+NSCLGET::FrameHeaderLayout::Cache::Cache() :
+    m_key(0), m_pLayout(nullptr)
+{}
+/**
+ * find
+ *    Find the layout for a frame that's already been resolved.
+ *
+ * @param pFrame - pointer to the frame bytes.
+ * @return const FrameHeaderLayout* - nullptr if no frame of this type and
+ *                 revision has been resolved yet.
+ */
+const NSCLGET::FrameHeaderLayout*
+NSCLGET::FrameHeaderLayout::Cache::find(const void* pFrame)
+{
+    uint32_t k = key(pFrame);
+    if (k != m_key || !m_pLayout) {
+        const FrameHeaderLayout* pLayout = FrameHeaderLayout::find(pFrame);
+        if (!pLayout) return nullptr;
+        m_pLayout = pLayout;
+        m_key     = k;
+    }
+    return m_pLayout;
+}
+/**
+ * layout
+ *    Return the layout for a frame, resolving it if need be.
+ *
+ * @param frame - the frame.
+ * @return const FrameHeaderLayout&
+ */
+const NSCLGET::FrameHeaderLayout&
+NSCLGET::FrameHeaderLayout::Cache::layout(mfm::Frame& frame)
+{
+    uint32_t k = key(frame.data());
+    if (k != m_key || !m_pLayout) {
+        m_pLayout = &FrameHeaderLayout::resolve(frame);
+        m_key     = k;
+    }
+    return *m_pLayout;
+}
+
+/*-----------------------------------------------------------------------------
+ * FrameHeaderLayout implementation.
+ */
+
+/**
+ * resolve
+ *    Returns the layout for a frame's type and revision, asking the
+ *    frame dictionary for it if this is the first such frame.
+ *
+ * @param frame - the frame.
+ * @return const FrameHeaderLayout&
+ */
+const NSCLGET::FrameHeaderLayout&
+NSCLGET::FrameHeaderLayout::resolve(mfm::Frame& frame)
+{
+    uint32_t k = key(frame.data());
+
+    std::lock_guard<std::mutex> lock(layoutLock);
+    std::map<uint32_t, FrameHeaderLayout*>::iterator p = layouts.find(k);
+    if (p != layouts.end()) {
+        return *(p->second);
+    }
+    FrameHeaderLayout* pLayout = new FrameHeaderLayout(frame);
+    layouts[k] = pLayout;
+    return *pLayout;
+}
+/**
+ * find
+ *    Returns the layout for a frame if it's already been resolved.
+ *
+ * @param pFrame - pointer to the frame bytes.
+ * @return const FrameHeaderLayout* - nullptr if not yet resolved.
+ */
+const NSCLGET::FrameHeaderLayout*
+NSCLGET::FrameHeaderLayout::find(const void* pFrame)
+{
+    uint32_t k = key(pFrame);
+
+    std::lock_guard<std::mutex> lock(layoutLock);
+    std::map<uint32_t, FrameHeaderLayout*>::iterator p = layouts.find(k);
+    return p == layouts.end() ? nullptr : p->second;
+}
+/**
+ * has
+ *   @param f - a field.
+ *   @return bool - true if frames with this layout have that field.
+ */
+bool
+NSCLGET::FrameHeaderLayout::has(Field f) const
+{
+    return m_fields[f].s_size != 0;
+}
+/**
+ * get
+ *    Read a field from a frame.
+ *
+ * @param f      - the field to read.
+ * @param pFrame - pointer to the frame bytes.
+ * @return uint64_t - the field's value or 0 if this layout lacks the field;
+ *                    use has to tell a missing field from a zero one.
+ */
+uint64_t
+NSCLGET::FrameHeaderLayout::get(Field f, const void* pFrame) const
+{
+    const Location& l(m_fields[f]);
+    if (l.s_size == 0) return 0;
+
+    const uint8_t* p = static_cast<const uint8_t*>(pFrame);
+    return load(p + l.s_offset, l.s_size, bigEndian(pFrame));
+}
+/**
+ * name
+ *   @param f - a field.
+ *   @return const char* - its name in the format description.
+ */
+const char*
+NSCLGET::FrameHeaderLayout::name(Field f)
+{
+    return fieldNames[f];
+}
+/**
+ * key
+ *    Frames with the same type and revision share a layout.
+ *
+ * @param pFrame - pointer to the frame bytes.
+ * @return uint32_t - frame type in the top bits, revision in the low 8.
+ */
+uint32_t
+NSCLGET::FrameHeaderLayout::key(const void* pFrame)
+{
+    return (uint32_t(frameType(pFrame)) << 8) | revision(pFrame);
+}
+/**
+ * bigEndian
+ *   @param pFrame - pointer to the frame bytes.
+ *   @return bool - true if the frame's multi-byte fields are big endian.
+ *                  CoBos produce big endian frames.
+ */
+bool
+NSCLGET::FrameHeaderLayout::bigEndian(const void* pFrame)
+{
+    return (*static_cast<const uint8_t*>(pFrame) & LITTLE_ENDIAN_BIT) == 0;
+}
+/**
+ * frameType
+ *   @param pFrame - pointer to the frame bytes.
+ *   @return uint16_t - the frame type from the primary header.
+ */
+uint16_t
+NSCLGET::FrameHeaderLayout::frameType(const void* pFrame)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(pFrame);
+    return load(p + FRAME_TYPE_OFFSET, sizeof(uint16_t), bigEndian(pFrame));
+}
+/**
+ * revision
+ *   @param pFrame - pointer to the frame bytes.
+ *   @return uint8_t - the format revision from the primary header.
+ */
+uint8_t
+NSCLGET::FrameHeaderLayout::revision(const void* pFrame)
+{
+    return static_cast<const uint8_t*>(pFrame)[REVISION_OFFSET];
+}
+/**
+ * load
+ *    Load an unsigned integer of up to 8 bytes.
+ *
+ * @param p         - points to the first byte of the value.
+ * @param nBytes    - number of bytes in the value.
+ * @param bigEndian - true if the most significant byte is first.
+ * @return uint64_t
+ */
+uint64_t
+NSCLGET::FrameHeaderLayout::load(const void* p, size_t nBytes, bool bigEndian)
+{
+    const uint8_t* pBytes = static_cast<const uint8_t*>(p);
+    uint64_t result = 0;
+    if (bigEndian) {
+        for (size_t i = 0; i < nBytes; i++) {
+            result = (result << 8) | pBytes[i];
+        }
+    } else {
+        for (size_t i = nBytes; i > 0; i--) {
+            result = (result << 8) | pBytes[i-1];
+        }
+    }
+    return result;
+}
+/**
+ * constructor
+ *    Looks up each field we care about in the frame's format description.
+ *    A field the revision doesn't have is recorded with a zero size.
+ *
+ * @param frame - a frame whose type/revision we're resolving.
+ */
+NSCLGET::FrameHeaderLayout::FrameHeaderLayout(mfm::Frame& frame)
+{
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        size_t pos;
+        size_t size;
+        try {
+            frame.findHeaderField(std::string(fieldNames[i]), pos, size);
+            m_fields[i].s_offset = pos;
+            m_fields[i].s_size   = size > sizeof(uint64_t) ? sizeof(uint64_t) : size;
+        }
+        catch (...) {
+            m_fields[i].s_offset = 0;
+            m_fields[i].s_size   = 0;
+        }
+    }
+}
@@ -0,0 +1,103 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  FrameHeaderLayout.h
+ *  @brief: Cached locations of the CoBo frame header fields we use per frame.
+ */
+
+#ifndef FRAMEHEADERLAYOUT_H
+#define FRAMEHEADERLAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace mfm {
+    class Frame;
+}
+
+namespace NSCLGET {
+
+/**
+ * @class FrameHeaderLayout
+ *    Looking a header field up by name in the frame dictionary
+ *    (mfm::Frame::findHeaderField) means building a string and searching
+ *    the format description for every frame.  The fields we care about,
+ *    however, are at fixed offsets for a given frame type and format
+ *    revision (see the CoboFormats-Rev-*.xcfg files).
+ *
+ *    A FrameHeaderLayout holds the offset and size of each of those
+ *    fields for one frame type/revision.  It is resolved from the frame
+ *    dictionary the first time a frame of that type/revision is seen and
+ *    kept for the life of the program.  After that, fields are read with
+ *    direct loads from the frame bytes.
+ *
+ *    Resolution is thread-safe.  Per-frame lookups should go through a
+ *    Cache, which remembers the last layout used and so normally needs
+ *    no locking at all.
+ */
+class FrameHeaderLayout
+{
+public:
+    typedef enum _Field {
+        EVENT_TIME, EVENT_IDX, COBO_IDX, ASAD_IDX, ITEM_COUNT,
+        FIELD_COUNT
+    } Field;
+
+    /**
+     * Remembers the most recently used layout.  Each thread (or object
+     * that's only used by one thread) should have its own.
+     */
+    class Cache {
+    private:
+        uint32_t                 m_key;
+        const FrameHeaderLayout* m_pLayout;
+    public:
+        Cache();
+        const FrameHeaderLayout* find(const void* pFrame);
+        const FrameHeaderLayout& layout(mfm::Frame& frame);
+    };
+
+private:
+    struct Location {
+        uint16_t s_offset;
+        uint16_t s_size;               // 0 if the revision lacks the field.
+    };
+    Location  m_fields[FIELD_COUNT];
+
+public:
+    static const FrameHeaderLayout& resolve(mfm::Frame& frame);
+    static const FrameHeaderLayout* find(const void* pFrame);
+
+    bool     has(Field f) const;
+    uint64_t get(Field f, const void* pFrame) const;
+    static const char* name(Field f);
+
+    // Primary header fields are at the same place in every frame:
+
+    static uint32_t key(const void* pFrame);
+    static bool     bigEndian(const void* pFrame);
+    static uint16_t frameType(const void* pFrame);
+    static uint8_t  revision(const void* pFrame);
+    static uint64_t load(const void* p, size_t nBytes, bool bigEndian);
+
+private:
+    FrameHeaderLayout(mfm::Frame& frame);
+};
+
+}
+
+#endif
@@ -165,18 +165,11 @@ CRingItemProcessor::processEvent(CPhysicsEventItem& item)
     // asad of the first hit added (since we only get hits from one cobo/asad combo at a time.
 
     int asad = hits[0].s_asad;
-    size_t requiredSize = hits.size() * sizeof(NSCLGET::Hit) + 100;
+    size_t requiredSize = NSCLGET::hitBodySize(hits.size()) + 100;
     
     CPhysicsEventItem hitItem(item.getEventTimestamp(), item.getSourceId() + asad, item.getBarrierType(), requiredSize);
     uint8_t* p = static_cast<uint8_t*>(hitItem.getBodyCursor());
-    uint32_t nhits = hits.size();
-    memcpy(p, &nhits, sizeof(uint32_t));
-    p += sizeof(uint32_t);
- 
-    for (int i = 0; i < hits.size(); i++) {
-        memcpy(p, &(hits[i]), sizeof(NSCLGET::Hit));
-        p += sizeof(NSCLGET::Hit);
-    }
+    p += NSCLGET::packHits(hits, p);
     hitItem.setBodyCursor(p);
     hitItem.updateSize();
     m_sink.putItem(hitItem);
@@ -0,0 +1,302 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  FrameGenerator.cpp
+ *  @brief: Implement the CoBo frame generator.
+ */
+#include "FrameGenerator.h"
+#include <math.h>
+
+static const int AGETS_PER_ASAD(4);
+static const int CHANNELS_PER_AGET(68);
+static const int BUCKETS(512);
+
+// Frame layout (see configs/CoboFormats-Rev-5*.xcfg):
+
+static const size_t   BLOCK_BYTES(256);
+static const uint8_t  META_TYPE(0x08);          // Big endian, 2^8 byte blocks.
+static const uint16_t REV5_FRAME_TYPE(1);
+static const uint16_t COMPACT_FRAME_TYPE(2);
+static const uint8_t  REVISION(5);
+static const size_t   HEADER_BLOCKS(1);
+
+static const size_t FRAME_SIZE_OFFSET(1);
+static const size_t FRAME_TYPE_OFFSET(5);
+static const size_t REVISION_OFFSET(7);
+static const size_t HEADER_SIZE_OFFSET(8);
+static const size_t ITEM_SIZE_OFFSET(10);
+static const size_t ITEM_COUNT_OFFSET(12);
+static const size_t EVENT_TIME_OFFSET(16);
+static const size_t EVENT_IDX_OFFSET(22);
+static const size_t COBO_IDX_OFFSET(26);
+static const size_t ASAD_IDX_OFFSET(27);
+static const size_t HIT_PAT_OFFSET(31);        // 9 bytes per AGET.
+static const size_t HIT_PAT_BYTES(9);
+static const size_t MULTIP_OFFSET(67);         // 2 bytes per AGET.
+
+// Made up signal: baseline with noise, pulses of random height.
+
+static const unsigned BASELINE(250);
+static const unsigned NOISE(8);
+static const unsigned MIN_PULSE(100);
+static const unsigned MAX_PULSE(3500);
+static const double   PULSE_SIGMA(6.0);
+static const unsigned MAX_SAMPLE(0xfff);
+
+/**
+ * constructor
+ *
+ * @param format           - frame layout.
+ * @param readout          - partial or full readout.
+ * @param occupancyPercent - percentage of channels with a pulse.
+ * @param buckets          - for partial readout, buckets read around each
+ *                           pulse.
+ * @param cobo             - CoBo index put in the frames.
+ * @param seed             - random number seed.
+ * @throw std::string - if the format can't hold the readout.
+ */
+FrameGenerator::FrameGenerator(
+    Format format, Readout readout, double occupancyPercent,
+    unsigned buckets, unsigned cobo, unsigned seed
+) :
+    m_format(format), m_readout(readout), m_occupancy(occupancyPercent/100.0),
+    m_buckets(buckets), m_cobo(cobo), m_random(seed)
+{
+    if ((format == REV5_COMPACT) && (readout == PARTIAL)) {
+        throw std::string("Rev-5-Compact frames have no channel or bucket index so they can only hold a full readout");
+    }
+    if (m_buckets == 0)       m_buckets = 1;
+    if (m_buckets > BUCKETS)  m_buckets = BUCKETS;
+}
+/**
+ * generate
+ *    Make a frame for one AsAd with a new set of pulses.
+ *
+ * @param[out] frame - the frame.
+ * @param      asad  - AsAd index to put in it.
+ */
+void
+FrameGenerator::generate(std::vector<uint8_t>& frame, unsigned asad)
+{
+    const int nChannels = AGETS_PER_ASAD*CHANNELS_PER_AGET;
+    std::bernoulli_distribution isHit(m_occupancy);
+
+    std::vector<bool>                  hit(nChannels);
+    std::vector<unsigned>              peak(nChannels, 0);
+    std::vector<std::vector<unsigned>> samples(nChannels);
+    for (int c = 0; c < nChannels; c++) {
+        hit[c] = isHit(m_random);
+        if (hit[c] || (m_readout == FULL)) {
+            samples[c].resize(BUCKETS);
+            for (int b = 0; b < BUCKETS; b++) {
+                samples[c][b] = baseline();
+            }
+            if (hit[c]) {
+                peak[c] = pulse(samples[c]);
+            }
+        }
+    }
+
+    frame.assign(HEADER_BLOCKS*BLOCK_BYTES, 0);
+    uint32_t itemCount = 0;
+    if (m_format == REV5_COMPACT) {
+
+        // Every bucket of every channel, AGETs interleaved.
+
+        frame.reserve(frame.size() + BUCKETS*nChannels*sizeof(uint16_t) + BLOCK_BYTES);
+        for (int b = 0; b < BUCKETS; b++) {
+            for (int chan = 0; chan < CHANNELS_PER_AGET; chan++) {
+                for (int aget = 0; aget < AGETS_PER_ASAD; aget++) {
+                    uint16_t item = (aget << 14) | samples[aget*CHANNELS_PER_AGET + chan][b];
+                    frame.push_back(item >> 8);
+                    frame.push_back(item & 0xff);
+                    itemCount++;
+                }
+            }
+        }
+    } else {
+
+        // Each sample is labeled with its AGET, channel and bucket.  A partial
+        // readout has only the buckets around the pulse of hit channels.
+
+        for (int c = 0; c < nChannels; c++) {
+            if (samples[c].empty()) continue;
+
+            int first = 0;
+            int last  = BUCKETS;
+            if (m_readout == PARTIAL) {
+                first = int(peak[c]) - int(m_buckets/2);
+                if (first < 0) first = 0;
+                last  = first + m_buckets;
+                if (last > BUCKETS) {
+                    last  = BUCKETS;
+                    first = last - m_buckets;
+                }
+            }
+            uint32_t aget = c / CHANNELS_PER_AGET;
+            uint32_t chan = c % CHANNELS_PER_AGET;
+            for (int b = first; b < last; b++) {
+                uint32_t item = (aget << 30) | (chan << 23) | (uint32_t(b) << 14) | samples[c][b];
+                size_t offset = frame.size();
+                frame.resize(offset + sizeof(uint32_t));
+                store(&frame[offset], item, sizeof(uint32_t));
+                itemCount++;
+            }
+        }
+    }
+    size_t padded = ((frame.size() + BLOCK_BYTES - 1)/BLOCK_BYTES)*BLOCK_BYTES;
+    frame.resize(padded, 0);
+    header(frame, asad, itemCount, hit);
+}
+/**
+ * setEvent
+ *    Set the event time and index of a frame made by generate.  This is
+ *    how one set of frames is sent for many triggers.
+ *
+ * @param frame     - the frame.
+ * @param eventTime - event time (48 bits).
+ * @param eventIdx  - event index (trigger number).
+ */
+void
+FrameGenerator::setEvent(std::vector<uint8_t>& frame, uint64_t eventTime, uint32_t eventIdx)
+{
+    store(&frame[EVENT_TIME_OFFSET], eventTime, 6);
+    store(&frame[EVENT_IDX_OFFSET], eventIdx, sizeof(uint32_t));
+}
+/**
+ * format
+ *    @param name - "Rev-5" or "Rev-5-Compact".
+ *    @return Format
+ *    @throw std::string - for any other name.
+ */
+FrameGenerator::Format
+FrameGenerator::format(const std::string& name)
+{
+    if (name == "Rev-5")         return REV5;
+    if (name == "Rev-5-Compact") return REV5_COMPACT;
+    throw std::string("Unknown frame format: '") + name + "'";
+}
+/**
+ * readout
+ *    @param name - "partial" or "full".
+ *    @return Readout
+ *    @throw std::string - for any other name.
+ */
+FrameGenerator::Readout
+FrameGenerator::readout(const std::string& name)
+{
+    if (name == "partial") return PARTIAL;
+    if (name == "full")    return FULL;
+    throw std::string("Unknown readout: '") + name + "'";
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * header
+ *    Fill in the frame header.  The frame must already be its full,
+ *    padded, size.  The event time and index are left zero (see setEvent).
+ *
+ * @param frame     - the frame.
+ * @param asad      - AsAd index.
+ * @param itemCount - number of sample items.
+ * @param hit       - which channels were hit; sets the hit patterns and
+ *                    multiplicities.
+ */
+void
+FrameGenerator::header(
+    std::vector<uint8_t>& frame, unsigned asad, uint32_t itemCount, const std::vector<bool>& hit
+)
+{
+    uint8_t* p = frame.data();
+    p[0] = META_TYPE;
+    store(p + FRAME_SIZE_OFFSET, frame.size()/BLOCK_BYTES, 3);
+    store(p + FRAME_TYPE_OFFSET,
+          m_format == REV5 ? REV5_FRAME_TYPE : COMPACT_FRAME_TYPE, sizeof(uint16_t));
+    p[REVISION_OFFSET] = REVISION;
+    store(p + HEADER_SIZE_OFFSET, HEADER_BLOCKS, sizeof(uint16_t));
+    store(p + ITEM_SIZE_OFFSET,
+          m_format == REV5 ? sizeof(uint32_t) : sizeof(uint16_t), sizeof(uint16_t));
+    store(p + ITEM_COUNT_OFFSET, itemCount, sizeof(uint32_t));
+    p[COBO_IDX_OFFSET] = m_cobo;
+    p[ASAD_IDX_OFFSET] = asad;
+
+    // Hit pattern: a bit per channel, channel 0 the low bit of the last byte.
+
+    for (int aget = 0; aget < AGETS_PER_ASAD; aget++) {
+        uint8_t* pPattern = p + HIT_PAT_OFFSET + aget*HIT_PAT_BYTES;
+        unsigned multiplicity = 0;
+        for (int chan = 0; chan < CHANNELS_PER_AGET; chan++) {
+            if (hit[aget*CHANNELS_PER_AGET + chan]) {
+                pPattern[HIT_PAT_BYTES - 1 - chan/8] |= 1 << (chan % 8);
+                multiplicity++;
+            }
+        }
+        store(p + MULTIP_OFFSET + aget*sizeof(uint16_t), multiplicity, sizeof(uint16_t));
+    }
+}
+/**
+ * pulse
+ *    Add a gaussian pulse of random height and position to a trace.
+ *
+ * @param samples - the trace.
+ * @return unsigned - bucket of the pulse's peak.
+ */
+unsigned
+FrameGenerator::pulse(std::vector<unsigned>& samples)
+{
+    std::uniform_int_distribution<unsigned> height(MIN_PULSE, MAX_PULSE);
+    std::uniform_int_distribution<unsigned> position(BUCKETS/8, BUCKETS - BUCKETS/8);
+    double   amplitude = height(m_random);
+    unsigned center    = position(m_random);
+
+    int reach = int(5*PULSE_SIGMA);
+    for (int b = int(center) - reach; b <= int(center) + reach; b++) {
+        if ((b < 0) || (b >= BUCKETS)) continue;
+        double x = (b - double(center))/PULSE_SIGMA;
+        unsigned value = samples[b] + unsigned(amplitude*exp(-0.5*x*x));
+        samples[b] = value > MAX_SAMPLE ? MAX_SAMPLE : value;
+    }
+    return center;
+}
+/**
+ * baseline
+ *    @return unsigned - a baseline sample with some noise.
+ */
+unsigned
+FrameGenerator::baseline()
+{
+    std::uniform_int_distribution<unsigned> noise(0, 2*NOISE);
+    return BASELINE - NOISE + noise(m_random);
+}
+/**
+ * store
+ *    Store a big endian unsigned integer.
+ *
+ * @param p      - where it goes.
+ * @param value  - the value.
+ * @param nBytes - number of bytes it takes.
+ */
+void
+FrameGenerator::store(uint8_t* p, uint64_t value, size_t nBytes)
+{
+    for (size_t i = nBytes; i > 0; i--) {
+        p[i-1] = value & 0xff;
+        value >>= 8;
+    }
+}
@@ -0,0 +1,86 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  FrameGenerator.h
+ *  @brief: Make CoBo MFM frames with made up pulses in them.
+ */
+#ifndef FRAMEGENERATOR_H
+#define FRAMEGENERATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <random>
+
+/**
+ * @class FrameGenerator
+ *    Builds the frames an AsAd's data would arrive in, laid out as
+ *    configs/CoboFormats-Rev-5.xcfg or CoboFormats-Rev-5-Compact.xcfg
+ *    describe: big endian, 256 byte blocks, a one block header and then
+ *    the sample items, padded to a whole block.
+ *
+ *    -  Rev-5 frames (frame type 1) have 4 byte items that carry the AGET,
+ *       channel and bucket of each sample.  They can hold a partial
+ *       readout, where only the buckets around each pulse of hit channels
+ *       are read, or a full readout of every bucket of every channel.
+ *    -  Rev-5-Compact frames (frame type 2) have 2 byte items with just the
+ *       AGET and sample, in bucket, channel, AGET order.  They can only hold
+ *       a full readout.
+ *
+ *    The hit channels are chosen at random with the given occupancy.  Each
+ *    has one pulse of random height and position on a noisy baseline;
+ *    channels that aren't hit are just baseline (and only appear in full
+ *    readout).  This is what analyzing/AnalyzeFrame expects to see.
+ */
+class FrameGenerator
+{
+public:
+    typedef enum _Format {
+        REV5, REV5_COMPACT
+    } Format;
+    typedef enum _Readout {
+        PARTIAL, FULL
+    } Readout;
+
+private:
+    Format       m_format;
+    Readout      m_readout;
+    double       m_occupancy;          // Fraction of channels hit.
+    unsigned     m_buckets;            // Partial readout: buckets per pulse.
+    unsigned     m_cobo;
+    std::mt19937 m_random;
+
+public:
+    FrameGenerator(Format format, Readout readout, double occupancyPercent,
+                   unsigned buckets, unsigned cobo, unsigned seed);
+
+    void generate(std::vector<uint8_t>& frame, unsigned asad);
+
+    static void   setEvent(std::vector<uint8_t>& frame, uint64_t eventTime, uint32_t eventIdx);
+    static Format  format(const std::string& name);
+    static Readout readout(const std::string& name);
+
+private:
+    void     header(std::vector<uint8_t>& frame, unsigned asad, uint32_t itemCount,
+                    const std::vector<bool>& hit);
+    unsigned pulse(std::vector<unsigned>& samples);
+    unsigned baseline();
+    static void store(uint8_t* p, uint64_t value, size_t nBytes);
+};
+
+#endif
@@ -0,0 +1,389 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  coboEmulatorMain.cpp
+ *  @brief: Stream CoBo frames to a data router so it can be benchmarked.
+ */
+
+#include "coboemulatorargs.h"
+#include "FrameGenerator.h"
+#include <mdaq/DefaultPortNums.h>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static const double   EVENT_CLOCK_HZ(100.0e6);        // CoBo eventTime ticks.
+static const uint32_t PHYSICS_EVENT(30);               // NSCLDAQ ring item type.
+static const size_t   MAX_IOVECS(64);                  // Per writev.
+
+// A trigger is one frame per AsAd, sent together.
+
+typedef std::vector<std::vector<uint8_t>> Trigger;
+
+/**
+ * Counts reported as we go; one set for the whole run and one for each
+ * report interval.
+ */
+struct Counters {
+    uint64_t s_triggers;            // Sent.
+    uint64_t s_frames;
+    uint64_t s_bytes;
+    uint64_t s_lost;                // Dropped for falling too far behind.
+    double   s_blocked;             // Seconds spent in writev.
+
+    Counters() : s_triggers(0), s_frames(0), s_bytes(0), s_lost(0), s_blocked(0.0) {}
+};
+
+/**
+ * seconds
+ *    @param d - a clock duration.
+ *    @return double - it in seconds.
+ */
+static double
+seconds(Clock::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+/**
+ * connectTo
+ *    Connect to the data router's data service.
+ *
+ * @param address - <host>:<port>; the port defaults to the GET data
+ *                  router's data port.
+ * @return int    - the connected socket.
+ * @throw std::string if the address is bad or the connection fails.
+ */
+static int
+connectTo(const std::string& address)
+{
+    std::string host = address;
+    std::string port = std::to_string(::mdaq::Default::dataRouterFlowPortNum);
+    size_t colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        host = address.substr(0, colon);
+        if (colon + 1 < address.size()) port = address.substr(colon + 1);
+    }
+    if (host.empty()) host = "localhost";
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* pInfo;
+    int status = getaddrinfo(host.c_str(), port.c_str(), &hints, &pInfo);
+    if (status) {
+        throw std::string("Bad data service address '") + address + "': " + gai_strerror(status);
+    }
+
+    int fd = socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+    if ((fd < 0) || connect(fd, pInfo->ai_addr, pInfo->ai_addrlen)) {
+        std::string msg = std::string("Unable to connect to '") + address + "': " + strerror(errno);
+        if (fd >= 0) close(fd);
+        freeaddrinfo(pInfo);
+        throw msg;
+    }
+    freeaddrinfo(pInfo);
+    return fd;
+}
+/**
+ * sendTrigger
+ *    Send the frames of a trigger with as few system calls as we can.
+ *
+ * @param fd      - socket connected to the router.
+ * @param trigger - the frames.
+ * @return size_t - bytes sent.
+ * @throw std::string if the router goes away.
+ */
+static size_t
+sendTrigger(int fd, Trigger& trigger)
+{
+    size_t total = 0;
+    for (size_t first = 0; first < trigger.size(); first += MAX_IOVECS) {
+        iovec  vectors[MAX_IOVECS];
+        size_t n = trigger.size() - first;
+        if (n > MAX_IOVECS) n = MAX_IOVECS;
+        for (size_t i = 0; i < n; i++) {
+            vectors[i].iov_base = trigger[first + i].data();
+            vectors[i].iov_len  = trigger[first + i].size();
+            total += vectors[i].iov_len;
+        }
+
+        // Short writes leave us part way through some frame.
+
+        iovec* pVector = vectors;
+        while (n) {
+            msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov    = pVector;
+            message.msg_iovlen = n;
+            ssize_t nSent = sendmsg(fd, &message, MSG_NOSIGNAL);
+            if (nSent < 0) {
+                if (errno == EINTR) continue;
+                throw std::string("Unable to send to the data router: ") + strerror(errno);
+            }
+            while (n && (size_t(nSent) >= pVector->iov_len)) {
+                nSent -= pVector->iov_len;
+                pVector++;
+                n--;
+            }
+            if (n) {
+                pVector->iov_base = static_cast<uint8_t*>(pVector->iov_base) + nSent;
+                pVector->iov_len -= nSent;
+            }
+        }
+    }
+    return total;
+}
+/**
+ * makeTriggers
+ *    Make up the sets of frames we send over and over.
+ *
+ * @param args - parsed command line.
+ * @return std::vector<Trigger>
+ * @throw std::string for bad parameters.
+ */
+static std::vector<Trigger>
+makeTriggers(const gengetopt_args_info& args)
+{
+    if ((args.asads_arg < 1) || (args.asads_arg > 255)) {
+        throw std::string("--asads must be from 1 to 255");
+    }
+    if ((args.occupancy_arg < 0.0) || (args.occupancy_arg > 100.0)) {
+        throw std::string("--occupancy is a percentage, from 0 to 100");
+    }
+    if (args.templates_arg < 1) {
+        throw std::string("--templates must be at least 1");
+    }
+    FrameGenerator generator(
+        FrameGenerator::format(args.format_arg), FrameGenerator::readout(args.readout_arg),
+        args.occupancy_arg, args.buckets_arg, args.cobo_arg, args.seed_arg
+    );
+
+    std::vector<Trigger> triggers(args.templates_arg);
+    for (size_t t = 0; t < triggers.size(); t++) {
+        triggers[t].resize(args.asads_arg);
+        for (int asad = 0; asad < args.asads_arg; asad++) {
+            generator.generate(triggers[t][asad], asad);
+        }
+    }
+    return triggers;
+}
+/**
+ * readTriggers
+ *    Read the frames to replay from an NSCLDAQ event file.  Each frame is
+ *    the body of a PHYSICS_EVENT ring item and is sent as a trigger by
+ *    itself.
+ *
+ * @param filename - the event file.
+ * @return std::vector<Trigger>
+ * @throw std::string if the file can't be read or has no frames.
+ */
+static std::vector<Trigger>
+readTriggers(const std::string& filename)
+{
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    if (!file) {
+        throw std::string("Unable to open replay file '") + filename + "': " + strerror(errno);
+    }
+
+    std::vector<Trigger> triggers;
+    uint32_t header[2];                     // size, type.
+    while (file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+        if (header[0] < sizeof(header) + sizeof(uint32_t)) {
+            throw std::string("Replay file '") + filename + "' has a bad ring item size";
+        }
+        std::vector<uint8_t> body(header[0] - sizeof(header));
+        if (!file.read(reinterpret_cast<char*>(body.data()), body.size())) {
+            throw std::string("Replay file '") + filename + "' ends part way through a ring item";
+        }
+        if (header[1] != PHYSICS_EVENT) continue;
+
+        // A body header size of 0 or sizeof(uint32_t) means there's none.
+
+        uint32_t bodyHeaderSize;
+        memcpy(&bodyHeaderSize, body.data(), sizeof(uint32_t));
+        if (bodyHeaderSize == 0) bodyHeaderSize = sizeof(uint32_t);
+        if (bodyHeaderSize >= body.size()) continue;
+
+        triggers.push_back(Trigger(1));
+        triggers.back()[0].assign(body.begin() + bodyHeaderSize, body.end());
+    }
+    if (triggers.empty()) {
+        throw std::string("Replay file '") + filename + "' has no PHYSICS_EVENT items";
+    }
+    return triggers;
+}
+/**
+ * report
+ *    Print the throughput over some interval.
+ *
+ * @param label   - what the interval is.
+ * @param c       - counts for it.
+ * @param elapsed - its length in seconds.
+ */
+static void
+report(const std::string& label, const Counters& c, double elapsed)
+{
+    if (elapsed <= 0.0) elapsed = 1.0e-9;
+    double handled = double(c.s_triggers + c.s_lost);
+    std::cout << std::fixed << std::setprecision(1) << label << ": "
+        << c.s_triggers << " triggers (" << c.s_frames << " frames) sent, "
+        << c.s_triggers/elapsed << " triggers/s, "
+        << c.s_bytes/elapsed/1.0e6 << " MB/s, "
+        << c.s_lost << " lost (" << (handled > 0 ? 100.0*c.s_lost/handled : 0.0) << "%), "
+        << 100.0*c.s_blocked/elapsed << "% of the time sending" << std::endl;
+}
+
+/**
+ * main
+ *    Parse the command line, make or read the frames, connect to the router
+ *    and send the frames until we've sent enough or the router goes away.
+ *
+ *    With a --rate, trigger k is due k/rate seconds after the start.  When
+ *    the router can't keep up, sends block and we fall behind.  We catch up
+ *    by sending as fast as we can, but once more than --max-lag triggers
+ *    are overdue the oldest are dropped and counted as lost, as they would
+ *    be by a CoBo whose buffers are full.  Each trigger gets its own
+ *    eventIdx and an eventTime at its due time.
+ */
+int main(int argc, char** argv)
+{
+    gengetopt_args_info parsedArgs;
+    cmdline_parser(argc, argv, &parsedArgs);
+
+    try {
+        std::vector<Trigger> triggers = parsedArgs.replay_given ?
+            readTriggers(parsedArgs.replay_arg) : makeTriggers(parsedArgs);
+        bool replaying = parsedArgs.replay_given;
+
+        double   rate        = parsedArgs.rate_arg;
+        uint64_t maxTriggers = parsedArgs.triggers_arg > 0 ? parsedArgs.triggers_arg : 0;
+        uint64_t maxLag      = parsedArgs.max_lag_arg > 0 ? parsedArgs.max_lag_arg : 0;
+        if (rate < 0.0) {
+            throw std::string("--rate can't be negative");
+        }
+
+        int fd = connectTo(parsedArgs.dataservice_arg);
+        std::cout << "Connected to " << parsedArgs.dataservice_arg << "; sending "
+            << (replaying ? std::string("frames from ") + parsedArgs.replay_arg :
+                std::string(parsedArgs.format_arg) + " " + parsedArgs.readout_arg + " readout frames")
+            << " at ";
+        if (rate > 0.0) {
+            std::cout << rate << " triggers/s" << std::endl;
+        } else {
+            std::cout << "full speed" << std::endl;
+        }
+
+        Counters total;
+        Counters interval;
+        Clock::time_point start      = Clock::now();
+        Clock::time_point lastReport = start;
+        Clock::duration   duration   = std::chrono::seconds(parsedArgs.duration_arg);
+        Clock::duration   reportEvery = std::chrono::seconds(parsedArgs.report_interval_arg);
+        uint64_t          k = 0;                // Next trigger: sent + lost so far.
+
+        try {
+            while (!maxTriggers || (k < maxTriggers)) {
+                Clock::time_point now = Clock::now();
+                double elapsed = seconds(now - start);
+                if ((parsedArgs.duration_arg > 0) && (now - start >= duration)) break;
+
+                if ((parsedArgs.report_interval_arg > 0) && (now - lastReport >= reportEvery)) {
+                    std::ostringstream label;
+                    label << std::fixed << std::setprecision(1) << std::setw(8) << elapsed << " s";
+                    report(label.str(), interval, seconds(now - lastReport));
+                    interval   = Counters();
+                    lastReport = now;
+                }
+
+                if (rate > 0.0) {
+                    uint64_t due = uint64_t(elapsed*rate) + 1;
+                    if (k >= due) {
+                        double wait = k/rate - elapsed;
+                        if (wait > 200.0e-6) {
+                            std::this_thread::sleep_for(std::chrono::duration<double>(wait/2));
+                        }
+                        continue;
+                    }
+                    if (due - k > maxLag + 1) {
+                        uint64_t dropped = due - k - maxLag - 1;
+                        if (maxTriggers && (k + dropped > maxTriggers)) dropped = maxTriggers - k;
+                        total.s_lost    += dropped;
+                        interval.s_lost += dropped;
+                        k += dropped;
+                        continue;
+                    }
+                }
+
+                Trigger& trigger(triggers[k % triggers.size()]);
+                if (!replaying) {
+                    uint64_t eventTime = uint64_t((rate > 0.0 ? k/rate : elapsed)*EVENT_CLOCK_HZ);
+                    for (size_t i = 0; i < trigger.size(); i++) {
+                        FrameGenerator::setEvent(trigger[i], eventTime, uint32_t(k));
+                    }
+                }
+                Clock::time_point sendStart = Clock::now();
+                size_t nBytes = sendTrigger(fd, trigger);
+                double sendTime = seconds(Clock::now() - sendStart);
+                k++;
+
+                total.s_triggers++;    interval.s_triggers++;
+                total.s_frames += trigger.size();
+                interval.s_frames += trigger.size();
+                total.s_bytes += nBytes;
+                interval.s_bytes += nBytes;
+                total.s_blocked += sendTime;
+                interval.s_blocked += sendTime;
+            }
+        }
+        catch (std::string& msg) {
+            std::cerr << msg << std::endl;          // Still report what we did.
+        }
+        close(fd);
+        report("Total", total, seconds(Clock::now() - start));
+    }
+    catch (std::string& msg) {
+        std::cerr << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    catch (const char* msg) {
+        std::cerr << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    catch (...) {
+        std::cerr << "Unexpected exception type\n";
+        exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}
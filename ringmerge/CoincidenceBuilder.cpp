@@ -0,0 +1,236 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  CoincidenceBuilder.cpp
+ *  @brief: Implement the glom compatible event builder.
+ */
+#include "CoincidenceBuilder.h"
+#include <DataFormat.h>
+#include <fragment.h>
+#include <string.h>
+
+// A built item is written once it's this big even if more fragments are in
+// the window; it keeps memory bounded and the item well inside the ring.
+
+static const size_t MAX_BUILT_BYTES(8*1024*1024);
+
+// Bytes in front of the first fragment:
+
+static const size_t BUILT_HEADER_BYTES(
+    sizeof(RingItemHeader) + sizeof(BodyHeader) + sizeof(uint32_t)
+);
+
+/**
+ * constructor
+ *
+ * @param sink      - where built (and passed through) items go.
+ * @param window    - items within this many ticks of an event's first
+ *                    fragment are built into it.
+ * @param policy    - which timestamp the built items get.
+ * @param sourceId  - source id of the built items.
+ * @param timeoutMs - the longest an event is held waiting for fragments.
+ */
+CoincidenceBuilder::CoincidenceBuilder(
+    ItemSink& sink, uint64_t window, CGlomParameters::TimestampPolicy policy,
+    uint32_t sourceId, unsigned timeoutMs
+) :
+    m_sink(sink), m_window(window), m_policy(policy), m_sourceId(sourceId),
+    m_timeout(timeoutMs), m_event(BUILT_HEADER_BYTES), m_fill(0),
+    m_fragments(0), m_firstTimestamp(0), m_lastTimestamp(0),
+    m_offsetSum(0), m_events(0), m_builtFragments(0), m_timeouts(0),
+    m_oversize(0), m_passed(0)
+{}
+/**
+ * writeInfo
+ *    Write the EVB_GLOM_INFO item describing the build.
+ */
+void
+CoincidenceBuilder::writeInfo()
+{
+    CGlomParameters info(m_window, true, m_policy);
+    m_sink.write(info.getItemPointer());
+}
+/**
+ * write
+ *    Take the next item.
+ *
+ * @param pItem - the item; its size is in its header.
+ */
+void
+CoincidenceBuilder::write(const void* pItem)
+{
+    const RingItemHeader* pHeader = static_cast<const RingItemHeader*>(pItem);
+    BodyHeader body;
+    bool timed = false;
+    if ((pHeader->s_type == PHYSICS_EVENT) &&
+        (pHeader->s_size >= sizeof(RingItemHeader) + sizeof(BodyHeader))) {
+        memcpy(&body, pHeader + 1, sizeof(body));
+        timed = (body.s_size >= sizeof(BodyHeader)) &&
+                (body.s_timestamp != NULL_TIMESTAMP);
+    }
+    if (!timed) {
+        writeEvent();
+        m_sink.write(pItem);
+        m_passed++;
+        if (pHeader->s_type == BEGIN_RUN) {
+            writeInfo();
+        }
+        return;
+    }
+
+    if (m_fragments) {
+        bool inWindow = (body.s_timestamp >= m_firstTimestamp) &&
+                        (body.s_timestamp - m_firstTimestamp <= m_window);
+        bool fits     = m_fill + sizeof(EVB::FragmentHeader) + pHeader->s_size
+                        <= MAX_BUILT_BYTES;
+        if (inWindow && !fits) {
+            m_oversize++;
+        }
+        if (!inWindow || !fits) {
+            writeEvent();
+        }
+    }
+    addFragment(pItem, body);
+}
+/**
+ * writeDue
+ *    Write the event being built if it's been held for the timeout.
+ *
+ * @return bool - true if it was written.
+ */
+bool
+CoincidenceBuilder::writeDue()
+{
+    if (m_fragments &&
+        (std::chrono::steady_clock::now() - m_started >= m_timeout)) {
+        m_timeouts++;
+        writeEvent();
+        return true;
+    }
+    return false;
+}
+/**
+ * report
+ *    Write a line of counters: events built, mean fragments an event,
+ *    events written on the timeout or because they were too big, and items
+ *    passed through unbuilt.  The sink's counters follow.
+ *
+ * @param out - where to write it.
+ */
+void
+CoincidenceBuilder::report(std::ostream& out)
+{
+    out << "ringmerge: " << m_events << " events built";
+    if (m_events) {
+        out << " (" << double(m_builtFragments)/m_events << " fragments/event)";
+    }
+    out << ", " << m_timeouts << " timed out, " << m_oversize << " too big, "
+        << m_passed << " items not built" << std::endl;
+    m_sink.report(out);
+}
+/**
+ * policy
+ *    @param name - "first", "last" or "average".
+ *    @return CGlomParameters::TimestampPolicy - the policy it names.
+ *    @throw std::string - for anything else.
+ */
+CGlomParameters::TimestampPolicy
+CoincidenceBuilder::policy(const std::string& name)
+{
+    if (name == "first")   return CGlomParameters::first;
+    if (name == "last")    return CGlomParameters::last;
+    if (name == "average") return CGlomParameters::average;
+    throw std::string("Unknown timestamp policy: ") + name;
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * addFragment
+ *    Append an item to the event being built, starting one if need be.
+ *
+ * @param pItem - the item.
+ * @param body  - its body header.
+ */
+void
+CoincidenceBuilder::addFragment(const void* pItem, const BodyHeader& body)
+{
+    const RingItemHeader* pHeader = static_cast<const RingItemHeader*>(pItem);
+    if (m_fragments == 0) {
+        m_fill           = BUILT_HEADER_BYTES;
+        m_firstTimestamp = body.s_timestamp;
+        m_offsetSum      = 0;
+        m_started        = std::chrono::steady_clock::now();
+    }
+    size_t needed = m_fill + sizeof(EVB::FragmentHeader) + pHeader->s_size;
+    if (m_event.size() < needed) {
+        m_event.resize(needed);
+    }
+
+    EVB::FragmentHeader fragment;
+    fragment.s_timestamp = body.s_timestamp;
+    fragment.s_sourceId  = body.s_sourceId;
+    fragment.s_size      = pHeader->s_size;
+    fragment.s_barrier   = body.s_barrier;
+    memcpy(m_event.data() + m_fill, &fragment, sizeof(fragment));
+    memcpy(m_event.data() + m_fill + sizeof(fragment), pItem, pHeader->s_size);
+    m_fill = needed;
+
+    m_fragments++;
+    m_lastTimestamp = body.s_timestamp;
+    m_offsetSum    += body.s_timestamp - m_firstTimestamp;
+}
+/**
+ * writeEvent
+ *    Fill in the headers of the event being built and write it, if there
+ *    is one.
+ */
+void
+CoincidenceBuilder::writeEvent()
+{
+    if (m_fragments == 0) return;
+
+    uint64_t timestamp = m_firstTimestamp;
+    if (m_policy == CGlomParameters::last) {
+        timestamp = m_lastTimestamp;
+    } else if (m_policy == CGlomParameters::average) {
+        timestamp = m_firstTimestamp + m_offsetSum/m_fragments;
+    }
+
+    RingItemHeader header;
+    header.s_size = m_fill;
+    header.s_type = PHYSICS_EVENT;
+    BodyHeader body;
+    body.s_size      = sizeof(BodyHeader);
+    body.s_timestamp = timestamp;
+    body.s_sourceId  = m_sourceId;
+    body.s_barrier   = 0;
+    uint32_t bodyBytes = m_fill - sizeof(RingItemHeader) - sizeof(BodyHeader);
+
+    uint8_t* p = m_event.data();
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, &body, sizeof(body));
+    p += sizeof(body);
+    memcpy(p, &bodyBytes, sizeof(bodyBytes));
+
+    m_sink.write(m_event.data());
+    m_events++;
+    m_builtFragments += m_fragments;
+    m_fragments = 0;
+}
@@ -0,0 +1,101 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  CoincidenceBuilder.h
+ *  @brief: Build events from timestamp ordered items as glom does.
+ */
+#ifndef COINCIDENCEBUILDER_H
+#define COINCIDENCEBUILDER_H
+
+#include "ItemSink.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <CGlomParameters.h>
+
+/**
+ * @class CoincidenceBuilder
+ *    Takes timestamp ordered items (from an OrderedMerge) and glues the
+ *    PHYSICS_EVENT items whose timestamps are within the coincidence
+ *    window of the first into one built PHYSICS_EVENT item, laid out as
+ *    the NSCLDAQ glom lays its output out:
+ *
+ *    - A ring item header and a body header whose timestamp is the first,
+ *      last or average of the fragments' (the timestamp policy) and whose
+ *      source id is ours.
+ *    - A uint32_t count of the bytes in the rest of the body, itself
+ *      included.
+ *    - Each fragment: an EVB::FragmentHeader giving the item's timestamp,
+ *      source id and barrier type and its size, then the whole ring item.
+ *
+ *    Other items (state changes, text items, ...) end the event being
+ *    built and are passed through as they are, as glom does.  An
+ *    EVB_GLOM_INFO item describing the build goes out first and after each
+ *    BEGIN_RUN so each run's files say how it was built.
+ *
+ *    The event being built is written once an item outside the window
+ *    comes in, once it's been held for the timeout (so the last event
+ *    before the data stop isn't held forever) and once it reaches the
+ *    largest built item size.
+ */
+class CoincidenceBuilder : public ItemSink
+{
+private:
+    ItemSink&                         m_sink;
+    uint64_t                          m_window;
+    CGlomParameters::TimestampPolicy  m_policy;
+    uint32_t                          m_sourceId;
+    std::chrono::milliseconds         m_timeout;
+
+    std::vector<uint8_t>              m_event;        // Headers + fragments.
+    size_t                            m_fill;         // Bytes of m_event in use.
+    unsigned                          m_fragments;
+    uint64_t                          m_firstTimestamp;
+    uint64_t                          m_lastTimestamp;
+    uint64_t                          m_offsetSum;    // Of timestamps from the first.
+    std::chrono::steady_clock::time_point m_started;
+
+    uint64_t                          m_events;
+    uint64_t                          m_builtFragments;
+    uint64_t                          m_timeouts;
+    uint64_t                          m_oversize;
+    uint64_t                          m_passed;       // Not built.
+
+public:
+    CoincidenceBuilder(ItemSink& sink, uint64_t window,
+                       CGlomParameters::TimestampPolicy policy,
+                       uint32_t sourceId, unsigned timeoutMs);
+
+    void writeInfo();
+
+    virtual void write(const void* pItem);
+    virtual bool writeDue();
+    virtual void report(std::ostream& out);
+
+    static CGlomParameters::TimestampPolicy policy(const std::string& name);
+
+private:
+    CoincidenceBuilder(const CoincidenceBuilder&);
+    CoincidenceBuilder& operator=(const CoincidenceBuilder&);
+
+    void addFragment(const void* pItem, const BodyHeader& body);
+    void writeEvent();
+};
+
+#endif
@@ -0,0 +1,117 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  ItemQueue.cpp
+ *  @brief: Implement the ring item queue.
+ */
+#include "ItemQueue.h"
+
+/**
+ * constructor
+ *
+ * @param slots - the most items the queue holds; rounded up to a power
+ *                of 2.
+ */
+ItemQueue::ItemQueue(size_t slots) :
+    m_pushIndex(0), m_fullPushes(0), m_popIndex(0)
+{
+    size_t n = 2;
+    while (n < slots) {
+        n *= 2;
+    }
+    m_slots.reset(new Slot[n]);
+    m_mask = n - 1;
+    for (size_t i = 0; i < n; i++) {
+        m_slots[i].s_sequence.store(i, std::memory_order_relaxed);
+        m_slots[i].s_source = 0;
+    }
+}
+/**
+ * push
+ *    Queue an item.  Any number of threads may push at once.
+ *
+ * @param item   - holds the ring item at its front.  On success it's
+ *                 swapped with a slot's buffer, so item then holds
+ *                 anything and the caller just reuses it.
+ * @param source - which input it came from; handed back by pop.
+ * @return bool  - false if the queue is full; item is untouched.
+ */
+bool
+ItemQueue::push(std::vector<uint8_t>& item, unsigned source)
+{
+    size_t index = m_pushIndex.load(std::memory_order_relaxed);
+    while (true) {
+        Slot& slot(m_slots[index & m_mask]);
+        size_t sequence = slot.s_sequence.load(std::memory_order_acquire);
+        intptr_t diff   = intptr_t(sequence) - intptr_t(index);
+        if (diff == 0) {
+            if (m_pushIndex.compare_exchange_weak(
+                index, index + 1, std::memory_order_relaxed
+            )) {
+                slot.s_item.swap(item);
+                slot.s_source = source;
+                slot.s_sequence.store(index + 1, std::memory_order_release);
+                return true;
+            }                               // index is reloaded on failure.
+        } else if (diff < 0) {
+            m_fullPushes.fetch_add(1, std::memory_order_relaxed);
+            return false;                   // Not yet popped a lap ago.
+        } else {
+            index = m_pushIndex.load(std::memory_order_relaxed);
+        }
+    }
+}
+/**
+ * pop
+ *    Take the oldest item.  Only one thread may pop.
+ *
+ * @param item   - swapped with the item's buffer; the ring item is at
+ *                 its front.
+ * @param[out] source - the input it came from.
+ * @return bool  - false if the queue is empty.
+ */
+bool
+ItemQueue::pop(std::vector<uint8_t>& item, unsigned& source)
+{
+    Slot& slot(m_slots[m_popIndex & m_mask]);
+    if (slot.s_sequence.load(std::memory_order_acquire) != m_popIndex + 1) {
+        return false;
+    }
+    slot.s_item.swap(item);
+    source = slot.s_source;
+    slot.s_sequence.store(m_popIndex + m_mask + 1, std::memory_order_release);
+    m_popIndex++;
+    return true;
+}
+/**
+ * capacity
+ *    @return size_t - the most items the queue holds.
+ */
+size_t
+ItemQueue::capacity() const
+{
+    return m_mask + 1;
+}
+/**
+ * fullPushes
+ *    @return uint64_t - how many pushes found the queue full.
+ */
+uint64_t
+ItemQueue::fullPushes() const
+{
+    return m_fullPushes.load(std::memory_order_relaxed);
+}
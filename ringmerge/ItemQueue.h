@@ -0,0 +1,88 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  ItemQueue.h
+ *  @brief: Bounded, lock-free multiple producer/single consumer ring item queue.
+ */
+#ifndef ITEMQUEUE_H
+#define ITEMQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <memory>
+
+/**
+ * @class ItemQueue
+ *    Hands ring items from the input reader threads (producers) to the
+ *    thread writing the output ring (consumer).  The queue is a circular
+ *    array of slots, each with a sequence number saying whose turn it is:
+ *    a slot is free for the push with index i when its sequence is i and
+ *    full for the pop with index i when its sequence is i + 1.  Producers
+ *    claim push indices with a compare and swap; there's only one consumer
+ *    so its index is its own.
+ *
+ *    Each slot owns a buffer.  A push or pop swaps the caller's buffer
+ *    with the slot's rather than copying the item, so once the buffers
+ *    have grown to fit the items nothing is allocated.  Items from one
+ *    producer come out in the order it pushed them.
+ */
+class ItemQueue
+{
+private:
+    struct Slot {
+        std::atomic<size_t>  s_sequence;
+        unsigned             s_source;
+        std::vector<uint8_t> s_item;
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t                  m_mask;             // Slots - 1; a power of 2.
+
+    // The producer and consumer indices are kept on separate cache lines
+    // so the threads don't fight over one line.
+
+    char                    m_pad0[64];
+    std::atomic<size_t>     m_pushIndex;        // Producers share.
+    std::atomic<uint64_t>   m_fullPushes;
+    char                    m_pad1[64];
+    size_t                  m_popIndex;         // Consumer owned.
+    char                    m_pad2[64];
+
+public:
+    ItemQueue(size_t slots);
+
+    // Producers:
+
+    bool push(std::vector<uint8_t>& item, unsigned source);
+
+    // Consumer:
+
+    bool pop(std::vector<uint8_t>& item, unsigned& source);
+
+    // Either:
+
+    size_t   capacity()   const;
+    uint64_t fullPushes() const;
+
+private:
+    ItemQueue(const ItemQueue&);
+    ItemQueue& operator=(const ItemQueue&);
+};
+
+#endif
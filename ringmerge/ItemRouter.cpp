@@ -0,0 +1,289 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  ItemRouter.cpp
+ *  @brief: Implement rule based routing of ring items.
+ */
+#include "ItemRouter.h"
+#include <CRingBuffer.h>
+#include <DataFormat.h>
+#include <algorithm>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+
+// Item type names a rule may use instead of numbers:
+
+static const struct {
+    const char* s_name;
+    uint32_t    s_type;
+} ITEM_TYPE_NAMES[] = {
+    {"begin", BEGIN_RUN}, {"end", END_RUN}, {"pause", PAUSE_RUN},
+    {"resume", RESUME_RUN}, {"packets", PACKET_TYPES},
+    {"variables", MONITORED_VARIABLES}, {"format", RING_FORMAT},
+    {"scalers", PERIODIC_SCALERS}, {"physics", PHYSICS_EVENT},
+    {"count", PHYSICS_EVENT_COUNT}, {"glom", EVB_GLOM_INFO}
+};
+
+/**
+ * constructor
+ *
+ * @param pDefault    - ring for items no rule matches.
+ * @param defaultName - its name; rules may name it too.
+ * @param ringBytes   - size of the rings rules make.
+ */
+ItemRouter::ItemRouter(CRingBuffer* pDefault, const std::string& defaultName,
+                       size_t ringBytes) :
+    m_ringBytes(ringBytes), m_unrouted(0)
+{
+    Output def = {defaultName, pDefault, 0, 0};
+    m_outputs.push_back(def);
+    m_selected.push_back(0);
+}
+/**
+ * addRule
+ *    Add a routing rule (see the class comments for the syntax).
+ *
+ * @param rule - the rule.
+ * @throw std::string - if the rule doesn't parse.
+ * @throw CException  - if a ring can't be made.
+ */
+void
+ItemRouter::addRule(const std::string& rule)
+{
+    std::istringstream fields(rule);
+    std::string rings;
+    if (!(fields >> rings)) {
+        throw std::string("Empty --route rule");
+    }
+
+    Rule r;
+    r.s_text      = rule;
+    r.s_timeRange = false;
+    r.s_low       = 0;
+    r.s_high      = UINT64_MAX;
+    r.s_matched   = 0;
+
+    std::string term;
+    while (fields >> term) {
+        size_t equals = term.find('=');
+        if ((equals == std::string::npos) || (equals + 1 == term.size())) {
+            throw std::string("--route term isn't name=value: ") + term + " in " + rule;
+        }
+        std::string name  = term.substr(0, equals);
+        std::string value = term.substr(equals + 1);
+        if (name == "type") {
+            std::vector<std::string> types = split(value, ',');
+            for (size_t i = 0; i < types.size(); i++) {
+                r.s_types.push_back(itemType(types[i], rule));
+            }
+        } else if (name == "sid") {
+            std::vector<std::string> ids = split(value, ',');
+            for (size_t i = 0; i < ids.size(); i++) {
+                r.s_sourceIds.push_back(number(ids[i], rule));
+            }
+        } else if (name == "ts") {
+            size_t dash = value.find('-');
+            if (dash == std::string::npos) {
+                throw std::string("--route ts isn't LOW-HIGH in ") + rule;
+            }
+            r.s_timeRange = true;
+            if (dash > 0) {
+                r.s_low = number(value.substr(0, dash), rule);
+            }
+            if (dash + 1 < value.size()) {
+                r.s_high = number(value.substr(dash + 1), rule);
+            }
+        } else {
+            throw std::string("Unknown --route term ") + name + " in " + rule;
+        }
+    }
+
+    std::vector<std::string> names = split(rings, ',');
+    for (size_t i = 0; i < names.size(); i++) {
+        size_t ring = output(names[i]);
+        if (std::find(r.s_rings.begin(), r.s_rings.end(), ring) == r.s_rings.end()) {
+            r.s_rings.push_back(ring);
+        }
+    }
+    m_rules.push_back(r);
+}
+/**
+ * write
+ *    Put an item in the rings of the rules it matches, or the default ring
+ *    if it matches none.
+ *
+ * @param pItem - the item; its size is in its header.
+ */
+void
+ItemRouter::write(const void* pItem)
+{
+    const RingItemHeader* pHeader = static_cast<const RingItemHeader*>(pItem);
+    BodyHeader body;
+    bool hasBody = false;
+    if (pHeader->s_size >= sizeof(RingItemHeader) + sizeof(BodyHeader)) {
+        memcpy(&body, pHeader + 1, sizeof(body));
+        hasBody = body.s_size >= sizeof(BodyHeader);
+    }
+
+    bool routed = false;
+    for (size_t i = 0; i < m_rules.size(); i++) {
+        Rule& rule(m_rules[i]);
+        if (matches(rule, pHeader->s_type, hasBody, body)) {
+            rule.s_matched++;
+            for (size_t r = 0; r < rule.s_rings.size(); r++) {
+                m_selected[rule.s_rings[r]] = 1;
+            }
+            routed = true;
+        }
+    }
+    if (!routed) {
+        m_selected[0] = 1;
+        m_unrouted++;
+    }
+
+    for (size_t i = 0; i < m_outputs.size(); i++) {
+        if (!m_selected[i]) continue;
+        m_selected[i] = 0;
+        Output& out(m_outputs[i]);
+        out.s_pRing->put(const_cast<void*>(pItem), pHeader->s_size);
+        out.s_items++;
+        out.s_bytes += pHeader->s_size;
+    }
+}
+/**
+ * report
+ *    Write the items each rule matched and each ring got.
+ *
+ * @param out - where to write it.
+ */
+void
+ItemRouter::report(std::ostream& out)
+{
+    for (size_t i = 0; i < m_rules.size(); i++) {
+        out << "ringmerge: route '" << m_rules[i].s_text << "' matched "
+            << m_rules[i].s_matched << " items" << std::endl;
+    }
+    out << "ringmerge: " << m_unrouted << " items matched no route";
+    for (size_t i = 0; i < m_outputs.size(); i++) {
+        out << ", " << m_outputs[i].s_name << ": " << m_outputs[i].s_items
+            << " items, " << m_outputs[i].s_bytes/1.0e6 << " MB";
+    }
+    out << std::endl;
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * output
+ *    @param name - a ring name.
+ *    @return size_t - index of its output; the ring is made if it's new.
+ *    @throw CException - if it can't be made.
+ */
+size_t
+ItemRouter::output(const std::string& name)
+{
+    for (size_t i = 0; i < m_outputs.size(); i++) {
+        if (m_outputs[i].s_name == name) {
+            return i;
+        }
+    }
+    Output o = {name, CRingBuffer::createAndProduce(name, m_ringBytes), 0, 0};
+    m_outputs.push_back(o);
+    m_selected.push_back(0);
+    return m_outputs.size() - 1;
+}
+/**
+ * matches
+ *    @param rule    - a rule.
+ *    @param type    - an item's type.
+ *    @param hasBody - whether it has a body header...
+ *    @param body    - ...and if so, the body header.
+ *    @return bool   - true if the rule matches the item.
+ */
+bool
+ItemRouter::matches(const Rule& rule, uint32_t type, bool hasBody,
+                    const BodyHeader& body) const
+{
+    if (!rule.s_types.empty() &&
+        (std::find(rule.s_types.begin(), rule.s_types.end(), type) == rule.s_types.end())) {
+        return false;
+    }
+    if (!rule.s_sourceIds.empty() &&
+        (!hasBody || (std::find(rule.s_sourceIds.begin(), rule.s_sourceIds.end(),
+                                body.s_sourceId) == rule.s_sourceIds.end()))) {
+        return false;
+    }
+    if (rule.s_timeRange &&
+        (!hasBody || (body.s_timestamp == NULL_TIMESTAMP) ||
+         (body.s_timestamp < rule.s_low) || (body.s_timestamp > rule.s_high))) {
+        return false;
+    }
+    return true;
+}
+/**
+ * split
+ *    @param list      - text with separators.
+ *    @param separator - the separator.
+ *    @return std::vector<std::string> - the pieces between separators.
+ */
+std::vector<std::string>
+ItemRouter::split(const std::string& list, char separator)
+{
+    std::vector<std::string> result;
+    std::string piece;
+    std::istringstream in(list);
+    while (std::getline(in, piece, separator)) {
+        result.push_back(piece);
+    }
+    return result;
+}
+/**
+ * number
+ *    @param text - an unsigned number (decimal, or hex with 0x).
+ *    @param rule - the rule it's in, for errors.
+ *    @return uint64_t - its value.
+ *    @throw std::string - if it's not a number.
+ */
+uint64_t
+ItemRouter::number(const std::string& text, const std::string& rule)
+{
+    char* end;
+    uint64_t value = strtoull(text.c_str(), &end, 0);
+    if (text.empty() || *end) {
+        throw std::string("--route value isn't a number: ") + text + " in " + rule;
+    }
+    return value;
+}
+/**
+ * itemType
+ *    @param text - an item type name or number.
+ *    @param rule - the rule it's in, for errors.
+ *    @return uint32_t - the item type.
+ *    @throw std::string - if it's neither.
+ */
+uint32_t
+ItemRouter::itemType(const std::string& text, const std::string& rule)
+{
+    for (size_t i = 0; i < sizeof(ITEM_TYPE_NAMES)/sizeof(ITEM_TYPE_NAMES[0]); i++) {
+        if (text == ITEM_TYPE_NAMES[i].s_name) {
+            return ITEM_TYPE_NAMES[i].s_type;
+        }
+    }
+    return number(text, rule);
+}
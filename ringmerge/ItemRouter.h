@@ -0,0 +1,97 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  ItemRouter.h
+ *  @brief: Send merged ring items to output rings by rules.
+ */
+#ifndef ITEMROUTER_H
+#define ITEMROUTER_H
+
+#include "ItemSink.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class CRingBuffer;
+
+/**
+ * @class ItemRouter
+ *    The last sink when ringmerge has --route rules.  A rule is written
+ *
+ *        RING[,RING...] [type=TYPE[,TYPE...]] [sid=ID[,ID...]] [ts=LOW-HIGH]
+ *
+ *    and matches the items whose type is one of the TYPEs (numbers or
+ *    names like physics or scalers), whose body header source id is one of
+ *    the IDs and whose body header timestamp is from LOW to HIGH inclusive
+ *    (either may be left out).  Terms left out match anything; items with
+ *    no body header never match a sid or ts term.
+ *
+ *    Each item goes to the rings of every rule it matches, but to each
+ *    ring only once, however many of its rules match; items no rule
+ *    matches go to the default (--output) ring.  So one pass over the
+ *    items splits them, copying each once per ring it goes to.  Rings
+ *    are made, as producer, the first time a rule names them.
+ */
+class ItemRouter : public ItemSink
+{
+private:
+    struct Rule {
+        std::string           s_text;
+        std::vector<size_t>   s_rings;
+        std::vector<uint32_t> s_types;          // Empty matches any.
+        std::vector<uint32_t> s_sourceIds;      // Empty matches any.
+        bool                  s_timeRange;
+        uint64_t              s_low;
+        uint64_t              s_high;
+        uint64_t              s_matched;
+    };
+    struct Output {
+        std::string  s_name;
+        CRingBuffer* s_pRing;
+        uint64_t     s_items;
+        uint64_t     s_bytes;
+    };
+
+    std::vector<Rule>     m_rules;
+    std::vector<Output>   m_outputs;            // [0] is the default ring.
+    size_t                m_ringBytes;
+    std::vector<char>     m_selected;           // write's scratch.
+    uint64_t              m_unrouted;
+
+public:
+    ItemRouter(CRingBuffer* pDefault, const std::string& defaultName,
+               size_t ringBytes);
+
+    void addRule(const std::string& rule);
+
+    virtual void write(const void* pItem);
+    virtual void report(std::ostream& out);
+
+private:
+    ItemRouter(const ItemRouter&);
+    ItemRouter& operator=(const ItemRouter&);
+
+    size_t   output(const std::string& name);
+    bool     matches(const Rule& rule, uint32_t type, bool hasBody,
+                     const BodyHeader& body) const;
+    static std::vector<std::string> split(const std::string& list, char separator);
+    static uint64_t number(const std::string& text, const std::string& rule);
+    static uint32_t itemType(const std::string& text, const std::string& rule);
+};
+
+#endif
@@ -0,0 +1,78 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  ItemSink.h
+ *  @brief: Where merged ring items go.
+ */
+#ifndef ITEMSINK_H
+#define ITEMSINK_H
+
+#include <ostream>
+#include <CRingBuffer.h>
+#include <DataFormat.h>
+
+/**
+ * @class ItemSink
+ *    Abstract base class for what an OrderedMerge writes its items to: the
+ *    output ring (RingSink) or a stage that does more with them on the
+ *    way there (e.g. CoincidenceBuilder).
+ */
+class ItemSink
+{
+public:
+    virtual ~ItemSink() {}
+
+    /**
+     * write
+     *    Take a ring item.
+     * @param pItem - the item; its size is in its header.  It's only
+     *                valid during the call.
+     */
+    virtual void write(const void* pItem) = 0;
+
+    /**
+     * writeDue
+     *    Called regularly so a sink can write what it's holding once it's
+     *    held it too long.
+     * @return bool - true if anything was written.
+     */
+    virtual bool writeDue() { return false; }
+
+    /**
+     * report
+     *    Write the sink's counters, if it has any.
+     */
+    virtual void report(std::ostream& out) {}
+};
+
+/**
+ * @class RingSink
+ *    Puts the items in a ring.
+ */
+class RingSink : public ItemSink
+{
+private:
+    CRingBuffer& m_ring;
+public:
+    RingSink(CRingBuffer& ring) : m_ring(ring) {}
+    virtual void write(const void* pItem) {
+        const RingItemHeader* pHeader = static_cast<const RingItemHeader*>(pItem);
+        m_ring.put(const_cast<void*>(pItem), pHeader->s_size);
+    }
+};
+
+#endif
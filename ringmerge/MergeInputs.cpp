@@ -0,0 +1,168 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  MergeInputs.cpp
+ *  @brief: Implement ringmerge's input rings.
+ */
+#include "MergeInputs.h"
+#include <CRingBuffer.h>
+#include <algorithm>
+
+/**
+ * constructor
+ *
+ * @param batchItems - most items drain reads from an input in a pass.
+ * @param batchBytes - bytes drain reads in a pass, shared among the
+ *                     inputs by backlog.
+ */
+MergeInputs::MergeInputs(size_t batchItems, size_t batchBytes) :
+    m_batchItems(std::max(batchItems, size_t(1))), m_batchBytes(batchBytes),
+    m_lastReport(std::chrono::steady_clock::now())
+{}
+/**
+ * add
+ *    Add an input ring.
+ *
+ * @param pRing - the ring, attached as a consumer.  It's not deleted.
+ * @param name  - its name (URI) for reports.
+ */
+void
+MergeInputs::add(CRingBuffer* pRing, const std::string& name)
+{
+    std::unique_ptr<Input> pInput(new Input);
+    pInput->s_pRing     = pRing;
+    pInput->s_name      = name;
+    pInput->s_ringBytes = pRing->getUsage().s_bufferSpace;
+    pInput->s_items.store(0);
+    pInput->s_bytes.store(0);
+    pInput->s_batches.store(0);
+    pInput->s_backlog.store(0);
+    pInput->s_maxBacklog.store(0);
+    pInput->s_reportedItems   = 0;
+    pInput->s_reportedBytes   = 0;
+    pInput->s_reportedBatches = 0;
+    m_inputs.push_back(std::move(pInput));
+    m_backlogs.push_back(0);
+}
+/**
+ * size
+ *    @return size_t - number of inputs.
+ */
+size_t
+MergeInputs::size() const
+{
+    return m_inputs.size();
+}
+/**
+ * read
+ *    Get the ring item at the head of an input ring.  The item isn't turned
+ *    into a CRingItem: its header is peeked for its size and its bytes are
+ *    moved into a buffer that's reused for every item, in one get.  Only
+ *    one thread may read a given input.
+ *
+ * @param input  - index of the input.
+ * @param buffer - the reusable buffer; it grows to fit the largest item.
+ *                 The item is at its front.
+ * @return bool  - true if an item was read, false if there isn't a
+ *                 whole item in the input ring yet.
+ * @throw std::string - if the item header is nonsense.
+ */
+bool
+MergeInputs::read(size_t input, std::vector<uint8_t>& buffer)
+{
+    Input& in(*m_inputs[input]);
+    size_t available = sample(in);
+    if (available < sizeof(RingItemHeader)) {
+        return false;
+    }
+    RingItemHeader header;
+    in.s_pRing->peek(&header, sizeof(header));
+    size_t size = header.s_size;
+    if (size < sizeof(RingItemHeader)) {
+        throw std::string("Corrupt ring item header in input ring ") + in.s_name;
+    }
+    if (available < size) {
+        return false;
+    }
+    if (buffer.size() < size) {
+        buffer.resize(size);
+    }
+    in.s_pRing->get(buffer.data(), size, size);
+    in.s_items.fetch_add(1, std::memory_order_relaxed);
+    in.s_bytes.fetch_add(size, std::memory_order_relaxed);
+    return true;
+}
+/**
+ * report
+ *    Write a line per input: its rates since the last report, the mean
+ *    items per batch (when drain reads it), and its backlog now and at
+ *    most since the last report, also as a fraction of the ring.
+ *
+ * @param out - where to write it.
+ */
+void
+MergeInputs::report(std::ostream& out)
+{
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - m_lastReport).count();
+    m_lastReport = now;
+
+    for (size_t i = 0; i < m_inputs.size(); i++) {
+        Input& in(*m_inputs[i]);
+        uint64_t items   = in.s_items.load(std::memory_order_relaxed);
+        uint64_t bytes   = in.s_bytes.load(std::memory_order_relaxed);
+        uint64_t batches = in.s_batches.load(std::memory_order_relaxed);
+        uint64_t backlog = in.s_backlog.load(std::memory_order_relaxed);
+        uint64_t most    = in.s_maxBacklog.exchange(backlog, std::memory_order_relaxed);
+        double   ring    = in.s_ringBytes ? 100.0/in.s_ringBytes : 0.0;
+
+        out << "ringmerge: input " << in.s_name << ": "
+            << (items - in.s_reportedItems)/seconds << " items/s, "
+            << (bytes - in.s_reportedBytes)/seconds/1.0e6 << " MB/s";
+        if (batches != in.s_reportedBatches) {
+            out << ", " << double(items - in.s_reportedItems)/(batches - in.s_reportedBatches)
+                << " items/batch";
+        }
+        out << ", backlog " << backlog/1024 << " KB (" << backlog*ring
+            << "%), most " << most/1024 << " KB (" << most*ring << "%)" << std::endl;
+
+        in.s_reportedItems   = items;
+        in.s_reportedBytes   = bytes;
+        in.s_reportedBatches = batches;
+    }
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * sample
+ *    Get and record an input's backlog.
+ *
+ * @param input - the input.
+ * @return size_t - bytes waiting in its ring.
+ */
+size_t
+MergeInputs::sample(Input& input)
+{
+    size_t backlog = input.s_pRing->availableData();
+    input.s_backlog.store(backlog, std::memory_order_relaxed);
+    if (backlog > input.s_maxBacklog.load(std::memory_order_relaxed)) {
+        input.s_maxBacklog.store(backlog, std::memory_order_relaxed);
+    }
+    return backlog;
+}
@@ -0,0 +1,140 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  MergeInputs.h
+ *  @brief: ringmerge's input rings, how they're drained and their counters.
+ */
+#ifndef MERGEINPUTS_H
+#define MERGEINPUTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <DataFormat.h>
+
+class CRingBuffer;
+
+/**
+ * @class MergeInputs
+ *    The input rings of a ringmerge.  Items are read from a ring as raw
+ *    bytes into a buffer that's reused for every item (see read), and each
+ *    ring's backlog (bytes waiting in it) is sampled as they are.
+ *
+ *    When one thread reads all the inputs, drain shares each pass among
+ *    them by backlog: a pass reads up to the batch bytes in all, each
+ *    input getting a share in proportion to its backlog, and at most the
+ *    batch items from any one input.  A busy input is then drained in
+ *    large batches rather than an item at a time, so its ring doesn't fill.
+ *    Every input with a whole item gets at least one item a pass, so a
+ *    nearly idle input waits at most one pass, however busy the others.
+ *
+ *    The counters are atomic so that, when each input has its own reader
+ *    thread, report can be called from another thread.
+ */
+class MergeInputs
+{
+private:
+    struct Input {
+        CRingBuffer*          s_pRing;
+        std::string           s_name;
+        size_t                s_ringBytes;
+        std::atomic<uint64_t> s_items;
+        std::atomic<uint64_t> s_bytes;
+        std::atomic<uint64_t> s_batches;        // Passes that read anything.
+        std::atomic<uint64_t> s_backlog;        // Bytes, last sampled.
+        std::atomic<uint64_t> s_maxBacklog;     // Since the last report.
+
+        // As of the last report:
+
+        uint64_t              s_reportedItems;
+        uint64_t              s_reportedBytes;
+        uint64_t              s_reportedBatches;
+    };
+
+    std::vector<std::unique_ptr<Input> > m_inputs;
+    size_t                m_batchItems;
+    size_t                m_batchBytes;
+    std::vector<size_t>   m_backlogs;           // drain's scratch.
+    std::chrono::steady_clock::time_point m_lastReport;
+
+public:
+    MergeInputs(size_t batchItems, size_t batchBytes);
+
+    void         add(CRingBuffer* pRing, const std::string& name);
+    size_t       size() const;
+
+    bool         read(size_t input, std::vector<uint8_t>& buffer);
+    template<class Sink> bool drain(std::vector<uint8_t>& buffer, Sink sink);
+    void         report(std::ostream& out);
+
+private:
+    MergeInputs(const MergeInputs&);
+    MergeInputs& operator=(const MergeInputs&);
+
+    size_t       sample(Input& input);
+};
+
+/**
+ * drain
+ *    One pass over the inputs, reading a backlog weighted batch from each
+ *    (see the class comments).
+ *
+ * @param buffer - the reusable item buffer.
+ * @param sink   - called with buffer for each item read; it may swap
+ *                 buffer's storage.
+ * @return bool  - true if any item was read.
+ * @throw std::string - if an item header is nonsense.
+ */
+template<class Sink> bool
+MergeInputs::drain(std::vector<uint8_t>& buffer, Sink sink)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < m_inputs.size(); i++) {
+        m_backlogs[i] = sample(*m_inputs[i]);
+        total        += m_backlogs[i];
+    }
+    if (total < sizeof(RingItemHeader)) {
+        return false;
+    }
+
+    bool moved = false;
+    for (size_t i = 0; i < m_inputs.size(); i++) {
+        if (m_backlogs[i] < sizeof(RingItemHeader)) continue;
+
+        size_t share = size_t(double(m_batchBytes)*m_backlogs[i]/total);
+        size_t items = 0;
+        size_t bytes = 0;
+        while ((items < m_batchItems) && ((items == 0) || (bytes < share))) {
+            if (!read(i, buffer)) break;
+            bytes += reinterpret_cast<RingItemHeader*>(buffer.data())->s_size;
+            items++;
+            sink(buffer);
+        }
+        if (items) {
+            m_inputs[i]->s_batches.fetch_add(1, std::memory_order_relaxed);
+            moved = true;
+        }
+    }
+    return moved;
+}
+
+#endif
@@ -0,0 +1,273 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  OrderedMerge.cpp
+ *  @brief: Implement the timestamp ordered merge.
+ */
+#include "OrderedMerge.h"
+#include "ItemSink.h"
+#include <DataFormat.h>
+#include <algorithm>
+#include <string.h>
+
+// Past this many held items the oldest are written regardless of the
+// window; it bounds memory when an input's timestamps run far ahead.
+
+static const size_t MAX_HELD_ITEMS(100000);
+
+/**
+ * constructor
+ *
+ * @param sink         - where the merged items go.
+ * @param window       - an item is written once one this many timestamp
+ *                       ticks newer has been seen.  0 writes items as soon
+ *                       as they're the oldest held.
+ * @param maxLatencyMs - an item is written once it's been held this long,
+ *                       newer items or not.
+ * @param untimed      - what to do with items that have no timestamp.
+ */
+OrderedMerge::OrderedMerge(ItemSink& sink, uint64_t window,
+                           unsigned maxLatencyMs, Untimed untimed) :
+    m_sink(sink), m_window(window), m_maxLatency(maxLatencyMs),
+    m_untimed(untimed), m_sequence(0), m_newest(0), m_lastWritten(0),
+    m_written(false), m_items(0), m_late(0), m_untimedItems(0), m_forced(0),
+    m_maxHeld(0)
+{}
+/**
+ * destructor
+ *    Held items are dropped, not written; call flush first to keep them.
+ */
+OrderedMerge::~OrderedMerge()
+{
+    for (size_t i = 0; i < m_heap.size(); i++) {
+        delete m_heap[i];
+    }
+    for (size_t i = 0; i < m_free.size(); i++) {
+        delete m_free[i];
+    }
+}
+/**
+ * add
+ *    Take a ring item from an input.
+ *
+ * @param item - the ring item, at the front of the vector (the vector may
+ *               be longer).  If the item's held, its storage is swapped
+ *               with a recycled buffer, so on return item may hold
+ *               anything; the caller just reuses it.
+ */
+void
+OrderedMerge::add(std::vector<uint8_t>& item)
+{
+    m_items++;
+    if (isBeginRun(item)) {
+        flush();                        // The new run's timestamps start over.
+        write(item);
+        return;
+    }
+    uint64_t ts;
+    if (!timestamp(item, ts)) {
+        m_untimedItems++;
+        if ((m_untimed == FLUSH) && isStateChange(item)) {
+            flush();
+        }
+        write(item);
+        return;
+    }
+    if (m_written && (ts < m_lastWritten)) {
+        m_late++;                       // Too late to be put in order.
+        write(item);
+        return;
+    }
+
+    Held* pHeld;
+    if (m_free.empty()) {
+        pHeld = new Held;
+    } else {
+        pHeld = m_free.back();
+        m_free.pop_back();
+    }
+    pHeld->s_timestamp = ts;
+    pHeld->s_sequence  = m_sequence++;
+    pHeld->s_received  = std::chrono::steady_clock::now();
+    pHeld->s_item.swap(item);
+    m_heap.push_back(pHeld);
+    std::push_heap(m_heap.begin(), m_heap.end(), Newer());
+
+    m_newest  = std::max(m_newest, ts);
+    m_maxHeld = std::max(m_maxHeld, m_heap.size());
+}
+/**
+ * writeDue
+ *    Write, oldest first, the held items that can no longer be overtaken:
+ *    those at least the window older than the newest item seen and those
+ *    held for the maximum latency.  The sink gets a chance to write what
+ *    it's due too.
+ *
+ * @return bool - true if anything was written.
+ */
+bool
+OrderedMerge::writeDue()
+{
+    bool wrote = false;
+    auto now = std::chrono::steady_clock::now();
+    while (!m_heap.empty()) {
+        const Held& oldest(*m_heap.front());
+        if (m_heap.size() > MAX_HELD_ITEMS) {
+            m_forced++;
+        } else if ((m_newest - oldest.s_timestamp < m_window) &&
+                   (now - oldest.s_received < m_maxLatency)) {
+            break;
+        }
+        writeOldest();
+        wrote = true;
+    }
+    if (m_sink.writeDue()) {
+        wrote = true;
+    }
+    return wrote;
+}
+/**
+ * flush
+ *    Write everything held, in order, then forget the timestamps seen so
+ *    that what follows (e.g. the next run, whose timestamps start over)
+ *    isn't taken to be late.
+ */
+void
+OrderedMerge::flush()
+{
+    while (!m_heap.empty()) {
+        writeOldest();
+    }
+    m_newest      = 0;
+    m_lastWritten = 0;
+    m_written     = false;
+}
+/**
+ * report
+ *    Write a line of counters: items merged, late items written out of
+ *    order, untimed items, items written early because too many were held
+ *    and how many are held.  The sink's counters follow.
+ *
+ * @param out - where to write it.
+ */
+void
+OrderedMerge::report(std::ostream& out)
+{
+    out << "ringmerge: " << m_items << " items, " << m_late << " late";
+    if (m_items) {
+        out << " (" << (100.0*m_late)/m_items << "%)";
+    }
+    out << ", " << m_untimedItems << " untimed, " << m_forced
+        << " forced out, " << m_heap.size() << " held (most " << m_maxHeld
+        << ")" << std::endl;
+    m_sink.report(out);
+}
+/**
+ * untimed
+ *    @param name - "flush" or "immediate".
+ *    @return Untimed - the policy it names.
+ *    @throw std::string - for anything else.
+ */
+OrderedMerge::Untimed
+OrderedMerge::untimed(const std::string& name)
+{
+    if (name == "flush")     return FLUSH;
+    if (name == "immediate") return IMMEDIATE;
+    throw std::string("Unknown untimed item policy: ") + name;
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * writeOldest
+ *    Write the oldest held item and recycle its storage.
+ */
+void
+OrderedMerge::writeOldest()
+{
+    std::pop_heap(m_heap.begin(), m_heap.end(), Newer());
+    Held* pHeld = m_heap.back();
+    m_heap.pop_back();
+
+    write(pHeld->s_item);
+    m_lastWritten = pHeld->s_timestamp;
+    m_written     = true;
+    m_free.push_back(pHeld);
+}
+/**
+ * write
+ *    Pass a ring item to the sink.
+ *
+ * @param item - holds the ring item at its front.
+ */
+void
+OrderedMerge::write(const std::vector<uint8_t>& item)
+{
+    m_sink.write(item.data());
+}
+/**
+ * isBeginRun
+ *    @param item - holds the ring item at its front.
+ *    @return bool - true if it's a BEGIN_RUN.
+ */
+bool
+OrderedMerge::isBeginRun(const std::vector<uint8_t>& item)
+{
+    const RingItemHeader* pHeader =
+        reinterpret_cast<const RingItemHeader*>(item.data());
+    return pHeader->s_type == BEGIN_RUN;
+}
+/**
+ * isStateChange
+ *    @param item - holds the ring item at its front.
+ *    @return bool - true if it's a BEGIN_RUN, END_RUN, PAUSE_RUN or
+ *                   RESUME_RUN.
+ */
+bool
+OrderedMerge::isStateChange(const std::vector<uint8_t>& item)
+{
+    const RingItemHeader* pHeader =
+        reinterpret_cast<const RingItemHeader*>(item.data());
+    return (pHeader->s_type == BEGIN_RUN) || (pHeader->s_type == END_RUN) ||
+        (pHeader->s_type == PAUSE_RUN) || (pHeader->s_type == RESUME_RUN);
+}
+/**
+ * timestamp
+ *    Get a ring item's body header timestamp.
+ *
+ * @param item - holds the ring item at its front.
+ * @param[out] ts - the timestamp.
+ * @return bool - false if the item has no body header or its timestamp is
+ *                NULL_TIMESTAMP.
+ */
+bool
+OrderedMerge::timestamp(const std::vector<uint8_t>& item, uint64_t& ts)
+{
+    const RingItemHeader* pHeader =
+        reinterpret_cast<const RingItemHeader*>(item.data());
+    if (pHeader->s_size < sizeof(RingItemHeader) + sizeof(BodyHeader)) {
+        return false;
+    }
+    BodyHeader body;
+    memcpy(&body, item.data() + sizeof(RingItemHeader), sizeof(body));
+    if (body.s_size < sizeof(BodyHeader)) {
+        return false;
+    }
+    ts = body.s_timestamp;
+    return ts != NULL_TIMESTAMP;
+}
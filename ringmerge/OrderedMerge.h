@@ -0,0 +1,116 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  OrderedMerge.h
+ *  @brief: Merge ring items from several rings in timestamp order.
+ */
+#ifndef ORDEREDMERGE_H
+#define ORDEREDMERGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ostream>
+
+class ItemSink;
+
+/**
+ * @class OrderedMerge
+ *    Instead of forwarding ring items in the order they arrive, items are
+ *    held in a min-heap on their body header timestamps and written to
+ *    a sink (the output ring, see ItemSink) oldest first.  Since the
+ *    inputs aren't in step, an item is only written once it can no longer
+ *    be overtaken: when an item more than the window (in timestamp ticks)
+ *    newer has arrived from any input, or when it's been held for the
+ *    maximum latency.
+ *
+ *    An item older than one already written is late; it's written at once,
+ *    out of order, and counted.  Untimed state changes either flush
+ *    everything held and follow it (FLUSH, so an END_RUN comes after the
+ *    run's data) or are written as soon as they arrive (IMMEDIATE).  Other
+ *    items without a timestamp (text items, scalers and the like without
+ *    body headers) are always written as they arrive.  A BEGIN_RUN always
+ *    flushes.  A flush forgets the timestamps seen, since
+ *    a new run's start over and would otherwise all look late.
+ *
+ *    Held items live in buffers that are recycled, so there's no heap
+ *    allocation per item once the merge is going.
+ */
+class OrderedMerge
+{
+public:
+    typedef enum _Untimed {
+        FLUSH, IMMEDIATE
+    } Untimed;
+
+private:
+    struct Held {
+        uint64_t              s_timestamp;
+        uint64_t              s_sequence;       // Arrival order breaks ties.
+        std::chrono::steady_clock::time_point s_received;
+        std::vector<uint8_t>  s_item;
+    };
+    struct Newer {
+        bool operator()(const Held* a, const Held* b) const {
+            return (a->s_timestamp != b->s_timestamp) ?
+                a->s_timestamp > b->s_timestamp : a->s_sequence > b->s_sequence;
+        }
+    };
+
+    ItemSink&                 m_sink;
+    uint64_t                  m_window;
+    std::chrono::milliseconds m_maxLatency;
+    Untimed                   m_untimed;
+    std::vector<Held*>        m_heap;
+    std::vector<Held*>        m_free;
+    uint64_t                  m_sequence;
+    uint64_t                  m_newest;         // Newest timestamp seen.
+    uint64_t                  m_lastWritten;    // Newest timestamp written.
+    bool                      m_written;        // m_lastWritten is valid.
+
+    uint64_t                  m_items;
+    uint64_t                  m_late;
+    uint64_t                  m_untimedItems;
+    uint64_t                  m_forced;         // Written because too many were held.
+    size_t                    m_maxHeld;
+
+public:
+    OrderedMerge(ItemSink& sink, uint64_t window, unsigned maxLatencyMs,
+                 Untimed untimed);
+    ~OrderedMerge();
+
+    void add(std::vector<uint8_t>& item);
+    bool writeDue();
+    void flush();
+    void report(std::ostream& out);
+
+    static Untimed untimed(const std::string& name);
+
+private:
+    OrderedMerge(const OrderedMerge&);
+    OrderedMerge& operator=(const OrderedMerge&);
+
+    void writeOldest();
+    void write(const std::vector<uint8_t>& item);
+    static bool isBeginRun(const std::vector<uint8_t>& item);
+    static bool isStateChange(const std::vector<uint8_t>& item);
+    static bool timestamp(const std::vector<uint8_t>& item, uint64_t& ts);
+};
+
+#endif
@@ -0,0 +1,530 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  mergebench.cpp
+ *  @brief: Measure ringmerge's throughput, CPU use and latency.
+ */
+
+#include "mergebenchargs.h"
+#include <CRingBuffer.h>
+#include <DataFormat.h>
+#include <Exception.h>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static const size_t   RING_SIZE(32*1024*1024);
+static const uint32_t BENCH_MAGIC(0x4d424e43);     // "MBNC"
+
+/**
+ * What a producer puts at the front of each item's body.
+ */
+struct BenchBody {
+    uint32_t s_magic;
+    uint32_t s_producer;
+    uint64_t s_sequence;
+    uint64_t s_sentNs;                  // steady_clock when put in the ring.
+};
+
+static const size_t MIN_ITEM_SIZE(
+    sizeof(RingItemHeader) + sizeof(BodyHeader) + sizeof(BenchBody)
+);
+
+/**
+ * nowNs
+ *    @return uint64_t - the steady clock in nanoseconds.  It's
+ *                       CLOCK_MONOTONIC, so it's the same for every thread.
+ */
+static uint64_t
+nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+/**
+ * LatencyHistogram
+ *    Log-linear histogram of latencies in nanoseconds: each power of two
+ *    is split into 32 bins, so a bin is at most about 3% wide however
+ *    long the latency.  Percentiles are the upper edge of the bin they fall
+ *    in (or the largest latency, if that's less).
+ */
+class LatencyHistogram
+{
+private:
+    static const unsigned SUB_BITS = 5;
+    static const unsigned SUB_BINS = 1 << SUB_BITS;
+    std::vector<uint64_t> m_bins;
+    uint64_t              m_count;
+    uint64_t              m_max;
+public:
+    LatencyHistogram() : m_bins((64 - SUB_BITS + 1)*SUB_BINS), m_count(0), m_max(0) {}
+    void add(uint64_t ns) {
+        m_bins[bin(ns)]++;
+        m_count++;
+        if (ns > m_max) m_max = ns;
+    }
+    uint64_t count() const { return m_count; }
+    uint64_t max()   const { return m_max; }
+    uint64_t percentile(double fraction) const {
+        uint64_t sum = 0;
+        for (size_t b = 0; b < m_bins.size(); b++) {
+            sum += m_bins[b];
+            if (sum && (sum >= fraction*m_count)) {
+                return std::min(upperEdge(b), m_max);
+            }
+        }
+        return m_max;
+    }
+private:
+    static size_t bin(uint64_t ns) {
+        if (ns < SUB_BINS) return ns;
+        unsigned msb = 63 - __builtin_clzll(ns);
+        unsigned shift = msb - SUB_BITS;
+        return (shift + 1)*SUB_BINS + ((ns >> shift) & (SUB_BINS - 1));
+    }
+    static uint64_t upperEdge(size_t b) {
+        if (b < SUB_BINS) return b + 1;
+        unsigned shift = b/SUB_BINS - 1;
+        return (uint64_t(SUB_BINS + b%SUB_BINS) + 1) << shift;
+    }
+};
+
+/**
+ * Results
+ *    What a run measured.
+ */
+struct Results {
+    double   s_seconds;
+    uint64_t s_sent;
+    uint64_t s_items;
+    uint64_t s_bytes;
+    uint64_t s_otherItems;              // Not ours (e.g. built, state items).
+    uint64_t s_outOfOrder;              // Within a producer's items.
+    double   s_mergerCpu;               // Cores.
+    LatencyHistogram s_latency;
+};
+
+/**
+ * produce
+ *    Body of a producer thread: put items in a ring, at the rate asked for
+ *    or as fast as the ring takes them, until told to stop.  The body
+ *    header timestamp is the time the item is put in the ring, so the
+ *    items can be merged in timestamp order too.
+ *
+ * @param ringName  - the input ring.
+ * @param producer  - the producer's number; its items' source id.
+ * @param itemBytes - size of each item.
+ * @param rate      - items/s; 0 for as fast as possible.
+ * @param pStop     - set when it's time to stop.
+ * @param pSent     - counts the items put.
+ */
+static void
+produce(std::string ringName, unsigned producer, size_t itemBytes, double rate,
+        const std::atomic<bool>* pStop, std::atomic<uint64_t>* pSent)
+{
+    try {
+        CRingBuffer ring(ringName, CRingBuffer::producer);
+        std::vector<uint8_t> item(itemBytes);
+        RingItemHeader* pHeader = reinterpret_cast<RingItemHeader*>(item.data());
+        pHeader->s_size = itemBytes;
+        pHeader->s_type = PHYSICS_EVENT;
+        BodyHeader body;
+        body.s_size      = sizeof(BodyHeader);
+        body.s_sourceId  = producer;
+        body.s_barrier   = 0;
+        BenchBody bench;
+        bench.s_magic    = BENCH_MAGIC;
+        bench.s_producer = producer;
+        uint8_t* pBody   = item.data() + sizeof(RingItemHeader);
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t n = 0; !pStop->load(std::memory_order_relaxed); n++) {
+            if (rate > 0) {
+                std::this_thread::sleep_until(
+                    start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(n/rate)
+                    )
+                );
+            }
+            while (ring.availablePutSpace() < itemBytes) {  // Don't block in put.
+                if (pStop->load(std::memory_order_relaxed)) return;
+                std::this_thread::sleep_for(std::chrono::microseconds(10));
+            }
+            bench.s_sequence = n;
+            bench.s_sentNs   = nowNs();
+            body.s_timestamp = bench.s_sentNs;
+            memcpy(pBody, &body, sizeof(body));
+            memcpy(pBody + sizeof(body), &bench, sizeof(bench));
+            ring.put(item.data(), itemBytes);
+            pSent->fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    catch (CException& e) {
+        std::cerr << "Producer " << producer << " failed: " << e.ReasonText() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+/**
+ * cpuTicks
+ *    @param pid - a process.
+ *    @return long - CPU time (user + system clock ticks) it has used, from
+ *                   /proc/<pid>/stat.  The fields we want follow the
+ *                   parenthesized command.
+ */
+static long
+cpuTicks(pid_t pid)
+{
+    std::ostringstream name;
+    name << "/proc/" << pid << "/stat";
+    std::ifstream stat(name.str().c_str());
+    std::string line;
+    std::getline(stat, line);
+    size_t paren = line.rfind(')');
+    if (paren == std::string::npos) {
+        return 0;
+    }
+    std::istringstream fields(line.substr(paren + 2));
+    std::string field;
+    for (int i = 3; i < 14; i++) {      // state through cmajflt.
+        fields >> field;
+    }
+    long utime = 0, stime = 0;
+    fields >> utime >> stime;
+    return utime + stime;
+}
+/**
+ * startMerger
+ *    Run ringmerge on the input rings.
+ *
+ * @param parsed - the command line; gives the program and extra arguments.
+ * @param inputs - the input ring names.
+ * @param output - the output ring name.
+ * @return pid_t - its process.
+ * @throw std::string - if it couldn't be run or died at once.
+ */
+static pid_t
+startMerger(const gengetopt_args_info& parsed, const std::vector<std::string>& inputs,
+            const std::string& output)
+{
+    std::vector<std::string> args;
+    args.push_back(parsed.merger_arg);
+    args.push_back("--output=" + output);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        args.push_back("--input=tcp://localhost/" + inputs[i]);
+    }
+    for (unsigned i = 0; i < parsed.merge_arg_given; i++) {
+        args.push_back(parsed.merge_arg_arg[i]);
+    }
+    std::vector<char*> argv;
+    for (size_t i = 0; i < args.size(); i++) {
+        argv.push_back(const_cast<char*>(args[i].c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    if (pid < 0) {
+        throw std::string("Unable to fork for ") + parsed.merger_arg;
+    }
+
+    // Wait for it to make its output ring:
+
+    for (int i = 0; i < 100; i++) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            throw std::string(parsed.merger_arg) + " exited at once; check its arguments";
+        }
+        if (CRingBuffer::isRing(output)) {
+            return pid;
+        }
+        usleep(50000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    throw std::string(parsed.merger_arg) + " never made its output ring";
+}
+/**
+ * consume
+ *    Take items from the output ring until a time, measuring those after
+ *    another.
+ *
+ * @param ring      - the output ring.
+ * @param measureNs - when to start measuring (nowNs).
+ * @param endNs     - when to stop.
+ * @param producers - number of producers, for the order check.
+ * @param results   - gets the counts and latencies.
+ */
+static void
+consume(CRingBuffer& ring, uint64_t measureNs, uint64_t endNs, unsigned producers,
+        Results& results)
+{
+    std::vector<uint8_t>  buffer(64*1024);
+    std::vector<uint64_t> next(producers, 0);
+    std::vector<bool>     seen(producers, false);
+    while (true) {
+        uint64_t now = nowNs();
+        if (now >= endNs) break;
+
+        size_t available = ring.availableData();
+        RingItemHeader header;
+        if (available >= sizeof(header)) {
+            ring.peek(&header, sizeof(header));
+        }
+        if ((available < sizeof(header)) || (available < header.s_size)) {
+            std::this_thread::sleep_for(std::chrono::microseconds(10));
+            continue;
+        }
+        if (header.s_size < sizeof(header)) {
+            throw std::string("Corrupt ring item header in the output ring");
+        }
+        if (buffer.size() < header.s_size) {
+            buffer.resize(header.s_size);
+        }
+        ring.get(buffer.data(), header.s_size, header.s_size);
+        now = nowNs();
+
+        BenchBody bench;
+        bool ours = (header.s_type == PHYSICS_EVENT) && (header.s_size >= MIN_ITEM_SIZE);
+        if (ours) {
+            memcpy(&bench, buffer.data() + sizeof(RingItemHeader) + sizeof(BodyHeader),
+                   sizeof(bench));
+            ours = (bench.s_magic == BENCH_MAGIC) && (bench.s_producer < producers);
+        }
+        if (ours) {
+            if (seen[bench.s_producer] && (bench.s_sequence != next[bench.s_producer])) {
+                results.s_outOfOrder++;
+            }
+            seen[bench.s_producer] = true;
+            next[bench.s_producer] = bench.s_sequence + 1;
+        }
+        if (now < measureNs) continue;
+
+        results.s_items++;
+        results.s_bytes += header.s_size;
+        if (ours) {
+            results.s_latency.add(now - bench.s_sentNs);
+        } else {
+            results.s_otherItems++;
+        }
+    }
+}
+/**
+ * jsonString
+ *    @param s - some text.
+ *    @return std::string - it as a JSON string.
+ */
+static std::string
+jsonString(const std::string& s)
+{
+    std::string result("\"");
+    for (size_t i = 0; i < s.size(); i++) {
+        char c = s[i];
+        if ((c == '"') || (c == '\\')) {
+            result += '\\';
+            result += c;
+        } else if (uint8_t(c) < 0x20) {
+            result += ' ';
+        } else {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+/**
+ * writeResults
+ *    Append a run's results to the results file as a line of JSON, and
+ *    print them.
+ *
+ * @param parsed  - the command line.
+ * @param results - what was measured.
+ * @throw std::string - if the file can't be written.
+ */
+static void
+writeResults(const gengetopt_args_info& parsed, const Results& results)
+{
+    std::string mergeArgs;
+    for (unsigned i = 0; i < parsed.merge_arg_given; i++) {
+        if (i) mergeArgs += ' ';
+        mergeArgs += parsed.merge_arg_arg[i];
+    }
+    double seconds = results.s_seconds;
+    const LatencyHistogram& latency(results.s_latency);
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(3)
+        << "{\"label\": " << jsonString(parsed.label_arg)
+        << ", \"time\": " << time(nullptr)
+        << ", \"producers\": " << parsed.producers_arg
+        << ", \"item_size\": " << parsed.item_size_arg
+        << ", \"rate\": " << parsed.rate_arg
+        << ", \"merge_args\": " << jsonString(mergeArgs)
+        << ", \"seconds\": " << seconds
+        << ", \"offered_items_per_s\": " << results.s_sent/seconds
+        << ", \"items_per_s\": " << results.s_items/seconds
+        << ", \"mb_per_s\": " << results.s_bytes/seconds/1.0e6
+        << ", \"merger_cpu\": " << results.s_mergerCpu
+        << ", \"other_items\": " << results.s_otherItems
+        << ", \"out_of_order\": " << results.s_outOfOrder
+        << ", \"latency_us\": {\"count\": " << latency.count()
+        << ", \"p50\": " << latency.percentile(0.5)/1.0e3
+        << ", \"p99\": " << latency.percentile(0.99)/1.0e3
+        << ", \"p999\": " << latency.percentile(0.999)/1.0e3
+        << ", \"max\": " << latency.max()/1.0e3 << "}}";
+
+    std::ofstream file(parsed.results_arg, std::ios::app);
+    file << line.str() << std::endl;
+    if (!file) {
+        throw std::string("Unable to write results to ") + parsed.results_arg;
+    }
+
+    std::cout << std::fixed << std::setprecision(1)
+        << parsed.producers_arg << " producers of " << parsed.item_size_arg
+        << " byte items: offered " << results.s_sent/seconds << " items/s, merged "
+        << results.s_items/seconds << " items/s, "
+        << results.s_bytes/seconds/1.0e6 << " MB/s, ringmerge used "
+        << results.s_mergerCpu*100 << "% of a core" << std::endl
+        << "Latency: 50% < " << latency.percentile(0.5)/1.0e3
+        << " us, 99% < " << latency.percentile(0.99)/1.0e3
+        << " us, 99.9% < " << latency.percentile(0.999)/1.0e3
+        << " us, max " << latency.max()/1.0e3 << " us" << std::endl;
+    if (results.s_outOfOrder) {
+        std::cout << results.s_outOfOrder << " items came out of order" << std::endl;
+    }
+}
+/**
+ * removeRing
+ *    Remove a ring which may or may not be there.
+ */
+static void
+removeRing(const std::string& name)
+{
+    try {
+        CRingBuffer::remove(name);
+    } catch (...) {}
+}
+
+/**
+ * main
+ *    Make the input rings, start ringmerge and the producers, measure what
+ *    comes out after the warm up, then stop everything, remove the rings
+ *    and write the results.
+ */
+int main(int argc, char** argv)
+{
+    gengetopt_args_info parsedArgs;
+    cmdline_parser(argc, argv, &parsedArgs);
+
+    std::vector<std::string> inputs;
+    std::string output = std::string(parsedArgs.ring_prefix_arg) + "_out";
+    pid_t merger = -1;
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> producers;
+    int status = EXIT_SUCCESS;
+
+    try {
+        if ((parsedArgs.producers_arg < 1) || (parsedArgs.seconds_arg < 1) ||
+            (parsedArgs.warmup_arg < 0) || (parsedArgs.rate_arg < 0)) {
+            throw std::string("--producers and --seconds must be at least 1; --warmup and --rate not negative");
+        }
+        if (size_t(parsedArgs.item_size_arg) < MIN_ITEM_SIZE) {
+            std::ostringstream msg;
+            msg << "--item-size must be at least " << MIN_ITEM_SIZE;
+            throw msg.str();
+        }
+
+        removeRing(output);
+        for (int i = 0; i < parsedArgs.producers_arg; i++) {
+            std::ostringstream name;
+            name << parsedArgs.ring_prefix_arg << "_in" << i;
+            inputs.push_back(name.str());
+            removeRing(name.str());
+            CRingBuffer::create(name.str(), RING_SIZE);
+        }
+        merger = startMerger(parsedArgs, inputs, output);
+        std::unique_ptr<CRingBuffer> pOutput(new CRingBuffer(output));
+
+        std::atomic<uint64_t> sent(0);
+        for (int i = 0; i < parsedArgs.producers_arg; i++) {
+            producers.push_back(std::thread(
+                produce, inputs[i], i, size_t(parsedArgs.item_size_arg),
+                parsedArgs.rate_arg, &stop, &sent
+            ));
+        }
+
+        Results results;
+        results.s_seconds    = parsedArgs.seconds_arg;
+        results.s_items      = 0;
+        results.s_bytes      = 0;
+        results.s_otherItems = 0;
+        results.s_outOfOrder = 0;
+        uint64_t measureNs = nowNs() + parsedArgs.warmup_arg*1000000000ull;
+        uint64_t endNs     = measureNs + parsedArgs.seconds_arg*1000000000ull;
+
+        consume(*pOutput, measureNs, measureNs, parsedArgs.producers_arg, results);
+        uint64_t sentBefore = sent.load();
+        long     ticksBefore = cpuTicks(merger);
+        consume(*pOutput, measureNs, endNs, parsedArgs.producers_arg, results);
+        results.s_sent      = sent.load() - sentBefore;
+        results.s_mergerCpu = double(cpuTicks(merger) - ticksBefore)/
+                              (parsedArgs.seconds_arg*sysconf(_SC_CLK_TCK));
+
+        writeResults(parsedArgs, results);
+    }
+    catch (std::string& msg) {
+        std::cerr << msg << std::endl;
+        status = EXIT_FAILURE;
+    }
+    catch (CException& e) {
+        std::cerr << e.ReasonText() << std::endl;
+        status = EXIT_FAILURE;
+    }
+
+    stop = true;
+    for (size_t i = 0; i < producers.size(); i++) {
+        producers[i].join();
+    }
+    if (merger > 0) {
+        kill(merger, SIGKILL);
+        waitpid(merger, nullptr, 0);
+    }
+    removeRing(output);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        removeRing(inputs[i]);
+    }
+    exit(status);
+}
@@ -9,13 +9,25 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <memory>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <CRingBuffer.h>
 #include <CRingStateChangeItem.h>
+#include <CRingTextItem.h>
 #include <CPhysicsEventItem.h>
 #include <CAllButPredicate.h>
 #include <CRingItemFactory.h>
+#include <CGlomParameters.h>
+#include <DataFormat.h>
+#include <fragment.h>
+#include <string.h>
 
 #include <iostream>
 
@@ -24,6 +36,16 @@ class ringmergetests : public CppUnit::TestFixture {
   CPPUNIT_TEST(singlering);
   CPPUNIT_TEST(multiring1);
   CPPUNIT_TEST(multiring2);
+  CPPUNIT_TEST(idlecpu);
+  CPPUNIT_TEST(throughput);
+  CPPUNIT_TEST(bigitem);
+  CPPUNIT_TEST(ordered);
+  CPPUNIT_TEST(tworuns);
+  CPPUNIT_TEST(untimedtext);
+  CPPUNIT_TEST(scaling);
+  CPPUNIT_TEST(backlog);
+  CPPUNIT_TEST(build);
+  CPPUNIT_TEST(route);
   CPPUNIT_TEST_SUITE_END();
 
 
@@ -33,6 +55,11 @@ private:
 private:
   void removeRing(const char* name);
   void startMerger(const char** commandLine);
+  void stopMerger();
+  double idleCpu(const char** commandLine);
+  double itemRate(const char** commandLine);
+  double mergedRate(const char** commandLine, int inputs);
+  static long cpuTicks(pid_t pid);
 public:
   void setUp() {
     
@@ -50,20 +77,27 @@ public:
     CRingBuffer::create("inring2");
   }
   void tearDown() {
-    if (m_subProcess != -1) {
-      int status;
-      kill(m_subProcess, 9);
-      waitpid(m_subProcess, &status, 0);
-      m_subProcess = -1;
-    }
+    stopMerger();
     removeRing("output");
     removeRing("inring1");
     removeRing("inring2");
+    removeRing("routeA");
+    removeRing("routeB");
   }
 protected:
   void singlering();
   void multiring1();
   void multiring2();
+  void idlecpu();
+  void throughput();
+  void bigitem();
+  void ordered();
+  void tworuns();
+  void untimedtext();
+  void scaling();
+  void backlog();
+  void build();
+  void route();
 };
 
 // Remove ring which may or may not be there in the first place.
@@ -80,12 +114,153 @@ ringmergetests::removeRing(const char* ringName)
 void
 ringmergetests::startMerger(const char** args)
 {
-  int m_subProcess = fork();
+  m_subProcess = fork();
   if (m_subProcess == 0) {
     execv(
       "./ringmerge", const_cast<char* const*>(args)
     );         // Run the merge program.
+    _exit(EXIT_FAILURE);
+  }
+}
+// Stop the merger if it's running.
+
+void
+ringmergetests::stopMerger()
+{
+  if (m_subProcess != -1) {
+    int status;
+    kill(m_subProcess, 9);
+    waitpid(m_subProcess, &status, 0);
+    m_subProcess = -1;
+  }
+}
+// CPU time (user + system clock ticks) a process has used, from
+// /proc/<pid>/stat.  The fields we want follow the parenthesized command.
+
+long
+ringmergetests::cpuTicks(pid_t pid)
+{
+  std::ostringstream name;
+  name << "/proc/" << pid << "/stat";
+  std::ifstream stat(name.str().c_str());
+  std::string line;
+  std::getline(stat, line);
+  std::istringstream fields(line.substr(line.rfind(')') + 2));
+  std::string field;
+  for (int i = 3; i < 14; i++) {      // state through cmajflt.
+    fields >> field;
   }
+  long utime, stime;
+  fields >> utime >> stime;
+  return utime + stime;
+}
+// Run the merger with no data flowing and return the fraction of a
+// core it used.
+
+double
+ringmergetests::idleCpu(const char** args)
+{
+  startMerger(args);
+  sleep(1);                         // Let it get started.
+  
+  long before = cpuTicks(m_subProcess);
+  sleep(2);
+  long after  = cpuTicks(m_subProcess);
+  stopMerger();
+  
+  return double(after - before)/(2*sysconf(_SC_CLK_TCK));
+}
+// Run the merger, push events through it in bursts and return the
+// events per second that came out.  The events must come out intact.
+
+double
+ringmergetests::itemRate(const char** args)
+{
+  CAllButPredicate all;
+  startMerger(args);
+  sleep(1);                         // Let it get started.
+  
+  std::unique_ptr<CRingBuffer> inring(new CRingBuffer("inring2", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> outring(new CRingBuffer("output"));
+  CPhysicsEventItem item;
+  uint16_t* p = static_cast<uint16_t*>(item.getBodyCursor());
+  for (int i =0; i < 100; i++) {
+    *p++ = i;
+  }
+  item.setBodyCursor(p);
+  item.updateSize();
+  
+  const int bursts(100);
+  const int burstSize(500);
+  auto start = std::chrono::steady_clock::now();
+  for (int b = 0; b < bursts; b++) {
+    for (int i = 0; i < burstSize; i++) {
+      item.commitToRing(*inring);
+    }
+    for (int i = 0; i < burstSize; i++) {
+      std::unique_ptr<CRingItem> event(CRingItem::getFromRing(*outring, all));
+      EQ(uint32_t(PHYSICS_EVENT), event->type());
+      EQ(uint16_t(99), static_cast<uint16_t*>(event->getBodyPointer())[99]);
+    }
+  }
+  double seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start
+  ).count();
+  
+  inring.reset();
+  outring.reset();
+  stopMerger();
+  return bursts*burstSize/seconds;
+}
+
+// Run the merger, have a thread per input ring (inring1, then inring2)
+// fill it as fast as it can, and return the events per second that came
+// out.  Events from each input must come out in order.
+
+double
+ringmergetests::mergedRate(const char** args, int inputs)
+{
+  CAllButPredicate all;
+  startMerger(args);
+  sleep(1);                         // Let it get started.
+  
+  const char* rings[] = {"inring1", "inring2"};
+  const uint32_t nEvents(50000);
+  std::unique_ptr<CRingBuffer> outring(new CRingBuffer("output"));
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> producers;
+  for (int i = 0; i < inputs; i++) {
+    producers.push_back(std::thread([&rings, i, nEvents]() {
+      CRingBuffer inring(rings[i], CRingBuffer::producer);
+      for (uint32_t n = 0; n < nEvents; n++) {
+        CPhysicsEventItem item(n, i, 0);
+        uint32_t* p = static_cast<uint32_t*>(item.getBodyCursor());
+        for (int w = 0; w < 50; w++) {
+          *p++ = n;
+        }
+        item.setBodyCursor(p);
+        item.updateSize();
+        item.commitToRing(inring);
+      }
+    }));
+  }
+  std::vector<uint32_t> next(inputs, 0);
+  for (uint32_t n = 0; n < inputs*nEvents; n++) {
+    std::unique_ptr<CRingItem> event(CRingItem::getFromRing(*outring, all));
+    uint32_t source = event->getSourceId();
+    ASSERT(source < uint32_t(inputs));
+    EQ(next[source]++, uint32_t(event->getEventTimestamp()));
+  }
+  double seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start
+  ).count();
+  for (int i = 0; i < inputs; i++) {
+    producers[i].join();
+  }
+  
+  outring.reset();
+  stopMerger();
+  return inputs*nEvents/seconds;
 }
 
 CPPUNIT_TEST_SUITE_REGISTRATION(ringmergetests);
@@ -274,3 +449,471 @@ ringmergetests::multiring2()
   std::unique_ptr<CRingItem> pEnd(CRingItem::getFromRing(*outring, all));
   EQ(uint32_t(END_RUN), pEnd->type());
 }
+
+// Idle, the merger should sleep rather than spin.  Report the share of a
+// core it uses; --max-sleep=0 is the old flat out spin loop, which is
+// measured for comparison.
+
+void
+ringmergetests::idlecpu()
+{
+  const char* spinning[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    "--max-sleep=0",
+    0
+  };
+  const char* sleeping[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    0
+  };
+  double before = idleCpu(spinning);
+  double after  = idleCpu(sleeping);
+  std::cerr << "\nIdle ringmerge CPU: spinning " << before*100
+            << "% of a core, backing off " << after*100 << "%\n";
+}
+// Events pushed through in bursts must all come out; the rates with and
+// without the back off are reported.  Like the idle CPU, the rates
+// depend on the machine and its load so they're reported, not checked.
+
+void
+ringmergetests::throughput()
+{
+  const char* spinning[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    "--max-sleep=0",
+    0
+  };
+  const char* sleeping[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    0
+  };
+  double before = itemRate(spinning);
+  double after  = itemRate(sleeping);
+  std::cerr << "\nringmerge throughput: spinning " << before
+            << " events/s, backing off " << after << " events/s ("
+            << (100.0*after)/before << "%)\n";
+}
+// An item bigger than the merger's initial forwarding buffer must come
+// through intact, as must a small one after it.
+
+void
+ringmergetests::bigitem()
+{
+  CAllButPredicate all;
+  const char* params[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    0
+  };
+  
+  startMerger(params);
+  sleep(1);                         // Let it get started.
+  
+  std::unique_ptr<CRingBuffer> inring(new CRingBuffer("inring1", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> outring(new CRingBuffer("output"));
+  
+  const int nWords(100000);
+  CPhysicsEventItem big(nWords*sizeof(uint16_t) + 100);
+  uint16_t* p = static_cast<uint16_t*>(big.getBodyCursor());
+  for (int i =0; i < nWords; i++) {
+    *p++ = i;
+  }
+  big.setBodyCursor(p);
+  big.updateSize();
+  CRingStateChangeItem end(END_RUN, 1 ,0, 1234, "This is a title");
+  
+  big.commitToRing(*inring);
+  end.commitToRing(*inring);
+  
+  std::unique_ptr<CRingItem> pBig(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(PHYSICS_EVENT), pBig->type());
+  EQ(big.size(), pBig->size());
+  uint16_t* pBody = static_cast<uint16_t*>(pBig->getBodyPointer());
+  for (int i =0; i < nWords; i++) {
+    EQ(uint16_t(i), pBody[i]);
+  }
+  std::unique_ptr<CRingItem> pEnd(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(END_RUN), pEnd->type());
+}
+// In --order=timestamp mode, items from two rings with interleaved
+// timestamps must come out in timestamp order.  The window and latency are
+// long enough that nothing is written until the END_RUN (no timestamp)
+// flushes everything ahead of itself.
+
+void
+ringmergetests::ordered()
+{
+  CAllButPredicate all;
+  const char* params[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    "--order=timestamp", "--window=1000000", "--max-latency=10000",
+    0
+  };
+  
+  startMerger(params);
+  sleep(1);                         // Let it get started.
+  
+  std::unique_ptr<CRingBuffer> inring1(new CRingBuffer("inring1", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> inring2(new CRingBuffer("inring2", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> outring(new CRingBuffer("output"));
+  
+  const uint64_t nItems(20);
+  for (uint64_t ts = 2; ts <= nItems; ts += 2) {        // Evens first.
+    CPhysicsEventItem item(ts, 2, 0);
+    item.commitToRing(*inring2);
+  }
+  for (uint64_t ts = 1; ts <= nItems; ts += 2) {
+    CPhysicsEventItem item(ts, 1, 0);
+    item.commitToRing(*inring1);
+  }
+  sleep(1);                         // Let them all be read and held.
+  CRingStateChangeItem end(END_RUN, 1 ,0, 1234, "This is a title");
+  end.commitToRing(*inring1);
+  
+  for (uint64_t ts = 1; ts <= nItems; ts++) {
+    std::unique_ptr<CRingItem> pItem(CRingItem::getFromRing(*outring, all));
+    EQ(uint32_t(PHYSICS_EVENT), pItem->type());
+    EQ(ts, pItem->getEventTimestamp());
+    EQ(uint32_t(2 - (ts & 1)), pItem->getSourceId());
+  }
+  std::unique_ptr<CRingItem> pEnd(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(END_RUN), pEnd->type());
+}
+// Timestamps start over with each run.  The second run's items must be
+// put in order too, not all taken as late because the first run's were
+// newer.
+
+void
+ringmergetests::tworuns()
+{
+  CAllButPredicate all;
+  const char* params[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    "--order=timestamp", "--window=1000000", "--max-latency=10000",
+    0
+  };
+  
+  startMerger(params);
+  sleep(1);                         // Let it get started.
+  
+  std::unique_ptr<CRingBuffer> inring1(new CRingBuffer("inring1", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> inring2(new CRingBuffer("inring2", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> outring(new CRingBuffer("output"));
+  
+  const uint64_t nItems(20);
+  for (uint32_t run = 1; run <= 2; run++) {
+    CRingStateChangeItem begin(BEGIN_RUN, run, 0, 1234, "This is a title");
+    begin.commitToRing(*inring1);
+    std::unique_ptr<CRingItem> pBegin(CRingItem::getFromRing(*outring, all));
+    EQ(uint32_t(BEGIN_RUN), pBegin->type());
+    
+    for (uint64_t ts = 2; ts <= nItems; ts += 2) {      // Evens first.
+      CPhysicsEventItem item(ts, 2, 0);
+      item.commitToRing(*inring2);
+    }
+    for (uint64_t ts = 1; ts <= nItems; ts += 2) {
+      CPhysicsEventItem item(ts, 1, 0);
+      item.commitToRing(*inring1);
+    }
+    sleep(1);                       // Let them all be read and held.
+    CRingStateChangeItem end(END_RUN, run, 0, 1234, "This is a title");
+    end.commitToRing(*inring1);
+    
+    for (uint64_t ts = 1; ts <= nItems; ts++) {
+      std::unique_ptr<CRingItem> pItem(CRingItem::getFromRing(*outring, all));
+      EQ(uint32_t(PHYSICS_EVENT), pItem->type());
+      EQ(ts, pItem->getEventTimestamp());
+    }
+    std::unique_ptr<CRingItem> pEnd(CRingItem::getFromRing(*outring, all));
+    EQ(uint32_t(END_RUN), pEnd->type());
+  }
+}
+// An untimed item that isn't a state change (e.g. the router's
+// MONITORED_VARIABLES reports) goes straight through without flushing,
+// so the items held around it still come out in order.
+
+void
+ringmergetests::untimedtext()
+{
+  CAllButPredicate all;
+  const char* params[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    "--order=timestamp", "--window=1000000", "--max-latency=10000",
+    0
+  };
+  
+  startMerger(params);
+  sleep(1);                         // Let it get started.
+  
+  std::unique_ptr<CRingBuffer> inring1(new CRingBuffer("inring1", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> inring2(new CRingBuffer("inring2", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> outring(new CRingBuffer("output"));
+  
+  const uint64_t nItems(20);
+  for (uint64_t ts = 2; ts <= nItems; ts += 2) {        // Evens first.
+    CPhysicsEventItem item(ts, 2, 0);
+    item.commitToRing(*inring2);
+  }
+  for (uint64_t ts = 1; ts <= nItems/2; ts += 2) {
+    CPhysicsEventItem item(ts, 1, 0);
+    item.commitToRing(*inring1);
+  }
+  std::vector<std::string> strings;
+  strings.push_back("congestion 1");
+  CRingTextItem text(MONITORED_VARIABLES, strings);
+  text.commitToRing(*inring1);
+  for (uint64_t ts = nItems/2 + 1; ts <= nItems; ts += 2) {
+    CPhysicsEventItem item(ts, 1, 0);
+    item.commitToRing(*inring1);
+  }
+  sleep(1);                         // Let them all be read and held.
+  CRingStateChangeItem end(END_RUN, 1 ,0, 1234, "This is a title");
+  end.commitToRing(*inring1);
+  
+  std::unique_ptr<CRingItem> pText(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(MONITORED_VARIABLES), pText->type());
+  for (uint64_t ts = 1; ts <= nItems; ts++) {
+    std::unique_ptr<CRingItem> pItem(CRingItem::getFromRing(*outring, all));
+    EQ(uint32_t(PHYSICS_EVENT), pItem->type());
+    EQ(ts, pItem->getEventTimestamp());
+  }
+  std::unique_ptr<CRingItem> pEnd(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(END_RUN), pEnd->type());
+}
+// Report the merged event rates with one and two busy inputs, read by a
+// single thread and by a thread per input.
+
+void
+ringmergetests::scaling()
+{
+  const char* single[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    "--single-thread",
+    0
+  };
+  const char* threaded[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    0
+  };
+  std::cerr << "\nringmerge events/s:";
+  for (int inputs = 1; inputs <= 2; inputs++) {
+    double singleRate   = mergedRate(single, inputs);
+    double threadedRate = mergedRate(threaded, inputs);
+    std::cerr << " " << inputs << " busy input(s): single thread "
+              << singleRate << ", thread per input " << threadedRate << ";";
+  }
+  std::cerr << std::endl;
+}
+// With one thread reading the inputs, a busy input must be drained in
+// batches while a nearly idle one still gets an item every pass.  The
+// merger is stopped while the backlog is built so it's all there at once.
+// --batch-bytes is small and --batch-items large so that it's the backlog
+// weighting that shares out each pass: the idle input's share is a few
+// bytes, so it gets its one item a pass, after at most a pass's worth of
+// the busy input's items.
+
+void
+ringmergetests::backlog()
+{
+  CAllButPredicate all;
+  const char* params[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    "--single-thread", "--batch-items=10000", "--batch-bytes=1",
+    0
+  };
+  
+  startMerger(params);
+  sleep(1);                         // Let it get started.
+  
+  std::unique_ptr<CRingBuffer> inring1(new CRingBuffer("inring1", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> inring2(new CRingBuffer("inring2", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> outring(new CRingBuffer("output"));
+  
+  const uint32_t busyItems(2000);
+  const uint32_t idleItems(10);
+  const uint32_t batchBytes(1024);
+  uint32_t itemSize = CPhysicsEventItem(0, 1, 0).size();
+  uint32_t perPass  = batchBytes/itemSize + 1;  // Most busy items a pass.
+  kill(m_subProcess, SIGSTOP);
+  for (uint32_t n = 0; n < busyItems; n++) {
+    CPhysicsEventItem item(n, 1, 0);
+    item.commitToRing(*inring1);
+  }
+  for (uint32_t n = 0; n < idleItems; n++) {
+    CPhysicsEventItem item(n, 2, 0);
+    item.commitToRing(*inring2);
+  }
+  kill(m_subProcess, SIGCONT);
+  
+  // The pass under way when the merger was stopped may have sampled
+  // the backlogs before they were built, so allow it on top.
+  
+  uint32_t next[2] = {0, 0};
+  uint32_t lastIdle(0);
+  for (uint32_t n = 0; n < busyItems + idleItems; n++) {
+    std::unique_ptr<CRingItem> pItem(CRingItem::getFromRing(*outring, all));
+    uint32_t source = pItem->getSourceId();
+    ASSERT((source == 1) || (source == 2));
+    EQ(next[source - 1]++, uint32_t(pItem->getEventTimestamp()));
+    if (source == 2) {
+      uint32_t idle = next[1];                  // This is idle item idle - 1.
+      ASSERT(n <= (idle + 1)*(perPass + 1));    // Never waits long...
+      if (idle > 1) {
+        ASSERT(n - lastIdle > 1);               // ...but gets one item a pass.
+      }
+      lastIdle = n;
+    }
+  }
+}
+// --build: items within the window are built into one item laid out as
+// glom lays them out; the glom parameters follow the BEGIN_RUN and the
+// END_RUN ends the last event.
+
+void
+ringmergetests::build()
+{
+  CAllButPredicate all;
+  const char* params[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--input=tcp://localhost/inring2",
+    "--build", "--build-window=5", "--build-source-id=99",
+    "--window=1000", "--max-latency=10000", "--build-timeout=10000",
+    0
+  };
+  
+  startMerger(params);
+  sleep(1);                         // Let it get started.
+  
+  std::unique_ptr<CRingBuffer> inring1(new CRingBuffer("inring1", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> inring2(new CRingBuffer("inring2", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> outring(new CRingBuffer("output"));
+  
+  CRingStateChangeItem begin(BEGIN_RUN, 1, 0, 1234, "This is a title");
+  begin.commitToRing(*inring1);
+  sleep(1);
+  CPhysicsEventItem first(100, 1, 0);
+  CPhysicsEventItem second(102, 2, 0);
+  CPhysicsEventItem third(200, 1, 0);
+  first.commitToRing(*inring1);
+  third.commitToRing(*inring1);
+  second.commitToRing(*inring2);
+  sleep(1);                         // Let them all be read and held.
+  CRingStateChangeItem end(END_RUN, 1 ,0, 1234, "This is a title");
+  end.commitToRing(*inring1);
+  
+  std::unique_ptr<CRingItem> pBegin(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(BEGIN_RUN), pBegin->type());
+  
+  std::unique_ptr<CRingItem> pInfo(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(EVB_GLOM_INFO), pInfo->type());
+  std::unique_ptr<CGlomParameters>
+    pGlom(static_cast<CGlomParameters*>(CRingItemFactory::createRingItem(*pInfo)));
+  EQ(uint64_t(5), pGlom->coincidenceTicks());
+  ASSERT(pGlom->isBuilding());
+  
+  // Two fragments, 100 from source 1 and 102 from source 2:
+  
+  std::unique_ptr<CRingItem> pBuilt(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(PHYSICS_EVENT), pBuilt->type());
+  EQ(uint64_t(100), pBuilt->getEventTimestamp());
+  EQ(uint32_t(99), pBuilt->getSourceId());
+  uint8_t* p = static_cast<uint8_t*>(pBuilt->getBodyPointer());
+  uint32_t bodyBytes;
+  memcpy(&bodyBytes, p, sizeof(bodyBytes));
+  EQ(uint32_t(pBuilt->getBodySize()), bodyBytes);
+  p += sizeof(uint32_t);
+  CRingItem* expected[] = {&first, &second};
+  for (int i = 0; i < 2; i++) {
+    EVB::FragmentHeader fragment;
+    memcpy(&fragment, p, sizeof(fragment));
+    p += sizeof(fragment);
+    EQ(expected[i]->getEventTimestamp(), fragment.s_timestamp);
+    EQ(expected[i]->getSourceId(), fragment.s_sourceId);
+    EQ(expected[i]->size(), fragment.s_size);
+    EQ(0, memcmp(p, expected[i]->getItemPointer(), fragment.s_size));
+    p += fragment.s_size;
+  }
+  EQ(static_cast<uint8_t*>(pBuilt->getBodyPointer()) + bodyBytes, p);
+  
+  // 200 is outside the window so it's an event of its own:
+  
+  pBuilt.reset(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(PHYSICS_EVENT), pBuilt->type());
+  EQ(uint64_t(200), pBuilt->getEventTimestamp());
+  
+  std::unique_ptr<CRingItem> pEnd(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(END_RUN), pEnd->type());
+}
+// --route: items go once to each ring of every rule they match; items
+// matching none go to --output.
+
+void
+ringmergetests::route()
+{
+  CAllButPredicate all;
+  const char* params[]= {
+    "./ringmerge", "--output=output",
+    "--input=tcp://localhost/inring1",
+    "--route=routeA,routeB sid=1",
+    "--route=routeB type=physics ts=100-199",
+    0
+  };
+  
+  startMerger(params);
+  sleep(1);                         // Let it get started and make the rings.
+  
+  std::unique_ptr<CRingBuffer> inring(new CRingBuffer("inring1", CRingBuffer::producer));
+  std::unique_ptr<CRingBuffer> outring(new CRingBuffer("output"));
+  std::unique_ptr<CRingBuffer> routeA(new CRingBuffer("routeA"));
+  std::unique_ptr<CRingBuffer> routeB(new CRingBuffer("routeB"));
+  
+  CPhysicsEventItem both(150, 1, 0);          // Both rules.
+  CPhysicsEventItem inRange(150, 2, 0);       // Second rule.
+  CPhysicsEventItem neither(500, 2, 0);
+  CRingStateChangeItem end(END_RUN, 1 ,0, 1234, "This is a title");
+  both.commitToRing(*inring);
+  inRange.commitToRing(*inring);
+  neither.commitToRing(*inring);
+  end.commitToRing(*inring);
+  
+  std::unique_ptr<CRingItem> pItem(CRingItem::getFromRing(*outring, all));
+  EQ(uint64_t(500), pItem->getEventTimestamp());
+  pItem.reset(CRingItem::getFromRing(*outring, all));
+  EQ(uint32_t(END_RUN), pItem->type());
+  
+  pItem.reset(CRingItem::getFromRing(*routeA, all));
+  EQ(uint32_t(1), pItem->getSourceId());
+  EQ(size_t(0), size_t(routeA->availableData()));
+  
+  pItem.reset(CRingItem::getFromRing(*routeB, all));
+  EQ(uint32_t(1), pItem->getSourceId());
+  pItem.reset(CRingItem::getFromRing(*routeB, all));
+  EQ(uint32_t(2), pItem->getSourceId());
+  EQ(uint64_t(150), pItem->getEventTimestamp());
+  EQ(size_t(0), size_t(routeB->availableData()));
+  
+  outring.reset();
+  routeA.reset();
+  routeB.reset();
+}
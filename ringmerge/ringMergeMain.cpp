@@ -20,20 +20,239 @@
  */
 
 #include "ringmerge.h"
+#include "OrderedMerge.h"
+#include "ItemQueue.h"
+#include "MergeInputs.h"
+#include "ItemSink.h"
+#include "CoincidenceBuilder.h"
+#include "ItemRouter.h"
 #include <CRemoteAccess.h>
 #include <CRingBuffer.h>
-#include <CRingItem.h>
-#include <CAllButPredicate.h>
+#include <DataFormat.h>
 #include <vector>
+#include <memory>
 #include <stdexcept>
 #include <Exception.h>
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
 
 
 const size_t RING_BUFFER_SIZE(32*1024*1024);
 
+// Initial size of the buffer items are forwarded through:
+
+const size_t RING_ITEM_BUFFER_SIZE(64*1024);
+
+// After the spin passes, the first sleep is this long.  Each idle pass
+// after that doubles it up to --max-sleep:
+
+const unsigned MIN_SLEEP_USEC(10);
+
+// At most this many items are taken from the queue in a pass between
+// checks for due merged items and reports:
+
+const unsigned MAX_ITEMS_PER_PASS(256);
+
+/**
+ * Backoff
+ *    How long to wait when no input has data.  NSCLDAQ rings offer no
+ *    way to block until any of several rings has data, so we spin for a
+ *    while (data usually come in bursts), then yield, then sleep for
+ *    longer and longer up to a limit.  Any data puts us back to spinning.
+ *    The limit bounds the latency added to the first item after an idle
+ *    spell; idle, we wake up at most 1/limit times a second.
+ */
+class Backoff
+{
+private:
+    unsigned m_spinPasses;
+    unsigned m_maxSleep;                    // usec; 0 never sleeps.
+    unsigned m_idlePasses;
+    unsigned m_sleep;
+public:
+    Backoff(unsigned spinPasses, unsigned maxSleep) :
+        m_spinPasses(spinPasses), m_maxSleep(maxSleep), m_idlePasses(0),
+        m_sleep(MIN_SLEEP_USEC)
+    {}
+    void busy() {
+        m_idlePasses = 0;
+        m_sleep      = MIN_SLEEP_USEC;
+    }
+    void idle() {
+        if ((m_maxSleep == 0) || (++m_idlePasses <= m_spinPasses)) {
+            return;
+        }
+        if (m_idlePasses == m_spinPasses + 1) {
+            sched_yield();
+            return;
+        }
+        usleep(std::min(m_sleep, m_maxSleep));
+        m_sleep = std::min(m_sleep*2, m_maxSleep);
+    }
+};
+
+/**
+ * Reporter
+ *    Says when it's time to write the counters (--report-interval).
+ */
+class Reporter
+{
+private:
+    std::chrono::seconds                  m_interval;    // 0 never reports.
+    std::chrono::steady_clock::time_point m_next;
+public:
+    Reporter(unsigned seconds) :
+        m_interval(seconds), m_next(std::chrono::steady_clock::now() + m_interval)
+    {}
+    bool due() {
+        if ((m_interval.count() == 0) || (std::chrono::steady_clock::now() < m_next)) {
+            return false;
+        }
+        m_next += m_interval;
+        return true;
+    }
+};
+/**
+ * mergeInputs
+ *    Main loop when one thread reads all the inputs: drain them in
+ *    backlog weighted batches (see MergeInputs::drain) into the output,
+ *    through an OrderedMerge if they're to be put in timestamp order.
+ *    Never returns.
+ *
+ * @param inputs   - the inputs.
+ * @param output   - the output (ring or event builder).
+ * @param pMerge   - the merge, or null to write items as they come.
+ * @param backoff  - what to do on a pass when nothing moved.
+ * @param reporter - when to write the counters to stderr.
+ */
+static void
+mergeInputs(MergeInputs& inputs, ItemSink& output, OrderedMerge* pMerge,
+            Backoff& backoff, Reporter& reporter)
+{
+    std::vector<uint8_t> buffer(RING_ITEM_BUFFER_SIZE);
+    while (true) {
+        bool moved;
+        if (pMerge) {
+            moved = inputs.drain(buffer, [pMerge](std::vector<uint8_t>& item) {
+                pMerge->add(item);
+            });
+            if (pMerge->writeDue()) {
+                moved = true;
+            }
+        } else {
+            moved = inputs.drain(buffer, [&output](std::vector<uint8_t>& item) {
+                output.write(item.data());
+            });
+        }
+        if (moved) {
+            backoff.busy();
+        } else {
+            backoff.idle();
+        }
+        if (reporter.due()) {
+            inputs.report(std::cerr);
+            if (pMerge) {
+                pMerge->report(std::cerr);      // Reports the output too.
+            } else {
+                output.report(std::cerr);
+            }
+        }
+    }
+}
+/**
+ * readInput
+ *    Body of an input's reader thread: queue the items from the input as
+ *    they come in.  A slow input (e.g. a remote ring) then only holds up
+ *    its own thread.  Never returns; errors end the program.
+ *
+ * @param pInputs  - the inputs.
+ * @param input    - index of the input this thread reads; it's queued with
+ *                   its items.
+ * @param pQueue   - the queue the output thread drains.
+ * @param spin     - passes to spin when idle (see Backoff).
+ * @param maxSleep - longest idle sleep, usec (see Backoff).
+ */
+static void
+readInput(MergeInputs* pInputs, unsigned input, ItemQueue* pQueue,
+          unsigned spin, unsigned maxSleep)
+{
+    Backoff backoff(spin, maxSleep);
+    std::vector<uint8_t> buffer(RING_ITEM_BUFFER_SIZE);
+    try {
+        while (true) {
+            if (!pInputs->read(input, buffer)) {
+                backoff.idle();
+                continue;
+            }
+            backoff.busy();
+            while (!pQueue->push(buffer, input)) {
+                backoff.idle();             // The output's behind.
+            }
+        }
+    }
+    catch (std::string& msg) {
+        std::cerr << msg << std::endl;
+    }
+    catch (CException& e) {
+        std::cerr << "Unable to read ring items: " << e.ReasonText() << std::endl;
+    }
+    exit(EXIT_FAILURE);
+}
+/**
+ * drainQueue
+ *    Main loop of the output thread when each input has a reader thread:
+ *    write the queued items to the output, through an OrderedMerge if
+ *    they're to be put in timestamp order.  Never returns.
+ *
+ * @param queue    - the queue the reader threads fill.
+ * @param inputs   - the inputs, for their counters.
+ * @param output   - the output (ring or event builder).
+ * @param pMerge   - the merge, or null to write items as they come.
+ * @param backoff  - what to do on a pass when nothing moved.
+ * @param reporter - when to write the counters to stderr.
+ */
+static void
+drainQueue(ItemQueue& queue, MergeInputs& inputs, ItemSink& output,
+           OrderedMerge* pMerge, Backoff& backoff, Reporter& reporter)
+{
+    std::vector<uint8_t> buffer(RING_ITEM_BUFFER_SIZE);
+    unsigned source;
+    while (true) {
+        bool moved = false;
+        for (unsigned n = 0; n < MAX_ITEMS_PER_PASS; n++) {
+            if (!queue.pop(buffer, source)) break;
+            if (pMerge) {
+                pMerge->add(buffer);
+            } else {
+                output.write(buffer.data());
+            }
+            moved = true;
+        }
+        if (pMerge && pMerge->writeDue()) {
+            moved = true;
+        }
+        if (moved) {
+            backoff.busy();
+        } else {
+            backoff.idle();
+        }
+        if (reporter.due()) {
+            inputs.report(std::cerr);
+            if (pMerge) {
+                pMerge->report(std::cerr);      // Reports the output too.
+            } else {
+                output.report(std::cerr);
+            }
+        }
+    }
+}
 /**
  * main
  *    Parse the command line arguments.
@@ -45,9 +264,41 @@ int main(int argc, char** argv)
 {
     gengetopt_args_info parsedArgs;
     cmdline_parser(argc, argv, &parsedArgs);
-    std::vector<CRingBuffer*> inputRings;
-    CRingBuffer*              outputRing;
-    CAllButPredicate          all;         //no exceptions gives all items.
+    if ((parsedArgs.spin_arg < 0) || (parsedArgs.max_sleep_arg < 0)) {
+        std::cerr << "--spin and --max-sleep must not be negative\n";
+        exit(EXIT_FAILURE);
+    }
+    bool ordered = parsedArgs.build_flag ||
+        (std::string(parsedArgs.order_arg) == "timestamp");
+    OrderedMerge::Untimed untimed;
+    CGlomParameters::TimestampPolicy timestampPolicy;
+    try {
+        untimed         = OrderedMerge::untimed(parsedArgs.untimed_arg);
+        timestampPolicy = CoincidenceBuilder::policy(parsedArgs.build_timestamp_arg);
+        if ((parsedArgs.build_window_arg < 0) || (parsedArgs.build_timeout_arg < 0) ||
+            (parsedArgs.build_source_id_arg < 0)) {
+            throw std::string("--build-window, --build-timeout and --build-source-id must not be negative");
+        }
+        if ((parsedArgs.window_arg < 0) || (parsedArgs.max_latency_arg < 0) ||
+            (parsedArgs.report_interval_arg < 0)) {
+            throw std::string("--window, --max-latency and --report-interval must not be negative");
+        }
+        if (ordered && (!parsedArgs.window_given || (parsedArgs.window_arg == 0))) {
+            throw std::string("--order=timestamp and --build need a --window of at least 1 tick");
+        }
+        if (parsedArgs.queue_items_arg <= 0) {
+            throw std::string("--queue-items must be at least 1");
+        }
+        if ((parsedArgs.batch_items_arg <= 0) || (parsedArgs.batch_bytes_arg <= 0)) {
+            throw std::string("--batch-items and --batch-bytes must be at least 1");
+        }
+    }
+    catch (std::string& msg) {
+        std::cerr << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    MergeInputs  inputs(parsedArgs.batch_items_arg, size_t(parsedArgs.batch_bytes_arg)*1024);
+    CRingBuffer* outputRing;
     std::string ringName;   // So we have it for exceptions.
     
     // Build up the vector of input ring buffers.
@@ -56,7 +307,7 @@ int main(int argc, char** argv)
         if (parsedArgs.input_given > 0) {
             for (int i =0; i < parsedArgs.input_given; i++) {
                 ringName = parsedArgs.input_arg[i];
-                inputRings.push_back(CRingAccess::daqConsumeFrom(ringName));
+                inputs.add(CRingAccess::daqConsumeFrom(ringName), ringName);
             }
         } else {
             throw std::string("There must be at least one input ringbuffer URI");
@@ -115,20 +366,80 @@ int main(int argc, char** argv)
         std::cerr << "Unexpected exception type processing output ring\n";
         exit(EXIT_FAILURE);
     }
+    
+    // With --route rules, items go to the rings the rules say instead
+    // (see ItemRouter):
+    
+    std::unique_ptr<ItemRouter> pRouter;
+    try {
+        if (parsedArgs.route_given > 0) {
+            pRouter.reset(new ItemRouter(outputRing, parsedArgs.output_arg, RING_BUFFER_SIZE));
+            for (int i = 0; i < parsedArgs.route_given; i++) {
+                pRouter->addRule(parsedArgs.route_arg[i]);
+            }
+        }
+    }
+    catch (CException& e) {
+        std::cerr << "Unable to make a --route output ring: " << e.ReasonText() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    catch (std::string& msg) {
+        std::cerr << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
     //  Now we can forward data as we get it from the input ring buffers
-    // to the output ring buffers.  The assumption is that once data is available
-    // to the ring, at least one ring item is or soon will be available.
-    //  Note that this is a spin loop which ain't great but gets the job done.
+    // to the output ring buffers.  Each input gets a reader thread (see
+    // readInput) and this thread just writes what they queue (see
+    // drainQueue).  With --single-thread, this thread reads the inputs
+    // itself, a batch from each in turn (see mergeInputs).
+    //  With --order=timestamp, items go through an OrderedMerge on their
+    // way to the output ring.  --build implies that, and the ordered items
+    // then go through a CoincidenceBuilder as well.  What comes out goes
+    // to the output ring or, with --route, the ItemRouter.
+    //  When a pass finds nothing, we back off (see Backoff) rather than
+    // spin flat out.
     
-    while (true) {
-        for (int i =0; i < inputRings.size(); i++) {  // Cycle over the inputs.
-            if (inputRings[i]->availableData()) {     // Can get a ring item.
-                CRingItem* pItem = CRingItem::getFromRing(*inputRings[i], all);
-                pItem->commitToRing(*outputRing);
-                delete pItem;
-            }
+    Backoff  backoff(parsedArgs.spin_arg, parsedArgs.max_sleep_arg);
+    Reporter reporter(parsedArgs.report_interval_arg);
+    try {
+        RingSink ring(*outputRing);
+        ItemSink* pOutput = &ring;
+        if (pRouter) {
+            pOutput = pRouter.get();
+        }
+        std::unique_ptr<CoincidenceBuilder> pBuilder;
+        if (parsedArgs.build_flag) {
+            pBuilder.reset(new CoincidenceBuilder(
+                *pOutput, parsedArgs.build_window_arg, timestampPolicy,
+                parsedArgs.build_source_id_arg, parsedArgs.build_timeout_arg
+            ));
+            pBuilder->writeInfo();
+            pOutput = pBuilder.get();
+        }
+        std::unique_ptr<OrderedMerge> pMerge;
+        if (ordered) {
+            pMerge.reset(new OrderedMerge(
+                *pOutput, parsedArgs.window_arg, parsedArgs.max_latency_arg, untimed
+            ));
+        }
+        if (parsedArgs.single_thread_flag) {
+            mergeInputs(inputs, *pOutput, pMerge.get(), backoff, reporter);
         }
+        ItemQueue queue(parsedArgs.queue_items_arg);
+        for (size_t i = 0; i < inputs.size(); i++) {
+            std::thread(
+                readInput, &inputs, i, &queue,
+                parsedArgs.spin_arg, parsedArgs.max_sleep_arg
+            ).detach();
+        }
+        drainQueue(queue, inputs, *pOutput, pMerge.get(), backoff, reporter);
+    }
+    catch (std::string& msg) {
+        std::cerr << msg << std::endl;
+    }
+    catch (CException& e) {
+        std::cerr << "Unable to forward ring items: " << e.ReasonText() << std::endl;
     }
     
     exit(EXIT_FAILURE);    
@@ -0,0 +1,384 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  CongestionTracker.cpp
+ *  @brief: Implement the output ring congestion policies.
+ */
+#include "CongestionTracker.h"
+#include "FrameQueue.h"
+#include <utl/Logging.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sstream>
+
+// Name of the Tcl array the congestion report sets:
+
+static const char* REPORT_ARRAY("routerCongestion");
+
+/**
+ * constructor
+ *
+ * @param policy         - What to do with frames that don't fit.
+ * @param sampleInterval - For SAMPLE, one in this many frames is kept.
+ * @param clearBytes     - Free ring space needed to end a congestion period.
+ * @param spillPrefix    - For SPILL, path and leading part of the spill
+ *                         file name.  The file is made when it's first needed.
+ */
+CongestionTracker::CongestionTracker(
+    Policy policy, unsigned sampleInterval, size_t clearBytes,
+    const std::string& spillPrefix
+) :
+    m_policy(policy), m_sampleInterval(sampleInterval > 0 ? sampleInterval : 1),
+    m_clearBytes(clearBytes), m_spillPrefix(spillPrefix),
+    m_congested(false), m_begin(0), m_end(0), m_seen(0),
+    m_spillFd(-1),
+    m_periods(0), m_droppedFrames(0), m_droppedBytes(0),
+    m_spilledFrames(0), m_spilledBytes(0),
+    m_journaledFrames(0), m_journaledBytes(0)
+{}
+/**
+ * destructor
+ *    Close the spill file if one was made.
+ */
+CongestionTracker::~CongestionTracker()
+{
+    if (m_spillFd >= 0) {
+        close(m_spillFd);
+    }
+}
+/**
+ * decide
+ *    Decide what to do with a frame.  If the ring has no room for it, a
+ *    congestion period begins.  Dropped frames are accounted for here;
+ *    spilled frames when they're spilled.
+ *
+ * @param record      - describes the frame.
+ * @param freeBytes   - free space in the ring.
+ * @param neededBytes - ring space needed to write the frame (and anything
+ *                      that's waiting to be written ahead of it).
+ * @return Decision
+ */
+CongestionTracker::Decision
+CongestionTracker::decide(const FrameRecord& record, size_t freeBytes, size_t neededBytes)
+{
+    if (!m_congested) {
+        if (freeBytes >= neededBytes) {
+            return WRITE;
+        }
+        beginPeriod();
+    }
+    m_seen++;
+
+    switch (m_policy) {
+    case BLOCK:
+        return WRITE;
+    case DROP:
+        drop(record);
+        return DISCARD;
+    case SAMPLE:
+        if (((m_seen - 1) % m_sampleInterval) == 0) {
+            return WRITE;
+        }
+        drop(record);
+        return DISCARD;
+    case SPILL:
+        return SPILL_FRAME;
+    case JOURNAL:
+        return JOURNAL_FRAME;
+    }
+    return WRITE;
+}
+/**
+ * cleared
+ *    @param freeBytes   - free space in the ring.
+ *    @param neededBytes - ring space needed for the next frame.
+ *    @return bool - true if we're congested and the ring now has enough
+ *                   room to end the congestion period.
+ */
+bool
+CongestionTracker::cleared(size_t freeBytes, size_t neededBytes) const
+{
+    return m_congested && (freeBytes >= neededBytes) && (freeBytes >= m_clearBytes);
+}
+/**
+ * spill
+ *    Write a frame, as a ring item, to the spill file.  If the spill file
+ *    can't be written, the frame is dropped instead.
+ *
+ * @param pHeaders    - the ring item and body headers for the frame.
+ * @param headerBytes - size of the headers.
+ * @param record      - describes the frame.
+ * @param pFrame      - the frame.
+ */
+void
+CongestionTracker::spill(
+    const void* pHeaders, size_t headerBytes, const FrameRecord& record, const void* pFrame
+)
+{
+    if (m_spillFd < 0) {
+        openSpillFile();
+    }
+    if (m_spillFd >= 0) {
+        iovec parts[2];
+        parts[0].iov_base = const_cast<void*>(pHeaders);
+        parts[0].iov_len  = headerBytes;
+        parts[1].iov_base = const_cast<void*>(pFrame);
+        parts[1].iov_len  = record.s_frameSize;
+        ssize_t nBytes = headerBytes + record.s_frameSize;
+        if (writev(m_spillFd, parts, 2) == nBytes) {
+            account(m_spilled, record);
+            m_spilledFrames++;
+            m_spilledBytes += record.s_frameSize;
+            return;
+        }
+        LOG_ERROR() << "Unable to write spill file " << m_spillFile << ": "
+            << strerror(errno) << "; dropping frames instead";
+        close(m_spillFd);
+        m_spillFd = -1;
+        m_policy  = DROP;
+    }
+    drop(record);
+}
+/**
+ * journaled
+ *    Account for a frame that was put in the journal.
+ *
+ * @param record - describes the frame.
+ */
+void
+CongestionTracker::journaled(const FrameRecord& record)
+{
+    account(m_journaled, record);
+    m_journaledFrames++;
+    m_journaledBytes += record.s_frameSize;
+}
+/**
+ * endPeriod
+ *    Ends the congestion period and describes it.
+ *
+ * @return std::vector<std::string> - Tcl set commands describing the
+ *           period: the policy, when it began and ended and, per source id,
+ *           how many frames were lost (or spilled) and the range of their
+ *           timestamps.
+ */
+std::vector<std::string>
+CongestionTracker::endPeriod()
+{
+    m_congested = false;
+    m_end       = time(nullptr);
+
+    std::vector<std::string> result;
+    std::ostringstream s;
+    s << "set " << REPORT_ARRAY << "(policy) " << policyName(m_policy);
+    result.push_back(s.str());
+    s.str("");
+    s << "set " << REPORT_ARRAY << "(begin) " << m_begin;
+    result.push_back(s.str());
+    s.str("");
+    s << "set " << REPORT_ARRAY << "(end) " << m_end;
+    result.push_back(s.str());
+    s.str("");
+    s << "set " << REPORT_ARRAY << "(frames) " << m_seen;
+    result.push_back(s.str());
+
+    describe(result, "dropped", m_dropped);
+    if (!m_spilled.empty()) {
+        describe(result, "spilled", m_spilled);
+        s.str("");
+        s << "set " << REPORT_ARRAY << "(spillFile) {" << m_spillFile << '}';
+        result.push_back(s.str());
+    }
+    if (!m_journaled.empty()) {
+        describe(result, "journaled", m_journaled);
+    }
+    return result;
+}
+/**
+ * congested
+ *   @return bool - true if we're in a congestion period.
+ */
+bool
+CongestionTracker::congested() const
+{
+    return m_congested;
+}
+/**
+ * logStatistics
+ *    Log the totals over all congestion periods.
+ */
+void
+CongestionTracker::logStatistics()
+{
+    LOG_INFO() << "Ring congestion policy " << policyName(m_policy) << ": "
+        << m_periods << " congestion periods, "
+        << m_droppedFrames << " frames (" << m_droppedBytes << " bytes) dropped, "
+        << m_spilledFrames << " frames (" << m_spilledBytes << " bytes) spilled, "
+        << m_journaledFrames << " frames (" << m_journaledBytes << " bytes) journaled";
+    if (m_spilledFrames) {
+        LOG_INFO() << "Spilled frames are in " << m_spillFile;
+    }
+}
+/**
+ * policy
+ *    @param name - a policy name as given on the command line.
+ *    @return Policy
+ *    @throw std::string - if the name is not a policy.
+ */
+CongestionTracker::Policy
+CongestionTracker::policy(const std::string& name)
+{
+    if (name == "block")  return BLOCK;
+    if (name == "drop")   return DROP;
+    if (name == "sample") return SAMPLE;
+    if (name == "spill")  return SPILL;
+    if (name == "journal") return JOURNAL;
+    throw std::string("Unknown congestion policy: '") + name + "'";
+}
+/**
+ * policyName
+ *    @param policy - a policy.
+ *    @return std::string - its name.
+ */
+std::string
+CongestionTracker::policyName(Policy policy)
+{
+    switch (policy) {
+    case BLOCK:  return "block";
+    case DROP:   return "drop";
+    case SAMPLE: return "sample";
+    case SPILL:  return "spill";
+    case JOURNAL: return "journal";
+    }
+    return "unknown";
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * beginPeriod
+ *    Start a new congestion period.
+ */
+void
+CongestionTracker::beginPeriod()
+{
+    m_congested = true;
+    m_begin     = time(nullptr);
+    m_seen      = 0;
+    m_dropped.clear();
+    m_spilled.clear();
+    m_journaled.clear();
+    m_periods++;
+}
+/**
+ * drop
+ *    Account for a dropped frame.
+ *
+ * @param record - describes the frame.
+ */
+void
+CongestionTracker::drop(const FrameRecord& record)
+{
+    account(m_dropped, record);
+    m_droppedFrames++;
+    m_droppedBytes += record.s_frameSize;
+}
+/**
+ * openSpillFile
+ *    Make the spill file.  Its name is the spill prefix followed by the
+ *    time it was made.  On failure the error is logged and m_spillFd
+ *    stays negative.
+ */
+void
+CongestionTracker::openSpillFile()
+{
+    char stamp[64];
+    time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+
+    m_spillFile = m_spillPrefix + "-spill-" + stamp + ".evt";
+    m_spillFd   = open(m_spillFile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (m_spillFd < 0) {
+        LOG_ERROR() << "Unable to create spill file " << m_spillFile << ": "
+            << strerror(errno) << "; dropping frames instead";
+        m_policy = DROP;
+    } else {
+        LOG_INFO() << "Ring is congested; spilling frames to " << m_spillFile;
+    }
+}
+/**
+ * account
+ *    Add a frame to a set of losses.
+ *
+ * @param losses - the losses.
+ * @param record - describes the frame.
+ */
+void
+CongestionTracker::account(LossMap& losses, const FrameRecord& record)
+{
+    LossMap::iterator p = losses.find(record.s_sourceId);
+    if (p == losses.end()) {
+        Loss first = {0, 0, record.s_timestamp, record.s_timestamp};
+        p = losses.insert(std::make_pair(record.s_sourceId, first)).first;
+    }
+    p->second.s_frames++;
+    p->second.s_bytes         += record.s_frameSize;
+    p->second.s_lastTimestamp  = record.s_timestamp;
+}
+/**
+ * describe
+ *    Append the Tcl set commands that describe a set of losses.
+ *
+ * @param result - where to append them.
+ * @param what   - what happened to the frames (e.g. "dropped").
+ * @param losses - the losses.
+ */
+void
+CongestionTracker::describe(
+    std::vector<std::string>& result, const char* what, const LossMap& losses
+)
+{
+    uint64_t total = 0;
+    for (LossMap::const_iterator p = losses.begin(); p != losses.end(); ++p) {
+        const Loss& l(p->second);
+        std::ostringstream s;
+        s << "set " << REPORT_ARRAY << '(' << what << ',' << p->first << ") " << l.s_frames;
+        result.push_back(s.str());
+        s.str("");
+        s << "set " << REPORT_ARRAY << '(' << what << "Bytes," << p->first << ") " << l.s_bytes;
+        result.push_back(s.str());
+        s.str("");
+        s << "set " << REPORT_ARRAY << "(first," << what << ',' << p->first << ") "
+            << l.s_firstTimestamp;
+        result.push_back(s.str());
+        s.str("");
+        s << "set " << REPORT_ARRAY << "(last," << what << ',' << p->first << ") "
+            << l.s_lastTimestamp;
+        result.push_back(s.str());
+        total += l.s_frames;
+    }
+    std::ostringstream s;
+    s << "set " << REPORT_ARRAY << '(' << what << ") " << total;
+    result.push_back(s.str());
+}
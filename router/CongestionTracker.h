@@ -0,0 +1,133 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  CongestionTracker.h
+ *  @brief: Decide what to do with frames when the output ring is full.
+ */
+#ifndef CONGESTIONTRACKER_H
+#define CONGESTIONTRACKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+
+struct FrameRecord;
+
+/**
+ * @class CongestionTracker
+ *    When the ring's consumers fall behind, the ring fills.  Blocking until
+ *    there's room (the default) eventually backs up into the CoBo.  The
+ *    tracker implements the alternatives:
+ *
+ *    - DROP   - Frames that don't fit are thrown away.
+ *    - SAMPLE - While congested, one in every N frames is written (waiting
+ *               for room if need be) and the rest are thrown away.
+ *    - SPILL  - While congested, frames are written to a spill file,
+ *               as ring items, instead of the ring.
+ *    - JOURNAL- While congested, frames are written to a FrameJournal and
+ *               put in the ring, in order, as room appears.  The journal
+ *               itself belongs to the RingWriter.
+ *
+ *    The ring is congested from the first frame that doesn't fit until
+ *    the ring has both room for the next frame and a minimum amount of free
+ *    space.  That minimum keeps a consumer that is barely keeping up from
+ *    making lots of very short congestion periods.
+ *
+ *    For each congestion period the tracker keeps, per source id, the
+ *    number of frames lost (or spilled) and the first and last timestamps
+ *    lost.  When the period ends, these are described by Tcl set commands
+ *    for a MONITORED_VARIABLES ring item so analysis knows which data are
+ *    missing.
+ */
+class CongestionTracker
+{
+public:
+    typedef enum _Policy {
+        BLOCK, DROP, SAMPLE, SPILL, JOURNAL
+    } Policy;
+    typedef enum _Decision {
+        WRITE, DISCARD, SPILL_FRAME, JOURNAL_FRAME
+    } Decision;
+
+private:
+    struct Loss {
+        uint64_t s_frames;
+        uint64_t s_bytes;
+        uint64_t s_firstTimestamp;
+        uint64_t s_lastTimestamp;
+    };
+    typedef std::map<uint32_t, Loss> LossMap;
+
+    Policy      m_policy;
+    unsigned    m_sampleInterval;
+    size_t      m_clearBytes;
+    std::string m_spillPrefix;
+
+    // The current (or last) congestion period:
+
+    bool        m_congested;
+    time_t      m_begin;
+    time_t      m_end;
+    uint64_t    m_seen;               // Frames offered while congested.
+    LossMap     m_dropped;
+    LossMap     m_spilled;
+    LossMap     m_journaled;
+
+    int         m_spillFd;
+    std::string m_spillFile;
+
+    // Totals for the life of the tracker:
+
+    uint64_t    m_periods;
+    uint64_t    m_droppedFrames;
+    uint64_t    m_droppedBytes;
+    uint64_t    m_spilledFrames;
+    uint64_t    m_spilledBytes;
+    uint64_t    m_journaledFrames;
+    uint64_t    m_journaledBytes;
+
+public:
+    CongestionTracker(Policy policy, unsigned sampleInterval, size_t clearBytes,
+                      const std::string& spillPrefix);
+    ~CongestionTracker();
+
+    Decision decide(const FrameRecord& record, size_t freeBytes, size_t neededBytes);
+    bool     cleared(size_t freeBytes, size_t neededBytes) const;
+    void     spill(const void* pHeaders, size_t headerBytes,
+                   const FrameRecord& record, const void* pFrame);
+    void     journaled(const FrameRecord& record);
+    std::vector<std::string> endPeriod();
+
+    bool     congested() const;
+    void     logStatistics();
+
+    static Policy      policy(const std::string& name);
+    static std::string policyName(Policy policy);
+
+private:
+    void beginPeriod();
+    void drop(const FrameRecord& record);
+    void openSpillFile();
+    static void account(LossMap& losses, const FrameRecord& record);
+    static void describe(std::vector<std::string>& result, const char* what,
+                         const LossMap& losses);
+};
+
+#endif
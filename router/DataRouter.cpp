@@ -37,6 +37,9 @@
  * Modifications are intended to support
  *  -  building external to GET source tree.
  *  -  NSCLDAQ ringbuffer outputter.
+ *  -  Receiving several CoBo data flows in one router (FlowReceiverPool).
+ *  -  Extracting hits inside the router (HitRing output type).
+ *  -  Recording frames straight to run files (RunFile output type).
  */
 
 
@@ -54,6 +57,10 @@
 #include <boost/algorithm/string.hpp>
 
 #include "NSCLDAQDataProcessor.h"
+#include "FlowReceiverPool.h"
+#include "RingOutput.h"
+#include "RunRecorder.h"
+#include <set>
 
 namespace ba = boost::algorithm;
 
@@ -101,7 +108,8 @@ DataRouter::DataRouter(const ::utl::net::SocketAddress& flowEndpoint, const std:
 	{
 		dataProcessor.reset(new FrameStorage());
 		dataReceiver->set_dataProcessorCore(dataProcessor);
-	} else if (dataProcessorType == "RingBuffer")
+	} else if (dataProcessorType == "RingBuffer" or dataProcessorType == "HitRing"
+		or dataProcessorType == "RunFile")
 	{
 		dataProcessor.reset(new NSCLDAQDataProcessor());
 		dataReceiver->set_dataProcessorCore(dataProcessor);
@@ -121,6 +129,11 @@ DataRouter::DataRouter(const ::utl::net::SocketAddress& flowEndpoint, const std:
 	dataReceiver->set_dataProcessorCore(dataProcessor);
 }
 
+DataRouter::DataRouter(std::auto_ptr < ::FlowReceiverPool > receiverPool)
+	: receiverPool(receiverPool)
+{
+}
+
 void DataRouter::createDataReceiver(const ::utl::net::SocketAddress& flowEndpoint, const std::string& flowType)
 {
 	std::string dataFlowType = flowType;
@@ -158,14 +171,87 @@ void DataRouter::runStart(const ::Ice::Current&)
 {
 	LOG_INFO() << "Starting run processor...";
 	if (dataReceiver.get())
+	{
+		// Run barriers go into the rings before any frames.
+		NSCLDAQDataProcessor* ringProcessor =
+			dynamic_cast<NSCLDAQDataProcessor*>(&dataReceiver->dataProcessorCore());
+		if (ringProcessor)
+			ringProcessor->beginRun();
 		dataReceiver->start();
+	}
+	if (receiverPool.get())
+	{
+		for (size_t i = 0; i < receiverPool->endpointCount(); i++)
+		{
+			NSCLDAQDataProcessor* ringProcessor =
+				dynamic_cast<NSCLDAQDataProcessor*>(&receiverPool->processor(i));
+			if (ringProcessor)
+				ringProcessor->beginRun();
+		}
+		receiverPool->start();
+	}
 }
 
 void DataRouter::runStop(const ::Ice::Current&)
 {
 	LOG_INFO() << "Stopping run processor...";
 	if (dataReceiver.get())
+	{
 		dataReceiver->stop();
+
+		// Ring buffer output may be holding a partial batch of frames.
+		NSCLDAQDataProcessor* ringProcessor =
+			dynamic_cast<NSCLDAQDataProcessor*>(&dataReceiver->dataProcessorCore());
+		if (ringProcessor)
+		{
+			ringProcessor->endRun();
+			ringProcessor->flush();
+			if (ringProcessor->getRecorder())
+				ringProcessor->getRecorder()->endRun();
+			ringProcessor->logStatistics();
+		}
+	}
+	if (receiverPool.get())
+	{
+		receiverPool->stop();
+		receiverPool->logStatistics();
+
+		// Processors may share ring outputs; each output is flushed
+		// and its statistics logged once.
+		std::set<RingOutput*> outputs;
+		std::set<RunRecorder*> recorders;
+		for (size_t i = 0; i < receiverPool->endpointCount(); i++)
+		{
+			NSCLDAQDataProcessor* ringProcessor =
+				dynamic_cast<NSCLDAQDataProcessor*>(&receiverPool->processor(i));
+			if (ringProcessor)
+			{
+				ringProcessor->drain();
+				ringProcessor->endRun();
+				ringProcessor->logSourceStatistics();
+				if (ringProcessor->getOutput())
+					outputs.insert(ringProcessor->getOutput());
+				if (ringProcessor->getHitOutput())
+					outputs.insert(ringProcessor->getHitOutput());
+				if (ringProcessor->getMonitor())
+					outputs.insert(ringProcessor->getMonitor());
+				std::vector<RingOutput*> shardOutputs = ringProcessor->getShardOutputs();
+				outputs.insert(shardOutputs.begin(), shardOutputs.end());
+				if (ringProcessor->getRecorder())
+					recorders.insert(ringProcessor->getRecorder());
+			}
+		}
+		for (std::set<RingOutput*>::iterator p = outputs.begin(); p != outputs.end(); ++p)
+		{
+			(*p)->flush();
+			(*p)->logStatistics();
+		}
+		for (std::set<RunRecorder*>::iterator p = recorders.begin(); p != recorders.end(); ++p)
+		{
+			(*p)->endRun();
+			(*p)->logStatistics();
+		}
+	}
 }
 
 } // namespace daq
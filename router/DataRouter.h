@@ -46,6 +46,7 @@
 #include <memory>
 
 // Forward declarations
+class FlowReceiverPool;
 namespace mdaq
 {
 namespace daq
@@ -64,6 +65,7 @@ class DataRouter : public virtual mdaq::daq::RunProcessor
 public:
 	DataRouter(const ::utl::net::SocketAddress& flowEndpoint, const std::string& flowType, const std::string& dataProcessorType);
 	DataRouter(const ::utl::net::SocketAddress& flowEndpoint, const std::string& flowType, std::auto_ptr < ::mdaq::daq::DataProcessorCore > dataProcessor);
+	DataRouter(std::auto_ptr < ::FlowReceiverPool > receiverPool);
 	virtual ~DataRouter();
     void runConfig(const std::string& configString, const ::Ice::Current& = ::Ice::Current());
     void runStart(const ::Ice::Current& = ::Ice::Current());
@@ -73,6 +75,11 @@ public:
      getting the data processor core.
     */
     mdaq::daq::DataReceiver* getDataReceiver() { return dataReceiver.get(); }
+    /*
+     When several data flows are received by one router, they're
+     received by a pool and each has its own data processor.
+    */
+    ::FlowReceiverPool* getReceiverPool() { return receiverPool.get(); }
 private:
 	DataRouter(DataRouter const & r);
 	DataRouter& operator=(const DataRouter & r);
@@ -80,6 +87,7 @@ private:
 
 protected:
 	std::auto_ptr < mdaq::daq::DataReceiver > dataReceiver;
+	std::auto_ptr < ::FlowReceiverPool > receiverPool;
 };
 //_________________________________________________________________________________________________
 } // namespace daq
@@ -0,0 +1,359 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  EventAssembler.cpp
+ *  @brief: Implement the AsAd frame merging.
+ */
+#include "EventAssembler.h"
+#include <utl/Logging.h>
+#include <string.h>
+
+// Merged frame types and revision (see configs/xml/CoboFormats.xcfg):
+
+static const uint16_t MERGED_BY_EVENT_ID(65281);
+static const uint16_t MERGED_BY_EVENT_TIME(65282);
+static const uint8_t  MERGED_REVISION(1);
+
+// Header sizes.  MergedDataFormats-ByEventTime-Rev-1.xcfg gives a
+// headerSize value of 22, but its deltaT field occupies bytes 22 and 23,
+// so the header we write is 24 bytes.
+
+static const size_t BY_EVENT_ID_HEADER(20);
+static const size_t BY_EVENT_TIME_HEADER(24);
+
+// Merged frames are big endian with a block size of one byte, so the
+// 3 byte frameSize limits their size:
+
+static const size_t MAX_MERGED_BYTES((1 << 24) - 1);
+
+// Most events that can be open at once:
+
+static const size_t MAX_OPEN_EVENTS(64);
+
+/**
+ * store
+ *    Store a big endian unsigned integer.
+ *
+ * @param p      - where it goes.
+ * @param value  - the value.
+ * @param nBytes - number of bytes it takes.
+ */
+static void
+store(uint8_t* p, uint64_t value, size_t nBytes)
+{
+    for (size_t i = nBytes; i > 0; i--) {
+        p[i-1] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/**
+ * constructor
+ *
+ * @param key         - how frames are matched to events.
+ * @param nAsads      - number of AsAds (indices 0..nAsads-1) whose frames
+ *                      make up a complete event.
+ * @param window      - for EVENT_TIME, how far (in timestamp ticks) a frame's
+ *                      eventTime may be from the event's earliest time.
+ * @param timeoutUsec - how long an event can stay open waiting for frames.
+ * @throw std::string - if nAsads is not in [1, 32].
+ */
+EventAssembler::EventAssembler(Key key, unsigned nAsads, uint64_t window, unsigned timeoutUsec) :
+    m_key(key), m_nAsads(nAsads), m_allAsads(0), m_window(window),
+    m_timeout(timeoutUsec),
+    m_headerSize(key == EVENT_IDX ? BY_EVENT_ID_HEADER : BY_EVENT_TIME_HEADER),
+    m_complete(0), m_incomplete(0), m_timeouts(0), m_overflows(0), m_duplicates(0),
+    m_missing(nAsads, 0)
+{
+    if ((nAsads == 0) || (nAsads > 32)) {
+        throw std::string("The number of AsAds in an event must be from 1 to 32");
+    }
+    for (unsigned i = 0; i < nAsads; i++) {
+        m_allAsads |= 1u << i;
+    }
+}
+/**
+ * destructor
+ *    Events not yet handed out are lost.
+ */
+EventAssembler::~EventAssembler()
+{
+    for (size_t i = 0; i < m_events.size(); i++) {
+        delete m_events[i];
+    }
+    for (size_t i = 0; i < m_free.size(); i++) {
+        delete m_free[i];
+    }
+}
+/**
+ * add
+ *    Add an AsAd frame to the event it belongs to, starting a new event if
+ *    there's none.  Events that have timed out are given up first.
+ *
+ * @param pFrame    - the frame.
+ * @param nBytes    - its size.
+ * @param key       - its eventIdx or eventTime, depending on our key.
+ * @param asad      - its asadIdx.
+ * @param timestamp - the ring item timestamp of the frame.  The merged
+ *                    frame gets the earliest of those of its frames.
+ */
+void
+EventAssembler::add(
+    const void* pFrame, size_t nBytes, uint64_t key, unsigned asad, uint64_t timestamp
+)
+{
+    timeOut();
+
+    Event* pEvent = findEvent(key, asad, nBytes);
+    if (!pEvent) {
+        if (m_events.size() >= MAX_OPEN_EVENTS) {
+            Event& oldest(*m_events.front());
+            if (!oldest.s_expired && !complete(oldest)) {
+                oldest.s_expired = true;
+                m_overflows++;
+            }
+        }
+        pEvent = newEvent(key, timestamp, pFrame);
+    }
+
+    Event& e(*pEvent);
+    size_t offset = e.s_data.size();
+    e.s_data.resize(offset + nBytes);
+    memcpy(e.s_data.data() + offset, pFrame, nBytes);
+    if (asad < 32) {
+        e.s_asads |= 1u << asad;
+    }
+    e.s_frames++;
+    if (timestamp < e.s_timestamp) e.s_timestamp = timestamp;
+    if ((m_key == EVENT_TIME) && (key < e.s_key)) e.s_key = key;
+}
+/**
+ * ready
+ *    Return the oldest event if it can be handed out: it's complete, has
+ *    timed out or has been given up.  Call pop once it's been used.
+ *
+ * @param[out] nBytes    - size of the merged frame.
+ * @param[out] timestamp - ring item timestamp for it.
+ * @return const uint8_t* - the merged frame or nullptr if the oldest event
+ *                    is still waiting for frames (or there are no events).
+ */
+const uint8_t*
+EventAssembler::ready(size_t& nBytes, uint64_t& timestamp)
+{
+    if (m_events.empty()) {
+        return nullptr;
+    }
+    Event& e(*m_events.front());
+    if (!e.s_expired && !complete(e)) {
+        return nullptr;
+    }
+    finish(e);
+    nBytes    = e.s_data.size();
+    timestamp = e.s_timestamp;
+    return e.s_data.data();
+}
+/**
+ * pop
+ *    Discard the oldest event (the one ready returned), counting it as
+ *    complete or not.
+ */
+void
+EventAssembler::pop()
+{
+    if (m_events.empty()) return;
+
+    Event* pEvent = m_events.front();
+    m_events.pop_front();
+    if (complete(*pEvent)) {
+        m_complete++;
+    } else {
+        m_incomplete++;
+        for (unsigned i = 0; i < m_nAsads; i++) {
+            if (!(pEvent->s_asads & (1u << i))) m_missing[i]++;
+        }
+    }
+    m_free.push_back(pEvent);
+}
+/**
+ * timeOut
+ *    Give up on the open events that have waited longer than the timeout
+ *    so that ready hands them out.
+ */
+void
+EventAssembler::timeOut()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < m_events.size(); i++) {
+        Event& e(*m_events[i]);
+        if (now - e.s_started < m_timeout) {
+            break;                              // Newer ones can't have timed out.
+        }
+        if (!e.s_expired && !complete(e)) {
+            e.s_expired = true;
+            m_timeouts++;
+        }
+    }
+}
+/**
+ * expire
+ *    Give up on all open events so that ready hands all of them out.
+ */
+void
+EventAssembler::expire()
+{
+    for (size_t i = 0; i < m_events.size(); i++) {
+        m_events[i]->s_expired = true;
+    }
+}
+/**
+ * logStatistics
+ *    Log how many events were complete and, for those that weren't, why
+ *    and which AsAds were missing.
+ */
+void
+EventAssembler::logStatistics()
+{
+    LOG_INFO() << "Event assembly by " << (m_key == EVENT_IDX ? "eventIdx" : "eventTime")
+        << ": " << m_complete << " complete events, " << m_incomplete << " incomplete ("
+        << m_timeouts << " timed out, " << m_overflows << " pushed out by newer events), "
+        << m_duplicates << " frames from an AsAd already in the event";
+    if (m_incomplete) {
+        for (unsigned i = 0; i < m_nAsads; i++) {
+            LOG_INFO() << "AsAd " << i << " missing from " << m_missing[i] << " events";
+        }
+    }
+}
+/**
+ * key
+ *    @param name - "eventIdx" or "eventTime".
+ *    @return Key
+ *    @throw std::string - for any other name.
+ */
+EventAssembler::Key
+EventAssembler::key(const std::string& name)
+{
+    if (name == "eventIdx")  return EVENT_IDX;
+    if (name == "eventTime") return EVENT_TIME;
+    throw std::string("Unknown event assembly key: '") + name + "'";
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * findEvent
+ *    Find the open event a frame belongs to.  The newest events are looked
+ *    at first since that's where a frame almost always goes.
+ *
+ * @param key    - the frame's eventIdx or eventTime.
+ * @param asad   - the frame's AsAd.
+ * @param nBytes - the frame's size.
+ * @return Event* - nullptr if the frame needs a new event: none matches,
+ *                  the matching event already has a frame from this AsAd
+ *                  or there's no room left in it.
+ */
+EventAssembler::Event*
+EventAssembler::findEvent(uint64_t key, unsigned asad, size_t nBytes)
+{
+    uint32_t bit = asad < 32 ? 1u << asad : 0;
+    for (size_t i = m_events.size(); i > 0; i--) {
+        Event& e(*m_events[i-1]);
+        bool match;
+        if (m_key == EVENT_IDX) {
+            match = key == e.s_key;
+        } else {
+            match = (key >= e.s_key ? key - e.s_key : e.s_key - key) <= m_window;
+        }
+        if (match) {
+            if (e.s_asads & bit) {
+                m_duplicates++;
+                return nullptr;
+            }
+            if (e.s_data.size() + nBytes > MAX_MERGED_BYTES) {
+                return nullptr;
+            }
+            return &e;
+        }
+    }
+    return nullptr;
+}
+/**
+ * newEvent
+ *    Start a new event, reusing an old one's storage if possible.  Room is
+ *    left for the merged frame header.
+ *
+ * @param key       - eventIdx or eventTime of its first frame.
+ * @param timestamp - ring item timestamp of its first frame.
+ * @param pFrame    - its first frame; the data source is taken from it.
+ * @return Event*   - the event, now the newest.
+ */
+EventAssembler::Event*
+EventAssembler::newEvent(uint64_t key, uint64_t timestamp, const void* pFrame)
+{
+    Event* pEvent;
+    if (m_free.empty()) {
+        pEvent = new Event;
+    } else {
+        pEvent = m_free.back();
+        m_free.pop_back();
+    }
+    pEvent->s_key       = key;
+    pEvent->s_timestamp = timestamp;
+    pEvent->s_asads     = 0;
+    pEvent->s_frames    = 0;
+    pEvent->s_expired   = false;
+    pEvent->s_started   = std::chrono::steady_clock::now();
+    pEvent->s_data.assign(m_headerSize, 0);
+    pEvent->s_data[4]   = static_cast<const uint8_t*>(pFrame)[4];   // dataSource.
+
+    m_events.push_back(pEvent);
+    return pEvent;
+}
+/**
+ * complete
+ *   @param event - an event.
+ *   @return bool - true if it has a frame from each of the AsAds.
+ */
+bool
+EventAssembler::complete(const Event& event) const
+{
+    return (event.s_asads & m_allAsads) == m_allAsads;
+}
+/**
+ * finish
+ *    Fill in the merged frame header of an event.
+ *
+ * @param event - the event.
+ */
+void
+EventAssembler::finish(Event& event)
+{
+    uint8_t* p = event.s_data.data();
+    p[0] = 0;                                   // Big endian, 1 byte blocks.
+    store(p + 1, event.s_data.size(), 3);       // frameSize
+    store(p + 5, m_key == EVENT_IDX ? MERGED_BY_EVENT_ID : MERGED_BY_EVENT_TIME, 2);
+    p[7] = MERGED_REVISION;
+    store(p + 8, m_headerSize, 2);              // headerSize
+    store(p + 10, 0, 2);                        // itemSize: items are frames.
+    store(p + 12, event.s_frames, 4);           // itemCount
+    if (m_key == EVENT_IDX) {
+        store(p + 16, event.s_key, 4);          // eventIdx
+    } else {
+        store(p + 16, event.s_key, 6);          // eventTime
+        store(p + 22, m_window > 0xffff ? 0xffff : m_window, 2);   // deltaT
+    }
+}
@@ -0,0 +1,116 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  EventAssembler.h
+ *  @brief: Merge the AsAd frames of one trigger into a single frame.
+ */
+#ifndef EVENTASSEMBLER_H
+#define EVENTASSEMBLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+
+/**
+ * @class EventAssembler
+ *    A CoBo sends one frame per AsAd per trigger.  The assembler groups the
+ *    frames of a trigger and wraps them in one merged frame, in the
+ *    MergedByEventId or MergedByEventTime format (see
+ *    configs/MergedDataFormats-*.xcfg): a header giving the number of frames
+ *    and the event id (or the earliest event time and the time window)
+ *    followed by the AsAd frames themselves, unchanged.
+ *
+ *    -  By event id, frames belong to the same event if their eventIdx
+ *       fields are equal.
+ *    -  By event time, a frame belongs to an event if its eventTime is
+ *       within the window of the event's earliest time.
+ *
+ *    An event is complete once a frame from each of the expected AsAds is
+ *    in it.  An event that has been open longer than the timeout, or that
+ *    is the oldest of too many open events, is given up as it is and
+ *    counted as incomplete (along with the AsAds it lacked).  Events are
+ *    handed out in the order they were started so a complete event waits
+ *    for older incomplete ones.  Timeouts are checked when frames arrive
+ *    and by timeOut, which the owner calls now and then so an event
+ *    doesn't wait for the next frame to be given up; expire gives up
+ *    everything (at the end of a run).
+ *
+ *    The assembler is not thread-safe; it belongs to a frame processor.
+ */
+class EventAssembler
+{
+public:
+    typedef enum _Key {
+        EVENT_IDX, EVENT_TIME
+    } Key;
+
+private:
+    struct Event {
+        uint64_t                              s_key;         // eventIdx or earliest eventTime.
+        uint64_t                              s_timestamp;   // Earliest ring item timestamp.
+        uint32_t                              s_asads;       // Bit per AsAd present.
+        uint32_t                              s_frames;
+        bool                                  s_expired;
+        std::chrono::steady_clock::time_point s_started;
+        std::vector<uint8_t>                  s_data;        // Header + frames.
+    };
+
+    Key                       m_key;
+    unsigned                  m_nAsads;
+    uint32_t                  m_allAsads;
+    uint64_t                  m_window;
+    std::chrono::microseconds m_timeout;
+    size_t                    m_headerSize;
+    std::deque<Event*>        m_events;        // Oldest first.
+    std::vector<Event*>       m_free;          // Recycled events.
+
+    uint64_t                  m_complete;
+    uint64_t                  m_incomplete;
+    uint64_t                  m_timeouts;
+    uint64_t                  m_overflows;
+    uint64_t                  m_duplicates;
+    std::vector<uint64_t>     m_missing;       // Per AsAd.
+
+public:
+    EventAssembler(Key key, unsigned nAsads, uint64_t window, unsigned timeoutUsec);
+    ~EventAssembler();
+
+    void           add(const void* pFrame, size_t nBytes, uint64_t key, unsigned asad,
+                       uint64_t timestamp);
+    const uint8_t* ready(size_t& nBytes, uint64_t& timestamp);
+    void           pop();
+    void           timeOut();
+    void           expire();
+
+    void logStatistics();
+
+    static Key key(const std::string& name);
+
+private:
+    EventAssembler(const EventAssembler&);
+    EventAssembler& operator=(const EventAssembler&);
+
+    Event* findEvent(uint64_t key, unsigned asad, size_t nBytes);
+    Event* newEvent(uint64_t key, uint64_t timestamp, const void* pFrame);
+    bool   complete(const Event& event) const;
+    void   finish(Event& event);
+};
+
+#endif
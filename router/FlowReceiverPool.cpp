@@ -0,0 +1,526 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  FlowReceiverPool.cpp
+ *  @brief: Implement the pool of data flow receiver threads.
+ */
+#include "FlowReceiverPool.h"
+#include "NSCLDAQDataProcessor.h"
+#include "FrameHeaderLayout.h"
+#include <get/daq/FrameStorage.h>
+#include <mfm/Common.h>
+#include <utl/Logging.h>
+#include <mdaq/DefaultPortNums.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+
+// Bytes read from a connection at a time.  This matches what the GET
+// TcpDataReceiver uses:
+
+static const size_t RECEIVE_BUFFER_SIZE(0x100000);
+
+// MFM primary header: the metaType byte holds the endianness bit and the
+// log2 of the block size; the next three bytes the frame size in blocks.
+// No frame is smaller than the primary header:
+
+static const size_t  FRAME_SIZE_OFFSET(1);
+static const size_t  FRAME_SIZE_BYTES(3);
+static const uint8_t BLOCK_SIZE_MASK(0x0f);
+static const size_t  MIN_FRAME_SIZE(8);
+
+// Most epoll events handled per wait and how long a worker waits before
+// checking whether it's been asked to stop:
+
+static const int MAX_EVENTS(64);
+static const int POLL_TIMEOUT_MS(100);
+
+// epoll user data is the endpoint index times two, plus one for the
+// data connection (vs. the listening socket):
+
+static uint64_t eventTag(size_t i, bool data)
+{
+    return (uint64_t(i) << 1) | (data ? 1 : 0);
+}
+
+/**
+ * Endpoint constructor
+ *    Starts out with no sockets and zeroed statistics.
+ */
+FlowReceiverPool::Endpoint::Endpoint() :
+    s_listenFd(-1), s_dataFd(-1), s_pInPlace(nullptr), s_fill(0),
+    s_bytes(0), s_reads(0), s_connections(0), s_rejected(0),
+    s_inPlaceFrames(0), s_copiedFrames(0)
+{}
+
+/**
+ * constructor
+ *
+ * @param nWorkers - Number of receiver threads.  Fewer are started if
+ *                   there are fewer endpoints than that.
+ */
+FlowReceiverPool::FlowReceiverPool(unsigned nWorkers) :
+    m_nWorkers(nWorkers > 0 ? nWorkers : 1), m_bufferSize(0), m_socketBuffer(0),
+    m_stop(false)
+{}
+/**
+ * destructor
+ *    Stops the workers and closes all sockets.  The processors are
+ *    destroyed along with the endpoints.
+ */
+FlowReceiverPool::~FlowReceiverPool()
+{
+    stop();
+    for (size_t i = 0; i < m_endpoints.size(); i++) {
+        close(m_endpoints[i]->s_listenFd);
+    }
+}
+/**
+ * setReceiveBuffer
+ *    Frame the received data ourselves, in place, in a buffer of this size
+ *    per endpoint (see the class comments).  Must be done before start.
+ *
+ * @param nbytes - buffer size; 0 (the default) gives the bytes to the
+ *                 processor's FrameStorage frame assembly as they come.
+ *                 It grows if a frame doesn't fit.
+ */
+void
+FlowReceiverPool::setReceiveBuffer(size_t nbytes)
+{
+    m_bufferSize = nbytes;
+}
+/**
+ * setSocketBuffer
+ *    Set the kernel receive buffer (SO_RCVBUF) of the connections to the
+ *    endpoints added from now on.  It's set on the listening socket so the
+ *    connection's TCP window is sized for it from the start.
+ *
+ * @param nbytes - buffer size; 0 (the default) leaves the system default.
+ *                 The kernel limits it to net.core.rmem_max.
+ */
+void
+FlowReceiverPool::setSocketBuffer(size_t nbytes)
+{
+    m_socketBuffer = nbytes;
+}
+/**
+ * addEndpoint
+ *    Starts listening on a new endpoint.  We listen right away so that
+ *    a bad or busy address is reported at startup.
+ *
+ * @param address    - <host>:<port> to listen on.  An empty host means
+ *                     all interfaces.
+ * @param pProcessor - Processor the data received are given to.  We
+ *                     take ownership of it.
+ */
+void
+FlowReceiverPool::addEndpoint(const std::string& address, get::daq::FrameStorage* pProcessor)
+{
+    std::unique_ptr<Endpoint> pEndpoint(new Endpoint);
+    pEndpoint->s_pProcessor.reset(pProcessor);
+    pEndpoint->s_pInPlace = dynamic_cast<NSCLDAQDataProcessor*>(pProcessor);
+    pEndpoint->s_address  = address;
+    pEndpoint->s_listenFd = listenOn(address, m_socketBuffer);
+
+    m_endpoints.push_back(std::move(pEndpoint));
+}
+/**
+ * endpointCount
+ *   @return size_t - the number of endpoints.
+ */
+size_t
+FlowReceiverPool::endpointCount() const
+{
+    return m_endpoints.size();
+}
+/**
+ * processor
+ *   @param i - an endpoint index.
+ *   @return get::daq::FrameStorage& - the processor for that endpoint.
+ */
+get::daq::FrameStorage&
+FlowReceiverPool::processor(size_t i)
+{
+    return *(m_endpoints.at(i)->s_pProcessor);
+}
+/**
+ * start
+ *    Divide the endpoints among the workers and start them.
+ */
+void
+FlowReceiverPool::start()
+{
+    if (!m_workers.empty()) return;             // Already running.
+
+    size_t nWorkers = m_nWorkers;
+    if (nWorkers > m_endpoints.size()) nWorkers = m_endpoints.size();
+
+    m_stop = false;
+    for (size_t w = 0; w < nWorkers; w++) {
+        std::unique_ptr<Worker> pWorker(new Worker);
+        pWorker->s_epollFd = epoll_create1(0);
+        if (pWorker->s_epollFd < 0) {
+            stop();
+            throw std::string("FlowReceiverPool unable to create epoll: ") + strerror(errno);
+        }
+        for (size_t i = w; i < m_endpoints.size(); i += nWorkers) {
+            epoll_event event;
+            event.events   = EPOLLIN;
+            event.data.u64 = eventTag(i, false);
+            epoll_ctl(pWorker->s_epollFd, EPOLL_CTL_ADD, m_endpoints[i]->s_listenFd, &event);
+            pWorker->s_endpoints.push_back(i);
+        }
+        m_workers.push_back(std::move(pWorker));
+    }
+    for (size_t w = 0; w < m_workers.size(); w++) {
+        Worker& worker(*m_workers[w]);
+        worker.s_thread = std::thread(&FlowReceiverPool::receive, this, std::ref(worker));
+    }
+    LOG_INFO() << "Receiving " << m_endpoints.size() << " data flows with "
+        << m_workers.size() << " threads";
+}
+/**
+ * stop
+ *    Stop the workers and drop any connections.  We keep listening so
+ *    the CoBos can connect again for the next run.
+ */
+void
+FlowReceiverPool::stop()
+{
+    m_stop = true;
+    for (size_t w = 0; w < m_workers.size(); w++) {
+        Worker& worker(*m_workers[w]);
+        if (worker.s_thread.joinable()) {
+            worker.s_thread.join();
+        }
+        for (size_t j = 0; j < worker.s_endpoints.size(); j++) {
+            disconnect(worker, worker.s_endpoints[j]);
+        }
+        close(worker.s_epollFd);
+    }
+    m_workers.clear();
+}
+/**
+ * logStatistics
+ *    Log what each endpoint received.
+ */
+void
+FlowReceiverPool::logStatistics()
+{
+    for (size_t i = 0; i < m_endpoints.size(); i++) {
+        Endpoint& e(*m_endpoints[i]);
+        uint64_t reads = e.s_reads.load(std::memory_order_relaxed);
+        uint64_t bytes = e.s_bytes.load(std::memory_order_relaxed);
+        LOG_INFO() << "Endpoint " << e.s_address << ": " << bytes << " bytes in "
+            << reads << " reads (" << (reads ? bytes/reads : 0) << " bytes/read), "
+            << e.s_connections << " connections, "
+            << e.s_rejected << " extra connections refused";
+        if (m_bufferSize) {
+            LOG_INFO() << "Endpoint " << e.s_address << ": " << e.s_inPlaceFrames
+                << " frames processed in place, " << e.s_copiedFrames << " copied";
+        }
+    }
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * receive
+ *    A worker thread.  Waits for connections to and data from the
+ *    worker's endpoints.  Each readable connection gets one read per
+ *    wakeup so a busy CoBo can't starve the others.
+ *
+ * @param worker - the worker we are.
+ */
+void
+FlowReceiverPool::receive(Worker& worker)
+{
+    std::vector<uint8_t> buffer(RECEIVE_BUFFER_SIZE);
+    epoll_event events[MAX_EVENTS];
+
+    while (!m_stop) {
+        int n = epoll_wait(worker.s_epollFd, events, MAX_EVENTS, POLL_TIMEOUT_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR() << "FlowReceiverPool epoll_wait failed: " << strerror(errno);
+            return;
+        }
+        for (int e = 0; e < n; e++) {
+            size_t i    = events[e].data.u64 >> 1;
+            bool   data = (events[e].data.u64 & 1) != 0;
+            if (data && m_bufferSize) {
+                readFrames(worker, i);
+            } else if (data) {
+                read(worker, i, buffer.data(), buffer.size());
+            } else {
+                accept(worker, i);
+            }
+        }
+    }
+}
+/**
+ * accept
+ *    Accept a connection on an endpoint.  If the endpoint already has a
+ *    connection, the new one is refused; interleaving two streams would
+ *    scramble the frames.
+ *
+ * @param worker - the worker servicing the endpoint.
+ * @param i      - the endpoint index.
+ */
+void
+FlowReceiverPool::accept(Worker& worker, size_t i)
+{
+    Endpoint& e(*m_endpoints[i]);
+    int fd = ::accept(e.s_listenFd, nullptr, nullptr);
+    if (fd < 0) {
+        LOG_WARN() << "Accept failed on " << e.s_address << ": " << strerror(errno);
+        return;
+    }
+    if (e.s_dataFd >= 0) {
+        LOG_WARN() << "Refusing a second connection to " << e.s_address;
+        e.s_rejected++;
+        close(fd);
+        return;
+    }
+    epoll_event event;
+    event.events   = EPOLLIN;
+    event.data.u64 = eventTag(i, true);
+    if (epoll_ctl(worker.s_epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        LOG_ERROR() << "Unable to poll connection to " << e.s_address << ": "
+            << strerror(errno);
+        close(fd);
+        return;
+    }
+    if (m_bufferSize && (e.s_buffer.size() < m_bufferSize)) {
+        e.s_buffer.resize(m_bufferSize);
+    }
+    e.s_fill   = 0;
+    e.s_dataFd = fd;
+    e.s_connections++;
+    LOG_INFO() << "Data flow connected to " << e.s_address;
+}
+/**
+ * read
+ *    Read what's available from an endpoint's connection and give it to
+ *    the endpoint's processor which assembles it into frames.
+ *
+ * @param worker  - the worker servicing the endpoint.
+ * @param i       - the endpoint index.
+ * @param pBuffer - where to read.
+ * @param nBytes  - size of the buffer.
+ */
+void
+FlowReceiverPool::read(Worker& worker, size_t i, uint8_t* pBuffer, size_t nBytes)
+{
+    Endpoint& e(*m_endpoints[i]);
+    ssize_t n = ::read(e.s_dataFd, pBuffer, nBytes);
+    if (received(worker, i, n)) {
+        try {
+            e.s_pProcessor->addDataChunk(
+                reinterpret_cast<const mfm::Byte*>(pBuffer),
+                reinterpret_cast<const mfm::Byte*>(pBuffer + n)
+            );
+        }
+        catch (std::exception& err) {
+            LOG_ERROR() << "Dropping data flow to " << e.s_address << ": " << err.what();
+            disconnect(worker, i);
+        }
+    }
+}
+/**
+ * readFrames
+ *    Read what's available from an endpoint's connection into the space
+ *    after the partial frame in its buffer.  Each complete frame in the
+ *    buffer is then processed where it lies if the processor can take it
+ *    that way, and otherwise given to the processor's frame assembly as a
+ *    whole.  What's left of a partial frame is moved to the front of the
+ *    buffer; it's at most one frame, so the move is cheap compared with
+ *    copying every byte.
+ *
+ * @param worker  - the worker servicing the endpoint.
+ * @param i       - the endpoint index.
+ */
+void
+FlowReceiverPool::readFrames(Worker& worker, size_t i)
+{
+    Endpoint& e(*m_endpoints[i]);
+    uint8_t* pBuffer = e.s_buffer.data();
+    ssize_t n = recv(e.s_dataFd, pBuffer + e.s_fill, e.s_buffer.size() - e.s_fill, 0);
+    if (!received(worker, i, n)) {
+        return;
+    }
+    e.s_fill += n;
+    
+    size_t used   = 0;
+    size_t needed = 0;                      // Size of the partial frame.
+    try {
+        while (e.s_fill - used >= FRAME_SIZE_OFFSET + FRAME_SIZE_BYTES) {
+            const uint8_t* pFrame = pBuffer + used;
+            size_t nbytes = frameSize(pFrame);
+            if (nbytes < MIN_FRAME_SIZE) {
+                throw std::runtime_error("frame header gives an impossible frame size");
+            }
+            if (nbytes > e.s_fill - used) {
+                needed = nbytes;
+                break;
+            }
+            if (e.s_pInPlace && e.s_pInPlace->processFrameBytes(pFrame, nbytes)) {
+                e.s_inPlaceFrames.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                e.s_pProcessor->addDataChunk(
+                    reinterpret_cast<const mfm::Byte*>(pFrame),
+                    reinterpret_cast<const mfm::Byte*>(pFrame + nbytes)
+                );
+                e.s_copiedFrames.fetch_add(1, std::memory_order_relaxed);
+            }
+            used += nbytes;
+        }
+    }
+    catch (std::exception& err) {
+        LOG_ERROR() << "Dropping data flow to " << e.s_address << ": " << err.what();
+        disconnect(worker, i);
+        return;
+    }
+    if (used) {
+        memmove(pBuffer, pBuffer + used, e.s_fill - used);
+        e.s_fill -= used;
+    }
+    if (needed > e.s_buffer.size()) {
+        e.s_buffer.resize(needed);
+    }
+}
+/**
+ * received
+ *    Account for a read from an endpoint's connection and, if it failed or
+ *    the connection closed, drop the connection.
+ *
+ * @param worker - the worker servicing the endpoint.
+ * @param i      - the endpoint index.
+ * @param n      - what read returned.
+ * @return bool  - true if bytes were read.
+ */
+bool
+FlowReceiverPool::received(Worker& worker, size_t i, ssize_t n)
+{
+    Endpoint& e(*m_endpoints[i]);
+    if (n > 0) {
+        e.s_bytes.fetch_add(n, std::memory_order_relaxed);
+        e.s_reads.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    if (n == 0) {
+        LOG_INFO() << "Data flow to " << e.s_address << " closed";
+        disconnect(worker, i);
+    } else if ((errno != EINTR) && (errno != EAGAIN)) {
+        LOG_WARN() << "Read failed on " << e.s_address << ": " << strerror(errno);
+        disconnect(worker, i);
+    }
+    return false;
+}
+/**
+ * disconnect
+ *    Close an endpoint's connection if it has one.
+ *
+ * @param worker - the worker servicing the endpoint.
+ * @param i      - the endpoint index.
+ */
+void
+FlowReceiverPool::disconnect(Worker& worker, size_t i)
+{
+    Endpoint& e(*m_endpoints[i]);
+    if (e.s_dataFd >= 0) {
+        epoll_ctl(worker.s_epollFd, EPOLL_CTL_DEL, e.s_dataFd, nullptr);
+        close(e.s_dataFd);
+        e.s_dataFd = -1;
+    }
+    if (e.s_fill) {
+        LOG_WARN() << "Discarding " << e.s_fill << " bytes of a partial frame from "
+            << e.s_address;
+        e.s_fill = 0;
+    }
+}
+/**
+ * frameSize
+ *    @param pFrame - start of a frame; at least its first four bytes.
+ *    @return size_t - the frame size in bytes from its primary header.
+ */
+size_t
+FlowReceiverPool::frameSize(const uint8_t* pFrame)
+{
+    size_t blockSize = size_t(1) << (pFrame[0] & BLOCK_SIZE_MASK);
+    return blockSize * NSCLGET::FrameHeaderLayout::load(
+        pFrame + FRAME_SIZE_OFFSET, FRAME_SIZE_BYTES,
+        NSCLGET::FrameHeaderLayout::bigEndian(pFrame)
+    );
+}
+/**
+ * listenOn
+ *    Create a socket listening on an endpoint.
+ *
+ * @param address      - <host>:<port>; either may be empty.  The port
+ *                       defaults to the GET data router's.
+ * @param socketBuffer - SO_RCVBUF for the connections; 0 leaves the default.
+ * @return int          - the listening socket.
+ * @throw std::string if the address is bad or can't be listened on.
+ */
+int
+FlowReceiverPool::listenOn(const std::string& address, int socketBuffer)
+{
+    std::string host = address;
+    std::string port = std::to_string(::mdaq::Default::dataRouterFlowPortNum);
+    size_t colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        host = address.substr(0, colon);
+        if (colon + 1 < address.size()) port = address.substr(colon + 1);
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    addrinfo* pInfo;
+    int status = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &pInfo);
+    if (status) {
+        throw std::string("Bad data flow endpoint '") + address + "': " + gai_strerror(status);
+    }
+
+    int fd = socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+    int on = 1;
+    if ((fd < 0)
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+        || (socketBuffer &&
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &socketBuffer, sizeof(socketBuffer)))
+        || bind(fd, pInfo->ai_addr, pInfo->ai_addrlen)
+        || listen(fd, 1)) {
+        std::string msg = std::string("Unable to listen on '") + address + "': " + strerror(errno);
+        if (fd >= 0) close(fd);
+        freeaddrinfo(pInfo);
+        throw msg;
+    }
+    freeaddrinfo(pInfo);
+    return fd;
+}
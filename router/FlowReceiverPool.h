@@ -0,0 +1,128 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  FlowReceiverPool.h
+ *  @brief: Receive several CoBo TCP data flows with a few threads.
+ */
+#ifndef FLOWRECEIVERPOOL_H
+#define FLOWRECEIVERPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+namespace get {
+    namespace daq {
+        class FrameStorage;
+    }
+}
+class NSCLDAQDataProcessor;
+
+/**
+ * @class FlowReceiverPool
+ *    The GET TcpDataReceiver dedicates a thread (and a process, since a
+ *    data router has one receiver) to each CoBo.  With many CoBos that's
+ *    many processes, each with its own ring.
+ *
+ *    A FlowReceiverPool instead listens on any number of data flow
+ *    endpoints and services all of them from a fixed number of worker
+ *    threads using epoll.  Each endpoint has its own frame processor
+ *    (normally an NSCLDAQDataProcessor with its own source id) that
+ *    the received bytes are fed to.  Each endpoint is serviced by
+ *    exactly one worker so its processor only ever sees one thread.
+ *
+ *    An endpoint accepts one connection at a time; a CoBo only makes one.
+ *    Bytes received and connection counts are kept per endpoint.
+ *
+ *    Normally each read goes through the processor's FrameStorage frame
+ *    assembly which copies the bytes into a frame.  With a receive buffer
+ *    size set (setReceiveBuffer), each endpoint instead reads into a large
+ *    buffer of its own, finds the frames in it from their MFM primary
+ *    headers and hands each complete frame, where it lies, to its
+ *    NSCLDAQDataProcessor (processFrameBytes).  The partial frame at the
+ *    end of the buffer is moved to its start for the next read.  Frames the
+ *    processor can't take that way yet (the first of each revision) go
+ *    through addDataChunk one whole frame at a time, so the frame assembly
+ *    never holds a partial frame.  The kernel's socket receive buffer can
+ *    be enlarged too (setSocketBuffer) so a CoBo isn't held back while the
+ *    worker is busy with other flows.
+ */
+class FlowReceiverPool
+{
+private:
+    struct Endpoint {
+        std::string s_address;
+        int         s_listenFd;
+        int         s_dataFd;               // -1 if not connected.
+        std::unique_ptr<get::daq::FrameStorage> s_pProcessor;
+        NSCLDAQDataProcessor*  s_pInPlace;  // s_pProcessor if it takes frames in place.
+        std::vector<uint8_t>   s_buffer;    // With a receive buffer size.
+        size_t                 s_fill;
+        std::atomic<uint64_t> s_bytes;
+        std::atomic<uint64_t> s_reads;
+        std::atomic<uint64_t> s_connections;
+        std::atomic<uint64_t> s_rejected;
+        std::atomic<uint64_t> s_inPlaceFrames;
+        std::atomic<uint64_t> s_copiedFrames;
+        Endpoint();
+    };
+    struct Worker {
+        int                    s_epollFd;
+        std::vector<size_t>    s_endpoints;  // Indices into m_endpoints.
+        std::thread            s_thread;
+    };
+
+    std::vector<std::unique_ptr<Endpoint> > m_endpoints;
+    std::vector<std::unique_ptr<Worker> >   m_workers;
+    unsigned                                m_nWorkers;
+    size_t                                  m_bufferSize;     // 0: FrameStorage assembly.
+    int                                     m_socketBuffer;   // 0: system default.
+    std::atomic<bool>                       m_stop;
+
+public:
+    FlowReceiverPool(unsigned nWorkers);
+    ~FlowReceiverPool();
+
+    void   setReceiveBuffer(size_t nbytes);
+    void   setSocketBuffer(size_t nbytes);
+    void   addEndpoint(const std::string& address, get::daq::FrameStorage* pProcessor);
+    size_t endpointCount() const;
+    get::daq::FrameStorage& processor(size_t i);
+
+    void start();
+    void stop();
+    void logStatistics();
+
+private:
+    FlowReceiverPool(const FlowReceiverPool&);
+    FlowReceiverPool& operator=(const FlowReceiverPool&);
+
+    void receive(Worker& worker);
+    void accept(Worker& worker, size_t i);
+    void read(Worker& worker, size_t i, uint8_t* pBuffer, size_t nBytes);
+    void readFrames(Worker& worker, size_t i);
+    bool received(Worker& worker, size_t i, ssize_t n);
+    void disconnect(Worker& worker, size_t i);
+    static size_t frameSize(const uint8_t* pFrame);
+    static int listenOn(const std::string& address, int socketBuffer);
+};
+
+#endif
@@ -0,0 +1,368 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  FrameJournal.cpp
+ *  @brief: Implement the memory mapped frame journal.
+ */
+#include "FrameJournal.h"
+#include "FrameQueue.h"
+#include <utl/Logging.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+// Identifies a segment file ("GETJ" little endian):
+
+static const uint32_t SEGMENT_MAGIC(0x4a544547);
+
+/**
+ * constructor
+ *    Recovers any segments an earlier journal with the same prefix
+ *    left behind.
+ *
+ * @param prefix       - Path and start of the name of segment files.
+ * @param maxBytes     - Most disk the journal can use.  At least two
+ *                       segments are allowed regardless.
+ * @param segmentBytes - Size of each segment file.
+ */
+FrameJournal::FrameJournal(const std::string& prefix, size_t maxBytes, size_t segmentBytes) :
+    m_prefix(prefix), m_maxSegments(segmentBytes ? maxBytes/segmentBytes : 0),
+    m_segmentBytes(segmentBytes), m_nextSequence(0),
+    m_frames(0), m_bytes(0), m_appended(0), m_recovered(0), m_maxUsed(0)
+{
+    if (m_maxSegments < 2) m_maxSegments = 2;
+    if (m_segmentBytes < 2*sizeof(SegmentHeader)) m_segmentBytes = 2*sizeof(SegmentHeader);
+    recover();
+}
+/**
+ * destructor
+ *    Segments still holding frames are left on disk to be recovered
+ *    later; empty ones are deleted.
+ */
+FrameJournal::~FrameJournal()
+{
+    while (!m_segments.empty()) {
+        Segment& s(m_segments.front());
+        if (s.s_pHeader->s_readOffset >= s.s_pHeader->s_writeOffset) {
+            removeSegment();
+        } else {
+            s.s_pHeader->s_sealed = 1;
+            unmapSegment(s);
+            m_segments.pop_front();
+        }
+    }
+}
+/**
+ * append
+ *    Add a frame to the end of the journal.
+ *
+ * @param record - describes the frame.
+ * @param pFrame - the frame.
+ * @return bool  - false if the journal is full (or the frame is bigger
+ *                 than a segment) and the frame was not added.
+ */
+bool
+FrameJournal::append(const FrameRecord& record, const void* pFrame)
+{
+    size_t nBytes = recordSize(record.s_frameSize);
+    if (nBytes > m_segmentBytes - sizeof(SegmentHeader)) {
+        return false;
+    }
+    if (m_segments.empty() || m_segments.back().s_pHeader->s_sealed
+        || (m_segments.back().s_pHeader->s_writeOffset + nBytes
+            > m_segments.back().s_pHeader->s_size)) {
+        if (!m_segments.empty() && !m_segments.back().s_pHeader->s_sealed) {
+            Segment& full(m_segments.back());
+            full.s_pHeader->s_sealed = 1;
+            msync(full.s_pBase, full.s_pHeader->s_size, MS_ASYNC);
+        }
+        if ((m_segments.size() >= m_maxSegments) || !addSegment()) {
+            return false;
+        }
+    }
+
+    Segment& s(m_segments.back());
+    FrameRecord* pRecord =
+        reinterpret_cast<FrameRecord*>(s.s_pBase + s.s_pHeader->s_writeOffset);
+    *pRecord = record;
+    pRecord->s_recordSize = nBytes;
+    memcpy(pRecord + 1, pFrame, record.s_frameSize);
+    s.s_pHeader->s_writeOffset += nBytes;     // Only now is the frame there.
+
+    m_frames++;
+    m_bytes += record.s_frameSize;
+    m_appended++;
+    return true;
+}
+/**
+ * front
+ *    @return const FrameRecord* - the oldest frame in the journal, which
+ *                    is immediately followed by the frame bytes.  nullptr
+ *                    if the journal is empty.
+ */
+const FrameRecord*
+FrameJournal::front()
+{
+    while (!m_segments.empty()) {
+        Segment& s(m_segments.front());
+        if (s.s_pHeader->s_readOffset < s.s_pHeader->s_writeOffset) {
+            return reinterpret_cast<const FrameRecord*>(s.s_pBase + s.s_pHeader->s_readOffset);
+        }
+        if (!s.s_pHeader->s_sealed) {
+            return nullptr;
+        }
+        removeSegment();
+    }
+    return nullptr;
+}
+/**
+ * pop
+ *    Remove the oldest frame from the journal.  An emptied segment is
+ *    deleted unless it's the one being written, in which case it's
+ *    reused from the start.
+ */
+void
+FrameJournal::pop()
+{
+    const FrameRecord* pRecord = front();
+    if (!pRecord) return;
+
+    Segment& s(m_segments.front());
+    m_frames--;
+    m_bytes -= pRecord->s_frameSize;
+    s.s_pHeader->s_readOffset += pRecord->s_recordSize;
+
+    if (s.s_pHeader->s_readOffset >= s.s_pHeader->s_writeOffset) {
+        if (s.s_pHeader->s_sealed) {
+            removeSegment();
+        } else {
+            s.s_pHeader->s_writeOffset = sizeof(SegmentHeader);
+            s.s_pHeader->s_readOffset  = sizeof(SegmentHeader);
+        }
+    }
+}
+/**
+ * empty
+ *   @return bool - true if there are no frames in the journal.
+ */
+bool
+FrameJournal::empty() const
+{
+    return m_frames == 0;
+}
+/**
+ * frames
+ *   @return uint64_t - number of frames in the journal.
+ */
+uint64_t
+FrameJournal::frames() const
+{
+    return m_frames;
+}
+/**
+ * bytes
+ *   @return uint64_t - bytes of frames in the journal.
+ */
+uint64_t
+FrameJournal::bytes() const
+{
+    return m_bytes;
+}
+/**
+ * logStatistics
+ *    Log how much use the journal got.
+ */
+void
+FrameJournal::logStatistics()
+{
+    LOG_INFO() << "Journal " << m_prefix << ": " << m_appended << " frames journaled, "
+        << m_recovered << " recovered from an earlier run, " << m_frames
+        << " still journaled; at most " << m_maxUsed << " of " << m_maxSegments
+        << " segments of " << m_segmentBytes << " bytes used";
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * recover
+ *    Find and map the segments left behind by an earlier journal with our
+ *    prefix.  They are taken oldest first and sealed.  Segments that don't
+ *    look like ours are left alone.
+ */
+void
+FrameJournal::recover()
+{
+    std::string pattern = m_prefix + "-journal-*.seg";
+    glob_t found;
+    if (glob(pattern.c_str(), 0, nullptr, &found) != 0) {
+        return;                              // Nothing there.
+    }
+    for (size_t i = 0; i < found.gl_pathc; i++) {
+        Segment s;
+        s.s_path = found.gl_pathv[i];
+        s.s_fd   = open(s.s_path.c_str(), O_RDWR);
+        struct stat info;
+        if ((s.s_fd < 0) || fstat(s.s_fd, &info) || (size_t(info.st_size) < sizeof(SegmentHeader))
+            || !mapSegment(s, info.st_size)) {
+            LOG_WARN() << "Ignoring journal segment " << s.s_path;
+            if (s.s_fd >= 0) close(s.s_fd);
+            continue;
+        }
+        SegmentHeader& h(*s.s_pHeader);
+        if ((h.s_magic != SEGMENT_MAGIC) || (h.s_size != uint64_t(info.st_size))
+            || (h.s_readOffset < sizeof(SegmentHeader)) || (h.s_readOffset > h.s_writeOffset)
+            || (h.s_writeOffset > h.s_size)) {
+            LOG_WARN() << "Ignoring journal segment " << s.s_path << "; its header is bad";
+            unmapSegment(s);
+            continue;
+        }
+
+        // Count the frames.  If a record is damaged, what follows it is lost.
+        // Arrival times from the earlier process mean nothing to this one,
+        // so the frames are marked untimed.
+
+        uint64_t offset = h.s_readOffset;
+        while (offset < h.s_writeOffset) {
+            FrameRecord* pRecord = reinterpret_cast<FrameRecord*>(s.s_pBase + offset);
+            if ((pRecord->s_recordSize < recordSize(pRecord->s_frameSize))
+                || (offset + pRecord->s_recordSize > h.s_writeOffset)) {
+                LOG_WARN() << "Journal segment " << s.s_path << " is damaged at offset "
+                    << offset << "; frames after that are lost";
+                h.s_writeOffset = offset;
+                break;
+            }
+            pRecord->s_received = 0;
+            m_frames++;
+            m_bytes += pRecord->s_frameSize;
+            m_recovered++;
+            offset  += pRecord->s_recordSize;
+        }
+        h.s_sealed = 1;
+        if (h.s_sequence >= m_nextSequence) m_nextSequence = h.s_sequence + 1;
+        m_segments.push_back(s);
+    }
+    globfree(&found);
+
+    if (m_recovered) {
+        LOG_INFO() << "Recovered " << m_recovered << " frames from " << m_segments.size()
+            << " journal segments of an earlier run";
+    }
+}
+/**
+ * addSegment
+ *    Make a new segment to append to.  The file's space is allocated up
+ *    front so that a full disk shows up here rather than as a bus error
+ *    when the mapped memory is written.
+ *
+ * @return bool - false if the segment could not be made.  The reason is
+ *                logged.
+ */
+bool
+FrameJournal::addSegment()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "-journal-%010llu.seg", (unsigned long long)m_nextSequence);
+
+    Segment s;
+    s.s_path = m_prefix + name;
+    s.s_fd   = open(s.s_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int status = s.s_fd < 0 ? errno : posix_fallocate(s.s_fd, 0, m_segmentBytes);
+    if (status || !mapSegment(s, m_segmentBytes)) {
+        LOG_ERROR() << "Unable to create journal segment " << s.s_path << ": "
+            << strerror(status ? status : errno);
+        if (s.s_fd >= 0) {
+            close(s.s_fd);
+            unlink(s.s_path.c_str());
+        }
+        return false;
+    }
+
+    SegmentHeader& h(*s.s_pHeader);
+    memset(&h, 0, sizeof(h));
+    h.s_magic       = SEGMENT_MAGIC;
+    h.s_headerSize  = sizeof(SegmentHeader);
+    h.s_sequence    = m_nextSequence++;
+    h.s_size        = m_segmentBytes;
+    h.s_writeOffset = sizeof(SegmentHeader);
+    h.s_readOffset  = sizeof(SegmentHeader);
+
+    m_segments.push_back(s);
+    if (m_segments.size() > m_maxUsed) m_maxUsed = m_segments.size();
+    return true;
+}
+/**
+ * removeSegment
+ *    Delete the oldest segment.
+ */
+void
+FrameJournal::removeSegment()
+{
+    Segment& s(m_segments.front());
+    std::string path = s.s_path;
+    unmapSegment(s);
+    unlink(path.c_str());
+    m_segments.pop_front();
+}
+/**
+ * mapSegment
+ *    Map a segment file into memory.
+ *
+ * @param segment - the segment; its file must be open.
+ * @param size    - size of the file.
+ * @return bool   - false if the map failed.
+ */
+bool
+FrameJournal::mapSegment(Segment& segment, size_t size)
+{
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment.s_fd, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    segment.s_pBase   = static_cast<uint8_t*>(p);
+    segment.s_mapSize = size;
+    segment.s_pHeader = reinterpret_cast<SegmentHeader*>(p);
+    return true;
+}
+/**
+ * unmapSegment
+ *    Unmap and close a segment file.
+ *
+ * @param segment - the segment.
+ */
+void
+FrameJournal::unmapSegment(Segment& segment)
+{
+    munmap(segment.s_pBase, segment.s_mapSize);
+    close(segment.s_fd);
+}
+/**
+ * recordSize
+ *    @param frameBytes - size of a frame.
+ *    @return size_t - space the frame takes in a segment.
+ */
+size_t
+FrameJournal::recordSize(size_t frameBytes)
+{
+    return (sizeof(FrameRecord) + frameBytes + 7) & ~size_t(7);
+}
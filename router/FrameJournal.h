@@ -0,0 +1,110 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  FrameJournal.h
+ *  @brief: Memory mapped, file backed FIFO of frames.
+ */
+#ifndef FRAMEJOURNAL_H
+#define FRAMEJOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+
+struct FrameRecord;
+
+/**
+ * @class FrameJournal
+ *    Holds frames that can't go into the ring right now so they can be
+ *    put there, in order, once there's room.  The journal is a sequence
+ *    of fixed size segment files, each memory mapped.  Frames are
+ *    appended to the newest segment and taken from the oldest.  A segment
+ *    is deleted once it has been emptied.
+ *
+ *    Each segment starts with a header that records how much has been
+ *    written to and read from it.  The header's write offset is only
+ *    advanced once a frame is completely in the segment so, if the router
+ *    dies, the segments left behind hold exactly the frames that had not
+ *    been put in the ring.  A new journal with the same name prefix
+ *    recovers those segments and gives up their frames before any new ones.
+ *
+ *    Segment files are named <prefix>-journal-<sequence>.seg.
+ *    Frames are stored as FrameRecord + frame, padded to 8 bytes, just
+ *    as in a FrameQueue.
+ *
+ *    The journal is not thread-safe.
+ */
+class FrameJournal
+{
+private:
+    struct SegmentHeader {
+        uint32_t s_magic;
+        uint32_t s_headerSize;
+        uint64_t s_sequence;
+        uint64_t s_size;               // Of the whole segment file.
+        uint64_t s_writeOffset;        // Frames end here.
+        uint64_t s_readOffset;         // Next frame to give up is here.
+        uint32_t s_sealed;             // Nonzero if no more will be written.
+        uint32_t s_unused[5];
+    };
+    struct Segment {
+        std::string    s_path;
+        int            s_fd;
+        uint8_t*       s_pBase;
+        size_t         s_mapSize;
+        SegmentHeader* s_pHeader;
+    };
+
+    std::string         m_prefix;
+    size_t              m_maxSegments;
+    size_t              m_segmentBytes;
+    uint64_t            m_nextSequence;
+    std::deque<Segment> m_segments;
+
+    uint64_t            m_frames;      // Frames in the journal now.
+    uint64_t            m_bytes;       // Bytes of frames in it now.
+    uint64_t            m_appended;
+    uint64_t            m_recovered;
+    size_t              m_maxUsed;     // Most segments in use at once.
+
+public:
+    FrameJournal(const std::string& prefix, size_t maxBytes, size_t segmentBytes);
+    ~FrameJournal();
+
+    bool               append(const FrameRecord& record, const void* pFrame);
+    const FrameRecord* front();
+    void               pop();
+
+    bool     empty()  const;
+    uint64_t frames() const;
+    uint64_t bytes()  const;
+    void     logStatistics();
+
+private:
+    FrameJournal(const FrameJournal&);
+    FrameJournal& operator=(const FrameJournal&);
+
+    void recover();
+    bool addSegment();
+    void removeSegment();
+    bool mapSegment(Segment& segment, size_t size);
+    static void unmapSegment(Segment& segment);
+    static size_t recordSize(size_t frameBytes);
+};
+
+#endif
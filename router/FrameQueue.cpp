@@ -0,0 +1,239 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  FrameQueue.cpp
+ *  @brief: Implements the single producer/single consumer frame queue.
+ */
+#include "FrameQueue.h"
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+
+/**
+ * constructor
+ *
+ * @param nbytes - size of the queue.  This is rounded up to a multiple
+ *                 of 8 bytes.
+ */
+FrameQueue::FrameQueue(size_t nbytes) :
+    m_storage((nbytes + sizeof(uint64_t) - 1)/sizeof(uint64_t)),
+    m_head(0), m_popped(0), m_tail(0), m_pushed(0), m_pendingSize(0),
+    m_highWater(0), m_stalls(0), m_stallNs(0)
+{
+    m_pBuffer  = reinterpret_cast<uint8_t*>(m_storage.data());
+    m_capacity = m_storage.size() * sizeof(uint64_t);
+}
+
+/**
+ * reserve
+ *    Reserve space for a frame.  The record's size is filled in; the caller
+ *    fills in the rest of the record and the frame that follows it, then
+ *    calls publish.
+ *
+ * @param frameBytes - size of the frame.
+ * @return FrameRecord* - the record to fill in or nullptr if the queue does
+ *                  not have room just now.
+ * @throw std::length_error - the frame could never fit.
+ */
+FrameRecord*
+FrameQueue::reserve(size_t frameBytes)
+{
+    size_t need = recordSize(frameBytes);
+    if (need > m_capacity) {
+        throw std::length_error("Frame is larger than the frame queue");
+    }
+    size_t tail  = m_tail.load(std::memory_order_relaxed);
+    size_t pos   = tail % m_capacity;
+    size_t toEnd = m_capacity - pos;
+    size_t pad   = (toEnd < need) ? toEnd : 0;
+    size_t head  = m_head.load(std::memory_order_acquire);
+
+    if ((m_capacity - (tail - head)) < (pad + need)) {
+        if (pad && (head == tail)) {
+            // Empty, but the record's too big to go in after the wrap
+            // marker without overwriting it.  Publish the marker alone;
+            // once the consumer's skipped it the whole buffer is free.
+
+            *reinterpret_cast<uint32_t*>(m_pBuffer + pos) = 0;
+            m_tail.store(tail + pad, std::memory_order_release);
+        }
+        return nullptr;
+    }
+    if (pad) {
+        *reinterpret_cast<uint32_t*>(m_pBuffer + pos) = 0;   // Wrap marker.
+        pos = 0;
+    }
+    m_pendingSize = pad + need;
+
+    FrameRecord* pRecord = reinterpret_cast<FrameRecord*>(m_pBuffer + pos);
+    pRecord->s_recordSize = need;
+    pRecord->s_frameSize  = frameBytes;
+    return pRecord;
+}
+/**
+ * reserveWait
+ *    Same as reserve but waits for room.  Time spent waiting is
+ *    counted as stall time.
+ *
+ * @param frameBytes - size of the frame.
+ * @return FrameRecord* - the record to fill in.
+ */
+FrameRecord*
+FrameQueue::reserveWait(size_t frameBytes)
+{
+    FrameRecord* pRecord = reserve(frameBytes);
+    if (pRecord) return pRecord;
+
+    auto start = std::chrono::steady_clock::now();
+    while (!(pRecord = reserve(frameBytes))) {
+        std::this_thread::sleep_for(std::chrono::microseconds(10));
+    }
+    auto waited = std::chrono::steady_clock::now() - start;
+    m_stalls.fetch_add(1, std::memory_order_relaxed);
+    m_stallNs.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count(),
+        std::memory_order_relaxed
+    );
+    return pRecord;
+}
+/**
+ * publish
+ *    Make the record from the last reserve visible to the consumer.
+ */
+void
+FrameQueue::publish()
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed) + m_pendingSize;
+    m_tail.store(tail, std::memory_order_release);
+    m_pushed.fetch_add(1, std::memory_order_relaxed);
+
+    size_t depth = tail - m_head.load(std::memory_order_relaxed);
+    if (depth > m_highWater.load(std::memory_order_relaxed)) {
+        m_highWater.store(depth, std::memory_order_relaxed);
+    }
+}
+/**
+ * front
+ *    @return const FrameRecord* - the oldest record in the queue or nullptr
+ *                  if the queue is empty.  The frame follows the record.
+ */
+const FrameRecord*
+FrameQueue::front()
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t tail = m_tail.load(std::memory_order_acquire);
+    if (head == tail) return nullptr;
+
+    size_t pos = head % m_capacity;
+    if (*reinterpret_cast<uint32_t*>(m_pBuffer + pos) == 0) {
+        head += m_capacity - pos;                   // Skip the wrap marker.
+        m_head.store(head, std::memory_order_release);
+        if (head == tail) return nullptr;           // It was alone.
+        pos = 0;
+    }
+    return reinterpret_cast<const FrameRecord*>(m_pBuffer + pos);
+}
+/**
+ * pop
+ *    Remove the record most recently returned by front.
+ */
+void
+FrameQueue::pop()
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    const FrameRecord* pRecord =
+        reinterpret_cast<const FrameRecord*>(m_pBuffer + (head % m_capacity));
+    m_head.store(head + pRecord->s_recordSize, std::memory_order_release);
+    m_popped.fetch_add(1, std::memory_order_relaxed);
+}
+/**
+ * empty
+ *   @return bool - true if there are no records in the queue.
+ */
+bool
+FrameQueue::empty() const
+{
+    return m_head.load(std::memory_order_acquire) ==
+        m_tail.load(std::memory_order_acquire);
+}
+/**
+ * capacity
+ *   @return size_t - queue size in bytes.
+ */
+size_t
+FrameQueue::capacity() const
+{
+    return m_capacity;
+}
+/**
+ * depth
+ *   @return size_t - bytes currently in the queue.
+ */
+size_t
+FrameQueue::depth() const
+{
+    return m_tail.load(std::memory_order_relaxed) -
+        m_head.load(std::memory_order_relaxed);
+}
+/**
+ * records
+ *    @return uint64_t - frames currently in the queue.
+ */
+uint64_t
+FrameQueue::records() const
+{
+    return m_pushed.load(std::memory_order_relaxed) -
+        m_popped.load(std::memory_order_relaxed);
+}
+/**
+ * highWater
+ *   @return size_t - most bytes that have been in the queue.
+ */
+size_t
+FrameQueue::highWater() const
+{
+    return m_highWater.load(std::memory_order_relaxed);
+}
+/**
+ * stalls
+ *    @return uint64_t - number of times the producer found the queue full.
+ */
+uint64_t
+FrameQueue::stalls() const
+{
+    return m_stalls.load(std::memory_order_relaxed);
+}
+/**
+ * stallNs
+ *    @return uint64_t - total nanoseconds the producer waited for room.
+ */
+uint64_t
+FrameQueue::stallNs() const
+{
+    return m_stallNs.load(std::memory_order_relaxed);
+}
+/**
+ * recordSize
+ *   @param frameBytes - size of a frame.
+ *   @return size_t    - size of the record needed to hold it.
+ */
+size_t
+FrameQueue::recordSize(size_t frameBytes)
+{
+    size_t n = sizeof(FrameRecord) + frameBytes;
+    return (n + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
@@ -0,0 +1,108 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  FrameQueue.h
+ *  @brief: Bounded, lock-free single producer/single consumer frame queue.
+ */
+#ifndef FRAMEQUEUE_H
+#define FRAMEQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+/**
+ * Each frame in the queue is preceded by one of these.  The frame bytes
+ * immediately follow the record.  Records are padded to a multiple of
+ * 8 bytes so the next record is aligned.
+ */
+struct FrameRecord {
+    uint32_t s_recordSize;        // Bytes in record + frame + padding.
+    uint32_t s_frameSize;         // Bytes in the frame.
+    uint64_t s_timestamp;         // Body header timestamp.
+    uint32_t s_sourceId;          // Body header source id.
+    uint32_t s_received;          // Arrival time for latency statistics
+                                  // (see RouterStatistics); 0 if not timed.
+};
+
+/**
+ * @class FrameQueue
+ *    Hands complete frames from the receiver thread (producer) to the
+ *    ring writer thread (consumer).  The queue is a circular byte buffer
+ *    of variable length records so a frame occupies only as much space as
+ *    it needs.  A record never wraps; if there's not room for it at the
+ *    end of the buffer, a zero record size is written as a marker and the
+ *    record goes at the start of the buffer.  If a record is too big to
+ *    follow its wrap marker even in an empty queue, the marker is
+ *    published on its own first.
+ *
+ *    Producer and consumer each own one index.  The indices only increase;
+ *    positions in the buffer are the index modulo the buffer size.
+ *
+ *    The producer side counts how often and for how long the queue was full.
+ */
+class FrameQueue
+{
+private:
+    std::vector<uint64_t>   m_storage;          // uint64_t for alignment.
+    uint8_t*                m_pBuffer;
+    size_t                  m_capacity;
+
+    // The producer and consumer indices are kept on separate cache lines
+    // so the two threads don't fight over one line.
+
+    char                              m_pad0[64];
+    std::atomic<size_t>               m_head;   // Consumer owned.
+    std::atomic<uint64_t>             m_popped;
+    char                              m_pad1[64];
+    std::atomic<size_t>               m_tail;   // Producer owned.
+    std::atomic<uint64_t>             m_pushed;
+    size_t                            m_pendingSize;
+    std::atomic<size_t>               m_highWater;
+    std::atomic<uint64_t>             m_stalls;
+    std::atomic<uint64_t>             m_stallNs;
+
+public:
+    FrameQueue(size_t nbytes);
+
+    // Producer:
+
+    FrameRecord* reserve(size_t frameBytes);
+    FrameRecord* reserveWait(size_t frameBytes);
+    void         publish();
+
+    // Consumer:
+
+    const FrameRecord* front();
+    void               pop();
+
+    // Either:
+
+    bool     empty()     const;
+    size_t   capacity()  const;
+    size_t   depth()     const;
+    uint64_t records()   const;
+    size_t   highWater() const;
+    uint64_t stalls()    const;
+    uint64_t stallNs()   const;
+
+private:
+    static size_t recordSize(size_t frameBytes);
+};
+
+#endif
@@ -0,0 +1,248 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  HitExtractor.cpp
+ *  @brief: Implement the hit extraction worker pool.
+ */
+#include "HitExtractor.h"
+#include "RingOutput.h"
+#include "FrameQueue.h"
+#include <AnalyzeFrame.h>
+#include <utl/Logging.h>
+#include <string.h>
+#include <exception>
+#include <chrono>
+
+// Smallest queue a worker gets in each direction:
+
+static const size_t MIN_WORKER_QUEUE(1024*1024);
+
+// How long workers and the collector sleep when there's nothing to do:
+
+static const unsigned IDLE_USEC(50);
+
+/**
+ * Worker constructor
+ *    Just zero the counters.
+ */
+HitExtractor::Worker::Worker() :
+    s_frames(0), s_hits(0), s_errors(0)
+{}
+
+/**
+ * constructor
+ *    Make the queues and start the workers and the collector.
+ *
+ * @param output     - ring output the hit items go to.  It may be shared.
+ * @param nWorkers   - number of analysis threads (at least one is made).
+ * @param queueBytes - frame queue space, split evenly among the workers.
+ *                     Each worker's result queue is the same size.
+ */
+HitExtractor::HitExtractor(
+    std::shared_ptr<RingOutput> output, unsigned nWorkers, size_t queueBytes
+) :
+    m_output(output), m_stop(false), m_nextWorker(0), m_nextResult(0),
+    m_items(0), m_empty(0)
+{
+    if (nWorkers == 0) nWorkers = 1;
+    size_t workerBytes = queueBytes/nWorkers;
+    if (workerBytes < MIN_WORKER_QUEUE) workerBytes = MIN_WORKER_QUEUE;
+
+    for (unsigned i = 0; i < nWorkers; i++) {
+        Worker* pWorker = new Worker;
+        pWorker->s_pInput.reset(new FrameQueue(workerBytes));
+        pWorker->s_pOutput.reset(new FrameQueue(workerBytes));
+        m_workers.push_back(std::unique_ptr<Worker>(pWorker));
+    }
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        m_workers[i]->s_thread = std::thread(&HitExtractor::analyze, this, std::ref(*m_workers[i]));
+    }
+    m_collector = std::thread(&HitExtractor::collect, this);
+}
+/**
+ * destructor
+ *    Frames already submitted are analyzed and written before the
+ *    threads are stopped.
+ */
+HitExtractor::~HitExtractor()
+{
+    drain();
+    stop();
+}
+/**
+ * submit
+ *    Queue a frame for analysis by the next worker in turn.  If that
+ *    worker's queue is full we wait.
+ *
+ * @param record - describes the frame; the timestamp and source id are
+ *                 those of the hit item (before adding the ASAD index).
+ * @param pFrame - the frame.
+ */
+void
+HitExtractor::submit(const FrameRecord& record, const void* pFrame)
+{
+    FrameQueue& queue(*m_workers[m_nextWorker]->s_pInput);
+    FrameRecord* pRecord = queue.reserveWait(record.s_frameSize);
+    pRecord->s_timestamp = record.s_timestamp;
+    pRecord->s_sourceId  = record.s_sourceId;
+    pRecord->s_received  = record.s_received;
+    memcpy(pRecord + 1, pFrame, record.s_frameSize);
+    queue.publish();
+
+    m_nextWorker = (m_nextWorker + 1) % m_workers.size();
+}
+/**
+ * drain
+ *    Wait until every submitted frame has been analyzed and its hits
+ *    handed to the ring output.  The ring output is not flushed.
+ */
+void
+HitExtractor::drain()
+{
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        Worker& w(*m_workers[i]);
+        while (!w.s_pInput->empty() || !w.s_pOutput->empty()) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+}
+/**
+ * getOutput
+ *    @return RingOutput* - the ring output hit items go to.
+ */
+RingOutput*
+HitExtractor::getOutput() const
+{
+    return m_output.get();
+}
+/**
+ * logStatistics
+ *    Log how much each worker did and how the queues fared.
+ */
+void
+HitExtractor::logStatistics()
+{
+    LOG_INFO() << "Hit extraction to ring " << m_output->getRingName() << ": "
+        << m_items.load() << " hit items written, " << m_empty.load()
+        << " frames without hits";
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        Worker& w(*m_workers[i]);
+        LOG_INFO() << "Hit worker " << i << ": " << w.s_frames.load() << " frames, "
+            << w.s_hits.load() << " hits, " << w.s_errors.load() << " bad frames; "
+            << "input queue high water mark " << w.s_pInput->highWater() << " of "
+            << w.s_pInput->capacity() << " bytes, full " << w.s_pInput->stalls()
+            << " times (" << w.s_pInput->stallNs()/1000000 << " ms)";
+    }
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * analyze
+ *    A worker thread.  Each frame is analyzed and the body of its hit
+ *    item put in the worker's output queue.  Frames without hits, or
+ *    that can't be analyzed, still get an (empty) output record so the
+ *    collector can keep its place in the round robin.
+ *
+ * @param worker - the worker whose queues we use.
+ */
+void
+HitExtractor::analyze(Worker& worker)
+{
+    std::chrono::microseconds idle(IDLE_USEC);
+    FrameQueue& input(*worker.s_pInput);
+    FrameQueue& output(*worker.s_pOutput);
+
+    while (!m_stop) {
+        const FrameRecord* pFrame = input.front();
+        if (!pFrame) {
+            std::this_thread::sleep_for(idle);
+            continue;
+        }
+        std::vector<NSCLGET::Hit> hits;
+        try {
+            hits = NSCLGET::analyzeFrame(pFrame->s_frameSize, pFrame + 1);
+        }
+        catch (std::exception& e) {
+            if (worker.s_errors.fetch_add(1, std::memory_order_relaxed) == 0) {
+                LOG_WARN() << "Unable to extract hits from a frame: " << e.what();
+            }
+            hits.clear();
+        }
+
+        size_t nbytes = hits.empty() ? 0 : NSCLGET::hitBodySize(hits.size());
+        FrameRecord* pResult = output.reserveWait(nbytes);
+        pResult->s_timestamp = pFrame->s_timestamp;
+        pResult->s_sourceId  = pFrame->s_sourceId;
+        pResult->s_received  = pFrame->s_received;
+        if (nbytes) {
+            pResult->s_sourceId += hits[0].s_asad;
+            NSCLGET::packHits(hits, pResult + 1);
+        }
+        output.publish();
+        input.pop();
+
+        worker.s_frames.fetch_add(1, std::memory_order_relaxed);
+        worker.s_hits.fetch_add(hits.size(), std::memory_order_relaxed);
+    }
+}
+/**
+ * collect
+ *    The collector thread.  Takes results from the workers in the order
+ *    submit handed them frames and writes the hit items to the ring.
+ */
+void
+HitExtractor::collect()
+{
+    std::chrono::microseconds idle(IDLE_USEC);
+
+    while (!m_stop) {
+        FrameQueue& results(*m_workers[m_nextResult]->s_pOutput);
+        const FrameRecord* pResult = results.front();
+        if (!pResult) {
+            std::this_thread::sleep_for(idle);
+            continue;
+        }
+        if (pResult->s_frameSize) {
+            m_output->write(*pResult, pResult + 1);
+            m_items.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            m_empty.fetch_add(1, std::memory_order_relaxed);
+        }
+        results.pop();
+        m_nextResult = (m_nextResult + 1) % m_workers.size();
+    }
+}
+/**
+ * stop
+ *    Stop the workers and the collector.  Anything still queued stays
+ *    there.
+ */
+void
+HitExtractor::stop()
+{
+    m_stop = true;
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        if (m_workers[i]->s_thread.joinable()) {
+            m_workers[i]->s_thread.join();
+        }
+    }
+    if (m_collector.joinable()) {
+        m_collector.join();
+    }
+}
@@ -0,0 +1,95 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  HitExtractor.h
+ *  @brief: Turn frames into hit ring items on a pool of worker threads.
+ */
+#ifndef HITEXTRACTOR_H
+#define HITEXTRACTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+class RingOutput;
+class FrameQueue;
+struct FrameRecord;
+
+/**
+ * @class HitExtractor
+ *    Does, inside the router, what the hit maker (analyzing/process) does
+ *    to a ring of frames: each frame is analyzed by NSCLGET::analyzeFrame
+ *    and its hits become a PHYSICS_EVENT item in the output ring exactly
+ *    as CRingItemProcessor::processEvent would make it.  Frames without
+ *    hits produce nothing.
+ *
+ *    Analysis is far slower than receiving, so it's spread over a pool of
+ *    worker threads.  Frames are handed to the workers round robin through
+ *    per worker input FrameQueues.  Each worker puts the hit item body
+ *    (or an empty record if there were no hits) into its own output queue.
+ *    A collector thread takes the results from the workers in the same
+ *    round robin order and writes them to the ring output, so hit items
+ *    are in the same order as the frames they came from.
+ *
+ *    submit must only be called from one thread (the receiver thread of
+ *    the frame processor that owns us).
+ */
+class HitExtractor
+{
+private:
+    struct Worker {
+        std::unique_ptr<FrameQueue> s_pInput;
+        std::unique_ptr<FrameQueue> s_pOutput;
+        std::thread                 s_thread;
+        std::atomic<uint64_t>       s_frames;
+        std::atomic<uint64_t>       s_hits;
+        std::atomic<uint64_t>       s_errors;
+        Worker();
+    };
+
+    std::shared_ptr<RingOutput>            m_output;
+    std::vector<std::unique_ptr<Worker> >  m_workers;
+    std::thread                            m_collector;
+    std::atomic<bool>                      m_stop;
+    size_t                                 m_nextWorker;      // submit's.
+    size_t                                 m_nextResult;      // collector's.
+    std::atomic<uint64_t>                  m_items;
+    std::atomic<uint64_t>                  m_empty;
+
+public:
+    HitExtractor(std::shared_ptr<RingOutput> output, unsigned nWorkers, size_t queueBytes);
+    ~HitExtractor();
+
+    void submit(const FrameRecord& record, const void* pFrame);
+    void drain();
+
+    RingOutput* getOutput() const;
+    void        logStatistics();
+
+private:
+    HitExtractor(const HitExtractor&);
+    HitExtractor& operator=(const HitExtractor&);
+
+    void analyze(Worker& worker);
+    void collect();
+    void stop();
+};
+
+#endif
@@ -19,17 +19,44 @@
  *  @brief: Implements the NSCLDAQ ringbuffer data processor.
  */
 #include "NSCLDAQDataProcessor.h"
-#include <CRingBuffer.h>
-#include <CPhysicsEventItem.h>
+#include "RingOutput.h"
+#include "FrameQueue.h"
+#include "HitExtractor.h"
+#include "RouterStatistics.h"
+#include "RunRecorder.h"
 #include <stdint.h>
 #include <string.h>
+#include <stdexcept>
 #include <mfm/Frame.h>
 #include <mfm/Field.h>
 #include <mfm/Header.h>
 #include <mfm/Common.h>
+#include <utl/Logging.h>
+#include <DataFormat.h>
+#include <CRingStateChangeItem.h>
 
+// Frame queue space shared by the hit workers when we have no queue size:
+
+static const size_t DEFAULT_HIT_QUEUE_SIZE(8*1024*1024);
+
+// Queue between us and the monitoring ring's writer thread:
+
+static const size_t MONITOR_QUEUE_SIZE(4*1024*1024);
+
+// The assembly timer naps for a quarter of the assembly timeout, but no
+// less than this:
+
+static const unsigned MIN_ASSEMBLY_NAP_USEC(100);
+
+// Frame counts are kept locally and copied to the shared statistics block
+// every this many frames or this often, whichever comes first.  Only one
+// frame in LATENCY_SAMPLE_INTERVAL is timed; reading the clock costs more
+// than all the counting.
+
+static const unsigned STATISTICS_PUBLISH_FRAMES(64);
+static const uint32_t STATISTICS_PUBLISH_USEC(100000);
+static const unsigned LATENCY_SAMPLE_INTERVAL(16);
 
-const size_t RING_BUFFER_SIZE(32*1024*1024);
 
 /**
  *  Constructor
@@ -37,86 +64,342 @@ const size_t RING_BUFFER_SIZE(32*1024*1024);
  */
 
 NSCLDAQDataProcessor::NSCLDAQDataProcessor() : m_sourceId(0), m_useTimestamp(false),
+    m_pCheckedLayout(nullptr), m_queue(nullptr), m_queueSize(0), m_batchBytes(0), m_batchLatency(0),
+    m_stopAssemblyTimer(false), m_assemblyTimeout(0),
+    m_assemblyField(NSCLGET::FrameHeaderLayout::EVENT_IDX),
+    m_frames(0), m_bytes(0), m_pStats(nullptr), m_received(0),
+    m_unpublished(0), m_untilTimed(1),
+    m_published(0),
+    m_demultiplex(NO_DEMULTIPLEX), m_nAsads(1), m_strayFrames(0),
+    m_monitorQueue(nullptr), m_monitorInterval(1), m_untilMonitor(1),
+    m_monitorSpacing(0), m_monitored(0), m_monitorDropped(0),
+    m_runBarriers(false), m_runOpen(false), m_run(0), m_runStarted(0),
     FrameStorage()
 {}
 
 /**
  * destructor
- *    Using a unique_ptr ensures the ring buffer is destroyed.
+ *    Using a shared_ptr ensures the ring output is destroyed once the
+ *    last processor feeding it is.  That stops its writer thread once the
+ *    queues are empty and any partial batch is flushed.  Unlike flush, we
+ *    only drain, so frames journaled by the outputs stay on disk to be
+ *    recovered when the router next starts.
  *    All other member data either are well behaved with respect to object
  *    destruction (std::string) or primitive types.
  *
  */
 NSCLDAQDataProcessor::~NSCLDAQDataProcessor()
-{}
+{
+    stopAssemblyTimer();
+    drain();
+}
 
 /**
  * processFrame
- *    This is where the action is.  The frame data are wrapped in a ring item
- *    and the body headers of that ring item set appropriately.
- *    The resulting ring item (a PHYSICS_EVENT) is submitted to the ring buffer
- *    which must have been set by now else bad things happen.
+ *    This is where the action is.  A frame assembled by the FrameStorage
+ *    base class goes wherever we've been set up to send it (see
+ *    handleFrame): wrapped in a PHYSICS_EVENT ring item, with its body
+ *    header set appropriately, to the ring outputs or the run recorder;
+ *    to the hit extractor; and, if it's sampled, to the monitoring ring.
  *    
  *  @param frame - reference to the frame data.
  */
 void
 NSCLDAQDataProcessor::processFrame(mfm::Frame& frame)
 {
-    // If no ringbuffer has been set, for now ignore the frame
+    // If there's nowhere for the frame to go, ignore it.
     
-    if (m_RingBuffer.get() == nullptr) {
+    if (!writingFrames() && (m_hits.get() == nullptr) && !m_monitorQueue) {
         return;
     }
     
+    // The layout cached for the frame's revision locates the header fields
+    // so they're direct loads, not dictionary lookups.
+    
+    const NSCLGET::FrameHeaderLayout& layout(m_layoutCache.layout(frame));
+    handleFrame(layout, frame.data(), sizeFrame(frame));
+}
+/**
+ * processFrameBytes
+ *    Process a complete frame that's still sitting in the receiver's
+ *    buffer (see FlowReceiverPool) without it going through the
+ *    FrameStorage frame assembly, which copies it.  This only works once
+ *    a frame of the same type and revision has been through processFrame
+ *    so its header layout is known.
+ *
+ * @param pFrame - the frame.
+ * @param nbytes - its size (from its header).
+ * @return bool  - false if the layout isn't known yet and the frame must
+ *                 go through addDataChunk instead.  It's not processed.
+ */
+bool
+NSCLDAQDataProcessor::processFrameBytes(const void* pFrame, size_t nbytes)
+{
+    const NSCLGET::FrameHeaderLayout* pLayout = m_layoutCache.find(pFrame);
+    if (!pLayout) {
+        return false;
+    }
+    if (writingFrames() || m_hits.get() || m_monitorQueue) {
+        handleFrame(*pLayout, static_cast<const mfm::Byte*>(pFrame), nbytes);
+    }
+    return true;
+}
+/**
+ * handleFrame
+ *    Count the frame, sample it for the monitoring ring, hand it to the
+ *    hit extractor and write it (assembled, reordered or demultiplexed as
+ *    configured) to our ring outputs or run recorder; see processFrame.
+ *
+ * @param layout - layout of the frame's header.
+ * @param pData  - the frame.
+ * @param nbytes - its size.
+ */
+void
+NSCLDAQDataProcessor::handleFrame(
+    const NSCLGET::FrameHeaderLayout& layout, const mfm::Byte* pData, size_t nbytes
+)
+{
+    if (&layout != m_pCheckedLayout) {
+        checkLayout(layout);
+    }
+    
     // To turn the frame into a ring item we need to know:
     //  The value we'll put in the timestamp, and the frame size.
     
-    uint64_t timestamp;                    // Could be trigger id too.
-    size_t   itempos;
-    size_t   itemsize;
-    if (m_useTimestamp) {
-        frame.findHeaderField(std::string("eventTime"), itempos, itemsize);
-    } else {
-        frame.findHeaderField(std::string("eventIdx"),  itempos, itemsize);
+    uint64_t timestamp = layout.get(                 // Could be trigger id too.
+        m_useTimestamp ? NSCLGET::FrameHeaderLayout::EVENT_TIME :
+                         NSCLGET::FrameHeaderLayout::EVENT_IDX,
+        pData
+    );
+    
+    m_frames++;
+    m_bytes += nbytes;
+    if (m_pStats) {
+        countFrame(layout, pData, nbytes);
+    }
+    if (m_monitorQueue) {
+        monitorFrame(layout, timestamp, pData, nbytes);
     }
-    mfm::Field f = frame.headerField(itempos, itemsize);
-    timestamp = f.value<uint64_t>();
     
-    size_t      nbytes= sizeFrame(frame);
-    const mfm::Byte* pData = frame.data();
+    // Hits are extracted from a copy of the frame by the hit workers.
     
-    // Now we have enough to build the physics item + 1024 is overly big body
-    // header size.  I suppose we could include DataFormat.h and use the actual
-    // size but I'm lazy today.
+    if (m_hits.get()) {
+        FrameRecord record;
+        record.s_recordSize = 0;
+        record.s_frameSize  = nbytes;
+        record.s_timestamp  = timestamp;
+        record.s_sourceId   = m_sourceId;
+        record.s_received   = m_received;
+        m_hits->submit(record, pData);
+    }
+    if (!writingFrames()) {
+        return;
+    }
     
-    CPhysicsEventItem item(timestamp, m_sourceId, 0, nbytes + 1024);
-    void* dest = item.getBodyCursor();
-    memcpy(dest, pData, nbytes);          // Frame -> ring item.
-    dest = static_cast<void*>(static_cast<uint8_t*>(dest) + nbytes);
-    item.setBodyCursor(dest);
-    item.updateSize();                      // Not sure I need this but...
+    // When merging AsAd frames, the frame joins its event and whatever
+    // events are finished are written.
     
-    CRingBuffer* pR = m_RingBuffer.get();
-    item.commitToRing(*pR);
+    if (m_assembler.get()) {
+        std::lock_guard<std::mutex> lock(m_emitLock);
+        m_assembler->add(
+            pData, nbytes, layout.get(m_assemblyField, pData),
+            layout.get(NSCLGET::FrameHeaderLayout::ASAD_IDX, pData), timestamp
+        );
+        writeAssembled(m_received);
+    } else {
+        unsigned shard = 0;
+        if (m_demultiplex == BY_EVENT) {
+            shard = layout.get(NSCLGET::FrameHeaderLayout::EVENT_IDX, pData) %
+                m_shardOutputs.size();
+        } else if (m_demultiplex != NO_DEMULTIPLEX) {
+            shard = layout.get(NSCLGET::FrameHeaderLayout::ASAD_IDX, pData);
+        }
+        if (m_reorder.get()) {
+            std::lock_guard<std::mutex> lock(m_emitLock);
+            emitFrame(timestamp, pData, nbytes, shard, m_received);
+        } else {
+            emitFrame(timestamp, pData, nbytes, shard, m_received);
+        }
+    }
+}
+/**
+ * checkLayout
+ *    A layout reads fields its frame revision lacks as 0, which would
+ *    silently become timestamps, AsAd numbers or shards.  The first time
+ *    frames with a layout are handled, make sure it has every header field
+ *    we'll read.
+ *
+ * @param layout - layout of the frame's header.
+ * @throw std::string - naming the first field that's missing.
+ */
+void
+NSCLDAQDataProcessor::checkLayout(const NSCLGET::FrameHeaderLayout& layout)
+{
+    std::vector<NSCLGET::FrameHeaderLayout::Field> fields;
+    fields.push_back(
+        m_useTimestamp ? NSCLGET::FrameHeaderLayout::EVENT_TIME :
+                         NSCLGET::FrameHeaderLayout::EVENT_IDX
+    );
+    if (m_assembler.get()) {
+        fields.push_back(m_assemblyField);
+    }
+    if (m_demultiplex == BY_EVENT) {
+        fields.push_back(NSCLGET::FrameHeaderLayout::EVENT_IDX);
+    }
+    if (m_pStats || m_assembler.get() ||
+        ((m_demultiplex != NO_DEMULTIPLEX) && (m_demultiplex != BY_EVENT))) {
+        fields.push_back(NSCLGET::FrameHeaderLayout::ASAD_IDX);
+    }
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (!layout.has(fields[i])) {
+            throw std::string("Frame header has no ") +
+                NSCLGET::FrameHeaderLayout::name(fields[i]) + " field";
+        }
+    }
+    m_pCheckedLayout = &layout;
+}
+/**
+ * emitFrame
+ *    Write a frame (or merged frame) now or, if reordering, hand it to the
+ *    reorder buffer and write whatever frames it lets go of.  When
+ *    reordering or assembling, the caller must hold m_emitLock.
+ *
+ * @param timestamp - body header timestamp.
+ * @param pData     - the frame.
+ * @param nbytes    - its size.
+ * @param shard     - its asadIdx, or its shard when sharding BY_EVENT (only
+ *                    used when demultiplexing).
+ * @param received  - when it arrived (see RouterStatistics::received).
+ */
+void
+NSCLDAQDataProcessor::emitFrame(
+    uint64_t timestamp, const void* pData, size_t nbytes, unsigned shard,
+    uint32_t received
+)
+{
+    if (m_reorder.get()) {
+        m_reorder->add(pData, nbytes, timestamp, shard, received);
+        writeReordered();
+    } else {
+        writeFrame(timestamp, pData, nbytes, shard, received);
+    }
+}
+/**
+ * writeFrame
+ *    Write a frame (or merged frame) to the ring output.  With a queue, the
+ *    frame is copied into the queue for the writer thread.  Without one, we
+ *    write it to the ring ourselves.
+ *
+ *    When demultiplexing, the frame's AsAd picks its source id or its
+ *    ring output, or its shard picks its ring output.  Frames from an
+ *    AsAd without a ring are counted and dropped.
+ *
+ * @param timestamp - body header timestamp.
+ * @param pData     - the frame.
+ * @param nbytes    - its size.
+ * @param shard     - its asadIdx or shard (only used when demultiplexing).
+ * @param received  - when it arrived (see RouterStatistics::received).
+ */
+void
+NSCLDAQDataProcessor::writeFrame(
+    uint64_t timestamp, const void* pData, size_t nbytes, unsigned shard,
+    uint32_t received
+)
+{
+    RingOutput* pOutput  = m_output.get();
+    FrameQueue* pQueue   = m_queue;
+    uint32_t    sourceId = m_sourceId;
+    if (m_demultiplex == BY_SOURCE_ID) {
+        sourceId += shard;
+    } else if ((m_demultiplex == BY_RING) || (m_demultiplex == BY_EVENT)) {
+        if (shard >= m_shardOutputs.size()) {
+            if (m_strayFrames.fetch_add(1, std::memory_order_relaxed) == 0) {
+                LOG_WARN() << "Source id " << m_sourceId << ": dropping frames from AsAd "
+                    << shard << " which has no ring";
+            }
+            return;
+        }
+        pOutput = m_shardOutputs[shard].get();
+        pQueue  = m_shardQueues[shard];
+    }
+    
+    if (pQueue) {
+        FrameRecord* pRecord = pQueue->reserveWait(nbytes);
+        pRecord->s_timestamp = timestamp;
+        pRecord->s_sourceId  = sourceId;
+        pRecord->s_received  = received;
+        memcpy(pRecord + 1, pData, nbytes);
+        pQueue->publish();
+    } else {
+        FrameRecord record;
+        record.s_recordSize = 0;
+        record.s_frameSize  = nbytes;
+        record.s_timestamp  = timestamp;
+        record.s_sourceId   = sourceId;
+        record.s_received   = received;
+        if (m_recorder.get()) {
+            m_recorder->write(record, pData);
+        } else {
+            pOutput->write(record, pData);
+        }
+    }
 }
 /**
  *   setRingBufferName
- *      If necessary creates the ringbuffer and then becomes the producer.
- *      We're going to make the ring buffer bigger than usual (see RING_BUFFER_SIZE
- *      const).  If the ring buffer is successfully created and we are
+ *      If necessary creates the ringbuffer and then becomes the producer
+ *      (see RingOutput).  If the ring buffer is successfully created and we are
  *      successfully the producer, m_ringName is updated.  If not, all is
  *      as before excetp an exception is thrown.
- *      if m_RingBuffer is already set the CRingBuffer pointed to by it is
- *      destroyed (the object not the ring), so someone else can produce into it.
+ *      If we were already writing a ring we stop doing so; once no other
+ *      processor shares it, the ring output, and with it the CRingBuffer,
+ *      is destroyed (the object not the ring), so someone else can
+ *      produce into it.
+ *      The current batching parameters are applied to the new ring.
  */
 void
 NSCLDAQDataProcessor::setRingBufferName(const std::string& ringName)
 {
+    std::shared_ptr<RingOutput> output(new RingOutput(ringName));
+    if (m_batchBytes) {
+        output->setBatching(m_batchBytes, m_batchLatency);
+    }
+    setOutput(output);
+}
+/**
+ * setOutput
+ *    Start writing to a ring output that may be shared with other
+ *    processors.  If we have a queue size, a queue into that output is
+ *    made for us.  This must be done before data flows.
+ *
+ * @param output - the ring output.
+ */
+void
+NSCLDAQDataProcessor::setOutput(std::shared_ptr<RingOutput> output)
+{
+    flush();
+    m_queue    = m_queueSize ? output->addQueue(m_queueSize) : nullptr;
+    m_output   = output;
+    m_ringName = output->getRingName();
+}
 
-    CRingBuffer* pNewRing = CRingBuffer::createAndProduce(ringName,  RING_BUFFER_SIZE);
-    m_ringName = ringName;
-    m_RingBuffer.reset(pNewRing);
-   
+/**
+ * setHitOutput
+ *    Start extracting hits from the frames and writing hit items to a ring
+ *    output that may be shared with other processors.  The hit items are
+ *    just like those the hit maker (analyzing/process) makes from a ring of
+ *    frames.  This must be done before data flows.
+ *
+ * @param output   - the ring output for hit items.
+ * @param nWorkers - number of threads extracting hits for us.  They
+ *                   share our queue size between them.
+ */
+void
+NSCLDAQDataProcessor::setHitOutput(std::shared_ptr<RingOutput> output, unsigned nWorkers)
+{
+    flush();
+    m_hits.reset(new HitExtractor(
+        output, nWorkers, m_queueSize ? m_queueSize : DEFAULT_HIT_QUEUE_SIZE
+    ));
 }
 
 /**
@@ -140,7 +423,8 @@ NSCLDAQDataProcessor::setSourceId(unsigned sid)
 void
 NSCLDAQDataProcessor::useTimestamp()
 {
-    m_useTimestamp = true;
+    m_useTimestamp   = true;
+    m_pCheckedLayout = nullptr;
 }
 /**
  *  useTriggerId
@@ -150,8 +434,458 @@ void
 NSCLDAQDataProcessor::useTriggerId()
 {
     m_useTimestamp= false;
+    m_pCheckedLayout = nullptr;
 }
 
+/**
+ * setBatching
+ *    Turns on batching of ring items.  Batching requires the writer
+ *    thread, even without a queue, since something has to flush partial
+ *    batches whose oldest frame has waited longer than the latency
+ *    limit; otherwise the last frames before a lull would sit in the
+ *    batch until data starts flowing again.
+ *
+ *    If the ring output is shared, the batching applies to all processors
+ *    writing it.
+ *
+ * @param maxBytes       - Largest batch.  This is clamped so that a batch
+ *                         can't be more than half the ring.
+ * @param maxLatencyUsec - Longest a frame waits in a partial batch.
+ */
+void
+NSCLDAQDataProcessor::setBatching(size_t maxBytes, unsigned maxLatencyUsec)
+{
+    m_batchBytes   = maxBytes;
+    m_batchLatency = maxLatencyUsec;
+    if (m_output.get()) {
+        m_output->setBatching(m_batchBytes, m_batchLatency);
+    }
+}
+/**
+ * setQueueSize
+ *    Sets up the queue between the receiver thread (that calls processFrame)
+ *    and the writer thread.  This must be done before data flows.
+ *
+ * @param nbytes - size of the queue; 0 means no queue, the receiver thread
+ *                 writes to the ring directly.
+ */
+void
+NSCLDAQDataProcessor::setQueueSize(size_t nbytes)
+{
+    m_queueSize = nbytes;
+    if (m_output.get()) {
+        flush();
+        m_queue = m_queueSize ? m_output->addQueue(m_queueSize) : nullptr;
+    }
+    if (!m_shardOutputs.empty()) {
+        setShardOutputs(m_shardOutputs);
+    }
+    if (m_recorder.get()) {
+        setRecorder(m_recorder);
+    }
+}
+/**
+ * setAssembly
+ *    Start merging the AsAd frames of each trigger into a single frame
+ *    (see EventAssembler) that's written as one ring item.  This must be
+ *    done before data flows.
+ *
+ * @param key         - whether frames are matched by eventIdx or eventTime.
+ * @param nAsads      - number of AsAds in a complete event.
+ * @param window      - for eventTime, largest eventTime difference between
+ *                      frames of an event.
+ * @param timeoutUsec - how long an event waits for missing AsAds.
+ */
+void
+NSCLDAQDataProcessor::setAssembly(
+    EventAssembler::Key key, unsigned nAsads, uint64_t window, unsigned timeoutUsec
+)
+{
+    if (m_demultiplex != NO_DEMULTIPLEX) {
+        throw std::string("Merged AsAd frames can't be demultiplexed by AsAd");
+    }
+    stopAssemblyTimer();
+    m_assembler.reset(new EventAssembler(key, nAsads, window, timeoutUsec));
+    m_assemblyTimeout = timeoutUsec;
+    startAssemblyTimer();
+    m_assemblyField = key == EventAssembler::EVENT_IDX ?
+        NSCLGET::FrameHeaderLayout::EVENT_IDX : NSCLGET::FrameHeaderLayout::EVENT_TIME;
+    m_pCheckedLayout = nullptr;
+}
+/**
+ * setReordering
+ *    Start holding frames back so they're written in order of their ring
+ *    item timestamps (see ReorderBuffer).  Merged AsAd frames are
+ *    reordered by their timestamps too.  This must be done before data
+ *    flows.
+ *
+ * @param unit   - whether the window is in timestamp ticks or frames.
+ * @param window - its size.
+ */
+void
+NSCLDAQDataProcessor::setReordering(ReorderBuffer::Unit unit, uint64_t window)
+{
+    std::lock_guard<std::mutex> lock(m_emitLock);
+    m_reorder.reset(new ReorderBuffer(unit, window));
+}
+/**
+ * setRecorder
+ *    Record frames to run files (see RunRecorder) rather than writing them
+ *    to a ring.  The recorder may be shared with other processors.  If we
+ *    have a queue size, we get a queue into it.  This replaces any ring
+ *    output set by setOutput and must be done before data flows.
+ *
+ * @param recorder - the recorder.
+ */
+void
+NSCLDAQDataProcessor::setRecorder(std::shared_ptr<RunRecorder> recorder)
+{
+    flush();
+    m_output.reset();
+    m_ringName.clear();
+    m_queue    = m_queueSize ? recorder->addQueue(m_queueSize) : nullptr;
+    m_recorder = recorder;
+}
+/**
+ * setMonitor
+ *    Copy a sample of the frames we receive, before any merging or
+ *    reordering, to a monitoring ring.  The frames go through a queue of
+ *    their own to the output's writer thread; when the queue is full the
+ *    frame is dropped rather than waiting.  The output may be shared with
+ *    other processors and should itself drop frames that don't fit in the
+ *    ring (CongestionTracker::DROP) so monitors can't back it up.  State
+ *    change items (see writeStateItem) are copied to it too.  This must be
+ *    done before data flows.
+ *
+ * @param monitor  - the monitoring ring's output.
+ * @param interval - one in this many frames is copied.
+ * @param maxRate  - and at most this many per second; 0 for no limit.
+ */
+void
+NSCLDAQDataProcessor::setMonitor(
+    std::shared_ptr<RingOutput> monitor, unsigned interval, unsigned maxRate
+)
+{
+    m_monitorQueue    = monitor->addQueue(MONITOR_QUEUE_SIZE);
+    m_monitor         = monitor;
+    m_monitorInterval = interval ? interval : 1;
+    m_untilMonitor    = m_monitorInterval;
+    m_monitorSpacing  = std::chrono::nanoseconds(maxRate ? 1000000000/maxRate : 0);
+    m_nextMonitor     = std::chrono::steady_clock::now();
+}
+/**
+ * setRunBarriers
+ *    Write a BEGIN_RUN barrier item to all our rings when the run starts
+ *    and an END_RUN barrier when it stops (see beginRun and endRun).  This
+ *    is for when no state change items come from elsewhere (see
+ *    writeStateItem), so that each consumer of a shard or AsAd ring can
+ *    tell where runs begin and end.
+ *
+ * @param firstRun - run number of the first run; it goes up by one for
+ *                   each run.
+ * @param title    - title of the items.
+ */
+void
+NSCLDAQDataProcessor::setRunBarriers(uint32_t firstRun, const std::string& title)
+{
+    m_runBarriers = true;
+    m_run         = firstRun;
+    m_runTitle    = title;
+}
+/**
+ * setStatistics
+ *    Start counting our frames in a shared memory statistics block (see
+ *    RouterStatistics).  Our frames are also timed so that the ring
+ *    outputs we write can count how long they took to get into the ring;
+ *    those outputs need their own statistics.
+ *
+ * @param pStats - where our counts go; nullptr to not count them (e.g.
+ *                 the statistics block had no room for us).
+ */
+void
+NSCLDAQDataProcessor::setStatistics(SourceStatistics* pStats)
+{
+    m_pStats = pStats;
+    m_pCheckedLayout = nullptr;
+    m_statAsadFrames.assign(MAX_STATISTICS_ASADS + 1, 0);
+    if (m_pStats && m_queue) {
+        m_pStats->s_queueCapacity.store(m_queue->capacity(), std::memory_order_relaxed);
+    }
+}
+/**
+ * setDemultiplexing
+ *    Choose how frames are separated by AsAd or sharded.  This must be
+ *    done before data flows.
+ *
+ * @param how    - NO_DEMULTIPLEX, BY_SOURCE_ID to give frames source id
+ *                 <sid>+asadIdx, BY_RING to write each AsAd's frames to
+ *                 its own ring or BY_EVENT to write each frame to ring
+ *                 eventIdx modulo the number of rings (see setShardOutputs).
+ * @param nAsads - number of AsAds.  State change items are copied once
+ *                 per AsAd to the hit ring and, with BY_SOURCE_ID, to the
+ *                 ring.
+ * @throw std::string - if AsAd frames are being merged.
+ */
+void
+NSCLDAQDataProcessor::setDemultiplexing(Demultiplex how, unsigned nAsads)
+{
+    if ((how != NO_DEMULTIPLEX) && m_assembler.get()) {
+        throw std::string("Merged AsAd frames can't be demultiplexed by AsAd");
+    }
+    m_demultiplex = how;
+    m_nAsads      = nAsads ? nAsads : 1;
+    m_pCheckedLayout = nullptr;
+}
+/**
+ * setShardOutputs
+ *    Write frames to several ring outputs, each of which may be shared
+ *    with other processors.  Sharding BY_EVENT, frames go to
+ *    outputs[eventIdx % outputs.size()] so all the frames of an event
+ *    land in the same ring and each ring gets every outputs.size()'th
+ *    event.  Otherwise each AsAd gets its own ring; frames from AsAd i go
+ *    to outputs[i] (BY_RING).  If we have a queue size, we get a queue
+ *    into each.  This replaces any ring output set by setOutput and must
+ *    be done before data flows.
+ *
+ * @param outputs - the ring outputs, indexed by asadIdx or shard.
+ * @throw std::string - if there are none.
+ */
+void
+NSCLDAQDataProcessor::setShardOutputs(
+    const std::vector<std::shared_ptr<RingOutput> >& outputs
+)
+{
+    if (outputs.empty()) {
+        throw std::string("Frames can't be sharded over no rings");
+    }
+    flush();
+    std::vector<std::shared_ptr<RingOutput> > newOutputs(outputs);
+    m_output.reset();
+    m_queue = nullptr;
+    m_shardQueues.clear();
+    for (size_t i = 0; i < newOutputs.size(); i++) {
+        m_shardQueues.push_back(m_queueSize ? newOutputs[i]->addQueue(m_queueSize) : nullptr);
+    }
+    m_shardOutputs = newOutputs;
+    if (m_demultiplex != BY_EVENT) {
+        m_demultiplex = BY_RING;
+    }
+}
+/**
+ * writeStateItem
+ *    Copy a state change (or other) ring item into our rings so that it's
+ *    seen along with our frames.  Its source id is set to ours and it's
+ *    put in each ring after any frames we've already queued:
+ *
+ *    -  The ring gets one copy, or, with BY_SOURCE_ID, a copy for each
+ *       AsAd with source id <sid>+asadIdx.
+ *    -  With BY_RING or BY_EVENT, each AsAd's or shard's ring gets a copy.
+ *    -  The monitoring ring gets one copy.
+ *    -  The hit ring gets a copy for each AsAd with source id
+ *       <sid>+asadIdx to match the hit items, as the hit maker does.
+ *
+ *    This can be called from any thread.
+ *
+ * @param pItem - the ring item.  Items without a body header are copied
+ *                unchanged.
+ */
+void
+NSCLDAQDataProcessor::writeStateItem(const void* pItem)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(pItem);
+    std::vector<uint8_t> item(p, p + static_cast<const RingItemHeader*>(pItem)->s_size);
+    
+    unsigned copies = m_demultiplex == BY_SOURCE_ID ? m_nAsads : 1;
+    if (m_output.get()) {
+        for (unsigned asad = 0; asad < copies; asad++) {
+            setItemSourceId(item, m_sourceId + asad);
+            m_output->writeItem(item.data());
+        }
+    }
+    if (m_recorder.get()) {
+        for (unsigned asad = 0; asad < copies; asad++) {
+            setItemSourceId(item, m_sourceId + asad);
+            m_recorder->writeItem(item.data());
+        }
+    }
+    for (size_t shard = 0; shard < m_shardOutputs.size(); shard++) {
+        setItemSourceId(item, m_sourceId);
+        m_shardOutputs[shard]->writeItem(item.data());
+    }
+    if (m_monitor.get()) {
+        setItemSourceId(item, m_sourceId);
+        m_monitor->writeItem(item.data());
+    }
+    if (m_hits.get()) {
+        for (unsigned asad = 0; asad < m_nAsads; asad++) {
+            setItemSourceId(item, m_sourceId + asad);
+            m_hits->getOutput()->writeItem(item.data());
+        }
+    }
+}
+/**
+ * beginRun
+ *    If we're making run barriers, write the BEGIN_RUN barrier.  This is
+ *    called when the run starts, before data flows.
+ */
+void
+NSCLDAQDataProcessor::beginRun()
+{
+    if (m_runBarriers && !m_runOpen) {
+        m_runStarted = time(nullptr);
+        writeBarrier(BEGIN_RUN);
+        m_runOpen = true;
+    }
+}
+/**
+ * endRun
+ *    If we're making run barriers, write the END_RUN barrier after all the
+ *    frames we've received.  This is called when the run stops, once no
+ *    more frames are arriving.
+ */
+void
+NSCLDAQDataProcessor::endRun()
+{
+    if (m_runOpen) {
+        drain();
+        writeBarrier(END_RUN);
+        m_runOpen = false;
+        m_run++;
+    }
+}
+/**
+ * flush
+ *    Waits for the writer thread to empty the queues and then puts any
+ *    partially filled batch into the ring.  This is called when
+ *    the run stops.
+ */
+void
+NSCLDAQDataProcessor::flush()
+{
+    drain();
+    if (m_hits.get()) {
+        m_hits->getOutput()->flush();
+    }
+    if (m_output.get()) {
+        m_output->flush();
+    }
+    for (size_t i = 0; i < m_shardOutputs.size(); i++) {
+        m_shardOutputs[i]->flush();
+    }
+    if (m_recorder.get()) {
+        m_recorder->flush();
+    }
+    if (m_monitor.get()) {
+        m_monitor->flush();
+    }
+}
+/**
+ * drain
+ *    Writes the events still being assembled, complete or not, and the
+ *    frames being held for reordering, and waits
+ *    until the hits of every frame we've received have been handed to the
+ *    hit ring output.  Unlike flush, the ring outputs aren't flushed; when
+ *    processors share ring outputs, each output is flushed once after all
+ *    of them have been drained.  Frames must not be arriving.
+ */
+void
+NSCLDAQDataProcessor::drain()
+{
+    if (m_assembler.get() || m_reorder.get()) {
+        // The assembly timer writes through the reorder buffer and our
+        // queues too, so it's kept out until everything's written.
+        
+        std::lock_guard<std::mutex> lock(m_emitLock);
+        if (m_assembler.get()) {
+            m_assembler->expire();
+            writeAssembled(0);
+        }
+        if (m_reorder.get()) {
+            m_reorder->expire();
+            writeReordered();
+        }
+    }
+    if (m_hits.get()) {
+        m_hits->drain();
+    }
+    if (m_pStats) {
+        publishStatistics();
+    }
+}
+/**
+ * logStatistics
+ *    Logs the batch size distribution, if batching, and our own
+ *    statistics (see logSourceStatistics).
+ */
+void
+NSCLDAQDataProcessor::logStatistics()
+{
+    if (m_output.get()) {
+        m_output->logStatistics();
+    }
+    if (m_hits.get()) {
+        m_hits->getOutput()->logStatistics();
+    }
+    for (size_t i = 0; i < m_shardOutputs.size(); i++) {
+        m_shardOutputs[i]->logStatistics();
+    }
+    if (m_recorder.get()) {
+        m_recorder->logStatistics();
+    }
+    if (m_monitor.get()) {
+        m_monitor->logStatistics();
+    }
+    logSourceStatistics();
+}
+/**
+ * logSourceStatistics
+ *    Logs how many frames we've seen and how our frame queue, hit
+ *    workers, event assembly and reordering fared, if there are any.
+ *    When processors share a ring output, this is logged for each of
+ *    them while the output's statistics are logged once.
+ */
+void
+NSCLDAQDataProcessor::logSourceStatistics()
+{
+    LOG_INFO() << "Source id " << m_sourceId << ": " << frames() << " frames, "
+        << bytes() << " bytes";
+    if (m_queue) {
+        LOG_INFO() << "Frame queue: " << m_queue->records() << " frames ("
+            << m_queue->depth() << " bytes) queued, high water mark "
+            << m_queue->highWater() << " of " << m_queue->capacity() << " bytes";
+        LOG_INFO() << "Frame queue was full " << m_queue->stalls()
+            << " times, stalling the receiver for "
+            << m_queue->stallNs()/1000000 << " ms";
+    }
+    for (size_t i = 0; i < m_shardQueues.size(); i++) {
+        if (!m_shardQueues[i]) continue;
+        LOG_INFO() << "AsAd " << i << " frame queue: high water mark "
+            << m_shardQueues[i]->highWater() << " of " << m_shardQueues[i]->capacity()
+            << " bytes, full " << m_shardQueues[i]->stalls() << " times for "
+            << m_shardQueues[i]->stallNs()/1000000 << " ms";
+    }
+    if (m_strayFrames.load(std::memory_order_relaxed)) {
+        LOG_WARN() << m_strayFrames.load(std::memory_order_relaxed)
+            << " frames dropped from AsAds without a ring";
+    }
+    if (m_hits.get()) {
+        m_hits->logStatistics();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_emitLock);
+        if (m_assembler.get()) {
+            m_assembler->logStatistics();
+        }
+        if (m_reorder.get()) {
+            m_reorder->logStatistics();
+        }
+    }
+    if (m_monitor.get()) {
+        LOG_INFO() << m_monitored << " frames copied to monitoring ring "
+            << m_monitor->getRingName() << ", " << m_monitorDropped
+            << " dropped with its queue full";
+    }
+}
 /**
  * getRingBufferName
  *    Return the name of the current ring buffer.
@@ -163,6 +897,80 @@ NSCLDAQDataProcessor::getRingBufferName() const
 {
     return m_ringName;
 }
+/**
+ * getOutput
+ *    Return the ring output we write to.
+ * @return RingOutput*
+ * @retval nullptr - there's no current ring buffer.
+ */
+RingOutput*
+NSCLDAQDataProcessor::getOutput() const
+{
+    return m_output.get();
+}
+/**
+ * getRecorder
+ *    Return the run file recorder we write to.
+ * @return RunRecorder*
+ * @retval nullptr - we're not recording run files.
+ */
+RunRecorder*
+NSCLDAQDataProcessor::getRecorder() const
+{
+    return m_recorder.get();
+}
+/**
+ * getMonitor
+ *    Return the monitoring ring's output.
+ * @return RingOutput*
+ * @retval nullptr - we're not copying frames to a monitoring ring.
+ */
+RingOutput*
+NSCLDAQDataProcessor::getMonitor() const
+{
+    return m_monitor.get();
+}
+/**
+ * getHitOutput
+ *    Return the ring output hit items are written to.
+ * @return RingOutput*
+ * @retval nullptr - we're not extracting hits.
+ */
+RingOutput*
+NSCLDAQDataProcessor::getHitOutput() const
+{
+    return m_hits.get() ? m_hits->getOutput() : nullptr;
+}
+/**
+ * getShardOutputs
+ *    @return std::vector<RingOutput*> - the per AsAd or per shard ring
+ *                       outputs, indexed by asadIdx or shard; empty unless
+ *                       demultiplexing BY_RING or BY_EVENT.
+ */
+std::vector<RingOutput*>
+NSCLDAQDataProcessor::getShardOutputs() const
+{
+    std::vector<RingOutput*> result;
+    for (size_t i = 0; i < m_shardOutputs.size(); i++) {
+        result.push_back(m_shardOutputs[i].get());
+    }
+    return result;
+}
+/**
+ * demultiplex
+ *    @param name - "none", "sourceid", "ring" or "event".
+ *    @return Demultiplex
+ *    @throw std::string - for any other name.
+ */
+NSCLDAQDataProcessor::Demultiplex
+NSCLDAQDataProcessor::demultiplex(const std::string& name)
+{
+    if (name == "none")     return NO_DEMULTIPLEX;
+    if (name == "sourceid") return BY_SOURCE_ID;
+    if (name == "ring")     return BY_RING;
+    if (name == "event")    return BY_EVENT;
+    throw std::string("Unknown demultiplexing: '") + name + "'";
+}
 /**
  * getSourceId
  *    Return the current source id.
@@ -184,6 +992,27 @@ NSCLDAQDataProcessor::usingTimestamp() const
 {
     return m_useTimestamp;
 }
+/**
+ * frames
+ *   @return uint64_t - number of frames processed.  The receiver thread
+ *                      counts them, so this is only exact once frames have
+ *                      stopped arriving; while they're arriving, see the
+ *                      statistics block.
+ */
+uint64_t
+NSCLDAQDataProcessor::frames() const
+{
+    return m_frames;
+}
+/**
+ * bytes
+ *   @return uint64_t - number of frame bytes processed (see frames).
+ */
+uint64_t
+NSCLDAQDataProcessor::bytes() const
+{
+    return m_bytes;
+}
 /*-----------------------------------------------------------------------------
  *  Private utilities.
  */
@@ -204,4 +1033,234 @@ NSCLDAQDataProcessor::sizeFrame(const mfm::Frame& frame)
     size_t result = h.headerSize_B() + h.dataSize_B();
     
     return result;
-}
\ No newline at end of file
+}
+/**
+ * countFrame
+ *    Count a frame by AsAd and, if it's one of those sampled for latency,
+ *    time its arrival (m_received; 0 if it's not timed).  The counts, and
+ *    the frame and byte totals, go to the statistics block in batches (see
+ *    publishStatistics).
+ *
+ * @param layout - the frame's header layout.
+ * @param pData  - the frame.
+ * @param nbytes - its size.
+ */
+void
+NSCLDAQDataProcessor::countFrame(
+    const NSCLGET::FrameHeaderLayout& layout, const void* pData, size_t nbytes
+)
+{
+    uint64_t asad = layout.get(NSCLGET::FrameHeaderLayout::ASAD_IDX, pData);
+    if (asad > MAX_STATISTICS_ASADS) asad = MAX_STATISTICS_ASADS;
+    
+    m_statAsadFrames[asad]++;
+    
+    bool due = ++m_unpublished >= STATISTICS_PUBLISH_FRAMES;
+    m_received = 0;
+    if (--m_untilTimed == 0) {
+        m_untilTimed = LATENCY_SAMPLE_INTERVAL;
+        m_received   = RouterStatistics::received();
+        due = due || (m_received - m_published >= STATISTICS_PUBLISH_USEC);
+    }
+    if (due) {
+        publishStatistics();
+    }
+}
+/**
+ * publishStatistics
+ *    Copy our frame counts and our queue's state to the statistics block.
+ *    We're the only writer of our counters, so they're stored, not added.
+ */
+void
+NSCLDAQDataProcessor::publishStatistics()
+{
+    m_pStats->s_frames.store(m_frames, std::memory_order_relaxed);
+    m_pStats->s_bytes.store(m_bytes, std::memory_order_relaxed);
+    for (size_t i = 0; i < m_statAsadFrames.size(); i++) {
+        m_pStats->s_asadFrames[i].store(m_statAsadFrames[i], std::memory_order_relaxed);
+    }
+    if (m_queue) {
+        m_pStats->s_queueCapacity.store(m_queue->capacity(), std::memory_order_relaxed);
+        m_pStats->s_queueDepth.store(m_queue->depth(), std::memory_order_relaxed);
+        m_pStats->s_queueHighWater.store(m_queue->highWater(), std::memory_order_relaxed);
+        m_pStats->s_queueStallNs.store(m_queue->stallNs(), std::memory_order_relaxed);
+    }
+    m_unpublished = 0;
+    if (m_received) {
+        m_published = m_received;
+    }
+}
+/**
+ * writeAssembled
+ *    Write the assembled events that are ready, oldest first.  The caller
+ *    must hold m_emitLock.
+ *
+ * @param received - arrival time to give them (see
+ *                   RouterStatistics::received); 0 if they're not timed.
+ */
+void
+NSCLDAQDataProcessor::writeAssembled(uint32_t received)
+{
+    const uint8_t* pEvent;
+    size_t         nbytes;
+    uint64_t       timestamp;
+    while ((pEvent = m_assembler->ready(nbytes, timestamp))) {
+        emitFrame(timestamp, pEvent, nbytes, 0, received);
+        m_assembler->pop();
+    }
+}
+/**
+ * startAssemblyTimer
+ *    Start the thread that gives up events that have waited too long
+ *    (see timeOutEvents).
+ */
+void
+NSCLDAQDataProcessor::startAssemblyTimer()
+{
+    if (!m_assemblyTimer.joinable()) {
+        m_stopAssemblyTimer = false;
+        m_assemblyTimer = std::thread(&NSCLDAQDataProcessor::timeOutEvents, this);
+    }
+}
+/**
+ * stopAssemblyTimer
+ *    Stop the assembly timer thread if it's running.
+ */
+void
+NSCLDAQDataProcessor::stopAssemblyTimer()
+{
+    if (m_assemblyTimer.joinable()) {
+        m_stopAssemblyTimer = true;
+        m_assemblyTimer.join();
+    }
+}
+/**
+ * timeOutEvents
+ *    The assembly timer thread.  Otherwise an event is only given up when
+ *    a frame arrives, so with the data stopped an incomplete event would
+ *    wait for the next run.  It naps for a quarter of the assembly timeout,
+ *    so an event waits at most about 1.25 times the timeout.  Events it
+ *    gives up aren't timed; they've waited the timeout anyway.
+ */
+void
+NSCLDAQDataProcessor::timeOutEvents()
+{
+    unsigned napUsec = m_assemblyTimeout/4;
+    if (napUsec < MIN_ASSEMBLY_NAP_USEC) napUsec = MIN_ASSEMBLY_NAP_USEC;
+    std::chrono::microseconds nap(napUsec);
+
+    while (!m_stopAssemblyTimer) {
+        std::this_thread::sleep_for(nap);
+        std::lock_guard<std::mutex> lock(m_emitLock);
+        m_assembler->timeOut();
+        writeAssembled(0);
+    }
+}
+/**
+ * writeReordered
+ *    Write the frames the reorder buffer lets go of, oldest first.  The
+ *    caller must hold m_emitLock.
+ */
+void
+NSCLDAQDataProcessor::writeReordered()
+{
+    const ReorderBuffer::Frame* pFrame;
+    while ((pFrame = m_reorder->ready())) {
+        writeFrame(
+            pFrame->s_timestamp, pFrame->s_data.data(), pFrame->s_data.size(),
+            pFrame->s_asad, pFrame->s_received
+        );
+        m_reorder->pop();
+    }
+}
+/**
+ * writeBarrier
+ *    Make a BEGIN_RUN or END_RUN barrier item for the current run and
+ *    write it to all our rings.
+ *
+ * @param type - BEGIN_RUN or END_RUN.
+ */
+void
+NSCLDAQDataProcessor::writeBarrier(uint16_t type)
+{
+    time_t now = time(nullptr);
+    CRingStateChangeItem item(
+        NULL_TIMESTAMP, m_sourceId, type == BEGIN_RUN ? 1 : 2,
+        type, m_run, type == BEGIN_RUN ? 0 : uint32_t(now - m_runStarted), now, m_runTitle
+    );
+    writeStateItem(item.getItemPointer());
+}
+/**
+ * monitorFrame
+ *    Copy every m_monitorInterval'th frame to the monitoring ring's queue
+ *    unless that would exceed the rate limit or the queue is full.
+ *
+ * @param layout    - layout of the frame's header.
+ * @param timestamp - body header timestamp.
+ * @param pData     - the frame.
+ * @param nbytes    - its size.
+ */
+void
+NSCLDAQDataProcessor::monitorFrame(
+    const NSCLGET::FrameHeaderLayout& layout, uint64_t timestamp,
+    const mfm::Byte* pData, size_t nbytes
+)
+{
+    if (--m_untilMonitor) {
+        return;
+    }
+    m_untilMonitor = m_monitorInterval;
+    if (m_monitorSpacing.count()) {
+        auto now = std::chrono::steady_clock::now();
+        if (now < m_nextMonitor) {
+            return;
+        }
+        m_nextMonitor = now + m_monitorSpacing;
+    }
+    
+    FrameRecord* pRecord = nullptr;
+    try {
+        pRecord = m_monitorQueue->reserve(nbytes);
+    }
+    catch (std::length_error&) {}               // Never fits; drop it.
+    if (!pRecord) {
+        m_monitorDropped++;
+        return;
+    }
+    uint32_t sourceId = m_sourceId;
+    if (m_demultiplex == BY_SOURCE_ID) {
+        sourceId += layout.get(NSCLGET::FrameHeaderLayout::ASAD_IDX, pData);
+    }
+    pRecord->s_timestamp = timestamp;
+    pRecord->s_sourceId  = sourceId;
+    pRecord->s_received  = m_received;
+    memcpy(pRecord + 1, pData, nbytes);
+    m_monitorQueue->publish();
+    m_monitored++;
+}
+/**
+ * writingFrames
+ *   @return bool - true if frames are written to a ring (or per AsAd rings
+ *                  or run files).
+ */
+bool
+NSCLDAQDataProcessor::writingFrames() const
+{
+    return (m_output.get() != nullptr) || !m_shardOutputs.empty() || (m_recorder.get() != nullptr);
+}
+/**
+ * setItemSourceId
+ *    Set the source id in the body header of a ring item, if it has one.
+ *
+ * @param item - the ring item.
+ * @param sid  - the source id.
+ */
+void
+NSCLDAQDataProcessor::setItemSourceId(std::vector<uint8_t>& item, uint32_t sid)
+{
+    pBodyHeader pBody = reinterpret_cast<pBodyHeader>(item.data() + sizeof(RingItemHeader));
+    if ((item.size() >= sizeof(RingItemHeader) + sizeof(BodyHeader))
+        && (pBody->s_size >= sizeof(BodyHeader))) {
+        pBody->s_sourceId = sid;
+    }
+}
@@ -22,11 +22,24 @@
 #define NSCLDAQDATAPROCESSOR_H
 
 #include <get/daq/FrameStorage.h>
+#include <FrameHeaderLayout.h>
+#include "EventAssembler.h"
+#include "ReorderBuffer.h"
 #include <string>
-
+#include <stdint.h>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <time.h>
+#include <vector>
 
-class CRingBuffer;
+class RingOutput;
+class RunRecorder;
+class FrameQueue;
+class HitExtractor;
+struct SourceStatistics;
 
 /**
  * @class NSCLDAQDataprocessor
@@ -37,12 +50,61 @@ class CRingBuffer;
  *  -  The Source is settable from the outside world.
  *  -  We can steal frame assembly from the FrameStorage processor just
  *     by overriding processFrame as that guy knows perfectly well how to
- *     receive and assemble it into frames.
+ *     receive and assemble it into frames.  A receiver that frames the
+ *     data itself can instead hand us frames in place (processFrameBytes).
+ *  -  Optionally, ring items can be gathered into batches that are put into
+ *     the ring in one put.  A batch is flushed when it is full, when its
+ *     oldest frame has waited longer than the batch latency or when the
+ *     run stops (see flush).
+ *  -  Normally frames are handed through a FrameQueue to a writer thread
+ *     that owns the ring (see RingOutput).  This keeps a momentarily full
+ *     ring from stalling the receiver thread and thence the CoBo.
+ *     With no queue, the receiver thread writes to the ring itself.
+ *  -  Several processors (one per CoBo data flow) can share one RingOutput
+ *     (see setOutput).  Each gets its own queue into the ring.
+ *  -  Hits can be extracted from the frames, as the hit maker
+ *     (analyzing/process) would, by a pool of worker threads and written
+ *     to a hit ring (see setHitOutput).  Raw frames are written too only
+ *     if there's also a ring output.
+ *  -  The AsAd frames of each trigger can be merged into one frame, and so
+ *     one ring item, before they're written (see setAssembly and
+ *     EventAssembler).  Hits are still extracted from each AsAd frame.
+ *     A timer thread gives up events that have waited too long, whether
+ *     or not frames are arriving.
+ *  -  Frames can be demultiplexed by their asadIdx (see setDemultiplexing):
+ *     either given source id <sid>+asadIdx, as the hit maker does for hit
+ *     items, or written to a ring of their own per AsAd (see
+ *     setShardOutputs).  Frames can also be sharded over several rings by
+ *     eventIdx so that several consumers can share the work.  State
+ *     change items from elsewhere (see writeStateItem and StateReplicator)
+ *     are copied to match, so consumers of each AsAd's data or of each
+ *     shard see the run's state changes.  Without those, the processor
+ *     can put BEGIN_RUN and END_RUN barriers in all its rings itself (see
+ *     setRunBarriers).
+ *  -  Instead of a ring, frames can be recorded straight to run files
+ *     (see setRecorder and RunRecorder).
+ *  -  A sample of the frames received (one in N, at most M per second) can
+ *     be copied to a monitoring ring (see setMonitor) for online monitors
+ *     so they needn't attach to the production ring.  Frames that don't
+ *     fit in its queue are dropped; the monitor never holds us up.
+ *  -  Frames (or merged frames) can be held back and written in timestamp
+ *     order (see setReordering and ReorderBuffer) so the event builder
+ *     needn't hold as wide a window.  Hits are not reordered.
+ *  -  Optionally, frames, bytes and frames per AsAd are counted in a shared
+ *     memory statistics block along with the state of our queue, and
+ *     a sample of the frames are timed from their arrival so the ring
+ *     outputs can tell how long they took to get into the ring (see
+ *     setStatistics and RouterStatistics).  The counts are copied to the
+ *     block in batches so they cost next to nothing per frame.
  */
 
 class NSCLDAQDataProcessor : public get::daq::FrameStorage
 {
 public:
+    typedef enum _Demultiplex {
+        NO_DEMULTIPLEX, BY_SOURCE_ID, BY_RING, BY_EVENT
+    } Demultiplex;
+    
     // Canonicals
     
     NSCLDAQDataProcessor();
@@ -52,22 +114,59 @@ public:
     
     virtual void processFrame(mfm::Frame& frame);
     
+    // Frames framed by the receiver:
+    
+    bool processFrameBytes(const void* pFrame, size_t nbytes);
+    
     // Things that get/set local data.
     
     void setRingBufferName(const std::string& ringName);
+    void setOutput(std::shared_ptr<RingOutput> output);
+    void setHitOutput(std::shared_ptr<RingOutput> output, unsigned nWorkers);
     void setSourceId(unsigned sid);
     void useTimestamp();
     void useTriggerId();
+    void setBatching(size_t maxBytes, unsigned maxLatencyUsec);
+    void setQueueSize(size_t nbytes);
+    void setAssembly(EventAssembler::Key key, unsigned nAsads, uint64_t window,
+                     unsigned timeoutUsec);
+    void setStatistics(SourceStatistics* pStats);
+    void setDemultiplexing(Demultiplex how, unsigned nAsads);
+    void setShardOutputs(const std::vector<std::shared_ptr<RingOutput> >& outputs);
+    void setReordering(ReorderBuffer::Unit unit, uint64_t window);
+    void setRecorder(std::shared_ptr<RunRecorder> recorder);
+    void setMonitor(std::shared_ptr<RingOutput> monitor, unsigned interval,
+                    unsigned maxRate);
+    void setRunBarriers(uint32_t firstRun, const std::string& title);
     
     std::string getRingBufferName() const;
+    RingOutput* getOutput()         const;
+    RingOutput* getHitOutput()      const;
+    std::vector<RingOutput*> getShardOutputs() const;
+    RunRecorder* getRecorder()      const;
+    RingOutput* getMonitor()        const;
     unsigned    getSourceId()       const;
     bool        usingTimestamp()    const;
+    uint64_t    frames()            const;
+    uint64_t    bytes()             const;
+    
+    // Run control:
+    
+    void writeStateItem(const void* pItem);
+    void beginRun();
+    void endRun();
+    void flush();
+    void drain();
+    void logStatistics();
+    void logSourceStatistics();
 
     // This is just done to disable the debugging log
     // message from each frame header:
 
     void processHeader(const mfm::PrimaryHeader& header) {}
     
+    static Demultiplex demultiplex(const std::string& name);
+    
     // Forbidden canonicals:
 private:
     NSCLDAQDataProcessor(const NSCLDAQDataProcessor& r);
@@ -77,15 +176,76 @@ private:
 
 private:
     size_t sizeFrame(const mfm::Frame& frame);
+    void   handleFrame(const NSCLGET::FrameHeaderLayout& layout, const mfm::Byte* pData,
+                       size_t nbytes);
+    void   checkLayout(const NSCLGET::FrameHeaderLayout& layout);
+    void   emitFrame(uint64_t timestamp, const void* pData, size_t nbytes, unsigned shard,
+                     uint32_t received);
+    void   writeFrame(uint64_t timestamp, const void* pData, size_t nbytes, unsigned shard,
+                      uint32_t received);
+    void   writeAssembled(uint32_t received);
+    void   startAssemblyTimer();
+    void   stopAssemblyTimer();
+    void   timeOutEvents();
+    void   writeReordered();
+    void   writeBarrier(uint16_t type);
+    void   monitorFrame(const NSCLGET::FrameHeaderLayout& layout, uint64_t timestamp,
+                        const mfm::Byte* pData, size_t nbytes);
+    void   countFrame(const NSCLGET::FrameHeaderLayout& layout, const void* pData,
+                      size_t nbytes);
+    void   publishStatistics();
+    bool   writingFrames() const;
+    static void setItemSourceId(std::vector<uint8_t>& item, uint32_t sid);
     
     // Object data:
     
 private:
     std::string   m_ringName;
-    std::unique_ptr<CRingBuffer>   m_RingBuffer;
     unsigned      m_sourceId;
     bool          m_useTimestamp;
+    NSCLGET::FrameHeaderLayout::Cache m_layoutCache;
+    const NSCLGET::FrameHeaderLayout* m_pCheckedLayout;   // Last checkLayout passed.
     
+    std::shared_ptr<RingOutput> m_output;
+    FrameQueue*   m_queue;                  // Owned by m_output.
+    size_t        m_queueSize;              // 0 means no queue.
+    size_t        m_batchBytes;             // 0 means not batching.
+    unsigned      m_batchLatency;           // usec.
+    std::unique_ptr<HitExtractor> m_hits;   // Only if extracting hits.
+    std::unique_ptr<EventAssembler> m_assembler;   // Only if merging AsAds.
+    std::mutex    m_emitLock;               // Assembly, reordering and their writes.
+    std::thread   m_assemblyTimer;
+    std::atomic<bool> m_stopAssemblyTimer;
+    unsigned      m_assemblyTimeout;        // usec.
+    std::unique_ptr<ReorderBuffer>  m_reorder;     // Only if reordering.
+    NSCLGET::FrameHeaderLayout::Field m_assemblyField;
+    uint64_t      m_frames;                 // Only the receiver thread
+    uint64_t      m_bytes;                  // writes these.
+    SourceStatistics* m_pStats;             // Null if not counting.
+    uint32_t      m_received;               // Arrival time of the current frame.
+    std::vector<uint64_t> m_statAsadFrames; // Not yet published to m_pStats.
+    unsigned      m_unpublished;            // Frames since the last publication.
+    unsigned      m_untilTimed;             // Frames until one is timed.
+    uint32_t      m_published;              // When they were last published.
+    Demultiplex   m_demultiplex;
+    unsigned      m_nAsads;                 // Copies of state change items.
+    std::vector<std::shared_ptr<RingOutput> > m_shardOutputs;   // BY_RING, BY_EVENT.
+    std::vector<FrameQueue*> m_shardQueues;  // Owned by m_shardOutputs.
+    std::atomic<uint64_t> m_strayFrames;    // BY_RING, asadIdx without a ring.
+    std::shared_ptr<RunRecorder> m_recorder;   // Frames go here, not to m_output.
+    std::shared_ptr<RingOutput> m_monitor;     // Sampled frames, if monitoring.
+    FrameQueue*   m_monitorQueue;           // Owned by m_monitor.
+    unsigned      m_monitorInterval;
+    unsigned      m_untilMonitor;
+    std::chrono::nanoseconds m_monitorSpacing;          // 0 if the rate isn't limited.
+    std::chrono::steady_clock::time_point m_nextMonitor;
+    uint64_t      m_monitored;
+    uint64_t      m_monitorDropped;         // Queue full.
+    bool          m_runBarriers;
+    bool          m_runOpen;                // A BEGIN_RUN barrier was written.
+    uint32_t      m_run;
+    std::string   m_runTitle;
+    time_t        m_runStarted;
 };
 
-#endif
+#endif
\ No newline at end of file
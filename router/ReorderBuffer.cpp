@@ -0,0 +1,206 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  ReorderBuffer.cpp
+ *  @brief: Implement the timestamp reordering of frames.
+ */
+#include "ReorderBuffer.h"
+#include <utl/Logging.h>
+#include <algorithm>
+#include <string.h>
+
+// Most frames held in TICKS, however wide the window:
+
+static const size_t MAX_HELD(65536);
+
+/**
+ * Heap order: std::push_heap and friends keep the greatest element on top
+ * so "less" here means newer.
+ */
+static bool
+newer(const ReorderBuffer::Frame* a, const ReorderBuffer::Frame* b)
+{
+    if (a->s_timestamp != b->s_timestamp) {
+        return a->s_timestamp > b->s_timestamp;
+    }
+    return a->s_sequence > b->s_sequence;
+}
+
+/**
+ * constructor
+ *
+ * @param unit   - what the window is measured in.
+ * @param window - timestamp ticks or frames frames are held for.
+ * @throw std::string - for a FRAMES window of 0.
+ */
+ReorderBuffer::ReorderBuffer(Unit unit, uint64_t window) :
+    m_unit(unit), m_window(window), m_sequence(0), m_newest(0), m_lastOut(0),
+    m_anyOut(false), m_expiring(false),
+    m_frames(0), m_late(0), m_maxLateness(0), m_overflows(0), m_highWater(0)
+{
+    if ((unit == FRAMES) && (window == 0)) {
+        throw std::string("A frame reordering window must hold at least one frame");
+    }
+}
+/**
+ * destructor
+ *    Frames not yet handed out are lost.
+ */
+ReorderBuffer::~ReorderBuffer()
+{
+    for (size_t i = 0; i < m_heap.size(); i++) {
+        delete m_heap[i];
+    }
+    for (size_t i = 0; i < m_free.size(); i++) {
+        delete m_free[i];
+    }
+}
+/**
+ * add
+ *    Hold on to a copy of a frame.
+ *
+ * @param pFrame    - the frame.
+ * @param nBytes    - its size.
+ * @param timestamp - its ring item timestamp, which orders it.
+ * @param asad      - its asadIdx, handed back with it.
+ * @param received  - its arrival time, handed back with it.
+ */
+void
+ReorderBuffer::add(
+    const void* pFrame, size_t nBytes, uint64_t timestamp, unsigned asad,
+    uint32_t received
+)
+{
+    Frame* pF;
+    if (m_free.empty()) {
+        pF = new Frame;
+    } else {
+        pF = m_free.back();
+        m_free.pop_back();
+    }
+    pF->s_timestamp = timestamp;
+    pF->s_sequence  = m_sequence++;
+    pF->s_asad      = asad;
+    pF->s_received  = received;
+    pF->s_data.resize(nBytes);
+    memcpy(pF->s_data.data(), pFrame, nBytes);
+
+    m_heap.push_back(pF);
+    std::push_heap(m_heap.begin(), m_heap.end(), newer);
+    if (m_heap.size() > m_highWater) m_highWater = m_heap.size();
+    m_frames++;
+
+    if (m_anyOut && (timestamp < m_lastOut)) {
+        m_late++;
+        m_maxLateness = std::max(m_maxLateness, m_lastOut - timestamp);
+    }
+    if (timestamp > m_newest) m_newest = timestamp;
+}
+/**
+ * ready
+ *    Return the oldest frame if it can be handed out.  Call pop once it's
+ *    been used.  After expire, this hands out every frame and, once
+ *    there are none, forgets the timestamps it's seen.
+ *
+ * @return const Frame* - the oldest frame or nullptr if it must still be
+ *                        held (or there are no frames).
+ */
+const ReorderBuffer::Frame*
+ReorderBuffer::ready()
+{
+    if (m_heap.empty()) {
+        if (m_expiring) {
+            m_expiring = false;
+            m_anyOut   = false;
+            m_newest   = 0;
+            m_lastOut  = 0;
+        }
+        return nullptr;
+    }
+    const Frame* pOldest = m_heap.front();
+    if (m_expiring) {
+        return pOldest;
+    }
+    if (m_unit == FRAMES) {
+        return m_heap.size() > m_window ? pOldest : nullptr;
+    }
+    if ((m_newest - pOldest->s_timestamp >= m_window) || (m_heap.size() > MAX_HELD)) {
+        return pOldest;
+    }
+    return nullptr;
+}
+/**
+ * pop
+ *    Discard the oldest frame (the one ready returned).
+ */
+void
+ReorderBuffer::pop()
+{
+    if (m_heap.empty()) return;
+
+    std::pop_heap(m_heap.begin(), m_heap.end(), newer);
+    Frame* pF = m_heap.back();
+    m_heap.pop_back();
+
+    if (!m_expiring && (m_unit == TICKS) && (m_newest - pF->s_timestamp < m_window)) {
+        m_overflows++;
+    }
+    if (!m_anyOut || (pF->s_timestamp > m_lastOut)) {
+        m_lastOut = pF->s_timestamp;
+    }
+    m_anyOut = true;
+    m_free.push_back(pF);
+}
+/**
+ * expire
+ *    Hand out all frames being held (see ready).
+ */
+void
+ReorderBuffer::expire()
+{
+    m_expiring = true;
+}
+/**
+ * logStatistics
+ *    Log how many frames were reordered, how many were late and how full
+ *    the buffer got.
+ */
+void
+ReorderBuffer::logStatistics()
+{
+    LOG_INFO() << "Timestamp reordering over " << m_window
+        << (m_unit == TICKS ? " ticks: " : " frames: ") << m_frames << " frames, "
+        << m_late << " late (by up to " << m_maxLateness << " ticks), at most "
+        << m_highWater << " frames held";
+    if (m_overflows) {
+        LOG_WARN() << m_overflows << " frames written before the reordering window passed to hold at most "
+            << MAX_HELD << " frames";
+    }
+}
+/**
+ * unit
+ *    @param name - "ticks" or "frames".
+ *    @return Unit
+ *    @throw std::string - for any other name.
+ */
+ReorderBuffer::Unit
+ReorderBuffer::unit(const std::string& name)
+{
+    if (name == "ticks")  return TICKS;
+    if (name == "frames") return FRAMES;
+    throw std::string("Unknown reordering window unit: '") + name + "'";
+}
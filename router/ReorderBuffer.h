@@ -0,0 +1,103 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  ReorderBuffer.h
+ *  @brief: Put frames back in timestamp order before they're written.
+ */
+#ifndef REORDERBUFFER_H
+#define REORDERBUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * @class ReorderBuffer
+ *    The frames of a CoBo's AsAds arrive interleaved and only roughly in
+ *    timestamp order, which makes the event builder hold wider windows.
+ *    A ReorderBuffer holds frames back in a heap ordered by their ring item
+ *    timestamp (eventTime or eventIdx) and hands them out oldest first once
+ *    they're outside the window:
+ *
+ *    -  In TICKS, a frame is handed out once a frame at least window ticks
+ *       newer has arrived.
+ *    -  In FRAMES, at most window frames are held; adding one more hands
+ *       out the oldest.
+ *
+ *    Frames with equal timestamps keep their arrival order.  A frame
+ *    older than one already handed out is late: it's counted and handed
+ *    out next, so no data are lost.  In TICKS, at most MAX_HELD frames are
+ *    held no matter what the window is; frames pushed out early are counted
+ *    too.  expire hands out everything and starts afresh, since timestamps
+ *    start over with each run.
+ *
+ *    The buffer is not thread-safe; it belongs to a frame processor,
+ *    which serializes the receiver and assembly timer threads' use of it.
+ */
+class ReorderBuffer
+{
+public:
+    typedef enum _Unit {
+        TICKS, FRAMES
+    } Unit;
+
+    struct Frame {
+        uint64_t             s_timestamp;
+        uint64_t             s_sequence;      // Arrival order, for ties.
+        unsigned             s_asad;
+        uint32_t             s_received;      // See RouterStatistics::received.
+        std::vector<uint8_t> s_data;
+    };
+
+private:
+    Unit                 m_unit;
+    uint64_t             m_window;
+    std::vector<Frame*>  m_heap;            // Oldest on top.
+    std::vector<Frame*>  m_free;            // Recycled frames.
+    uint64_t             m_sequence;
+    uint64_t             m_newest;          // Newest timestamp added.
+    uint64_t             m_lastOut;         // Newest timestamp handed out.
+    bool                 m_anyOut;
+    bool                 m_expiring;
+
+    uint64_t             m_frames;
+    uint64_t             m_late;
+    uint64_t             m_maxLateness;     // Ticks.
+    uint64_t             m_overflows;
+    size_t               m_highWater;
+
+public:
+    ReorderBuffer(Unit unit, uint64_t window);
+    ~ReorderBuffer();
+
+    void         add(const void* pFrame, size_t nBytes, uint64_t timestamp,
+                     unsigned asad, uint32_t received);
+    const Frame* ready();
+    void         pop();
+    void         expire();
+
+    void logStatistics();
+
+    static Unit unit(const std::string& name);
+
+private:
+    ReorderBuffer(const ReorderBuffer&);
+    ReorderBuffer& operator=(const ReorderBuffer&);
+};
+
+#endif
@@ -0,0 +1,194 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  RingItemBatch.cpp
+ *  @brief: Implements the ring item batch.
+ */
+#include "RingItemBatch.h"
+#include <CRingBuffer.h>
+#include <sstream>
+#include <string.h>
+
+/**
+ * constructor
+ *
+ * @param maxBytes       - Size of the batch buffer.  This is the most data
+ *                         that will go into the ring in a single put.
+ * @param maxLatencyUsec - Longest time (microseconds) an item can sit in
+ *                         the batch before the batch is due to be flushed.
+ */
+RingItemBatch::RingItemBatch(size_t maxBytes, unsigned maxLatencyUsec) :
+    m_buffer(maxBytes), m_used(0), m_items(0),
+    m_maxLatency(maxLatencyUsec), m_batches(0), m_flushedItems(0)
+{
+    memset(m_histogram, 0, sizeof(m_histogram));
+}
+/**
+ * fits
+ *
+ * @param nbytes - size of a ring item.
+ * @return bool  - true if the item can be added to the batch as it is now.
+ */
+bool
+RingItemBatch::fits(size_t nbytes) const
+{
+    return (m_used + nbytes) <= m_buffer.size();
+}
+/**
+ * reserve
+ *    Returns a pointer to where the next item should be formatted.
+ *    The caller must have checked that the item fits.
+ *    The item is not part of the batch until commit is called.
+ *
+ * @param nbytes - size of the item that will be formatted.
+ * @return void* - where to format it.
+ */
+void*
+RingItemBatch::reserve(size_t nbytes)
+{
+    return m_buffer.data() + m_used;
+}
+/**
+ * commit
+ *    Adds the item formatted at the last reserve to the batch.
+ *
+ * @param nbytes - number of bytes in the item.
+ */
+void
+RingItemBatch::commit(size_t nbytes)
+{
+    if (m_items == 0) {
+        m_oldest = Clock::now();
+    }
+    m_used += nbytes;
+    m_items++;
+}
+/**
+ * empty
+ *   @return bool - true if there's nothing in the batch.
+ */
+bool
+RingItemBatch::empty() const
+{
+    return m_items == 0;
+}
+/**
+ * expired
+ *   @return bool - true if the oldest item in the batch has waited longer
+ *                  than the latency limit.
+ */
+bool
+RingItemBatch::expired() const
+{
+    if (m_items == 0) return false;
+    return (Clock::now() - m_oldest) >= m_maxLatency;
+}
+/**
+ * capacity
+ *   @return size_t - the largest batch in bytes.
+ */
+size_t
+RingItemBatch::capacity() const
+{
+    return m_buffer.size();
+}
+/**
+ * size
+ *   @return size_t - bytes of ring items in the batch now.
+ */
+size_t
+RingItemBatch::size() const
+{
+    return m_used;
+}
+/**
+ * flush
+ *    Put the batch into the ring with a single put and start a new batch.
+ *    This blocks if the ring does not have room for the batch.
+ *
+ * @param ring - ring into which the batch is put.
+ */
+void
+RingItemBatch::flush(CRingBuffer& ring)
+{
+    if (m_items == 0) return;
+
+    ring.put(m_buffer.data(), m_used);
+
+    unsigned bin = 0;
+    for (size_t n = m_items; n > 1 && bin < (HISTOGRAM_BINS - 1); n >>= 1) {
+        bin++;
+    }
+    m_histogram[bin]++;
+    m_batches++;
+    m_flushedItems += m_items;
+
+    m_used  = 0;
+    m_items = 0;
+}
+/**
+ * histogram
+ *   @return const uint64_t* - pointer to the HISTOGRAM_BINS bins of the
+ *                             batch size histogram.
+ */
+const uint64_t*
+RingItemBatch::histogram() const
+{
+    return m_histogram;
+}
+/**
+ * batches
+ *    @return uint64_t - number of batches flushed so far.
+ */
+uint64_t
+RingItemBatch::batches() const
+{
+    return m_batches;
+}
+/**
+ * items
+ *    @return uint64_t - number of items flushed so far.
+ */
+uint64_t
+RingItemBatch::items() const
+{
+    return m_flushedItems;
+}
+/**
+ * describeHistogram
+ *    Produce a human readable rendition of the non-empty histogram bins.
+ *
+ * @return std::string - e.g. "1: 10 2-3: 4 4-7: 1000"
+ */
+std::string
+RingItemBatch::describeHistogram() const
+{
+    std::ostringstream s;
+    for (unsigned i = 0; i < HISTOGRAM_BINS; i++) {
+        if (m_histogram[i] == 0) continue;
+        uint64_t low  = uint64_t(1) << i;
+        uint64_t high = (uint64_t(1) << (i+1)) - 1;
+        s << low;
+        if (i == HISTOGRAM_BINS - 1) {
+            s << "+";
+        } else if (high != low) {
+            s << '-' << high;
+        }
+        s << ": " << m_histogram[i] << ' ';
+    }
+    return s.str();
+}
@@ -0,0 +1,80 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  RingItemBatch.h
+ *  @brief: Gathers ring items so that several can be put with one ring put.
+ */
+#ifndef RINGITEMBATCH_H
+#define RINGITEMBATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <chrono>
+
+class CRingBuffer;
+
+/**
+ * @class RingItemBatch
+ *    Ring items are formatted directly into a buffer owned by this object.
+ *    When the batch is flushed, the whole buffer goes into the ring with a
+ *    single put, so consumers see one put-pointer update per batch rather
+ *    than one per item.
+ *
+ *    A batch is due to be flushed when either it can't hold the next item
+ *    or its oldest item has waited longer than the latency limit.
+ *    The batch keeps a histogram of the number of items in each flushed batch.
+ *    Bin i counts batches with [2^i, 2^(i+1)) items.
+ */
+class RingItemBatch
+{
+public:
+    static const unsigned HISTOGRAM_BINS = 16;
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::vector<uint8_t>  m_buffer;
+    size_t                m_used;
+    size_t                m_items;
+    std::chrono::microseconds m_maxLatency;
+    Clock::time_point     m_oldest;
+
+    uint64_t              m_histogram[HISTOGRAM_BINS];
+    uint64_t              m_batches;
+    uint64_t              m_flushedItems;
+public:
+    RingItemBatch(size_t maxBytes, unsigned maxLatencyUsec);
+
+    bool     fits(size_t nbytes) const;
+    void*    reserve(size_t nbytes);
+    void     commit(size_t nbytes);
+
+    bool     empty()    const;
+    bool     expired()  const;
+    size_t   capacity() const;
+    size_t   size()     const;
+
+    void     flush(CRingBuffer& ring);
+
+    const uint64_t* histogram() const;
+    uint64_t batches() const;
+    uint64_t items()   const;
+    std::string describeHistogram() const;
+};
+
+#endif
@@ -0,0 +1,340 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  RingOutput.cpp
+ *  @brief: Implement the output ring and its writer thread.
+ */
+#include "RingOutput.h"
+#include "RingWriter.h"
+#include "FrameQueue.h"
+#include "FrameJournal.h"
+#include <CRingBuffer.h>
+#include <utl/Logging.h>
+#include <algorithm>
+#include <chrono>
+
+const size_t RING_BUFFER_SIZE(32*1024*1024);
+
+// Most frames the writer thread takes from one queue before moving on
+// to the next queue:
+
+static const unsigned MAX_FRAMES_PER_PASS(256);
+
+// How long the writer thread sleeps when there's nothing to do:
+
+static const unsigned WRITER_IDLE_USEC(50);
+
+/**
+ * constructor
+ *    If necessary creates the ringbuffer and then becomes the producer.
+ *    We're going to make the ring buffer bigger than usual (see
+ *    RING_BUFFER_SIZE const).  Failures are reported by CRingBuffer
+ *    as exceptions.
+ *
+ * @param ringName - name of the ring.
+ */
+RingOutput::RingOutput(const std::string& ringName) :
+    m_ringName(ringName),
+    m_writer(new RingWriter(CRingBuffer::createAndProduce(ringName,  RING_BUFFER_SIZE))),
+    m_batchBytes(0), m_batchLatency(0), m_stopWriter(false)
+{}
+/**
+ * destructor
+ *    Frames still queued are handed to the ring writer before the writer
+ *    thread is stopped.  Destroying the writer flushes any partial batch;
+ *    unlike flush, journaled frames stay in the journal.
+ */
+RingOutput::~RingOutput()
+{
+    waitForQueues();
+    stopWriter();
+}
+/**
+ * addQueue
+ *    Creates a queue for a new frame source.  The writer thread is started
+ *    if it isn't already running.
+ *
+ * @param nbytes - Size of the queue.
+ * @return FrameQueue* - The queue.  It's owned by this object and lives
+ *                       as long as it does.
+ */
+FrameQueue*
+RingOutput::addQueue(size_t nbytes)
+{
+    FrameQueue* pQueue = new FrameQueue(nbytes);
+    {
+        std::lock_guard<std::mutex> lock(m_writerLock);
+        m_queues.push_back(std::unique_ptr<FrameQueue>(pQueue));
+    }
+    startWriter();
+    return pQueue;
+}
+/**
+ * setBatching
+ *    Turns on batching of ring items.  Batching requires the writer
+ *    thread, even without a queue, since something has to flush partial
+ *    batches whose oldest frame has waited longer than the latency
+ *    limit; otherwise the last frames before a lull would sit in the
+ *    batch until data starts flowing again.
+ *
+ * @param maxBytes       - Largest batch.  This is clamped so that a batch
+ *                         can't be more than half the ring.
+ * @param maxLatencyUsec - Longest a frame waits in a partial batch.
+ */
+void
+RingOutput::setBatching(size_t maxBytes, unsigned maxLatencyUsec)
+{
+    if (maxBytes > RING_BUFFER_SIZE/2) {
+        maxBytes = RING_BUFFER_SIZE/2;
+    }
+    stopWriter();                   // Idle time depends on the latency.
+    {
+        std::lock_guard<std::mutex> lock(m_writerLock);
+        m_batchBytes   = maxBytes;
+        m_batchLatency = maxLatencyUsec;
+        m_writer->setBatching(m_batchBytes, m_batchLatency);
+    }
+    startWriter();
+}
+/**
+ * setCongestionPolicy
+ *    Sets what's done with frames when the ring is full
+ *    (see CongestionTracker).
+ *
+ * @param policy         - the policy.
+ * @param sampleInterval - for SAMPLE, one in this many frames is kept
+ *                         while the ring is congested.
+ * @param spillDirectory - for SPILL, where spill files are made.  They are
+ *                         named after the ring.
+ */
+void
+RingOutput::setCongestionPolicy(
+    CongestionTracker::Policy policy, unsigned sampleInterval,
+    const std::string& spillDirectory
+)
+{
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    m_writer->setCongestionPolicy(policy, sampleInterval, spillDirectory + "/" + m_ringName);
+}
+/**
+ * setJournal
+ *    Use the journal congestion policy: frames that don't fit in the ring
+ *    go to a journal on disk and the writer thread puts them into the ring
+ *    as room appears.  Segments left by an earlier journal for this ring
+ *    in the same directory are recovered.
+ *
+ * @param directory    - where the journal segment files live.  They are
+ *                       named after the ring.
+ * @param maxBytes     - most disk space the journal can use.
+ * @param segmentBytes - size of each segment file.
+ */
+void
+RingOutput::setJournal(const std::string& directory, size_t maxBytes, size_t segmentBytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_writerLock);
+        m_writer->setJournal(
+            new FrameJournal(directory + "/" + m_ringName, maxBytes, segmentBytes)
+        );
+    }
+    startWriter();
+}
+/**
+ * setStatistics
+ *    Count the frames going into the ring, the time spent waiting for room
+ *    in it and how long frames took to get there (see RouterStatistics).
+ *
+ * @param pStats - where the counts go.
+ */
+void
+RingOutput::setStatistics(OutputStatistics* pStats)
+{
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    m_writer->setStatistics(pStats);
+}
+/**
+ * write
+ *    Write a frame from the calling thread rather than through a queue.
+ *
+ * @param record - describes the frame (only the size, timestamp and
+ *                 source id are used).
+ * @param pFrame - the frame bytes.
+ */
+void
+RingOutput::write(const FrameRecord& record, const void* pFrame)
+{
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    m_writer->write(record, pFrame);
+}
+/**
+ * writeItem
+ *    Write a complete ring item, such as a state change, from the calling
+ *    thread.  The frames already in the queues are written first so the
+ *    item follows them in the ring.
+ *
+ * @param pItem - the ring item.
+ */
+void
+RingOutput::writeItem(const void* pItem)
+{
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    for (size_t i = 0; i < m_queues.size(); i++) {
+        writeQueued(*m_queues[i], m_queues[i]->records());
+    }
+    m_writer->writeItem(pItem);
+}
+/**
+ * flush
+ *    Waits for the writer thread to empty the queues and then puts any
+ *    partially filled batch into the ring.  This is called when
+ *    the run stops.
+ */
+void
+RingOutput::flush()
+{
+    waitForQueues();
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    m_writer->flush();
+}
+/**
+ * logStatistics
+ *    Logs the batch size distribution, if batching.  Queue statistics are
+ *    logged by the frame sources that own them.
+ */
+void
+RingOutput::logStatistics()
+{
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    LOG_INFO() << "Ring " << m_ringName << ':';
+    m_writer->logStatistics();
+}
+/**
+ * getRingName
+ *    @return std::string - name of the ring we write.
+ */
+std::string
+RingOutput::getRingName() const
+{
+    return m_ringName;
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * startWriter
+ *    Start the writer thread if it's not already running.
+ */
+void
+RingOutput::startWriter()
+{
+    if (!m_writerThread.joinable()) {
+        m_stopWriter = false;
+        m_writerThread = std::thread(&RingOutput::writeFrames, this);
+    }
+}
+/**
+ * stopWriter
+ *    Stop the writer thread if it's running.  Frames still in the queues
+ *    stay there.
+ */
+void
+RingOutput::stopWriter()
+{
+    if (m_writerThread.joinable()) {
+        m_stopWriter = true;
+        m_writerThread.join();
+    }
+}
+/**
+ * waitForQueues
+ *    Waits for the writer thread, if it's running, to empty the queues.
+ */
+void
+RingOutput::waitForQueues()
+{
+    std::vector<FrameQueue*> queues;
+    {
+        std::lock_guard<std::mutex> lock(m_writerLock);
+        for (size_t i = 0; i < m_queues.size(); i++) {
+            queues.push_back(m_queues[i].get());
+        }
+    }
+    if (m_writerThread.joinable()) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            while (!queues[i]->empty()) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+}
+/**
+ * writeFrames
+ *    The writer thread.  Moves frames from the queues to the ring writer,
+ *    replays journaled frames (ahead of the queues, since they're older)
+ *    and flushes batches that have waited too long.  Queues are visited
+ *    round robin, at most MAX_FRAMES_PER_PASS frames from each at a time,
+ *    so a busy source can't starve the others.
+ *    When there's nothing to do it naps for WRITER_IDLE_USEC or a quarter
+ *    of the batch latency, whichever is less, so a frame waits at most
+ *    about 1.25 times the batch latency.
+ */
+void
+RingOutput::writeFrames()
+{
+    unsigned idleUsec = WRITER_IDLE_USEC;
+    if (m_batchBytes && (m_batchLatency/4 < idleUsec)) {
+        idleUsec = m_batchLatency/4 > 0 ? m_batchLatency/4 : 1;
+    }
+    std::chrono::microseconds idle(idleUsec);
+
+    while (!m_stopWriter) {
+        unsigned written = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_writerLock);
+            written += m_writer->replay(MAX_FRAMES_PER_PASS);
+            for (size_t i = 0; i < m_queues.size(); i++) {
+                written += writeQueued(*m_queues[i], MAX_FRAMES_PER_PASS);
+            }
+            m_writer->flushIfExpired();
+        }
+        if (written == 0) {
+            std::this_thread::sleep_for(idle);
+        }
+    }
+}
+/**
+ * writeQueued
+ *    Move frames from a queue to the ring writer.  The caller must hold
+ *    m_writerLock.
+ *
+ * @param queue     - the queue.
+ * @param maxFrames - most frames to move.
+ * @return unsigned - number of frames moved.
+ */
+unsigned
+RingOutput::writeQueued(FrameQueue& queue, uint64_t maxFrames)
+{
+    const FrameRecord* pRecord;
+    unsigned n = 0;
+    while ((n < maxFrames) && (pRecord = queue.front())) {
+        m_writer->write(*pRecord, pRecord + 1);
+        queue.pop();
+        n++;
+    }
+    return n;
+}
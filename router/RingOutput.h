@@ -0,0 +1,93 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  RingOutput.h
+ *  @brief: An output ring and the thread that writes to it.
+ */
+#ifndef RINGOUTPUT_H
+#define RINGOUTPUT_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "CongestionTracker.h"
+
+class RingWriter;
+class FrameQueue;
+struct FrameRecord;
+struct OutputStatistics;
+
+/**
+ * @class RingOutput
+ *    Owns a ring (through a RingWriter) and the writer thread that drains
+ *    frame queues into it.  Each frame source (normally an
+ *    NSCLDAQDataProcessor) that feeds the ring gets its own FrameQueue so
+ *    every queue has exactly one producer and one consumer.
+ *    The writer thread visits the queues round robin.
+ *
+ *    Sources can instead write directly (see write), in which case the
+ *    writer thread is only needed to flush batches that have waited too long
+ *    and to replay journaled frames.
+ */
+class RingOutput
+{
+private:
+    std::string                 m_ringName;
+    std::unique_ptr<RingWriter> m_writer;
+    std::vector<std::unique_ptr<FrameQueue> > m_queues;
+    size_t        m_batchBytes;             // 0 means not batching.
+    unsigned      m_batchLatency;           // usec.
+    std::mutex    m_writerLock;             // Serializes m_writer, m_queues.
+    std::thread   m_writerThread;
+    std::atomic<bool> m_stopWriter;
+
+public:
+    RingOutput(const std::string& ringName);
+    ~RingOutput();
+
+    FrameQueue* addQueue(size_t nbytes);
+    void        setBatching(size_t maxBytes, unsigned maxLatencyUsec);
+    void        setCongestionPolicy(CongestionTracker::Policy policy,
+                                    unsigned sampleInterval,
+                                    const std::string& spillDirectory);
+    void        setJournal(const std::string& directory, size_t maxBytes,
+                           size_t segmentBytes);
+    void        setStatistics(OutputStatistics* pStats);
+
+    void        write(const FrameRecord& record, const void* pFrame);
+    void        writeItem(const void* pItem);
+    void        flush();
+    void        logStatistics();
+
+    std::string getRingName() const;
+
+private:
+    RingOutput(const RingOutput&);
+    RingOutput& operator=(const RingOutput&);
+
+    void startWriter();
+    void stopWriter();
+    void waitForQueues();
+    void writeFrames();
+    unsigned writeQueued(FrameQueue& queue, uint64_t maxFrames);
+};
+
+#endif
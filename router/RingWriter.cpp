@@ -0,0 +1,548 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  RingWriter.cpp
+ *  @brief: Implements the ring writer.
+ */
+#include "RingWriter.h"
+#include "RingItemBatch.h"
+#include "FrameQueue.h"
+#include "FrameJournal.h"
+#include "RouterStatistics.h"
+#include <CRingBuffer.h>
+#include <CRingTextItem.h>
+#include <DataFormat.h>
+#include <utl/Logging.h>
+#include <string.h>
+#include <time.h>
+
+// A congestion period ends once this fraction of the ring is free:
+
+static const size_t CONGESTION_CLEAR_DIVISOR(8);
+
+/**
+ * constructor
+ *
+ * @param pRing - ring we are the producer for.  We take ownership of the
+ *                CRingBuffer object (not the ring itself).
+ */
+RingWriter::RingWriter(CRingBuffer* pRing) :
+    m_ring(pRing), m_journalFull(false), m_pStats(nullptr)
+{}
+/**
+ * destructor
+ *    Flushes any partial batch.  Journaled frames are left on disk for the
+ *    journal to recover when the router next starts rather than waiting,
+ *    perhaps forever, for room in the ring.  The unique_ptrs take care of
+ *    the rest.
+ */
+RingWriter::~RingWriter()
+{
+    if (m_batch.get()) {
+        flushBatch();
+    }
+}
+
+/**
+ * setBatching
+ *    Turns on batching of ring items.
+ *
+ * @param maxBytes       - Largest batch.
+ * @param maxLatencyUsec - Longest a frame waits in a partial batch.
+ */
+void
+RingWriter::setBatching(size_t maxBytes, unsigned maxLatencyUsec)
+{
+    flush();
+    m_batch.reset(new RingItemBatch(maxBytes, maxLatencyUsec));
+}
+/**
+ * batching
+ *   @return bool - true if frames are being batched.
+ */
+bool
+RingWriter::batching() const
+{
+    return m_batch.get() != nullptr;
+}
+/**
+ * setCongestionPolicy
+ *    Sets what's done with frames when the ring is full.
+ *
+ * @param policy         - the policy.  BLOCK waits for room.
+ * @param sampleInterval - for SAMPLE, one in this many frames is kept
+ *                         while the ring is congested.
+ * @param spillPrefix    - for SPILL, the path and start of the name of
+ *                         the spill file.
+ */
+void
+RingWriter::setCongestionPolicy(
+    CongestionTracker::Policy policy, unsigned sampleInterval, const std::string& spillPrefix
+)
+{
+    flush();
+    m_journal.reset();
+    if (policy == CongestionTracker::BLOCK) {
+        m_congestion.reset();
+    } else {
+        size_t clearBytes = m_ring->getUsage().s_bufferSpace/CONGESTION_CLEAR_DIVISOR;
+        m_congestion.reset(
+            new CongestionTracker(policy, sampleInterval, clearBytes, spillPrefix)
+        );
+    }
+}
+/**
+ * setJournal
+ *    Use the journal congestion policy.  Frames that won't fit in the ring
+ *    go into the journal, as do all frames after them until the journal
+ *    has been emptied into the ring, so frames reach the ring in order.
+ *    Frames the journal recovered from an earlier run will be the first
+ *    into the ring.
+ *
+ * @param pJournal - the journal.  We take ownership of it.
+ */
+void
+RingWriter::setJournal(FrameJournal* pJournal)
+{
+    flush();
+    size_t clearBytes = m_ring->getUsage().s_bufferSpace/CONGESTION_CLEAR_DIVISOR;
+    m_congestion.reset(
+        new CongestionTracker(CongestionTracker::JOURNAL, 1, clearBytes, "")
+    );
+    m_journal.reset(pJournal);
+}
+/**
+ * setStatistics
+ *    Start counting what goes into the ring.
+ *
+ * @param pStats - where the counts go (see RouterStatistics).
+ */
+void
+RingWriter::setStatistics(OutputStatistics* pStats)
+{
+    m_pStats = pStats;
+}
+/**
+ * write
+ *    Write a frame to the ring, either directly or through the batch.
+ *
+ * @param record - describes the frame.
+ * @param pFrame - the frame itself.
+ */
+void
+RingWriter::write(const FrameRecord& record, const void* pFrame)
+{
+    if (m_congestion.get() && !admit(record, pFrame)) {
+        return;
+    }
+    put(record, pFrame);
+}
+/**
+ * writeItem
+ *    Put a complete ring item (e.g. a state change) into the ring.  Anything
+ *    journaled or batched goes first so the item follows every frame
+ *    written before it.  This waits for room; it's not subject to the
+ *    congestion policy.
+ *
+ * @param pItem - the ring item; its header gives its size.
+ */
+void
+RingWriter::writeItem(const void* pItem)
+{
+    flush();
+    
+    size_t nbytes = static_cast<const RingItemHeader*>(pItem)->s_size;
+    waitForPutSpace(nbytes);
+    m_ring->put(const_cast<void*>(pItem), nbytes);
+}
+/**
+ * flush
+ *    Empties the journal into the ring, waiting for room as needed, and
+ *    puts any partially filled batch into the ring.  If the ring is
+ *    congested, the congestion period is ended and reported.
+ */
+void
+RingWriter::flush()
+{
+    if (m_journal.get()) {
+        while (m_journal->front()) {
+            replayOldest();
+        }
+    }
+    if (m_batch.get()) {
+        flushBatch();
+    }
+    if (m_congestion.get() && m_congestion->congested()) {
+        reportCongestion();
+    }
+}
+/**
+ * flushIfExpired
+ *    Puts the partially filled batch into the ring if its oldest frame has
+ *    waited longer than the latency limit.  Also ends a congestion period
+ *    if the ring has drained while no frames were arriving.
+ */
+void
+RingWriter::flushIfExpired()
+{
+    if (m_batch.get() && m_batch->expired()) {
+        flushBatch();
+    }
+    if (m_congestion.get() && m_congestion->congested() && !backlogged()
+        && m_congestion->cleared(m_ring->availablePutSpace(), pendingBytes())) {
+        reportCongestion();
+    }
+}
+/**
+ * replay
+ *    Moves frames from the journal into the ring while there's room for
+ *    them (see replayOldest).  This never waits.
+ *
+ * @param maxFrames - most frames to move.
+ * @return unsigned - number of frames moved.
+ */
+unsigned
+RingWriter::replay(unsigned maxFrames)
+{
+    if (!m_journal.get()) return 0;
+
+    size_t headerSize = sizeof(RingItemHeader) + sizeof(BodyHeader);
+    unsigned n = 0;
+    const FrameRecord* pRecord;
+    while ((n < maxFrames) && (pRecord = m_journal->front())) {
+        size_t needed = headerSize + pRecord->s_frameSize + pendingBytes();
+        if (m_ring->availablePutSpace() < needed) {
+            break;
+        }
+        replayOldest();
+        n++;
+    }
+    return n;
+}
+/**
+ * logStatistics
+ *    Logs the batch size distribution, if batching, and what the
+ *    congestion policy did, if there is one.
+ */
+void
+RingWriter::logStatistics()
+{
+    if (m_batch.get()) {
+        LOG_INFO() << "Ring item batches: " << m_batch->batches()
+            << " holding " << m_batch->items() << " frames";
+        LOG_INFO() << "Batch size distribution (frames: batches): "
+            << m_batch->describeHistogram();
+    }
+    if (m_congestion.get()) {
+        m_congestion->logStatistics();
+    }
+    if (m_journal.get()) {
+        m_journal->logStatistics();
+    }
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * put
+ *    Put a frame in the ring, either directly or through the batch.
+ *
+ * @param record - describes the frame.
+ * @param pFrame - the frame itself.
+ */
+void
+RingWriter::put(const FrameRecord& record, const void* pFrame)
+{
+    if (m_batch.get()) {
+        batchFrame(record, pFrame);
+    } else {
+        commitFrame(record, pFrame);
+    }
+}
+/**
+ * commitFrame
+ *    Puts a frame into the ring as a PHYSICS_EVENT item without first
+ *    building it in a CPhysicsEventItem.  The ring item and body headers
+ *    are built on the stack and, once the ring has room for the whole item,
+ *    the headers and then the frame bytes are put directly from where they
+ *    live.  The frame is therefore copied exactly once; into ring memory.
+ *
+ *    Waiting for room for the whole item before the first put means
+ *    consumers never see a header whose body is stuck behind a full ring.
+ *
+ * @param record - describes the frame.
+ * @param pFrame - pointer to the frame (header and all).
+ */
+void
+RingWriter::commitFrame(const FrameRecord& record, const void* pFrame)
+{
+    uint8_t headers[sizeof(RingItemHeader) + sizeof(BodyHeader)];
+    formatHeaders(headers, record);
+    
+    waitForPutSpace(sizeof(headers) + record.s_frameSize);
+    m_ring->put(headers, sizeof(headers));
+    m_ring->put(const_cast<void*>(pFrame), record.s_frameSize);
+    
+    if (m_pStats) {
+        m_pStats->s_frames.fetch_add(1, std::memory_order_relaxed);
+        m_pStats->s_bytes.fetch_add(sizeof(headers) + record.s_frameSize, std::memory_order_relaxed);
+        if (record.s_received) {            // Only a sample of frames are timed.
+            RouterStatistics::recordLatency(*m_pStats, record.s_received, RouterStatistics::received());
+        }
+    }
+}
+/**
+ * batchFrame
+ *    Formats a frame as a ring item directly into the current batch.
+ *    If the item won't fit, the batch is flushed first.  Frames too big to
+ *    ever fit in a batch are committed on their own after the batch is
+ *    flushed so that ring order matches frame order.
+ *
+ * @param record - describes the frame.
+ * @param pFrame - pointer to the frame (header and all).
+ */
+void
+RingWriter::batchFrame(const FrameRecord& record, const void* pFrame)
+{
+    size_t headerSize = sizeof(RingItemHeader) + sizeof(BodyHeader);
+    size_t itemSize   = headerSize + record.s_frameSize;
+    
+    if (!m_batch->fits(itemSize)) {
+        flushBatch();
+    }
+    if (!m_batch->fits(itemSize)) {
+        commitFrame(record, pFrame);              // Bigger than a batch.
+        return;
+    }
+    
+    uint8_t* pItem = static_cast<uint8_t*>(m_batch->reserve(itemSize));
+    formatHeaders(pItem, record);
+    memcpy(pItem + headerSize, pFrame, record.s_frameSize);
+    m_batch->commit(itemSize);
+    if (m_pStats) {
+        m_batchReceived.push_back(record.s_received);
+    }
+    
+    if (m_batch->expired()) {
+        flushBatch();
+    }
+}
+/**
+ * admit
+ *    Applies the congestion policy to a frame.  The space the frame needs
+ *    includes anything batched ahead of it, so once a frame is admitted
+ *    putting it (and the batch) into the ring can't block.
+ *    A congestion period that has cleared is reported first.
+ *    While there are frames in the journal, a frame has to wait its turn
+ *    so, as far as the policy is concerned, there's no room for it.
+ *
+ * @param record - describes the frame.
+ * @param pFrame - pointer to the frame (header and all).
+ * @return bool  - true if the frame should be written to the ring.
+ */
+bool
+RingWriter::admit(const FrameRecord& record, const void* pFrame)
+{
+    size_t headerSize = sizeof(RingItemHeader) + sizeof(BodyHeader);
+    size_t itemSize   = headerSize + record.s_frameSize;
+    size_t freeBytes  = m_ring->availablePutSpace();
+    
+    if (backlogged()) {
+        freeBytes = 0;
+    } else if (m_congestion->cleared(freeBytes, itemSize + pendingBytes())) {
+        reportCongestion();
+        freeBytes = m_ring->availablePutSpace();
+    }
+    
+    switch (m_congestion->decide(record, freeBytes, itemSize + pendingBytes())) {
+    case CongestionTracker::WRITE:
+        return true;
+    case CongestionTracker::SPILL_FRAME:
+        {
+            uint8_t headers[sizeof(RingItemHeader) + sizeof(BodyHeader)];
+            formatHeaders(headers, record);
+            m_congestion->spill(headers, sizeof(headers), record, pFrame);
+        }
+        return false;
+    case CongestionTracker::JOURNAL_FRAME:
+        journalFrame(record, pFrame);
+        return false;
+    case CongestionTracker::DISCARD:
+        return false;
+    }
+    return true;
+}
+/**
+ * journalFrame
+ *    Put a frame in the journal.  If the journal is full, we fall back on
+ *    waiting for the ring: the oldest journaled frames are put into the
+ *    ring, waiting for room, until the frame fits.  A frame too big for
+ *    a journal segment goes into the ring once the journal is empty.
+ *
+ * @param record - describes the frame.
+ * @param pFrame - pointer to the frame (header and all).
+ */
+void
+RingWriter::journalFrame(const FrameRecord& record, const void* pFrame)
+{
+    while (!m_journal->append(record, pFrame)) {
+        const FrameRecord* pOldest = m_journal->front();
+        if (!pOldest) {
+            put(record, pFrame);
+            return;
+        }
+        if (!m_journalFull) {
+            LOG_WARN() << "Frame journal is full; waiting for room in the ring";
+            m_journalFull = true;
+        }
+        replayOldest();
+    }
+    m_congestion->journaled(record);
+}
+/**
+ * replayOldest
+ *    Puts the oldest journaled frame into the ring, waiting for room, and
+ *    only then removes it from the journal so that, should the router die,
+ *    the frame is in the ring or still in the journal.  Journaled frames
+ *    therefore bypass the batch; anything batched was admitted ahead of
+ *    the journal and goes into the ring first.
+ */
+void
+RingWriter::replayOldest()
+{
+    const FrameRecord* pRecord = m_journal->front();
+    if (m_batch.get()) {
+        flushBatch();
+    }
+    commitFrame(*pRecord, pRecord + 1);
+    m_journal->pop();
+}
+/**
+ * flushBatch
+ *    Puts the batch into the ring.  When counting, we wait for room
+ *    ourselves so the wait is counted, and the frames in the batch are
+ *    counted once they're in the ring.
+ */
+void
+RingWriter::flushBatch()
+{
+    if (m_pStats && m_batch->size()) {
+        size_t nbytes = m_batch->size();
+        waitForPutSpace(nbytes);
+        m_batch->flush(*m_ring);
+
+        uint32_t now = RouterStatistics::received();
+        for (size_t i = 0; i < m_batchReceived.size(); i++) {
+            RouterStatistics::recordLatency(*m_pStats, m_batchReceived[i], now);
+        }
+        m_pStats->s_frames.fetch_add(m_batchReceived.size(), std::memory_order_relaxed);
+        m_pStats->s_bytes.fetch_add(nbytes, std::memory_order_relaxed);
+        m_batchReceived.clear();
+    } else {
+        m_batch->flush(*m_ring);
+    }
+}
+/**
+ * backlogged
+ *   @return bool - true if there are frames in the journal.
+ */
+bool
+RingWriter::backlogged() const
+{
+    return m_journal.get() && !m_journal->empty();
+}
+/**
+ * reportCongestion
+ *    Ends the congestion period and puts a MONITORED_VARIABLES item
+ *    describing it into the ring (see CongestionTracker::endPeriod).
+ *    Any batch is flushed first so the report follows the frames that
+ *    were written during the period.
+ */
+void
+RingWriter::reportCongestion()
+{
+    std::vector<std::string> report = m_congestion->endPeriod();
+    m_journalFull = false;
+    if (m_batch.get()) {
+        flushBatch();
+    }
+    CRingTextItem item(MONITORED_VARIABLES, report);
+    waitForPutSpace(item.size());
+    item.commitToRing(*m_ring);
+}
+/**
+ * pendingBytes
+ *   @return size_t - bytes batched but not yet put in the ring.
+ */
+size_t
+RingWriter::pendingBytes() const
+{
+    return m_batch.get() ? m_batch->size() : 0;
+}
+/**
+ * formatHeaders
+ *    Formats the ring item header and body header of a PHYSICS_EVENT
+ *    item that will wrap a frame.
+ *
+ * @param pDest  - where to put them; must have room for a RingItemHeader
+ *                 and a BodyHeader.
+ * @param record - describes the frame the item will wrap.
+ */
+void
+RingWriter::formatHeaders(void* pDest, const FrameRecord& record)
+{
+    pRingItemHeader pHeader = static_cast<pRingItemHeader>(pDest);
+    pBodyHeader     pBody   = reinterpret_cast<pBodyHeader>(pHeader + 1);
+    
+    pHeader->s_size      = sizeof(RingItemHeader) + sizeof(BodyHeader)
+        + record.s_frameSize;
+    pHeader->s_type      = PHYSICS_EVENT;
+    pBody->s_size        = sizeof(BodyHeader);
+    pBody->s_timestamp   = record.s_timestamp;
+    pBody->s_sourceId    = record.s_sourceId;
+    pBody->s_barrier     = 0;
+}
+/**
+ * waitForPutSpace
+ *    Blocks until the ring has at least the requested number of free bytes.
+ *    The ring's own put would do this for each put, but we need the space
+ *    for several puts to be there at once.  When counting, the time spent
+ *    waiting is counted as stall time.
+ *
+ * @param nbytes - number of bytes we need.
+ */
+void
+RingWriter::waitForPutSpace(size_t nbytes)
+{
+    if (m_ring->availablePutSpace() >= nbytes) return;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (m_ring->availablePutSpace() < nbytes) {
+        struct timespec wait = {0, 100*1000};     // 100usec.
+        nanosleep(&wait, nullptr);
+    }
+    if (m_pStats) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        m_pStats->s_stallNs.fetch_add(
+            (end.tv_sec - start.tv_sec)*1000000000ll + (end.tv_nsec - start.tv_nsec),
+            std::memory_order_relaxed
+        );
+    }
+}
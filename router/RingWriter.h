@@ -0,0 +1,98 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  RingWriter.h
+ *  @brief: Puts frames into an NSCLDAQ ring buffer as PHYSICS_EVENT items.
+ */
+#ifndef RINGWRITER_H
+#define RINGWRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "CongestionTracker.h"
+
+class CRingBuffer;
+class RingItemBatch;
+class FrameJournal;
+struct FrameRecord;
+struct OutputStatistics;
+
+/**
+ * @class RingWriter
+ *    Owns the output ring and knows how to wrap frames in ring items and
+ *    get them into the ring, either one at a time or in batches
+ *    (see RingItemBatch).
+ *
+ *    What happens when the ring is full is up to the congestion policy
+ *    (see CongestionTracker).  By default, the writer waits for room.
+ *    With a journal, frames that don't fit go into the journal and
+ *    whoever drives the writer must call replay regularly to move them
+ *    into the ring as room appears.
+ *
+ *    With statistics, the frames and bytes put in the ring, the time spent
+ *    waiting for room and the latency of each frame are counted.
+ *
+ *    The writer is not thread-safe.  Whoever drives it must serialize
+ *    access to it.
+ */
+class RingWriter
+{
+private:
+    std::unique_ptr<CRingBuffer>   m_ring;
+    std::unique_ptr<RingItemBatch> m_batch;
+    std::unique_ptr<CongestionTracker> m_congestion;  // Null to just block.
+    std::unique_ptr<FrameJournal>      m_journal;
+    bool                               m_journalFull;
+    OutputStatistics*                  m_pStats;      // Null if not counting.
+    std::vector<uint32_t>              m_batchReceived;  // Arrival of batched frames.
+public:
+    RingWriter(CRingBuffer* pRing);
+    ~RingWriter();
+
+    void setBatching(size_t maxBytes, unsigned maxLatencyUsec);
+    bool batching() const;
+    void setCongestionPolicy(CongestionTracker::Policy policy,
+                             unsigned sampleInterval, const std::string& spillPrefix);
+    void setJournal(FrameJournal* pJournal);
+    void setStatistics(OutputStatistics* pStats);
+
+    void write(const FrameRecord& record, const void* pFrame);
+    void writeItem(const void* pItem);
+    void flush();
+    void flushIfExpired();
+    unsigned replay(unsigned maxFrames);
+    void logStatistics();
+
+private:
+    void put(const FrameRecord& record, const void* pFrame);
+    void commitFrame(const FrameRecord& record, const void* pFrame);
+    void batchFrame(const FrameRecord& record, const void* pFrame);
+    bool admit(const FrameRecord& record, const void* pFrame);
+    void journalFrame(const FrameRecord& record, const void* pFrame);
+    void replayOldest();
+    void flushBatch();
+    bool backlogged() const;
+    void reportCongestion();
+    size_t pendingBytes() const;
+    static void formatHeaders(void* pDest, const FrameRecord& record);
+    void waitForPutSpace(size_t nbytes);
+};
+
+#endif
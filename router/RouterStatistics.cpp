@@ -0,0 +1,202 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  RouterStatistics.cpp
+ *  @brief: Implement the shared memory statistics block.
+ */
+#include "RouterStatistics.h"
+#include <utl/Logging.h>
+#include <chrono>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * constructor
+ *    Create (or replace) the shared memory block and zero it.
+ *
+ * @param name - name of the block; it's /<name> in /dev/shm.
+ * @throw std::string - if the block can't be made.
+ */
+RouterStatistics::RouterStatistics(const std::string& name) :
+    m_name(shmName(name)), m_pBlock(nullptr), m_nSources(0), m_nOutputs(0)
+{
+    int fd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::string("Unable to create statistics block ") + m_name + ": " + strerror(errno);
+    }
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, sizeof(StatisticsBlock)) == 0) {
+        p = mmap(nullptr, sizeof(StatisticsBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (p == MAP_FAILED) {
+        std::string msg = std::string("Unable to map statistics block ") + m_name + ": " + strerror(errno);
+        close(fd);
+        shm_unlink(m_name.c_str());
+        throw msg;
+    }
+    close(fd);
+
+    m_pBlock = static_cast<StatisticsBlock*>(p);       // Zero filled by ftruncate.
+    m_pBlock->s_version = STATISTICS_VERSION;
+    m_pBlock->s_started = time(nullptr);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_pBlock->s_magic   = STATISTICS_MAGIC;
+}
+/**
+ * destructor
+ *    Readers can no longer find the block.  It stays mapped (see the class
+ *    comments).
+ */
+RouterStatistics::~RouterStatistics()
+{
+    shm_unlink(m_name.c_str());
+}
+/**
+ * addSource
+ *    A full block only costs the source its statistics; the router still
+ *    runs.
+ *
+ *    @param sourceId - source id of the frame source.
+ *    @return SourceStatistics* - its counters; nullptr, with a warning
+ *                      logged, if there are no free slots.
+ */
+SourceStatistics*
+RouterStatistics::addSource(unsigned sourceId)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_nSources >= MAX_STATISTICS_SOURCES) {
+        LOG_WARN() << "Statistics block is full; source id " << sourceId
+            << " won't be counted";
+        return nullptr;
+    }
+    SourceStatistics* pStats = &m_pBlock->s_sources[m_nSources++];
+    pStats->s_sourceId = sourceId;
+    pStats->s_inUse.store(1, std::memory_order_release);
+    return pStats;
+}
+/**
+ * addOutput
+ *    As with addSource, a full block only costs the output its statistics.
+ *
+ *    @param ringName - name of the ring the output writes.
+ *    @return OutputStatistics* - its counters; nullptr, with a warning
+ *                      logged, if there are no free slots.
+ */
+OutputStatistics*
+RouterStatistics::addOutput(const std::string& ringName)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_nOutputs >= MAX_STATISTICS_OUTPUTS) {
+        LOG_WARN() << "Statistics block is full; ring " << ringName
+            << " won't be counted";
+        return nullptr;
+    }
+    OutputStatistics* pStats = &m_pBlock->s_outputs[m_nOutputs++];
+    strncpy(pStats->s_ringName, ringName.c_str(), STATISTICS_NAME_SIZE - 1);
+    pStats->s_inUse.store(1, std::memory_order_release);
+    return pStats;
+}
+/**
+ * attach
+ *    Map a router's statistics block read-only.
+ *
+ * @param name - the name the router was given.
+ * @return const StatisticsBlock* - the block.  It's never unmapped.
+ * @throw std::string - if there's no such block or it's not one of ours.
+ */
+const StatisticsBlock*
+RouterStatistics::attach(const std::string& name)
+{
+    std::string shm = shmName(name);
+    int fd = shm_open(shm.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        throw std::string("Unable to open statistics block ") + shm + ": " + strerror(errno);
+    }
+    struct stat info;
+    void* p = MAP_FAILED;
+    if ((fstat(fd, &info) == 0) && (size_t(info.st_size) >= sizeof(StatisticsBlock))) {
+        p = mmap(nullptr, sizeof(StatisticsBlock), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        throw std::string("Unable to map statistics block ") + shm;
+    }
+
+    const StatisticsBlock* pBlock = static_cast<const StatisticsBlock*>(p);
+    if ((pBlock->s_magic != STATISTICS_MAGIC) || (pBlock->s_version != STATISTICS_VERSION)) {
+        munmap(p, sizeof(StatisticsBlock));
+        throw std::string(shm) + " is not a data router statistics block";
+    }
+    return pBlock;
+}
+/**
+ * received
+ *    @return uint32_t - arrival time to put in a FrameRecord: the low 32
+ *                       bits of the steady clock in microseconds.  It's
+ *                       never 0, which means a frame wasn't timed.  The
+ *                       difference of two of these is good for about an
+ *                       hour.
+ */
+uint32_t
+RouterStatistics::received()
+{
+    uint64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+    return uint32_t(usec) | 1;
+}
+/**
+ * recordLatency
+ *    Histogram the time since a frame arrived.
+ *
+ * @param stats    - the output's counters.
+ * @param received - the frame's arrival time (see received); 0 means
+ *                   it wasn't timed and isn't counted.
+ * @param now      - the time it went into the ring, also from received.
+ */
+void
+RouterStatistics::recordLatency(OutputStatistics& stats, uint32_t received, uint32_t now)
+{
+    if (received == 0) return;
+
+    uint32_t latency = now - received;
+    unsigned bin = 0;
+    for (uint32_t n = latency; n && bin < (LATENCY_BINS - 1); n >>= 1) {
+        bin++;
+    }
+    stats.s_latency[bin].fetch_add(1, std::memory_order_relaxed);
+    stats.s_latencyUsec.fetch_add(latency, std::memory_order_relaxed);
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * shmName
+ *    @param name - a statistics block name.
+ *    @return std::string - its shared memory name.
+ */
+std::string
+RouterStatistics::shmName(const std::string& name)
+{
+    return name.empty() || (name[0] != '/') ? std::string("/") + name : name;
+}
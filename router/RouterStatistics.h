@@ -0,0 +1,128 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  RouterStatistics.h
+ *  @brief: Counters the router keeps in shared memory for routerstats.
+ */
+#ifndef ROUTERSTATISTICS_H
+#define ROUTERSTATISTICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <mutex>
+
+static const uint32_t STATISTICS_MAGIC(0x47455453);      // "GETS"
+static const uint32_t STATISTICS_VERSION(1);
+static const size_t   MAX_STATISTICS_SOURCES(32);
+static const size_t   MAX_STATISTICS_OUTPUTS(8);
+static const size_t   MAX_STATISTICS_ASADS(4);        // AsAds per CoBo.
+static const size_t   LATENCY_BINS(32);
+static const size_t   STATISTICS_NAME_SIZE(64);
+
+/**
+ * Counters for one frame source (an NSCLDAQDataProcessor).  They're only
+ * written by the source, which keeps its counts itself and copies them
+ * here every few dozen frames or tenth of a second, and at the end of a
+ * run.  Queue depth and stall time are copies of the source's FrameQueue
+ * values as of the last copy.
+ */
+struct alignas(64) SourceStatistics {
+    std::atomic<uint32_t> s_inUse;
+    uint32_t              s_sourceId;
+    std::atomic<uint64_t> s_frames;
+    std::atomic<uint64_t> s_bytes;
+    std::atomic<uint64_t> s_asadFrames[MAX_STATISTICS_ASADS + 1];  // Last: other asadIdx.
+    std::atomic<uint64_t> s_queueCapacity;
+    std::atomic<uint64_t> s_queueDepth;         // Bytes.
+    std::atomic<uint64_t> s_queueHighWater;
+    std::atomic<uint64_t> s_queueStallNs;       // Receiver waiting for the queue.
+};
+
+/**
+ * Counters for one ring output (a RingWriter).  Latency is from the
+ * frame's arrival in the receiver thread until it's in the ring; only a
+ * sample of the frames (those with a FrameRecord s_received) are timed.
+ * Bin b of the latency histogram counts latencies of b bits of
+ * microseconds, i.e. bin 0 is under 1 usec and bin b > 0 is from 2^(b-1)
+ * up to 2^b usec.
+ */
+struct alignas(64) OutputStatistics {
+    std::atomic<uint32_t> s_inUse;
+    char                  s_ringName[STATISTICS_NAME_SIZE];
+    std::atomic<uint64_t> s_frames;
+    std::atomic<uint64_t> s_bytes;
+    std::atomic<uint64_t> s_stallNs;            // Waiting for room in the ring.
+    std::atomic<uint64_t> s_latencyUsec;        // Sum, for the mean.
+    std::atomic<uint64_t> s_latency[LATENCY_BINS];
+};
+
+/**
+ * The shared memory block.  Sources and outputs are added in order; a
+ * slot is used once its s_inUse is set.
+ */
+struct StatisticsBlock {
+    uint32_t         s_magic;
+    uint32_t         s_version;
+    uint64_t         s_started;                 // time(2) the router started.
+    SourceStatistics s_sources[MAX_STATISTICS_SOURCES];
+    OutputStatistics s_outputs[MAX_STATISTICS_OUTPUTS];
+};
+
+/**
+ * @class RouterStatistics
+ *    Makes a POSIX shared memory block named /<name> holding the router's
+ *    counters and hands out slots in it to the frame sources and ring
+ *    outputs.  The counters are only updated with relaxed atomic adds and
+ *    stores, so keeping them costs next to nothing; turning them into rates
+ *    is left to the reader (see routerstats.cpp), which just maps the block.
+ *
+ *    The block stays mapped for the life of the process since the threads
+ *    that update it may outlive this object.  The name is unlinked when
+ *    this object is destroyed.
+ */
+class RouterStatistics
+{
+private:
+    std::string      m_name;
+    StatisticsBlock* m_pBlock;
+    size_t           m_nSources;
+    size_t           m_nOutputs;
+    std::mutex       m_lock;
+
+public:
+    RouterStatistics(const std::string& name);
+    ~RouterStatistics();
+
+    SourceStatistics* addSource(unsigned sourceId);
+    OutputStatistics* addOutput(const std::string& ringName);
+
+    static const StatisticsBlock* attach(const std::string& name);
+
+    static uint32_t received();
+    static void     recordLatency(OutputStatistics& stats, uint32_t received,
+                                  uint32_t now);
+
+private:
+    RouterStatistics(const RouterStatistics&);
+    RouterStatistics& operator=(const RouterStatistics&);
+
+    static std::string shmName(const std::string& name);
+};
+
+#endif
@@ -0,0 +1,625 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  RunRecorder.cpp
+ *  @brief: Implement recording frames straight to run files.
+ */
+#include "RunRecorder.h"
+#include "FrameQueue.h"
+#include "RouterStatistics.h"
+#include <DataFormat.h>
+#include <CRingStateChangeItem.h>
+#include <utl/Logging.h>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// O_DIRECT needs buffers, offsets and sizes aligned to the device's
+// logical block size; 4096 covers everything current.
+
+static const size_t BLOCK_BYTES(4096);
+
+// Size of the write buffer:
+
+static const size_t BUFFER_BYTES(8*1024*1024);
+
+// As in RingOutput:
+
+static const unsigned MAX_FRAMES_PER_PASS(256);
+static const unsigned WRITER_IDLE_USEC(50);
+
+// A partially filled buffer is written once nothing has been written
+// for this long:
+
+static const std::chrono::milliseconds IDLE_WRITE(500);
+
+/**
+ * stateChangeRun
+ *    @param pItem - a BEGIN_RUN or END_RUN ring item, with or without a
+ *                   body header.
+ *    @return uint32_t - its run number.
+ */
+static uint32_t
+stateChangeRun(const void* pItem)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(pItem) + sizeof(RingItemHeader);
+    uint32_t bodyHeaderSize = *reinterpret_cast<const uint32_t*>(p);
+    p += bodyHeaderSize > sizeof(uint32_t) ? bodyHeaderSize : sizeof(uint32_t);
+    return *reinterpret_cast<const uint32_t*>(p);
+}
+
+/**
+ * constructor
+ *
+ * @param directory    - where the run files are written.
+ * @param segmentBytes - largest run file; 0 for no limit.
+ * @param firstRun     - run number for the first run unless a BEGIN_RUN
+ *                       item gives one.
+ * @param title        - title for the BEGIN_RUN and END_RUN items we make.
+ * @param sourceId     - source id for them.
+ * @throw std::string - if the buffer can't be allocated.
+ */
+RunRecorder::RunRecorder(
+    const std::string& directory, size_t segmentBytes, uint32_t firstRun,
+    const std::string& title, uint32_t sourceId
+) :
+    m_directory(directory), m_segmentBytes(segmentBytes), m_title(title),
+    m_sourceId(sourceId), m_nextRun(firstRun),
+    m_runOpen(false), m_endWritten(false), m_run(0), m_segment(0), m_runStarted(0),
+    m_fd(-1), m_direct(false), m_fileOffset(0), m_segmentUsed(0), m_pBuffer(nullptr),
+    m_fill(0), m_dirty(false), m_lastWrite(std::chrono::steady_clock::now()), m_failed(false),
+    m_stopWriter(false), m_pStats(nullptr),
+    m_frames(0), m_bytes(0), m_files(0), m_writes(0), m_writeNs(0),
+    m_lost(0), m_strayItems(0)
+{
+    void* p;
+    if (posix_memalign(&p, BLOCK_BYTES, BUFFER_BYTES)) {
+        throw std::string("Unable to allocate the run file buffer");
+    }
+    m_pBuffer = static_cast<uint8_t*>(p);
+}
+/**
+ * destructor
+ *    Frames still queued are written and the run, if any, is ended.
+ */
+RunRecorder::~RunRecorder()
+{
+    endRun();
+    stopWriter();
+    free(m_pBuffer);
+}
+/**
+ * addQueue
+ *    Creates a queue for a new frame source and starts the writer thread
+ *    if it isn't already running.
+ *
+ * @param nbytes - Size of the queue.
+ * @return FrameQueue* - The queue.  It's owned by this object.
+ */
+FrameQueue*
+RunRecorder::addQueue(size_t nbytes)
+{
+    FrameQueue* pQueue = new FrameQueue(nbytes);
+    {
+        std::lock_guard<std::mutex> lock(m_writerLock);
+        m_queues.push_back(std::unique_ptr<FrameQueue>(pQueue));
+    }
+    startWriter();
+    return pQueue;
+}
+/**
+ * setStatistics
+ *    Count the frames recorded and how long they took to get to disk
+ *    (see RouterStatistics).  Time spent writing is counted as stall time.
+ *
+ * @param pStats - where the counts go.
+ */
+void
+RunRecorder::setStatistics(OutputStatistics* pStats)
+{
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    m_pStats = pStats;
+}
+/**
+ * write
+ *    Record a frame from the calling thread rather than through a queue.
+ *
+ * @param record - describes the frame.
+ * @param pFrame - the frame bytes.
+ */
+void
+RunRecorder::write(const FrameRecord& record, const void* pFrame)
+{
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    recordFrame(record, pFrame);
+}
+/**
+ * writeItem
+ *    Record a complete ring item, such as a state change, after the frames
+ *    already queued.  A BEGIN_RUN item starts a run with its run number
+ *    (ending the current run if it's for another run) and an END_RUN
+ *    item is written in place of the one we'd make up.  Other items
+ *    arriving outside a run are counted and dropped.
+ *
+ * @param pItem - the ring item.
+ */
+void
+RunRecorder::writeItem(const void* pItem)
+{
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    for (size_t i = 0; i < m_queues.size(); i++) {
+        writeQueued(*m_queues[i], m_queues[i]->records());
+    }
+    if (m_failed) return;
+
+    const RingItemHeader* pHeader = static_cast<const RingItemHeader*>(pItem);
+    try {
+        if (pHeader->s_type == BEGIN_RUN) {
+            uint32_t run = stateChangeRun(pItem);
+            if (m_runOpen && (run != m_run)) {
+                closeRun();
+            }
+            if (!m_runOpen) {
+                beginRun(run, pItem);
+                return;
+            }
+        } else if (!m_runOpen) {
+            m_strayItems++;
+            return;
+        }
+        append(pItem, pHeader->s_size, nullptr, 0);
+        if (pHeader->s_type == END_RUN) {
+            m_endWritten = true;
+        }
+    }
+    catch (std::string& msg) {
+        fail(msg);
+    }
+}
+/**
+ * flush
+ *    Waits for the writer thread to empty the queues and then writes the
+ *    buffer, so everything recorded so far is in the file.
+ */
+void
+RunRecorder::flush()
+{
+    std::vector<FrameQueue*> queues;
+    {
+        std::lock_guard<std::mutex> lock(m_writerLock);
+        for (size_t i = 0; i < m_queues.size(); i++) {
+            queues.push_back(m_queues[i].get());
+        }
+    }
+    if (m_writerThread.joinable()) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            while (!queues[i]->empty()) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    try {
+        writeBuffer(true);
+    }
+    catch (std::string& msg) {
+        fail(msg);
+    }
+}
+/**
+ * endRun
+ *    Write what's queued and close the run's file, adding an END_RUN item
+ *    if none came in.  This is called when the run stops.
+ */
+void
+RunRecorder::endRun()
+{
+    flush();
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    if (m_runOpen) {
+        try {
+            closeRun();
+        }
+        catch (std::string& msg) {
+            fail(msg);
+        }
+    }
+}
+/**
+ * logStatistics
+ *    Logs what's been recorded and how long writing took.
+ */
+void
+RunRecorder::logStatistics()
+{
+    std::lock_guard<std::mutex> lock(m_writerLock);
+    LOG_INFO() << "Run files in " << m_directory << ": " << m_frames << " frames, "
+        << m_bytes << " bytes in " << m_files << " files, " << m_writes
+        << (m_direct ? " O_DIRECT" : "") << " writes taking "
+        << m_writeNs/1000000 << " ms";
+    if (m_strayItems) {
+        LOG_WARN() << m_strayItems << " ring items arrived outside a run and weren't recorded";
+    }
+    if (m_lost) {
+        LOG_ERROR() << m_lost << " frames were lost after a write error";
+    }
+}
+/**
+ * getDirectory
+ *    @return std::string - where run files are written.
+ */
+std::string
+RunRecorder::getDirectory() const
+{
+    return m_directory;
+}
+/*-----------------------------------------------------------------------------
+ *  Private utilities.
+ */
+
+/**
+ * startWriter
+ *    Start the writer thread if it's not already running.
+ */
+void
+RunRecorder::startWriter()
+{
+    if (!m_writerThread.joinable()) {
+        m_stopWriter = false;
+        m_writerThread = std::thread(&RunRecorder::writeFrames, this);
+    }
+}
+/**
+ * stopWriter
+ *    Stop the writer thread if it's running.
+ */
+void
+RunRecorder::stopWriter()
+{
+    if (m_writerThread.joinable()) {
+        m_stopWriter = true;
+        m_writerThread.join();
+    }
+}
+/**
+ * writeFrames
+ *    The writer thread.  Moves frames from the queues to the run file,
+ *    round robin as RingOutput does, and writes the buffer when there's
+ *    been nothing to write for IDLE_WRITE so recorded data don't sit in
+ *    memory through a lull.
+ */
+void
+RunRecorder::writeFrames()
+{
+    std::chrono::microseconds idle(WRITER_IDLE_USEC);
+
+    while (!m_stopWriter) {
+        unsigned written = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_writerLock);
+            for (size_t i = 0; i < m_queues.size(); i++) {
+                written += writeQueued(*m_queues[i], MAX_FRAMES_PER_PASS);
+            }
+            if ((written == 0) && m_dirty &&
+                (std::chrono::steady_clock::now() - m_lastWrite > IDLE_WRITE)) {
+                try {
+                    writeBuffer(true);
+                }
+                catch (std::string& msg) {
+                    fail(msg);
+                }
+            }
+        }
+        if (written == 0) {
+            std::this_thread::sleep_for(idle);
+        }
+    }
+}
+/**
+ * writeQueued
+ *    Move frames from a queue to the run file.  The caller must hold
+ *    m_writerLock.
+ *
+ * @param queue     - the queue.
+ * @param maxFrames - most frames to move.
+ * @return unsigned - number of frames moved.
+ */
+unsigned
+RunRecorder::writeQueued(FrameQueue& queue, uint64_t maxFrames)
+{
+    const FrameRecord* pRecord;
+    unsigned n = 0;
+    while ((n < maxFrames) && (pRecord = queue.front())) {
+        recordFrame(*pRecord, pRecord + 1);
+        queue.pop();
+        n++;
+    }
+    return n;
+}
+/**
+ * recordFrame
+ *    Wrap a frame in a PHYSICS_EVENT ring item and record it, starting
+ *    a run if need be.  The caller must hold m_writerLock.
+ *
+ * @param record - describes the frame.
+ * @param pFrame - the frame.
+ */
+void
+RunRecorder::recordFrame(const FrameRecord& record, const void* pFrame)
+{
+    if (m_failed) {
+        m_lost++;
+        return;
+    }
+    uint8_t headers[sizeof(RingItemHeader) + sizeof(BodyHeader)];
+    pRingItemHeader pHeader = reinterpret_cast<pRingItemHeader>(headers);
+    pBodyHeader     pBody   = reinterpret_cast<pBodyHeader>(pHeader + 1);
+    pHeader->s_size    = sizeof(headers) + record.s_frameSize;
+    pHeader->s_type    = PHYSICS_EVENT;
+    pBody->s_size      = sizeof(BodyHeader);
+    pBody->s_timestamp = record.s_timestamp;
+    pBody->s_sourceId  = record.s_sourceId;
+    pBody->s_barrier   = 0;
+
+    try {
+        if (!m_runOpen) {
+            beginRun(m_nextRun, nullptr);
+        }
+        append(headers, sizeof(headers), pFrame, record.s_frameSize);
+    }
+    catch (std::string& msg) {
+        fail(msg);
+        m_lost++;
+        return;
+    }
+    m_frames++;
+    m_bytes += pHeader->s_size;
+    if (m_pStats) {
+        m_pStats->s_frames.fetch_add(1, std::memory_order_relaxed);
+        m_pStats->s_bytes.fetch_add(pHeader->s_size, std::memory_order_relaxed);
+        if (record.s_received) {            // Only a sample of frames are timed.
+            RouterStatistics::recordLatency(*m_pStats, record.s_received, RouterStatistics::received());
+        }
+    }
+}
+/**
+ * beginRun
+ *    Open the first file of a run and write its BEGIN_RUN item.
+ *
+ * @param run        - the run number.
+ * @param pBeginItem - the BEGIN_RUN item to write or nullptr to make one.
+ */
+void
+RunRecorder::beginRun(uint32_t run, const void* pBeginItem)
+{
+    m_run        = run;
+    m_nextRun    = run + 1;
+    m_segment    = 0;
+    m_runOpen    = true;
+    m_endWritten = false;
+    m_runStarted = time(nullptr);
+    openSegment();
+    if (pBeginItem) {
+        append(pBeginItem, static_cast<const RingItemHeader*>(pBeginItem)->s_size, nullptr, 0);
+    } else {
+        writeStateChange(BEGIN_RUN);
+    }
+    LOG_INFO() << "Recording run " << m_run << " in " << m_directory;
+}
+/**
+ * closeRun
+ *    Write an END_RUN item, unless one came in, and close the run's file.
+ */
+void
+RunRecorder::closeRun()
+{
+    m_runOpen = false;
+    if (!m_endWritten) {
+        writeStateChange(END_RUN);
+    }
+    closeSegment();
+    LOG_INFO() << "Run " << m_run << " recorded in " << m_segment + 1 << " files";
+}
+/**
+ * writeStateChange
+ *    Make up and record a BEGIN_RUN or END_RUN item for the current run.
+ *
+ * @param type - BEGIN_RUN or END_RUN.
+ */
+void
+RunRecorder::writeStateChange(uint16_t type)
+{
+    time_t now = time(nullptr);
+    CRingStateChangeItem item(
+        NULL_TIMESTAMP, m_sourceId, type == BEGIN_RUN ? 1 : 2,
+        type, m_run, type == BEGIN_RUN ? 0 : uint32_t(now - m_runStarted), now, m_title
+    );
+    append(item.getItemPointer(), item.size(), nullptr, 0);
+}
+/**
+ * append
+ *    Add a ring item, given in two pieces, to the current file, moving on
+ *    to the run's next file first if it won't fit in this one.
+ *
+ * @param pHeaders    - the start of the item.
+ * @param headerBytes - its size.
+ * @param pBody       - the rest of the item (may be nullptr if bodyBytes is 0).
+ * @param bodyBytes   - its size.
+ * @throw std::string - if a file can't be written.
+ */
+void
+RunRecorder::append(
+    const void* pHeaders, size_t headerBytes, const void* pBody, size_t bodyBytes
+)
+{
+    size_t nBytes = headerBytes + bodyBytes;
+    if (m_segmentBytes && m_segmentUsed && (m_segmentUsed + nBytes > m_segmentBytes)) {
+        closeSegment();
+        m_segment++;
+        openSegment();
+    }
+    bufferBytes(pHeaders, headerBytes);
+    bufferBytes(pBody, bodyBytes);
+    m_segmentUsed += nBytes;
+}
+/**
+ * bufferBytes
+ *    Copy bytes into the buffer, writing it each time it fills.
+ *
+ * @param pData  - the bytes.
+ * @param nBytes - how many.
+ */
+void
+RunRecorder::bufferBytes(const void* pData, size_t nBytes)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(pData);
+    while (nBytes) {
+        size_t n = std::min(nBytes, BUFFER_BYTES - m_fill);
+        memcpy(m_pBuffer + m_fill, p, n);
+        m_fill += n;
+        m_dirty = true;
+        p      += n;
+        nBytes -= n;
+        if (m_fill == BUFFER_BYTES) {
+            writeBuffer(false);
+        }
+    }
+}
+/**
+ * openSegment
+ *    Create the current file of the run, with O_DIRECT if the file system
+ *    allows.
+ *
+ * @throw std::string - if it can't be created.
+ */
+void
+RunRecorder::openSegment()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "run-%04u-%02u.evt", m_run, m_segment);
+    m_path = m_directory + "/" + name;
+
+    m_direct = true;
+    m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if ((m_fd < 0) && (errno == EINVAL)) {
+        m_direct = false;
+        m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (m_fd < 0) {
+        throw std::string("Unable to create run file ") + m_path + ": " + strerror(errno);
+    }
+    if (!m_direct) {
+        LOG_WARN() << m_directory << " doesn't support O_DIRECT; " << m_path
+            << " goes through the page cache";
+    }
+    m_fileOffset  = 0;
+    m_segmentUsed = 0;
+    m_fill        = 0;
+    m_files++;
+}
+/**
+ * closeSegment
+ *    Write what's left in the buffer and close the file.
+ */
+void
+RunRecorder::closeSegment()
+{
+    writeBuffer(true);
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    m_fill = 0;
+}
+/**
+ * writeBuffer
+ *    Write the buffered whole blocks and keep the partial block at the
+ *    start of the buffer.  With all, the partial block is also written,
+ *    padded, and the file truncated to the bytes really recorded; the
+ *    block is written again once more has been added to it.
+ *
+ * @param all - write the partial block too.
+ * @throw std::string - if the file can't be written.
+ */
+void
+RunRecorder::writeBuffer(bool all)
+{
+    if (m_fd < 0) return;
+
+    size_t whole   = m_fill - m_fill % BLOCK_BYTES;
+    size_t nBytes  = whole;
+    bool   partial = all && (m_fill > whole);
+    if (partial) {
+        nBytes = whole + BLOCK_BYTES;
+        memset(m_pBuffer + m_fill, 0, nBytes - m_fill);
+    }
+    if (nBytes == 0) {
+        m_dirty = false;
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t done = 0;
+    while (done < nBytes) {
+        ssize_t n = pwrite(m_fd, m_pBuffer + done, nBytes - done, m_fileOffset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::string("Unable to write run file ") + m_path + ": " + strerror(errno);
+        }
+        done += n;
+    }
+    if (partial && (ftruncate(m_fd, m_fileOffset + m_fill) < 0)) {
+        throw std::string("Unable to truncate run file ") + m_path + ": " + strerror(errno);
+    }
+    m_lastWrite = std::chrono::steady_clock::now();
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(m_lastWrite - start).count();
+    m_writes++;
+    m_writeNs += ns;
+    if (m_pStats) {
+        m_pStats->s_stallNs.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    m_fileOffset += whole;
+    memmove(m_pBuffer, m_pBuffer + whole, m_fill - whole);
+    m_fill -= whole;
+    if (all || (m_fill == 0)) {
+        m_dirty = false;
+    }
+}
+/**
+ * fail
+ *    Give up recording after an I/O error.  Frames from now on are
+ *    counted as lost.
+ *
+ * @param msg - what went wrong.
+ */
+void
+RunRecorder::fail(const std::string& msg)
+{
+    LOG_ERROR() << msg << "; no more frames will be recorded";
+    m_failed = true;
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
@@ -0,0 +1,144 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  RunRecorder.h
+ *  @brief: Record frames straight to run files instead of a ring.
+ */
+#ifndef RUNRECORDER_H
+#define RUNRECORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+class FrameQueue;
+struct FrameRecord;
+struct OutputStatistics;
+
+/**
+ * @class RunRecorder
+ *    Putting frames in a ring only for an event logger to copy them to disk
+ *    costs a copy and a process.  A RunRecorder writes the PHYSICS_EVENT
+ *    ring items the ring would have held straight into event files named,
+ *    as the event logger names them, run-<run>-<segment>.evt.  Each file
+ *    is at most the segment size; ring items never straddle files.
+ *
+ *    Files are written with O_DIRECT (unless the file system refuses it)
+ *    from a large block aligned buffer, so the data don't go through the
+ *    page cache.  Partially filled blocks are written padded and the file
+ *    truncated to its true length; the block is rewritten as it fills.  The
+ *    buffer is written out when full, when nothing has been written for a
+ *    while and when the run ends.
+ *
+ *    A run starts with the first frame (or BEGIN_RUN item) and is wrapped
+ *    in BEGIN_RUN and END_RUN items.  When BEGIN_RUN and END_RUN items come
+ *    from elsewhere (see writeItem) they're used instead; otherwise the
+ *    items are made up with the run number given to the constructor, which
+ *    goes up by one for each run.
+ *
+ *    Like a RingOutput, each frame source gets its own FrameQueue that a
+ *    writer thread drains, or sources can write directly.  A sample of the
+ *    frames can go to a monitoring ring as well; see
+ *    NSCLDAQDataProcessor::setMonitor.
+ */
+class RunRecorder
+{
+private:
+    std::string   m_directory;
+    size_t        m_segmentBytes;
+    std::string   m_title;
+    uint32_t      m_sourceId;               // For the items we make up.
+    uint32_t      m_nextRun;
+
+    // The run being recorded:
+
+    bool          m_runOpen;
+    bool          m_endWritten;             // An END_RUN item came in.
+    uint32_t      m_run;
+    unsigned      m_segment;
+    time_t        m_runStarted;
+    int           m_fd;
+    bool          m_direct;                 // m_fd was opened O_DIRECT.
+    std::string   m_path;
+    uint64_t      m_fileOffset;             // Of the start of m_pBuffer; block aligned.
+    uint64_t      m_segmentUsed;            // Bytes of items in this file.
+    uint8_t*      m_pBuffer;
+    size_t        m_fill;
+    bool          m_dirty;                  // Bytes buffered since the last write.
+    std::chrono::steady_clock::time_point m_lastWrite;
+    bool          m_failed;
+
+    std::vector<std::unique_ptr<FrameQueue> > m_queues;
+    std::mutex    m_writerLock;             // Serializes everything above.
+    std::thread   m_writerThread;
+    std::atomic<bool> m_stopWriter;
+    OutputStatistics* m_pStats;             // Null if not counting.
+
+    uint64_t      m_frames;
+    uint64_t      m_bytes;
+    uint64_t      m_files;
+    uint64_t      m_writes;
+    uint64_t      m_writeNs;
+    uint64_t      m_lost;                   // After a write error.
+    uint64_t      m_strayItems;             // State items outside a run.
+
+public:
+    RunRecorder(const std::string& directory, size_t segmentBytes,
+                uint32_t firstRun, const std::string& title, uint32_t sourceId);
+    ~RunRecorder();
+
+    FrameQueue* addQueue(size_t nbytes);
+    void        setStatistics(OutputStatistics* pStats);
+
+    void        write(const FrameRecord& record, const void* pFrame);
+    void        writeItem(const void* pItem);
+    void        flush();
+    void        endRun();
+    void        logStatistics();
+
+    std::string getDirectory() const;
+
+private:
+    RunRecorder(const RunRecorder&);
+    RunRecorder& operator=(const RunRecorder&);
+
+    void startWriter();
+    void stopWriter();
+    void writeFrames();
+    unsigned writeQueued(FrameQueue& queue, uint64_t maxFrames);
+    void recordFrame(const FrameRecord& record, const void* pFrame);
+
+    void beginRun(uint32_t run, const void* pBeginItem);
+    void closeRun();
+    void writeStateChange(uint16_t type);
+    void append(const void* pHeaders, size_t headerBytes, const void* pBody,
+                size_t bodyBytes);
+    void bufferBytes(const void* pData, size_t nBytes);
+    void openSegment();
+    void closeSegment();
+    void writeBuffer(bool all);
+    void fail(const std::string& msg);
+};
+
+#endif
@@ -0,0 +1,79 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  StateReplicator.cpp
+ *  @brief: Implement the state change item copier.
+ */
+#include "StateReplicator.h"
+#include "NSCLDAQDataProcessor.h"
+#include <CRemoteAccess.h>
+#include <CRingBuffer.h>
+#include <CRingItem.h>
+#include <CAllButPredicate.h>
+#include <utl/Logging.h>
+#include <chrono>
+
+static const unsigned POLL_MS(10);       // How often we look for items.
+
+/**
+ * constructor
+ *    Attach to the state ring as a consumer and start copying items.
+ *
+ * @param ringUri    - URI of the ring the state change items are put in.
+ * @param processors - the processors to hand them to.
+ */
+StateReplicator::StateReplicator(
+    const std::string& ringUri, const std::vector<NSCLDAQDataProcessor*>& processors
+) :
+    m_ring(CRingAccess::daqConsumeFrom(ringUri)), m_processors(processors),
+    m_stop(false)
+{
+    m_thread = std::thread(&StateReplicator::run, this);
+    LOG_INFO() << "Copying state change items from " << ringUri << " to "
+        << m_processors.size() << " frame sources";
+}
+/**
+ * destructor
+ *    Stop the thread.
+ */
+StateReplicator::~StateReplicator()
+{
+    m_stop = true;
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+/**
+ * run
+ *    Thread entry: poll the ring so we can notice being stopped, and
+ *    give each item to all processors.
+ */
+void
+StateReplicator::run()
+{
+    CAllButPredicate all;
+    while (!m_stop) {
+        if (!m_ring->availableData()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_MS));
+            continue;
+        }
+        std::unique_ptr<CRingItem> pItem(CRingItem::getFromRing(*m_ring, all));
+        for (size_t i = 0; i < m_processors.size(); i++) {
+            m_processors[i]->writeStateItem(pItem->getItemPointer());
+        }
+    }
+}
@@ -0,0 +1,65 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  StateReplicator.h
+ *  @brief: Copy state change items into the router's rings.
+ */
+#ifndef STATEREPLICATOR_H
+#define STATEREPLICATOR_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+class CRingBuffer;
+class NSCLDAQDataProcessor;
+
+/**
+ * @class StateReplicator
+ *    State change items (from insertstatechange) and barriers never pass
+ *    through the router; they're put in a ring of their own which is then
+ *    merged with the router's ring.  Once the router splits a CoBo's data
+ *    into a source id or ring per AsAd, each of those needs its own copy.
+ *
+ *    A StateReplicator consumes that state ring in a thread of its own and
+ *    hands each item to the processors' writeStateItem, which puts it, with
+ *    the right source ids, into every ring they write after the frames
+ *    already queued.  The processors must outlive this object.
+ */
+class StateReplicator
+{
+private:
+    std::unique_ptr<CRingBuffer>        m_ring;
+    std::vector<NSCLDAQDataProcessor*>  m_processors;
+    std::atomic<bool>                   m_stop;
+    std::thread                         m_thread;
+
+public:
+    StateReplicator(const std::string& ringUri,
+                    const std::vector<NSCLDAQDataProcessor*>& processors);
+    ~StateReplicator();
+
+private:
+    StateReplicator(const StateReplicator&);
+    StateReplicator& operator=(const StateReplicator&);
+
+    void run();
+};
+
+#endif
@@ -45,6 +45,21 @@
  *     to be used to tag ring item body headers.
  *   - Command line processing will be modified to support the choice of
  *     trigger number or timestamp as the timestamp in event body headers.
+ *   - Command line processing will be modified to allow several CoBo data
+ *     flows to be received by one router (--flow).
+ *   - Command line processing will be modified to select what happens when
+ *     the ring is full (--congestion).
+ *   - Command line processing will be modified to keep statistics in
+ *     shared memory (--statistics).
+ *   - Command line processing will be modified to separate frames by AsAd
+ *     or shard them by event (--demultiplex) and copy state change items
+ *     to match (--state-ring) or make up run barriers (--barriers).
+ *   - Command line processing will be modified to write frames in timestamp
+ *     order (--reorder).
+ *   - Command line processing will be modified to allow frames to be recorded
+ *     straight to run files (--outputtype=RunFile).
+ *   - Command line processing will be modified to copy a sample of the
+ *     frames to a monitoring ring (--monitor-ring).
  *
  *  @note to support the added flexibility required, it's likely we'll modify
  *        command processing to use gengetopt so that we can get it to do
@@ -70,12 +85,426 @@ namespace ba = boost::algorithm;
 #include <CRingBuffer.h>
 #include "datarouterargs.h"
 #include "NSCLDAQDataProcessor.h"
+#include "FlowReceiverPool.h"
+#include "RingOutput.h"
+#include "RunRecorder.h"
+#include "RouterStatistics.h"
+#include "StateReplicator.h"
 
 using ::utl::net::SocketAddress;
 using ::mdaq::utl::CmdLineArgs;
 using ::mdaq::utl::Server;
 using ::get::daq::DataRouter;
 
+// The shared memory statistics block, if --statistics was given:
+
+static std::unique_ptr<RouterStatistics> statistics;
+
+// The monitoring ring output, if --monitor-ring was given.  All the
+// processors share it:
+
+static std::shared_ptr<RingOutput> monitor;
+
+// The ring buffer data processors, for --state-ring:
+
+static std::vector<NSCLDAQDataProcessor*> processors;
+
+/**
+ * ringName
+ *    Figure out the ring buffer name.. if not provided, use the
+ *    default name
+ */
+static std::string
+ringName(const gengetopt_args_info& parsed)
+{
+	std::string name = CRingBuffer::defaultRing();
+	if (parsed.ring_given) name = parsed.ring_arg;
+	return name;
+}
+/**
+ * batchingRequested
+ *    Batching is off unless a batch size is given.
+ *
+ * @return bool - true if ring outputs should batch.
+ */
+static bool
+batchingRequested(const gengetopt_args_info& parsed)
+{
+	if (parsed.batch_bytes_arg > 0) {
+		if (parsed.batch_latency_arg <= 0) {
+			throw "--batch-latency must be a positive number of microseconds";
+		}
+		return true;
+	}
+	return false;
+}
+/**
+ * configureOutput
+ *    Set the batching and congestion policy (and journal) of a ring output
+ *    and give it its statistics.
+ */
+static void
+configureOutput(RingOutput& output, const gengetopt_args_info& parsed)
+{
+	if (statistics) {
+		output.setStatistics(statistics->addOutput(output.getRingName()));
+	}
+	if (batchingRequested(parsed)) {
+		output.setBatching(parsed.batch_bytes_arg, parsed.batch_latency_arg);
+	}
+	if (parsed.sample_interval_arg <= 0) {
+		throw "--sample-interval must be at least 1";
+	}
+	CongestionTracker::Policy policy = CongestionTracker::policy(parsed.congestion_arg);
+	if (policy == CongestionTracker::JOURNAL) {
+		if ((parsed.journal_size_arg <= 0) || (parsed.journal_segment_arg <= 0)) {
+			throw "--journal-size and --journal-segment must be positive";
+		}
+		output.setJournal(
+			parsed.journal_directory_arg,
+			size_t(parsed.journal_size_arg) * 1024 * 1024,
+			size_t(parsed.journal_segment_arg) * 1024 * 1024
+		);
+	} else {
+		output.setCongestionPolicy(
+			policy, parsed.sample_interval_arg, parsed.spill_directory_arg
+		);
+	}
+}
+/**
+ * monitorOutput
+ *    Get the --monitor-ring output, making it the first time.  It drops
+ *    frames that don't fit in the ring so a slow monitor can't hold up
+ *    its writer thread.
+ */
+static std::shared_ptr<RingOutput>
+monitorOutput(const gengetopt_args_info& parsed)
+{
+	if (!monitor) {
+		if ((parsed.monitor_interval_arg <= 0) || (parsed.monitor_rate_arg < 0)) {
+			throw "--monitor-interval must be at least 1 and --monitor-rate must not be negative";
+		}
+		monitor.reset(new RingOutput(parsed.monitor_ring_arg));
+		if (statistics) {
+			monitor->setStatistics(statistics->addOutput(monitor->getRingName()));
+		}
+		monitor->setCongestionPolicy(CongestionTracker::DROP, 1, ".");
+		LOG_INFO() << "Sampled frames go to monitoring ring " << monitor->getRingName();
+	}
+	return monitor;
+}
+/**
+ * configureProcessor
+ *    Set the source id, how the timestamp comes about, the queue size,
+ *    the AsAd frame assembly or demultiplexing, the reordering, the run
+ *    barriers, the monitoring ring and the statistics of a ring buffer
+ *    data processor.  This must be done before the processor is given
+ *    its ring.
+ */
+static void
+configureProcessor(NSCLDAQDataProcessor& proc, const gengetopt_args_info& parsed, unsigned sid)
+{
+	processors.push_back(&proc);
+	proc.setSourceId(sid);
+	if (statistics) {
+		proc.setStatistics(statistics->addSource(sid));
+	}
+	
+	// Figure out timestamp source:
+	
+	std::string tsSource = parsed.timestamp_arg;
+	if(tsSource == "timestamp") {
+		proc.useTimestamp();
+	} else if (tsSource == "trigger_number") {
+		proc.useTriggerId();
+	} else {
+		throw "--timestamp value must be either 'timestamp' or 'trigger_number'";
+	}
+	
+	// Frames are queued for a separate writer thread unless
+	// the queue size is zero.
+	
+	if (parsed.queue_size_arg < 0) {
+		throw "--queue-size must not be negative";
+	}
+	proc.setQueueSize(size_t(parsed.queue_size_arg) * 1024 * 1024);
+	
+	// AsAd frames of a trigger are merged only if asked.
+	
+	std::string assemble = parsed.assemble_arg;
+	if (assemble != "none") {
+		if ((parsed.asads_arg <= 0) || (parsed.asads_arg > 32)) {
+			throw "--asads must be from 1 to 32";
+		}
+		if ((parsed.assembly_window_arg < 0) || (parsed.assembly_timeout_arg <= 0)) {
+			throw "--assembly-window must not be negative and --assembly-timeout must be positive";
+		}
+		proc.setAssembly(
+			EventAssembler::key(assemble), parsed.asads_arg,
+			parsed.assembly_window_arg, parsed.assembly_timeout_arg
+		);
+	}
+	
+	// So are the AsAd frames separated.
+	
+	std::string demultiplex = parsed.demultiplex_arg;
+	if (demultiplex != "none") {
+		if (assemble != "none") {
+			throw "--demultiplex can't be used with --assemble";
+		}
+		if ((parsed.asads_arg <= 0) || (parsed.asads_arg > 32)) {
+			throw "--asads must be from 1 to 32";
+		}
+		proc.setDemultiplexing(
+			NSCLDAQDataProcessor::demultiplex(demultiplex), parsed.asads_arg
+		);
+	}
+	
+	// Frames are put in timestamp order only if asked.
+	
+	std::string reorder = parsed.reorder_arg;
+	if (reorder != "none") {
+		if (parsed.reorder_window_arg <= 0) {
+			throw "--reorder-window must be positive";
+		}
+		proc.setReordering(ReorderBuffer::unit(reorder), parsed.reorder_window_arg);
+	}
+	
+	// Run barriers are made up only if asked.
+	
+	if (parsed.barriers_flag) {
+		if (parsed.state_ring_given) {
+			throw "--barriers can't be used with --state-ring";
+		}
+		proc.setRunBarriers(parsed.record_run_arg, parsed.record_title_arg);
+	}
+	
+	// A sample of the frames goes to the monitoring ring if there is one.
+	
+	if (parsed.monitor_ring_given) {
+		proc.setMonitor(
+			monitorOutput(parsed), parsed.monitor_interval_arg, parsed.monitor_rate_arg
+		);
+	}
+}
+/**
+ * demultiplexingRings
+ *    @return bool - true if each AsAd's frames, or each shard of the
+ *                   events, go to a ring of their own.
+ */
+static bool
+demultiplexingRings(const gengetopt_args_info& parsed)
+{
+	std::string demultiplex = parsed.demultiplex_arg;
+	return (demultiplex == "ring") || (demultiplex == "event");
+}
+/**
+ * shardOutputs
+ *    Get the per AsAd ring outputs for --demultiplex=ring or the per shard
+ *    ring outputs for --demultiplex=event.  AsAd i's ring is named
+ *    <name>_asad<i> and shard i's <name>_shard<i>, with _<sid> appended
+ *    with --separate-rings.  The shared ones are made the first time
+ *    they're needed.
+ *
+ * @param name   - name the rings are based on.
+ * @param sid    - source id of the data flow.
+ * @param shared - the shared ring outputs, if made yet.
+ */
+static std::vector<std::shared_ptr<RingOutput> >
+shardOutputs(
+	const gengetopt_args_info& parsed, const std::string& name, unsigned sid,
+	std::vector<std::shared_ptr<RingOutput> >& shared
+)
+{
+	if (!parsed.separate_rings_flag && !shared.empty()) {
+		return shared;
+	}
+	bool byEvent = std::string(parsed.demultiplex_arg) == "event";
+	if (byEvent && ((parsed.shards_arg <= 0) || (parsed.shards_arg > 64))) {
+		throw "--shards must be from 1 to 64";
+	}
+	int n = byEvent ? parsed.shards_arg : parsed.asads_arg;
+	std::vector<std::shared_ptr<RingOutput> > outputs;
+	for (int i = 0; i < n; i++) {
+		std::ostringstream shardName;
+		shardName << name << (byEvent ? "_shard" : "_asad") << i;
+		if (parsed.separate_rings_flag) {
+			shardName << '_' << sid;
+		}
+		std::shared_ptr<RingOutput> output(new RingOutput(shardName.str()));
+		configureOutput(*output, parsed);
+		outputs.push_back(output);
+	}
+	if (!parsed.separate_rings_flag) {
+		shared = outputs;
+	}
+	return outputs;
+}
+/**
+ * flowOutput
+ *    Get the ring output for one --flow.  With --separate-rings, each flow
+ *    gets a new ring output named <name>_<sid>; otherwise all flows share
+ *    the one named <name>, which is made the first time it's needed.
+ *
+ * @param name   - name of the ring (or the start of it).
+ * @param sid    - source id of the flow.
+ * @param shared - the shared ring output, if made yet.
+ */
+static std::shared_ptr<RingOutput>
+flowOutput(
+	const gengetopt_args_info& parsed, const std::string& name, unsigned sid,
+	std::shared_ptr<RingOutput>& shared
+)
+{
+	if (parsed.separate_rings_flag) {
+		std::ostringstream separateName;
+		separateName << name << '_' << sid;
+		std::shared_ptr<RingOutput> output(new RingOutput(separateName.str()));
+		configureOutput(*output, parsed);
+		return output;
+	}
+	if (!shared) {
+		shared.reset(new RingOutput(name));
+		configureOutput(*shared, parsed);
+	}
+	return shared;
+}
+/**
+ * makeRecorder
+ *    Make the run file recorder for --outputtype=RunFile.
+ */
+static std::shared_ptr<RunRecorder>
+makeRecorder(const gengetopt_args_info& parsed)
+{
+	if (parsed.record_segment_arg < 0) {
+		throw "--record-segment must not be negative";
+	}
+	std::shared_ptr<RunRecorder> recorder(new RunRecorder(
+		parsed.record_directory_arg, size_t(parsed.record_segment_arg) * 1024 * 1024,
+		parsed.record_run_arg, parsed.record_title_arg, parsed.id_arg
+	));
+	if (statistics) {
+		recorder->setStatistics(statistics->addOutput(parsed.record_directory_arg));
+	}
+	LOG_INFO() << "Recording run files in " << parsed.record_directory_arg;
+	return recorder;
+}
+/**
+ * configureHits
+ *    For --outputtype=HitRing, give a ring data processor its hit ring and,
+ *    with --raw-ring, the ring for raw frames.  This is for a single data
+ *    flow; createFlowRouter does the same for each --flow.
+ */
+static void
+configureHits(NSCLDAQDataProcessor& proc, const gengetopt_args_info& parsed)
+{
+	std::shared_ptr<RingOutput> hits(new RingOutput(ringName(parsed)));
+	configureOutput(*hits, parsed);
+	proc.setHitOutput(hits, parsed.hit_workers_arg);
+	if (parsed.raw_ring_given && demultiplexingRings(parsed)) {
+		std::vector<std::shared_ptr<RingOutput> > none;
+		proc.setShardOutputs(shardOutputs(parsed, parsed.raw_ring_arg, parsed.id_arg, none));
+	} else if (parsed.raw_ring_given) {
+		proc.setRingBufferName(parsed.raw_ring_arg);
+		configureOutput(*proc.getOutput(), parsed);
+	}
+}
+/**
+ * createFlowRouter
+ *    Create a data router that receives each of the --flow data flows
+ *    with its own ring buffer data processor.  The processors share one
+ *    ring unless --separate-rings is given.  With --outputtype=HitRing
+ *    that ring gets the hit items and raw frames go to the --raw-ring
+ *    ring(s), if any.  With --demultiplex=ring, raw frames go to the
+ *    per AsAd rings instead.  With --outputtype=RunFile, all flows share
+ *    one run file recorder.
+ */
+static DataRouter*
+createFlowRouter(const gengetopt_args_info& parsed, const std::string& flowType, const std::string& processorType)
+{
+	if (flowType != "TCP") {
+		throw "--flow requires --protocol=TCP";
+	}
+	if ((processorType != "RingBuffer") && (processorType != "HitRing") &&
+	    (processorType != "RunFile")) {
+		throw "--flow requires --outputtype=RingBuffer, --outputtype=HitRing or --outputtype=RunFile";
+	}
+	if (parsed.workers_arg <= 0) {
+		throw "--workers must be at least 1";
+	}
+	if ((parsed.receive_buffer_arg < 0) || (parsed.socket_buffer_arg < 0)) {
+		throw "--receive-buffer and --socket-buffer can't be negative";
+	}
+	
+	bool hitRing = processorType == "HitRing";
+	
+	std::auto_ptr<FlowReceiverPool> pool(new FlowReceiverPool(parsed.workers_arg));
+	pool->setReceiveBuffer(size_t(parsed.receive_buffer_arg)*1024*1024);
+	pool->setSocketBuffer(size_t(parsed.socket_buffer_arg)*1024);
+	std::shared_ptr<RingOutput>     sharedOutput;
+	std::shared_ptr<RingOutput>     sharedRawOutput;
+	std::vector<std::shared_ptr<RingOutput> > sharedShardOutputs;
+	std::shared_ptr<RunRecorder>    recorder;
+	if (processorType == "RunFile") {
+		recorder = makeRecorder(parsed);
+	}
+	for (unsigned i = 0; i < parsed.flow_given; i++) {
+		
+		// Split off the source id if given.
+		
+		std::string address = parsed.flow_arg[i];
+		unsigned    sid     = parsed.id_arg + i;
+		size_t at = address.find('@');
+		if (at != std::string::npos) {
+			std::string sidString = address.substr(at + 1);
+			char* pEnd;
+			sid = strtoul(sidString.c_str(), &pEnd, 0);
+			if (sidString.empty() || *pEnd) {
+				throw std::string("Bad source id in --flow ") + parsed.flow_arg[i];
+			}
+			address = address.substr(0, at);
+		}
+		
+		NSCLDAQDataProcessor* pProc = new NSCLDAQDataProcessor;
+		pool->addEndpoint(address, pProc);            // Owns pProc now.
+		configureProcessor(*pProc, parsed, sid);
+		
+		if (recorder) {
+			pProc->setRecorder(recorder);
+			LOG_INFO() << "Data flow " << address << " is recorded with source id " << sid;
+			continue;
+		}
+		std::string frameRing = ringName(parsed);
+		if (hitRing) {
+			std::shared_ptr<RingOutput> hits =
+				flowOutput(parsed, ringName(parsed), sid, sharedOutput);
+			pProc->setHitOutput(hits, parsed.hit_workers_arg);
+			LOG_INFO() << "Hits from data flow " << address << " go to ring "
+				<< hits->getRingName() << " with source id " << sid << " + ASAD";
+			if (!parsed.raw_ring_given) {
+				continue;
+			}
+			frameRing = parsed.raw_ring_arg;
+		}
+		if (demultiplexingRings(parsed)) {
+			std::vector<std::shared_ptr<RingOutput> > shards =
+				shardOutputs(parsed, frameRing, sid, sharedShardOutputs);
+			pProc->setShardOutputs(shards);
+			LOG_INFO() << "Data flow " << address << " goes to rings "
+				<< shards.front()->getRingName() << " to "
+				<< shards.back()->getRingName() << " with source id " << sid;
+			continue;
+		}
+		std::shared_ptr<RingOutput> output = hitRing ?
+			flowOutput(parsed, frameRing, sid, sharedRawOutput) :
+			flowOutput(parsed, frameRing, sid, sharedOutput);
+		pProc->setOutput(output);
+		LOG_INFO() << "Data flow " << address << " goes to ring "
+			<< output->getRingName() << " with source id " << sid;
+	}
+	return new DataRouter(pool);
+}
+
 int main(int argc, char* argv[])
 {
 	gengetopt_args_info parsed;
@@ -123,7 +552,8 @@ int main(int argc, char* argv[])
 		{
 		  //mfm::FrameDictionary::instance().addFormats("CoboFormats.xcfg");
 		  mfm::FrameDictionary::instance().addFormats(COBO_FORMAT_FILE);
-		} else if (processorType == "RingBuffer") {
+		} else if ((processorType == "RingBuffer") || (processorType == "HitRing") ||
+		           (processorType == "RunFile")) {
 		  //	mfm::FrameDictionary::instance().addFormats("CoboFormats.xcfg");  // We'll also need to assemble/decode frames.
 		  mfm::FrameDictionary::instance().addFormats(COBO_FORMAT_FILE);  // We'll also need to assemble/decode frames.
 			
@@ -140,35 +570,65 @@ int main(int argc, char* argv[])
 		// Creating data router servant
 		Server& server = Server::create(ctrlEndpoint, args);
 		server.ic(); // Hack to ensure ICE communicator is initialized with desired arguments
-		DataRouter* r = new DataRouter(flowEndpoint, flowType, processorType);
+		if (parsed.hit_workers_arg <= 0) {
+			throw "--hit-workers must be at least 1";
+		}
+		if (parsed.raw_ring_given && (processorType != "HitRing")) {
+			throw "--raw-ring requires --outputtype=HitRing";
+		}
+		if ((processorType == "RunFile") && demultiplexingRings(parsed)) {
+			throw "--outputtype=RunFile can't be used with --demultiplex=ring or event";
+		}
+		if (parsed.statistics_given) {
+			statistics.reset(new RouterStatistics(parsed.statistics_arg));
+		}
+		DataRouter* r;
+		if (parsed.flow_given) {
+			r = createFlowRouter(parsed, flowType, processorType);
+		} else {
+			r = new DataRouter(flowEndpoint, flowType, processorType);
+		}
 		IceUtil::Handle< DataRouter > dataRouter(r);
 		
 		// If the data router was for a "RingBuffer", we need to set the
 		// ringbuffer name, source id and how the timestamp comes about.
+		// A "HitRing" also needs its hit workers and a "RunFile" its recorder.
+		// (createFlowRouter did that for each flow).
 		
-		if (processorType == "RingBuffer") {
+		if ((processorType == "RingBuffer") && !parsed.flow_given) {
 			NSCLDAQDataProcessor& proc(
 				dynamic_cast<NSCLDAQDataProcessor&>(r->getDataReceiver()->dataProcessorCore())
 			);
-			proc.setSourceId(parsed.id_arg);
-			
-			// Figure out timestamp source:
-			
-			std::string tsSource = parsed.timestamp_arg;
-			if(tsSource == "timestamp") {
-				proc.useTimestamp();
-			} else if (tsSource == "trigger_number") {
-				proc.useTriggerId();
- 			} else {
-				throw "--timestamp value must be either 'timestamp' or 'trigger_number'";
+			configureProcessor(proc, parsed, parsed.id_arg);
+			if (demultiplexingRings(parsed)) {
+				std::vector<std::shared_ptr<RingOutput> > none;
+				proc.setShardOutputs(shardOutputs(parsed, ringName(parsed), parsed.id_arg, none));
+			} else {
+				proc.setRingBufferName(ringName(parsed));
+				configureOutput(*proc.getOutput(), parsed);
 			}
-            // Figure out the ring buffer name.. if not provided, use the
-			// default name
-			
-			std::string ringName = CRingBuffer::defaultRing();
-			if (parsed.ring_given) ringName = parsed.ring_arg;
-			proc.setRingBufferName(ringName);
-			
+		} else if ((processorType == "HitRing") && !parsed.flow_given) {
+			NSCLDAQDataProcessor& proc(
+				dynamic_cast<NSCLDAQDataProcessor&>(r->getDataReceiver()->dataProcessorCore())
+			);
+			configureProcessor(proc, parsed, parsed.id_arg);
+			configureHits(proc, parsed);
+		} else if ((processorType == "RunFile") && !parsed.flow_given) {
+			NSCLDAQDataProcessor& proc(
+				dynamic_cast<NSCLDAQDataProcessor&>(r->getDataReceiver()->dataProcessorCore())
+			);
+			configureProcessor(proc, parsed, parsed.id_arg);
+			proc.setRecorder(makeRecorder(parsed));
+		}
+		
+		// State change items are copied into the rings if asked.
+		
+		std::unique_ptr<StateReplicator> stateReplicator;
+		if (parsed.state_ring_given) {
+			if (processors.empty()) {
+				throw "--state-ring requires --outputtype=RingBuffer, --outputtype=HitRing or --outputtype=RunFile";
+			}
+			stateReplicator.reset(new StateReplicator(parsed.state_ring_arg, processors));
 		}
 		
 		server.addServant("DataRouter", dataRouter).start();
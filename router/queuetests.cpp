@@ -0,0 +1,155 @@
+// Tests for the router's frame queue.
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/Asserter.h>
+
+
+#include "Asserts.h"
+#include "FrameQueue.h"
+#include <stdexcept>
+#include <thread>
+
+class queuetests : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(queuetests);
+  CPPUNIT_TEST(fifo);
+  CPPUNIT_TEST(wrap);
+  CPPUNIT_TEST(bigwrap);
+  CPPUNIT_TEST(toobig);
+  CPPUNIT_TEST(threaded);
+  CPPUNIT_TEST_SUITE_END();
+
+public:
+  void setUp() {}
+  void tearDown() {}
+protected:
+  void fifo();
+  void wrap();
+  void bigwrap();
+  void toobig();
+  void threaded();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(queuetests);
+
+// Put a frame in the queue with its timestamp and its last byte set
+// to n.
+
+static bool
+put(FrameQueue& queue, size_t frameBytes, uint64_t n)
+{
+  FrameRecord* pRecord = queue.reserve(frameBytes);
+  if (!pRecord) return false;
+  pRecord->s_timestamp = n;
+  reinterpret_cast<uint8_t*>(pRecord + 1)[frameBytes - 1] = n;
+  queue.publish();
+  return true;
+}
+// Take the next frame out of the queue and check it's frame n of
+// frameBytes.
+
+static void
+take(FrameQueue& queue, size_t frameBytes, uint64_t n)
+{
+  const FrameRecord* pRecord = queue.front();
+  ASSERT(pRecord);
+  EQ(uint32_t(frameBytes), pRecord->s_frameSize);
+  EQ(n, pRecord->s_timestamp);
+  EQ(uint8_t(n), reinterpret_cast<const uint8_t*>(pRecord + 1)[frameBytes - 1]);
+  queue.pop();
+}
+
+// Frames come out in the order they went in.
+
+void
+queuetests::fifo()
+{
+  FrameQueue queue(4096);
+  ASSERT(queue.empty());
+  ASSERT(!queue.front());
+  for (uint64_t n = 0; n < 10; n++) {
+    ASSERT(put(queue, 100, n));
+  }
+  EQ(uint64_t(10), queue.records());
+  for (uint64_t n = 0; n < 10; n++) {
+    take(queue, 100, n);
+  }
+  ASSERT(queue.empty());
+  ASSERT(!queue.front());
+}
+// A frame that doesn't fit before the end of the buffer goes at the start.
+
+void
+queuetests::wrap()
+{
+  FrameQueue queue(4096);
+  ASSERT(put(queue, 3000, 1));
+  take(queue, 3000, 1);
+  ASSERT(put(queue, 2000, 2));
+  take(queue, 2000, 2);
+  ASSERT(queue.empty());
+}
+// A frame bigger than both the space before the end of the buffer and the
+// space before the last frame must still fit in an empty queue: 400K then
+// 700K in a 1M queue.
+
+void
+queuetests::bigwrap()
+{
+  FrameQueue queue(1024*1024);
+  ASSERT(put(queue, 400*1024, 1));
+  take(queue, 400*1024, 1);
+  ASSERT(queue.empty());
+  
+  FrameRecord* pRecord;
+  int tries = 0;
+  while (!(pRecord = queue.reserve(700*1024))) {
+    ASSERT(++tries < 3);
+    ASSERT(!queue.front());         // Only the wrap marker's there.
+  }
+  pRecord->s_timestamp = 2;
+  reinterpret_cast<uint8_t*>(pRecord + 1)[700*1024 - 1] = 2;
+  queue.publish();
+  take(queue, 700*1024, 2);
+  ASSERT(queue.empty());
+}
+// A frame bigger than the queue can never fit.
+
+void
+queuetests::toobig()
+{
+  FrameQueue queue(4096);
+  EXCEPTION(queue.reserve(4096), std::length_error&);
+  EXCEPTION(queue.reserveWait(4096), std::length_error&);
+}
+// With a consumer thread and frames of all sizes, up to most of the queue,
+// every frame must come through in order.
+
+void
+queuetests::threaded()
+{
+  FrameQueue queue(1024*1024);
+  const uint64_t nFrames(20000);
+  auto size = [](uint64_t n) -> size_t {
+    return (n % 7) ? 1 + (n*7919) % (300*1024) : 700*1024;
+  };
+  uint64_t bad = 0;                 // Keep going so the producer can't stall.
+  std::thread consumer([&queue, &size, &bad, nFrames]() {
+    for (uint64_t n = 0; n < nFrames; ) {
+      const FrameRecord* pRecord = queue.front();
+      if (!pRecord) continue;
+      if ((pRecord->s_timestamp != n) || (pRecord->s_frameSize != size(n))) bad++;
+      queue.pop();
+      n++;
+    }
+  });
+  for (uint64_t n = 0; n < nFrames; n++) {
+    size_t nBytes = size(n);
+    FrameRecord* pRecord = queue.reserveWait(nBytes);
+    pRecord->s_timestamp = n;
+    reinterpret_cast<uint8_t*>(pRecord + 1)[nBytes - 1] = n;
+    queue.publish();
+  }
+  consumer.join();
+  EQ(uint64_t(0), bad);
+  ASSERT(queue.empty());
+}
@@ -0,0 +1,216 @@
+/*
+    This software is Copyright by the Board of Trustees of Michigan
+    State University (c) Copyright 2017.
+
+    You may use this software under the terms of the GNU public license
+    (GPL).  The terms of this license are described at:
+
+     http://www.gnu.org/licenses/gpl.txt
+
+     Authors:
+             Ron Fox
+             Jeromy Tompkins
+	     NSCL
+	     Michigan State University
+	     East Lansing, MI 48824-1321
+*/
+
+/** @file:  routerstats.cpp
+ *  @brief: Print the statistics a data router keeps in shared memory.
+ */
+
+#include "routerstatsargs.h"
+#include "RouterStatistics.h"
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <stdlib.h>
+
+/**
+ * What we keep of a source's counters between reports.
+ */
+struct SourceSnapshot {
+    uint64_t s_frames;
+    uint64_t s_bytes;
+    uint64_t s_asadFrames[MAX_STATISTICS_ASADS + 1];
+    uint64_t s_queueStallNs;
+};
+/**
+ * What we keep of an output's counters between reports.
+ */
+struct OutputSnapshot {
+    uint64_t s_frames;
+    uint64_t s_bytes;
+    uint64_t s_stallNs;
+    uint64_t s_latencyUsec;
+    uint64_t s_latency[LATENCY_BINS];
+};
+
+/**
+ * snapshot
+ *    Copy the counters of a source or output.
+ */
+static SourceSnapshot
+snapshot(const SourceStatistics& s)
+{
+    SourceSnapshot result;
+    result.s_frames = s.s_frames.load(std::memory_order_relaxed);
+    result.s_bytes  = s.s_bytes.load(std::memory_order_relaxed);
+    for (size_t i = 0; i <= MAX_STATISTICS_ASADS; i++) {
+        result.s_asadFrames[i] = s.s_asadFrames[i].load(std::memory_order_relaxed);
+    }
+    result.s_queueStallNs = s.s_queueStallNs.load(std::memory_order_relaxed);
+    return result;
+}
+static OutputSnapshot
+snapshot(const OutputStatistics& s)
+{
+    OutputSnapshot result;
+    result.s_frames      = s.s_frames.load(std::memory_order_relaxed);
+    result.s_bytes       = s.s_bytes.load(std::memory_order_relaxed);
+    result.s_stallNs     = s.s_stallNs.load(std::memory_order_relaxed);
+    result.s_latencyUsec = s.s_latencyUsec.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < LATENCY_BINS; i++) {
+        result.s_latency[i] = s.s_latency[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+/**
+ * percentile
+ *    @param bins     - latency counts for the interval.
+ *    @param total    - sum of the bins.
+ *    @param fraction - which percentile, e.g. 0.99.
+ *    @return uint64_t - upper edge, in usec, of the bin it falls in.
+ */
+static uint64_t
+percentile(const uint64_t* bins, uint64_t total, double fraction)
+{
+    uint64_t sum = 0;
+    for (size_t b = 0; b < LATENCY_BINS; b++) {
+        sum += bins[b];
+        if (sum >= fraction*total) {
+            return uint64_t(1) << b;
+        }
+    }
+    return uint64_t(1) << (LATENCY_BINS - 1);
+}
+/**
+ * reportSource
+ *    Print a source's rates over an interval and the state of its queue.
+ */
+static void
+reportSource(const SourceStatistics& s, const SourceSnapshot& now,
+             const SourceSnapshot& before, double seconds)
+{
+    std::cout << "Source " << s.s_sourceId << ": "
+        << (now.s_frames - before.s_frames)/seconds << " frames/s, "
+        << (now.s_bytes - before.s_bytes)/seconds/1.0e6 << " MB/s, AsAd frames/s";
+    for (size_t i = 0; i <= MAX_STATISTICS_ASADS; i++) {
+        uint64_t n = now.s_asadFrames[i] - before.s_asadFrames[i];
+        if (i == MAX_STATISTICS_ASADS) {
+            if (n) std::cout << " other:" << n/seconds;
+        } else {
+            std::cout << ' ' << i << ':' << n/seconds;
+        }
+    }
+    std::cout << std::endl;
+
+    uint64_t capacity = s.s_queueCapacity.load(std::memory_order_relaxed);
+    if (capacity) {
+        std::cout << "    queue " << s.s_queueDepth.load(std::memory_order_relaxed)/1.0e6
+            << " of " << capacity/1.0e6 << " MB (high water "
+            << s.s_queueHighWater.load(std::memory_order_relaxed)/1.0e6
+            << " MB), receiver stalled "
+            << (now.s_queueStallNs - before.s_queueStallNs)/1.0e6/seconds << " ms/s" << std::endl;
+    }
+}
+/**
+ * reportOutput
+ *    Print a ring output's rates, stall time and latency over an interval.
+ */
+static void
+reportOutput(const OutputStatistics& s, const OutputSnapshot& now,
+             const OutputSnapshot& before, double seconds)
+{
+    std::cout << "Ring " << s.s_ringName << ": "
+        << (now.s_frames - before.s_frames)/seconds << " frames/s, "
+        << (now.s_bytes - before.s_bytes)/seconds/1.0e6 << " MB/s, stalled "
+        << (now.s_stallNs - before.s_stallNs)/1.0e6/seconds << " ms/s";
+
+    uint64_t bins[LATENCY_BINS];
+    uint64_t total = 0;
+    for (size_t b = 0; b < LATENCY_BINS; b++) {
+        bins[b] = now.s_latency[b] - before.s_latency[b];
+        total  += bins[b];
+    }
+    if (total) {
+        std::cout << ", latency mean " << (now.s_latencyUsec - before.s_latencyUsec)/total
+            << " us, 50% < " << percentile(bins, total, 0.5)
+            << " us, 99% < " << percentile(bins, total, 0.99) << " us";
+    }
+    std::cout << std::endl;
+}
+
+/**
+ * main
+ *    Attach to the statistics block and, every interval, print the rates
+ *    over that interval.
+ */
+int main(int argc, char** argv)
+{
+    gengetopt_args_info parsedArgs;
+    cmdline_parser(argc, argv, &parsedArgs);
+
+    try {
+        if (parsedArgs.interval_arg <= 0) {
+            throw std::string("--interval must be at least 1");
+        }
+        const StatisticsBlock& block(*RouterStatistics::attach(parsedArgs.name_arg));
+
+        std::vector<SourceSnapshot> sources(MAX_STATISTICS_SOURCES);
+        std::vector<OutputSnapshot> outputs(MAX_STATISTICS_OUTPUTS);
+        for (size_t i = 0; i < MAX_STATISTICS_SOURCES; i++) {
+            sources[i] = snapshot(block.s_sources[i]);
+        }
+        for (size_t i = 0; i < MAX_STATISTICS_OUTPUTS; i++) {
+            outputs[i] = snapshot(block.s_outputs[i]);
+        }
+        auto before = std::chrono::steady_clock::now();
+
+        std::cout << std::fixed << std::setprecision(1);
+        for (int n = 0; (parsedArgs.count_arg <= 0) || (n < parsedArgs.count_arg); n++) {
+            std::this_thread::sleep_for(std::chrono::seconds(parsedArgs.interval_arg));
+            auto now = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(now - before).count();
+            before = now;
+
+            for (size_t i = 0; i < MAX_STATISTICS_SOURCES; i++) {
+                const SourceStatistics& s(block.s_sources[i]);
+                if (!s.s_inUse.load(std::memory_order_acquire)) break;
+                SourceSnapshot current = snapshot(s);
+                reportSource(s, current, sources[i], seconds);
+                sources[i] = current;
+            }
+            for (size_t i = 0; i < MAX_STATISTICS_OUTPUTS; i++) {
+                const OutputStatistics& s(block.s_outputs[i]);
+                if (!s.s_inUse.load(std::memory_order_acquire)) break;
+                OutputSnapshot current = snapshot(s);
+                reportOutput(s, current, outputs[i], seconds);
+                outputs[i] = current;
+            }
+            std::cout << std::endl;
+        }
+    }
+    catch (std::string& msg) {
+        std::cerr << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    catch (const char* msg) {
+        std::cerr << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}